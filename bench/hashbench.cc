@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2011-2015 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Hashing benchmark (scons benchmark)
+ *
+ * Generates synthetic file corpora from a fixed seed and measures the hashing stack with them.
+ * The files are hashed by the hashers of HashManager with each FileReader strategy, the results
+ * are also written in a hash database of their own under the benchmark directory.
+ * Each result is printed as a single JSON object per line so that the output of different
+ * runs can be compared with a script.
+ *
+ * The directory must be on the disk that should be measured (not tmpfs), the page cache is
+ * dropped before each run to measure the cold reads.
+ *
+ * Usage: hashbench --dir <path> [--seed <n>] [--scale <factor>] [--runs <n>] [--keep]
+ */
+
+#include <client/stdinc.h>
+
+#include <client/File.h>
+#include <client/FileReader.h>
+#include <client/HashManager.h>
+#include <client/LogManager.h>
+#include <client/MerkleTree.h>
+#include <client/ResourceManager.h>
+#include <client/Semaphore.h>
+#include <client/SettingsManager.h>
+#include <client/TigerHash.h>
+#include <client/TimerManager.h>
+#include <client/ZUtils.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/magic.h>
+#include <sys/vfs.h>
+
+using namespace dcpp;
+
+namespace {
+
+struct Options {
+	string dir;
+	uint64_t seed = 1;
+	double scale = 1.0;
+	int runs = 3;
+	bool keep = false;
+};
+
+struct Corpus {
+	string name;
+	StringList files;
+	int64_t bytes = 0;
+};
+
+struct CorpusSpec {
+	const char* name;
+	int files;
+	int64_t minSize;
+	int64_t maxSize;
+};
+
+// sizes are chosen log-uniformly between the limits
+const CorpusSpec corpusSpecs[] = {
+	{ "tiny", 5000, 1024, 16*1024 },
+	{ "mixed", 500, 16*1024, 64*1024*1024 },
+	{ "huge", 3, 512*1024*1024, 1024*1024*1024 }
+};
+
+const pair<FileReader::Strategy, const char*> strategies[] = {
+	{ FileReader::DIRECT, "direct" },
+	{ FileReader::MAPPED, "mapped" },
+	{ FileReader::CACHED, "cached" }
+};
+
+const size_t MEMORY_BUFFER_SIZE = 256*1024*1024;
+
+class Timer {
+public:
+	Timer() : start(std::chrono::steady_clock::now()) { }
+
+	double getSeconds() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+private:
+	std::chrono::steady_clock::time_point start;
+};
+
+void report(const string& aBenchmark, const string& aCorpus, const string& aVariant, int aRun, size_t aFiles, int64_t aBytes, double aSeconds) {
+	auto seconds = max(aSeconds, 1e-9);
+	printf("{\"benchmark\":\"%s\",\"corpus\":\"%s\",\"variant\":\"%s\",\"run\":%d,\"files\":%u,\"bytes\":" I64_FMT ",\"seconds\":%.6f,\"mb_per_s\":%.2f,\"files_per_s\":%.2f}\n",
+		aBenchmark.c_str(), aCorpus.c_str(), aVariant.c_str(), aRun, static_cast<unsigned>(aFiles), aBytes, aSeconds,
+		static_cast<double>(aBytes) / (1024*1024) / seconds, aFiles / seconds);
+	fflush(stdout);
+}
+
+void fill(std::mt19937_64& aGen, uint8_t* aBuf, size_t aLen) {
+	size_t i = 0;
+	for (; i + 8 <= aLen; i += 8) {
+		auto v = aGen();
+		memcpy(aBuf + i, &v, 8);
+	}
+
+	if (i < aLen) {
+		auto v = aGen();
+		memcpy(aBuf + i, &v, aLen - i);
+	}
+}
+
+// the same seed and scale always produce identical files
+Corpus createCorpus(const Options& aOptions, const CorpusSpec& aSpec, int aIndex) {
+	Corpus corpus;
+	corpus.name = aSpec.name;
+
+	std::mt19937_64 gen(aOptions.seed * 1000 + aIndex);
+	std::uniform_real_distribution<double> sizeDist(log(static_cast<double>(aSpec.minSize)), log(static_cast<double>(aSpec.maxSize)));
+
+	auto count = max(static_cast<int>(aSpec.files * aOptions.scale), 1);
+	auto dir = aOptions.dir + aSpec.name + PATH_SEPARATOR_STR;
+	File::ensureDirectory(dir);
+
+	ByteVector buf(1024*1024);
+	for (int i = 0; i < count; ++i) {
+		auto size = static_cast<int64_t>(exp(sizeDist(gen)));
+		if (aSpec.files < 10) {
+			// scale the size instead of the count of the few huge files
+			size = max(static_cast<int64_t>(size * aOptions.scale), aSpec.minSize / 64);
+		}
+
+		auto path = dir + Util::toString(i) + ".dat";
+		File f(path, File::WRITE, File::CREATE | File::TRUNCATE);
+		for (int64_t left = size; left > 0;) {
+			auto n = static_cast<size_t>(min(left, static_cast<int64_t>(buf.size())));
+			fill(gen, &buf[0], n);
+			f.write(&buf[0], n);
+			left -= n;
+		}
+
+		corpus.files.push_back(path);
+		corpus.bytes += size;
+	}
+
+	return corpus;
+}
+
+// measure the cold read performance
+void dropCache(const Corpus& aCorpus) {
+	for (const auto& path: aCorpus.files) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd == -1)
+			continue;
+
+		::fdatasync(fd);
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		::close(fd);
+	}
+}
+
+// counts the files that the hashers have finished (the results are reported after they have been written in the database)
+class HashListener : public HashManagerListener {
+public:
+	HashListener() : hashed(0), failed(0) { HashManager::getInstance()->addListener(this); }
+	~HashListener() { HashManager::getInstance()->removeListener(this); }
+
+	void wait(size_t aFiles) {
+		while (static_cast<size_t>(hashed + failed) < aFiles) {
+			done.wait(100);
+		}
+	}
+
+	atomic<long> hashed;
+	atomic<long> failed;
+private:
+	Semaphore done;
+
+	void on(HashManagerListener::TTHDone, const string&, HashedFile&) noexcept {
+		hashed++;
+		done.signal();
+	}
+
+	void on(HashManagerListener::HashFailed, const string& aPath, HashedFile&) noexcept {
+		fprintf(stderr, "Hashing failed: %s\n", aPath.c_str());
+		failed++;
+		done.signal();
+	}
+};
+
+bool isHashing() {
+	string file;
+	int64_t bytesLeft = 0, speed = 0;
+	size_t filesLeft = 0;
+	int hashers = 0;
+	HashManager::getInstance()->getStats(file, bytesLeft, filesLeft, speed, hashers);
+	return filesLeft > 0;
+}
+
+void benchmarkMemory(const Options& aOptions) {
+	ByteVector buf(static_cast<size_t>(max(MEMORY_BUFFER_SIZE * aOptions.scale, 1024.0*1024)));
+	std::mt19937_64 gen(aOptions.seed);
+	fill(gen, &buf[0], buf.size());
+
+	auto size = static_cast<int64_t>(buf.size());
+	for (int run = 0; run < aOptions.runs; ++run) {
+		{
+			Timer t;
+			TigerHash h;
+			h.update(&buf[0], buf.size());
+			h.finalize();
+			report("tiger", "memory", "", run, 1, size, t.getSeconds());
+		}
+
+		{
+			Timer t;
+			TigerTree tt(TigerTree::calcBlockSize(size, 10));
+			tt.update(&buf[0], buf.size());
+			tt.finalize();
+			report("merkle", "memory", "", run, 1, size, t.getSeconds());
+		}
+
+		{
+			Timer t;
+			CRC32Filter crc32;
+			crc32(&buf[0], buf.size());
+			report("crc32", "memory", "", run, 1, size, t.getSeconds());
+		}
+	}
+}
+
+// the raw read performance of each strategy that the hashers may use
+void benchmarkReaders(const Options& aOptions, const Corpus& aCorpus) {
+	for (const auto& s: strategies) {
+		for (int run = 0; run < aOptions.runs; ++run) {
+			dropCache(aCorpus);
+
+			Timer t;
+			try {
+				for (const auto& path: aCorpus.files) {
+					FileReader fr(s.first == FileReader::DIRECT);
+					fr.read(path, s.first, [](const void*, size_t) { return true; });
+				}
+			} catch (const FileException& e) {
+				fprintf(stderr, "%s: %s\n", s.second, e.getError().c_str());
+				break;
+			}
+
+			report("reader", aCorpus.name, s.second, run, aCorpus.files.size(), aCorpus.bytes, t.getSeconds());
+		}
+	}
+}
+
+// the files are queued in HashManager like the shared files with changed timestamps, the hashers read them with each strategy
+void benchmarkHashers(const Options& aOptions, const Corpus& aCorpus) {
+	HashListener listener;
+	size_t reported = 0;
+
+	for (const auto& s: strategies) {
+		HashManager::getInstance()->setReadStrategy(s.first);
+		long failed = listener.failed;
+
+		for (int run = 0; run < aOptions.runs; ++run) {
+			dropCache(aCorpus);
+
+			Timer t;
+			for (const auto& path: aCorpus.files) {
+				// the timestamp won't match with the previous run so that the file is always hashed again
+				HashedFile fi(0, File::getSize(path));
+				HashManager::getInstance()->checkTTH(Text::toLower(path), path, fi);
+			}
+
+			while (isHashing()) {
+				Thread::sleep(10);
+			}
+
+			report("hasher", aCorpus.name, s.second, run, aCorpus.files.size(), aCorpus.bytes, t.getSeconds());
+
+			// the next run mustn't find the queued database writes
+			reported += aCorpus.files.size();
+			listener.wait(reported);
+		}
+
+		if (listener.failed > failed) {
+			fprintf(stderr, "%s (%s): hashing failed for %d files\n", aCorpus.name.c_str(), s.second, static_cast<int>(listener.failed - failed));
+		}
+	}
+
+	HashManager::getInstance()->setReadStrategy(FileReader::AUTO);
+}
+
+void removeTree(const string& aPath) {
+	File::forEachFile(aPath, "*", [&](const string& aName, bool aIsDir, int64_t) {
+		if (aIsDir) {
+			removeTree(aPath + aName);
+		} else {
+			File::deleteFile(aPath + aName);
+		}
+	});
+
+	File::removeDirectory(aPath);
+}
+
+void removeCorpus(const Options& aOptions, const Corpus& aCorpus) {
+	removeTree(aOptions.dir + aCorpus.name + PATH_SEPARATOR_STR);
+}
+
+bool parseOptions(int argc, char** argv, Options& options_) {
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		auto hasValue = i + 1 < argc;
+		if (arg == "--dir" && hasValue) {
+			options_.dir = argv[++i];
+		} else if (arg == "--seed" && hasValue) {
+			options_.seed = static_cast<uint64_t>(Util::toInt64(argv[++i]));
+		} else if (arg == "--scale" && hasValue) {
+			options_.scale = Util::toDouble(argv[++i]);
+		} else if (arg == "--runs" && hasValue) {
+			options_.runs = max(Util::toInt(argv[++i]), 1);
+		} else if (arg == "--keep") {
+			options_.keep = true;
+		} else {
+			fprintf(stderr, "Usage: %s --dir <path> [--seed <n>] [--scale <factor>] [--runs <n>] [--keep]\n", argv[0]);
+			return false;
+		}
+	}
+
+	if (options_.scale <= 0)
+		return false;
+
+	if (options_.dir.empty()) {
+		fprintf(stderr, "The directory for the test files must be given with --dir\n");
+		return false;
+	}
+
+	options_.dir = Util::validatePath(options_.dir, true);
+	File::ensureDirectory(options_.dir);
+
+	// the page cache can't be dropped and unbuffered reads aren't supported
+	struct statfs sfs;
+	if (::statfs(options_.dir.c_str(), &sfs) == 0 && sfs.f_type == TMPFS_MAGIC) {
+		fprintf(stderr, "%s is on tmpfs, use a directory on the disk that should be measured\n", options_.dir.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+int run(const Options& options) {
+	fprintf(stderr, "Using %s (seed " U64_FMT ", scale %.2f, %d runs)\n", options.dir.c_str(), options.seed, options.scale, options.runs);
+
+	// the results wouldn't be comparable with broken leaf hashes
+	if (!TigerHash::verifySimd()) {
+		fprintf(stderr, "The vectorized Tiger leaf hashes differ from the scalar ones\n");
+		return 1;
+	}
+
+	fprintf(stderr, "Hashing %u leaves in parallel\n", static_cast<unsigned>(max(TigerHash::getSimdLanes(), static_cast<size_t>(1))));
+
+	benchmarkMemory(options);
+
+	int index = 0;
+	for (const auto& spec: corpusSpecs) {
+		try {
+			auto corpus = createCorpus(options, spec, index++);
+			fprintf(stderr, "Created the %s corpus: %u files, %s\n", corpus.name.c_str(), static_cast<unsigned>(corpus.files.size()), Util::formatBytes(corpus.bytes).c_str());
+
+			benchmarkReaders(options, corpus);
+			benchmarkHashers(options, corpus);
+
+			if (!options.keep) {
+				removeCorpus(options, corpus);
+			}
+		} catch (const FileException& e) {
+			fprintf(stderr, "%s: %s\n", spec.name, e.getError().c_str());
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+string getConfigPath(const Options& aOptions) {
+	return aOptions.dir + "config" + PATH_SEPARATOR_STR;
+}
+
+}
+
+int main(int argc, char** argv) {
+	Options options;
+	if (!parseOptions(argc, argv, options))
+		return 1;
+
+	// the hash database is created in the benchmark directory
+	Util::addStartupParam("-c=" + getConfigPath(options));
+	Util::initialize();
+
+	// the parts of the client that the hashers use
+	ResourceManager::newInstance();
+	SettingsManager::newInstance();
+	LogManager::newInstance();
+	TimerManager::newInstance();
+	HashManager::newInstance();
+
+	// the timer writes the hashed files in the database
+	TimerManager::getInstance()->start();
+
+	int ret = 1;
+	try {
+		HashManager::getInstance()->startup([](const string&) { }, [](float) { }, [](const string& aMessage, bool, bool) {
+			fprintf(stderr, "%s\n", aMessage.c_str());
+			return false;
+		});
+
+		ret = run(options);
+	} catch (const HashException& e) {
+		fprintf(stderr, "Failed to open the hash database: %s\n", e.getError().c_str());
+	}
+
+	TimerManager::getInstance()->shutdown();
+	HashManager::getInstance()->shutdown([](float) { });
+
+	HashManager::deleteInstance();
+	TimerManager::deleteInstance();
+	LogManager::deleteInstance();
+	SettingsManager::deleteInstance();
+	ResourceManager::deleteInstance();
+
+	if (!options.keep) {
+		removeTree(getConfigPath(options));
+	}
+
+	return ret;
+}
@@ -23,17 +23,34 @@
 
 namespace dcpp {
 
-AdcCommand::AdcCommand(uint32_t aCmd, char aType /* = TYPE_CLIENT */) : cmdInt(aCmd), from(0), type(aType) { }
-AdcCommand::AdcCommand(uint32_t aCmd, const uint32_t aTarget, char aType) : cmdInt(aCmd), from(0), to(aTarget), type(aType) { }
-AdcCommand::AdcCommand(Severity sev, Error err, const string& desc, char aType /* = TYPE_CLIENT */) : cmdInt(CMD_STA), from(0), type(aType) {
+AdcCommand::AdcCommand(uint32_t aCmd, char aType /* = TYPE_CLIENT */) : lazyParams(false), cmdInt(aCmd), from(0), type(aType) { }
+AdcCommand::AdcCommand(uint32_t aCmd, const uint32_t aTarget, char aType) : lazyParams(false), cmdInt(aCmd), from(0), to(aTarget), type(aType) { }
+AdcCommand::AdcCommand(Severity sev, Error err, const string& desc, char aType /* = TYPE_CLIENT */) : lazyParams(false), cmdInt(CMD_STA), from(0), type(aType) {
 	addParam((sev == SEV_SUCCESS && err == SUCCESS) ? "000" : Util::toString(sev * 100 + err));
 	addParam(desc);
 }
 
-AdcCommand::AdcCommand(const string& aLine, bool nmdc /* = false */) : cmdInt(0), type(TYPE_CLIENT) {
+AdcCommand::AdcCommand(const string& aLine, bool nmdc /* = false */) : lazyParams(false), cmdInt(0), type(TYPE_CLIENT) {
 	parse(aLine, nmdc);
 }
 
+AdcCommand::AdcCommand(const AdcCommand& rhs) : parameters(rhs.parameters), lazyParams(false), features(rhs.features), cmdInt(rhs.cmdInt), from(rhs.from), to(rhs.to), type(rhs.type) {
+	// create the strings without modifying the source, the copy may be accessed from another thread
+	if(rhs.lazyParams) {
+		parameters.reserve(parameters.size() + rhs.ranges.size());
+		for(const auto& r: rhs.ranges) {
+			parameters.emplace_back(rhs.paramData, r.first, r.second);
+		}
+	}
+}
+
+AdcCommand& AdcCommand::operator=(const AdcCommand& rhs) {
+	if(this != &rhs) {
+		*this = AdcCommand(rhs);
+	}
+	return *this;
+}
+
 void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
 	string::size_type i = 5;
 
@@ -66,13 +83,51 @@ void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
 
 	string::size_type len = aLine.length();
 	const char* buf = aLine.c_str();
-	string cur;
-	cur.reserve(128);
+
+	// The parameters are copied to a single buffer (unescaping the ones that need it) and only their
+	// ranges are stored; separate strings are created if the parameter list is accessed
+	parameters.clear();
+	ranges.clear();
+	paramData.clear();
+	paramData.reserve(len > i ? len - i : 0);
+	lazyParams = true;
 
 	bool toSet = false;
 	bool featureSet = false;
 	bool fromSet = nmdc; // $ADCxxx never have a from CID...
 
+	size_t curStart = 0;
+	auto addToken = [&] {
+		auto cur = paramData.data() + curStart;
+		auto curLen = paramData.size() - curStart;
+		if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
+			if(curLen != 4) {
+				throw ParseException("Invalid SID length");
+			}
+			from = toFourCC(cur);
+			fromSet = true;
+		} else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
+			if(curLen != 4) {
+				throw ParseException("Invalid SID length");
+			}
+			to = toFourCC(cur);
+			toSet = true;
+		} else if(type == TYPE_FEATURE && !featureSet) {
+			if(curLen % 5 != 0) {
+				throw ParseException("Invalid feature length");
+			}
+			// Skip...
+			featureSet = true;
+		} else {
+			ranges.emplace_back(static_cast<uint32_t>(curStart), static_cast<uint32_t>(curLen));
+			curStart = paramData.size();
+			return;
+		}
+
+		// not a parameter
+		paramData.resize(curStart);
+	};
+
 	while(i < len) {
 		switch(buf[i]) {
 		case '\\':
@@ -80,71 +135,36 @@ void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
 			if(i == len)
 				throw ParseException("Escape at eol");
 			if(buf[i] == 's')
-				cur += ' ';
+				paramData += ' ';
 			else if(buf[i] == 'n')
-				cur += '\n';
+				paramData += '\n';
 			else if(buf[i] == '\\')
-				cur += '\\';
+				paramData += '\\';
 			else if(buf[i] == ' ' && nmdc)	// $ADCGET escaping, leftover from old specs
-				cur += ' ';
+				paramData += ' ';
 			else
 				throw ParseException("Unknown escape");
+			++i;
 			break;
 		case ' ': 
 			// New parameter...
-			{
-				if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
-					if(cur.length() != 4) {
-						throw ParseException("Invalid SID length");
-					}
-					from = toSID(cur);
-					fromSet = true;
-				} else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
-					if(cur.length() != 4) {
-						throw ParseException("Invalid SID length");
-					}
-					to = toSID(cur);
-					toSet = true;
-				} else if(type == TYPE_FEATURE && !featureSet) {
-					if(cur.length() % 5 != 0) {
-						throw ParseException("Invalid feature length");
-					}
-					// Skip...
-					featureSet = true;
-				} else {
-					parameters.push_back(cur);
-				}
-				cur.clear();
-			}
+			addToken();
+			++i;
 			break;
 		default:
-			cur += buf[i];
-		}
-		++i;
-	}
-	if(!cur.empty()) {
-		if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
-			if(cur.length() != 4) {
-				throw ParseException("Invalid SID length");
-			}
-			from = toSID(cur);
-			fromSet = true;
-		} else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
-			if(cur.length() != 4) {
-				throw ParseException("Invalid SID length");
-			}
-			to = toSID(cur);
-			toSet = true;
-		} else if(type == TYPE_FEATURE && !featureSet) {
-			if(cur.length() % 5 != 0) {
-				throw ParseException("Invalid feature length");
+			{
+				// copy everything until the next separator or escape at once
+				auto next = aLine.find_first_of(" \\", i);
+				if(next == string::npos)
+					next = len;
+				paramData.append(buf + i, next - i);
+				i = next;
 			}
-			// Skip...
-			featureSet = true;
-		} else {
-			parameters.push_back(cur);
 		}
 	}
+	if(paramData.size() > curStart) {
+		addToken();
+	}
 
 	if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
 		throw ParseException("Missing from_sid");
@@ -236,6 +256,19 @@ string AdcCommand::getHeaderString() const {
 	return tmp;
 }
 
+void AdcCommand::materialize() const {
+	if(!lazyParams)
+		return;
+
+	parameters.reserve(parameters.size() + ranges.size());
+	for(const auto& r: ranges) {
+		parameters.emplace_back(paramData, r.first, r.second);
+	}
+
+	ranges.clear();
+	lazyParams = false;
+}
+
 const string& AdcCommand::getParam(size_t n) const {
 	return getParameters().size() > n ? getParameters()[n] : Util::emptyString;
 }
@@ -254,31 +287,44 @@ string AdcCommand::getParamString(bool nmdc) const {
 	return tmp;
 }
 
-bool AdcCommand::getParam(const char* name, size_t start, string& ret) const {
-	for(string::size_type i = start; i < getParameters().size(); ++i) {
-		if(toCode(name) == toCode(getParameters()[i].c_str())) {
-			ret = getParameters()[i].substr(2);
-			return true;
+const char* AdcCommand::findParam(const char* name, size_t start, size_t& len_) const {
+	for(size_t i = start; i < getParamCount(); ++i) {
+		size_t len;
+		auto p = getParamData(i, len);
+		if(len >= 2 && toCode(name) == toCode(p)) {
+			len_ = len - 2;
+			return p + 2;
 		}
 	}
-	return false;
+	return nullptr;
+}
+
+bool AdcCommand::getParam(const char* name, size_t start, string& ret) const {
+	size_t len;
+	auto p = findParam(name, start, len);
+	if(!p)
+		return false;
+
+	ret.assign(p, len);
+	return true;
 }
 
 bool AdcCommand::getParam(const char* name, size_t start, StringList& ret) const {
-	for(string::size_type i = start; i < getParameters().size(); ++i) {
-		if(toCode(name) == toCode(getParameters()[i].c_str())) {
-			ret.push_back(getParameters()[i].substr(2));
+	for(size_t i = start; i < getParamCount(); ++i) {
+		size_t len;
+		auto p = getParamData(i, len);
+		if(len >= 2 && toCode(name) == toCode(p)) {
+			ret.emplace_back(p + 2, len - 2);
 		}
 	}
 	return !ret.empty();
 }
 
 bool AdcCommand::hasFlag(const char* name, size_t start) const {
-	for(string::size_type i = start; i < getParameters().size(); ++i) {
-		if(toCode(name) == toCode(getParameters()[i].c_str()) && 
-			getParameters()[i].size() == 3 &&
-			getParameters()[i][2] == '1')
-		{
+	for(size_t i = start; i < getParamCount(); ++i) {
+		size_t len;
+		auto p = getParamData(i, len);
+		if(len == 3 && toCode(name) == toCode(p) && p[2] == '1') {
 			return true;
 		}
 	}
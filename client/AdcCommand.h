@@ -29,6 +29,11 @@ STANDARD_EXCEPTION(ParseException);
 
 class CID;
 
+/**
+ * The parameters of a parsed command are kept in a single buffer until the parameter list is accessed,
+ * which may also happen through the const accessors. A parsed command must not be shared between threads
+ * by reference; the copies are created with the parameter list in place and can be passed to other threads.
+ */
 class AdcCommand {
 public:
 	template<uint32_t T>
@@ -131,6 +136,12 @@ public:
 	explicit AdcCommand(uint32_t aCmd, const uint32_t aTarget, char aType);
 	explicit AdcCommand(Severity sev, Error err, const string& desc, char aType = TYPE_CLIENT);
 	explicit AdcCommand(const string& aLine, bool nmdc = false);
+
+	AdcCommand(const AdcCommand& rhs);
+	AdcCommand& operator=(const AdcCommand& rhs);
+	AdcCommand(AdcCommand&&) = default;
+	AdcCommand& operator=(AdcCommand&&) = default;
+
 	void parse(const string& aLine, bool nmdc = false);
 
 	uint32_t getCommand() const { return cmdInt; }
@@ -141,19 +152,33 @@ public:
 	const string& getFeatures() const { return features; }
 	AdcCommand& setFeatures(const string& feat) { features = feat; return *this; }
 
-	StringList& getParameters() { return parameters; }
-	const StringList& getParameters() const { return parameters; }
+	StringList& getParameters() { materialize(); return parameters; }
+	const StringList& getParameters() const { materialize(); return parameters; }
+
+	size_t getParamCount() const { return lazyParams ? ranges.size() : parameters.size(); }
+
+	/** Calls aF(param, length) for each parameter (including the name) without copying them */
+	template<class F>
+	void forEachParam(size_t start, F aF) const {
+		for(size_t i = start; i < getParamCount(); ++i) {
+			size_t len;
+			auto p = getParamData(i, len);
+			aF(p, len);
+		}
+	}
 
 	string toString() const;
 	string toString(const CID& aCID) const;
 	string toString(uint32_t sid, bool nmdc = false) const;
 
 	AdcCommand& addParam(const string& name, const string& value) {
+		materialize();
 		parameters.push_back(name);
 		parameters.back() += value;
 		return *this;
 	}
 	AdcCommand& addParam(const string& str) {
+		materialize();
 		parameters.push_back(str);
 		return *this;
 	}
@@ -161,6 +186,8 @@ public:
 	/** Return a named parameter where the name is a two-letter code */
 	bool getParam(const char* name, size_t start, string& ret) const;
 	bool getParam(const char* name, size_t start, StringList& ret) const;
+	/** Return the value of a named parameter without copying it (nullptr if it doesn't exist) */
+	const char* findParam(const char* name, size_t start, size_t& len_) const;
 	bool hasFlag(const char* name, size_t start) const;
 	static uint16_t toCode(const char* x) { return *((uint16_t*)x); }
 
@@ -179,7 +206,27 @@ private:
 	string getHeaderString() const;
 	string getHeaderString(uint32_t sid, bool nmdc) const;
 	string getParamString(bool nmdc) const;
-	StringList parameters;
+
+	const char* getParamData(size_t n, size_t& len_) const {
+		if(lazyParams) {
+			len_ = ranges[n].second;
+			return paramData.data() + ranges[n].first;
+		}
+
+		len_ = parameters[n].size();
+		return parameters[n].data();
+	}
+
+	/* Create the parameter list from the parsed data (done when the list is accessed or modified for the first time) */
+	void materialize() const;
+
+	mutable StringList parameters;
+
+	// Parsed parameters as (offset, length) ranges of the unescaped parameter data
+	string paramData;
+	mutable vector<pair<uint32_t, uint32_t>> ranges;
+	mutable bool lazyParams;
+
 	string features;
 	union {
 		char cmdChar[4];
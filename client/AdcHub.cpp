@@ -179,7 +179,7 @@ void AdcHub::clearUsers() {
 }
 
 void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
-	if(c.getParameters().empty())
+	if(c.getParamCount() == 0)
 		return;
 
 	string cid;
@@ -217,24 +217,30 @@ void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
 		return;
 	}
 
-	for(const auto& p: c.getParameters()) {
-		if(p.length() < 2)
-			continue;
+	// the parameters are read directly from the parsed command as there may be thousands of them after logging in
+	bool connectivityChanged = false;
+	c.forEachParam(0, [&](const char* p, size_t len) {
+		if(len < 2)
+			return;
 
-		if(p.substr(0, 2) == "SS") {
+		auto code = AdcCommand::toCode(p);
+		if(code == AdcCommand::toCode("SS")) {
 			availableBytes -= u->getIdentity().getBytesShared();
-			u->getIdentity().setBytesShared(p.substr(2));
+			u->getIdentity().setBytesShared(string(p + 2, len - 2));
 			availableBytes += u->getIdentity().getBytesShared();
 		} else {
-			u->getIdentity().set(p.c_str(), p.substr(2));
+			u->getIdentity().set(p, string(p + 2, len - 2));
 		}
 		
-		if((p.substr(0, 2) == "VE") || (p.substr(0, 2) == "AP")) {
-			if (p.find("AirDC++") != string::npos) {
+		if(code == AdcCommand::toCode("VE") || code == AdcCommand::toCode("AP")) {
+			static const string airdc = "AirDC++";
+			if (std::search(p, p + len, airdc.begin(), airdc.end()) != p + len) {
 				u->getUser()->setFlag(User::AIRDCPLUSPLUS);
 			}
+		} else if(code == AdcCommand::toCode("SU") || code == AdcCommand::toCode("I4") || code == AdcCommand::toCode("I6")) {
+			connectivityChanged = true;
 		}
-	}
+	});
 
 	if(u->getIdentity().isBot()) {
 		u->getUser()->setFlag(User::BOT);
@@ -263,7 +269,7 @@ void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
 
 		//we have to update the modes in case our connectivity changed
 
-		if (oldState != STATE_NORMAL || any_of(c.getParameters().begin(), c.getParameters().end(), [](const string& p) { return p.substr(0, 2) == "SU" || p.substr(0, 2) == "I4" || p.substr(0, 2) == "I6"; })) {
+		if (oldState != STATE_NORMAL || connectivityChanged) {
 			fire(ClientListener::HubUpdated(), this);
 			for(auto ou: users | map_values) {
 				if (ou->getIdentity().getConnectMode() != Identity::MODE_ME && ou->getIdentity().updateConnectMode(getMyIdentity(), this)) {
@@ -21,6 +21,9 @@
 
 #include "Exception.h"
 #include "ResourceManager.h"
+#include "Streams.h"
+
+#include <thread>
 
 namespace dcpp {
 	
@@ -65,6 +68,195 @@ bool BZFilter::operator()(const void* in, size_t& insize, void* out, size_t& out
 	}
 }
 
+ParallelBZFilter::ParallelBZFilter() : maxQueued(max(std::thread::hardware_concurrency(), 1u)) {
+	// stream header (the blocks use the maximum size)
+	output = "BZh9";
+}
+
+ParallelBZFilter::~ParallelBZFilter() {
+	try {
+		tasks.cancel();
+		tasks.wait();
+	} catch (...) {
+		// the error has been reported already
+	}
+}
+
+static uint32_t readBits(const string& aData, size_t aPos, int aCount) noexcept {
+	uint32_t ret = 0;
+	for (int i = 0; i < aCount; ++i, ++aPos) {
+		ret = (ret << 1) | ((static_cast<uint8_t>(aData[aPos / 8]) >> (7 - aPos % 8)) & 1);
+	}
+	return ret;
+}
+
+size_t BZBlock::add(const void* aData, size_t aLen) noexcept {
+	dcassert(!isCompressed());
+	if (data.empty()) {
+		data.reserve(MAX_SIZE);
+	}
+
+	aLen = min(aLen, MAX_SIZE - data.size());
+	data.append(static_cast<const char*>(aData), aLen);
+	return aLen;
+}
+
+void BZBlock::compress() throw(Exception) {
+	// the output may be 1% + 600 bytes larger than the input
+	auto len = static_cast<unsigned int>(data.size() + data.size() / 100 + 600);
+	compressed.resize(len);
+	if (BZ2_bzBuffToBuffCompress(&compressed[0], &len, &data[0], static_cast<unsigned int>(data.size()), 9, 0, 30) != BZ_OK) {
+		throw Exception(STRING(COMPRESSION_ERROR));
+	}
+
+	compressed.resize(len);
+	compressed.shrink_to_fit();
+	string().swap(data);
+
+	// a single block stream: header (32 bits), block magic (48 bits), block CRC (32 bits), ..., 
+	// end of stream magic (48 bits), stream CRC (32 bits, same as the block CRC) and padding to full bytes
+	crc = readBits(compressed, 80, 32);
+	for (size_t pad = 0; pad < 8; ++pad) {
+		auto end = compressed.size() * 8 - pad - 80;
+		if (readBits(compressed, end, 24) == 0x177245 && readBits(compressed, end + 24, 24) == 0x385090 && readBits(compressed, end + 48, 32) == crc) {
+			endBit = end;
+			return;
+		}
+	}
+
+	throw Exception(STRING(COMPRESSION_ERROR));
+}
+
+bool ParallelBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
+	if(outsize == 0)
+		return 0;
+
+	if (insize == 0) {
+		if (!finished) {
+			finished = true;
+			endBlock();
+			runBlocks();
+			waitBlocks();
+		}
+	} else {
+		if (!current) {
+			current = make_shared<BZBlock>();
+		}
+
+		insize = current->add(in, insize);
+		if (current->isFull()) {
+			endBlock();
+		}
+	}
+
+	while (output.size() < outsize && !ready.empty()) {
+		appendBlock(*ready.front());
+		ready.pop_front();
+	}
+
+	if (finished && ready.empty() && !ended) {
+		ended = true;
+
+		// end of stream marker
+		putBits(0x177245, 24);
+		putBits(0x385090, 24);
+		putBits(combinedCRC, 32);
+		if (bitCount > 0) {
+			putBits(0, 8 - bitCount);
+		}
+	}
+
+	outsize = min(outsize, output.size());
+	memcpy(out, output.data(), outsize);
+	output.erase(0, outsize);
+
+	return !ended || !output.empty();
+}
+
+void ParallelBZFilter::addBlocks(const BZBlock::List& aBlocks) {
+	dcassert(!finished);
+	endBlock();
+	for (const auto& b: aBlocks) {
+		queueBlock(b);
+	}
+}
+
+void ParallelBZFilter::writeReady(OutputStream& aStream) {
+	dcassert(!finished);
+	while (!ready.empty()) {
+		appendBlock(*ready.front());
+		ready.pop_front();
+	}
+
+	// the bits of an incomplete byte stay in the buffer
+	if (!output.empty()) {
+		aStream.write(output);
+		output.clear();
+	}
+}
+
+void ParallelBZFilter::endBlock() {
+	if (current && !current->isEmpty()) {
+		queueBlock(current);
+	}
+
+	current = nullptr;
+}
+
+void ParallelBZFilter::queueBlock(const BZBlock::Ptr& aBlock) {
+	queued.push_back(aBlock);
+	if (queued.size() >= maxQueued) {
+		runBlocks();
+	}
+}
+
+void ParallelBZFilter::runBlocks() {
+	waitBlocks();
+
+	running.swap(queued);
+	for (const auto& b: running) {
+		if (!b->isCompressed()) {
+			auto block = b.get();
+			tasks.run([block] { block->compress(); });
+		}
+	}
+}
+
+void ParallelBZFilter::waitBlocks() {
+	tasks.wait();
+	ready.insert(ready.end(), running.begin(), running.end());
+	running.clear();
+}
+
+void ParallelBZFilter::appendBlock(const BZBlock& aBlock) {
+	// skip the stream header and the trailer, blocks don't need to be aligned to full bytes
+	auto p = reinterpret_cast<const uint8_t*>(aBlock.compressed.data());
+	auto bytes = aBlock.endBit / 8;
+	if (bitCount == 0) {
+		output.append(aBlock.compressed.data() + 4, bytes - 4);
+	} else {
+		for (size_t i = 4; i < bytes; ++i) {
+			putBits(p[i], 8);
+		}
+	}
+
+	auto rest = static_cast<int>(aBlock.endBit % 8);
+	if (rest > 0) {
+		putBits(p[bytes] >> (8 - rest), rest);
+	}
+
+	combinedCRC = ((combinedCRC << 1) | (combinedCRC >> 31)) ^ aBlock.crc;
+}
+
+void ParallelBZFilter::putBits(uint32_t aValue, int aCount) {
+	bitBuffer = (bitBuffer << aCount) | aValue;
+	bitCount += aCount;
+	while (bitCount >= 8) {
+		bitCount -= 8;
+		output += static_cast<char>(bitBuffer >> bitCount);
+	}
+}
+
 UnBZFilter::UnBZFilter() {
 	memzero(&zs, sizeof(zs));
 
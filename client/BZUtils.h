@@ -21,8 +21,13 @@
 
 #include <bzlib.h>
 
+#include "concurrency.h"
+#include "Exception.h"
+
 namespace dcpp {
 
+class OutputStream;
+
 class BZFilter {
 public:
 	BZFilter();
@@ -40,6 +45,96 @@ private:
 	bz_stream zs;
 };
 
+/**
+* Data that is compressed independently of the other blocks. The compressed blocks can be
+* combined into a single bzip2 stream, and the same block may be used in multiple streams.
+*/
+class BZBlock : boost::noncopyable {
+public:
+	typedef shared_ptr<BZBlock> Ptr;
+	typedef vector<Ptr> List;
+
+	/* Returns the number of bytes that fit in the block */
+	size_t add(const void* aData, size_t aLen) noexcept;
+
+	bool isFull() const noexcept { return data.size() == MAX_SIZE; }
+	bool isEmpty() const noexcept { return data.empty() && !isCompressed(); }
+	bool isCompressed() const noexcept { return endBit > 0; }
+
+	void compress() throw(Exception);
+	size_t getCompressedSize() const noexcept { return compressed.size(); }
+private:
+	friend class ParallelBZFilter;
+
+	// the initial run-length encoding may expand the data by 25%, make sure that the input fits in one 900k block
+	static const size_t MAX_SIZE = 700 * 1024;
+
+	string data;
+	string compressed;
+	uint32_t crc = 0;
+	size_t endBit = 0;
+};
+
+/**
+* Compresses the data in independent blocks that are processed in parallel. The blocks are
+* combined into a single bzip2 stream, which can be read with any decoder (including the
+* ones that stop after the first stream). The amount of buffered data is limited to two
+* blocks per core, blocks added with addBlocks must be written out with writeReady for that.
+*/
+class ParallelBZFilter : boost::noncopyable {
+public:
+	ParallelBZFilter();
+	~ParallelBZFilter();
+	/**
+	* Compress data.
+	* @param in Input data
+	* @param insize Input size (Set to 0 to indicate that no more data will follow)
+	* @param out Output buffer
+	* @param outsize Output size, set to compressed size on return.
+	* @return True if there's more processing to be done.
+	*/
+	bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
+
+	/**
+	* Ends the current block and appends existing blocks after it. Blocks that haven't
+	* been compressed yet are compressed in place, so that they can be reused later.
+	*/
+	void addBlocks(const BZBlock::List& aBlocks);
+
+	/**
+	* Writes the compressed blocks that are ready to aStream, the remaining blocks are
+	* passed on by the next calls or the final flush. Must not be used after flushing has started.
+	*/
+	void writeReady(OutputStream& aStream);
+private:
+	// queue the current block for compressing
+	void endBlock();
+	void queueBlock(const BZBlock::Ptr& aBlock);
+
+	// wait for the running blocks and start compressing the queued ones
+	void runBlocks();
+	void waitBlocks();
+
+	void appendBlock(const BZBlock& aBlock);
+	void putBits(uint32_t aValue, int aCount);
+
+	const size_t maxQueued;
+	BZBlock::Ptr current;
+	BZBlock::List queued;
+	BZBlock::List running;
+	task_group tasks;
+
+	// compressed blocks are combined into the output only when there's room for them
+	deque<BZBlock::Ptr> ready;
+
+	string output;
+	uint64_t bitBuffer = 0;
+	int bitCount = 0;
+	uint32_t combinedCRC = 0;
+	bool finished = false;
+	bool ended = false;
+};
+
 class UnBZFilter {
 public:
 	UnBZFilter();
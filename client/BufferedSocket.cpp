@@ -21,8 +21,6 @@
 
 #include <algorithm>
 
-#include <boost/scoped_array.hpp>
-
 #include "ConnectivityManager.h"
 #include "SettingsManager.h"
 #include "SSLSocket.h"
@@ -31,21 +29,33 @@
 #include "TimerManager.h"
 #include "ZUtils.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
 namespace dcpp {
 
 using std::min;
 using std::max;
 
-// Polling is used for tasks...should be fixed...
-#define POLL_TIMEOUT 250
+// Limits for a single turn so that busy sockets won't starve the other ones in the same loop
+#define MAX_READS_PER_TURN 16
+#define MAX_FILE_BYTES_PER_TURN (1024*1024)
+
+// Amount of file data that is read to the page cache at once before sending it with sendfile
+#define FILE_READ_AHEAD (4*1024*1024)
+
+// Retry interval when the throttling limits have been reached
+#define THROTTLE_RETRY 100
 
 BufferedSocket::BufferedSocket(char aSeparator, bool v4only) :
-separator(aSeparator), useLimiter(false), mode(MODE_LINE), dataBytes(0), rollback(0), state(STARTING),
-disconnecting(false), v4only(v4only)
+separator(aSeparator), useLimiter(false), hasCurrent(false), scheduled(false), watchedRead(false), readPaused(false), resolving(false), endTime(0), retryTime(0), 
+filePos(0), fileWriteSize(0), fileReadBytes(0), fileCachedEnd(0), fileDone(false), fileWriteBlocked(false), fileZeroCopy(false), fileReading(false), mode(MODE_LINE), dataBytes(0), rollback(0), sendPos(0), 
+state(STARTING), disconnecting(false), v4only(v4only)
 {
-	start();
-
 	++sockets;
+
+	loop = SocketReactor::getInstance()->addSocket(this);
 }
 
 atomic<long> BufferedSocket::sockets(0);
@@ -109,9 +119,9 @@ void BufferedSocket::connect(const string& aAddress, const string& aPort, bool s
 	connect(aAddress, aPort, Util::emptyString, NAT_NONE, secure, allowUntrusted, proxy, expKP);
 }
 
-void BufferedSocket::connect(const string& aAddress, const string& aPort, const string& localPort, NatRoles natRole, bool secure, bool allowUntrusted, bool proxy, const string& expKP) {
+void BufferedSocket::connect(const string& aAddress, const string& aPort, const string& localPort, NatRoles natRole, bool secure, bool allowUntrusted, bool proxy, const string& expKP, const string& aPeerId) {
 	//dcdebug("BufferedSocket::connect() %p\n", (void*)this);
-	unique_ptr<Socket> s(secure ? new SSLSocket(natRole == NAT_SERVER ? CryptoManager::SSL_SERVER : CryptoManager::SSL_CLIENT, allowUntrusted, expKP) : new Socket(Socket::TYPE_TCP));
+	unique_ptr<Socket> s(secure ? new SSLSocket(natRole == NAT_SERVER ? CryptoManager::SSL_SERVER : CryptoManager::SSL_CLIENT, allowUntrusted, expKP, aPeerId) : new Socket(Socket::TYPE_TCP));
 
 	s->setLocalIp4(CONNSETTING(BIND_ADDRESS));
 	s->setLocalIp6(CONNSETTING(BIND_ADDRESS6));
@@ -124,48 +134,101 @@ void BufferedSocket::connect(const string& aAddress, const string& aPort, const
 
 #define LONG_TIMEOUT 30000
 #define SHORT_TIMEOUT 1000
-void BufferedSocket::threadConnect(const string& aAddr, const string& aPort, const string& localPort, NatRoles natRole, bool proxy) {
-	dcassert(state == STARTING);
-
-	fire(BufferedSocketListener::Connecting());
+void BufferedSocket::threadConnect(ConnectInfo* ci) {
+	// Name resolution and the SOCKS5 negotiation are blocking so they are performed outside the reactor
+	for (auto fd: watched) {
+		loop->unwatch(this, fd);
+	}
+	watched.clear();
 
-	const uint64_t endTime = GET_TICK() + LONG_TIMEOUT;
-	state = RUNNING;
+	{
+		Lock l(cs);
+		resolving = true;
+		resolveError.clear();
+	}
 
-	while (GET_TICK() < endTime) {
-		//dcdebug("threadConnect attempt %s %s:%s\n", localPort.c_str(), aAddr.c_str(), aPort.c_str());
+	SocketReactor::getInstance()->callBlocking([this, ci] {
+		string error;
 		try {
-
-			if(proxy) {
-				sock->socksConnect(aAddr, aPort, LONG_TIMEOUT);
+			if(ci->proxy) {
+				sock->socksConnect(ci->addr, ci->port, LONG_TIMEOUT);
 			} else {
-				sock->connect(aAddr, aPort, localPort);
+				sock->connect(ci->addr, ci->port, ci->localPort);
 			}
 
 			setOptions();
-
-			bool connSucceeded;
-			while(!(connSucceeded = sock->waitConnected(POLL_TIMEOUT)) && endTime >= GET_TICK()) {
-				if(disconnecting) return;
+		} catch(const SocketException& e) {
+			error = e.getError();
+			if(error.empty()) {
+				error = STRING(UNKNOWN_ERROR);
 			}
+		}
 
-			if (connSucceeded) {
-				inbuf.resize(sock->getSocketOptInt(SO_RCVBUF));
+		// the socket may be deleted as soon as the loop sees that we are done
+		Lock l(cs);
+		resolving = false;
+		resolveError = move(error);
+		loop->schedule(this);
+	});
+}
 
-				fire(BufferedSocketListener::Connected());
-				return;
-			}
+bool BufferedSocket::threadConnected(ConnectInfo* ci) {
+	{
+		Lock l(cs);
+		if(resolving)
+			return false;
+	}
+
+	if(disconnecting)
+		return true;
+
+	auto tick = GET_TICK();
+	if(retryTime > 0) {
+		if(tick < retryTime) {
+			loop->setTimer(this, retryTime);
+			return false;
 		}
-		catch (const SSLSocketException&) {
+
+		retryTime = 0;
+		threadConnect(ci);
+		return false;
+	}
+
+	try {
+		if(!resolveError.empty()) {
+			auto error = move(resolveError);
+			resolveError.clear();
+			throw SocketException(error);
+		}
+
+		if(sock->waitConnected(0)) {
+			inbuf.resize(sock->getSocketOptInt(SO_RCVBUF));
+
+			fire(BufferedSocketListener::Connected());
+			return true;
+		}
+	} catch (const SSLSocketException&) {
+		throw;
+	} catch (const SocketException&) {
+		if (ci->natRole == NAT_NONE)
 			throw;
-		} catch (const SocketException&) {
-			if (natRole == NAT_NONE)
-				throw;
-			Thread::sleep(SHORT_TIMEOUT);
+
+		// NAT traversal, keep trying until the other side has opened the port
+		retryTime = tick + SHORT_TIMEOUT;
+		if(retryTime >= endTime) {
+			throw SocketException(STRING(CONNECTION_TIMEOUT));
 		}
+
+		loop->setTimer(this, retryTime);
+		return false;
+	}
+
+	if(tick >= endTime) {
+		throw SocketException(STRING(CONNECTION_TIMEOUT));
 	}
 
-	throw SocketException(STRING(CONNECTION_TIMEOUT));
+	loop->setTimer(this, endTime);
+	return false;
 }
 
 void BufferedSocket::threadAccept() {
@@ -176,50 +239,65 @@ void BufferedSocket::threadAccept() {
 	state = RUNNING;
 
 	inbuf.resize(sock->getSocketOptInt(SO_RCVBUF));
+	endTime = GET_TICK() + 30000;
+}
 
-	uint64_t startTime = GET_TICK();
-	while(!sock->waitAccepted(POLL_TIMEOUT)) {
-		if(disconnecting)
-			return;
+bool BufferedSocket::threadAccepted() {
+	if(disconnecting)
+		return true;
 
-		if((startTime + 30000) < GET_TICK()) {
-			throw SocketException(STRING(CONNECTION_TIMEOUT));
-		}
+	if(sock->waitAccepted(0))
+		return true;
+
+	if(GET_TICK() >= endTime) {
+		throw SocketException(STRING(CONNECTION_TIMEOUT));
 	}
+
+	loop->setTimer(this, endTime);
+	return false;
 }
 
-void BufferedSocket::threadRead() {
+bool BufferedSocket::threadRead() {
 	if(state != RUNNING)
-		return;
+		return false;
 
-	int left = (mode == MODE_DATA && useLimiter) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], inbuf.size()) : sock->read(&inbuf[0], inbuf.size());
+	bool limited = false;
+	int left = mode == MODE_DATA && useLimiter ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], inbuf.size(), limited) : sock->read(&inbuf[0], inbuf.size());
 	if(left == -1) {
 		// EWOULDBLOCK, no data received...
-		return;
+		if(limited) {
+			// there won't be a new event if we left data in the socket because of the limiter
+			loop->setTimer(this, GET_TICK() + THROTTLE_RETRY);
+		}
+		return false;
 	} else if(left == 0) {
 		// This socket has been closed...
 		throw SocketException(STRING(CONNECTION_CLOSED));
 	}
 
-	string::size_type pos = 0;
-	// always uncompressed data
-	string l;
+	// the lines are passed to the listeners through a reused buffer so that they don't need to be allocated every time
+	auto fireLine = [this](const char* aLine, size_t aLen) {
+		if(aLen > 0) { // check empty (only pipe) command and don't waste cpu with it ;o)
+			lineBuf.assign(aLine, aLen);
+			fire(BufferedSocketListener::Line(), lineBuf);
+		}
+	};
+
 	int bufpos = 0, total = left;
 
 	while (left > 0) {
 		switch (mode) {
 			case MODE_ZPIPE: {
 					const int BUF_SIZE = 1024;
-					// Special to autodetect nmdc connections...
-					boost::scoped_array<char> buffer(new char[BUF_SIZE]);
-					l = line;
-					// decompress all input data and store in l.
+					char buffer[BUF_SIZE];
+
+					// decompress all input data after the incomplete line
 					while (left) {
 						size_t in = BUF_SIZE;
 						size_t used = left;
-						bool ret = (*filterIn) (&inbuf[0] + total - left, used, &buffer[0], in);
+						bool ret = (*filterIn) (&inbuf[0] + total - left, used, buffer, in);
 						left -= used;
-						l.append (&buffer[0], in);
+						line.append (buffer, in);
 						// if the stream ends before the data runs out, keep remainder of data in inbuf
 						if (!ret) {
 							bufpos = total-left;
@@ -227,43 +305,57 @@ void BufferedSocket::threadRead() {
 							break;
 						}
 					}
-					// process all lines
-					while ((pos = l.find(separator)) != string::npos) {
-                       	if(pos > 0) // check empty (only pipe) command and don't waste cpu with it ;o)
-							fire(BufferedSocketListener::Line(), l.substr(0, pos));
-						l.erase (0, pos + 1 /* separator char */);
+
+					// process all lines and drop them from the buffer at once
+					string::size_type lineStart = 0, pos;
+					while ((pos = line.find(separator, lineStart)) != string::npos) {
+						fireLine(line.data() + lineStart, pos - lineStart);
+						lineStart = pos + 1 /* separator char */;
 					}
-					// store remainder
-					line = l;
+					line.erase(0, lineStart);
 
 					break;
 				}
-			case MODE_LINE:
-				// Special to autodetect nmdc connections...
-				if(separator == 0) {
-					if(inbuf[0] == '$') {
-						separator = '|';
-					} else {
-						separator = '\n';
+			case MODE_LINE: {
+					// Special to autodetect nmdc connections...
+					if(separator == 0) {
+						if(inbuf[0] == '$') {
+							separator = '|';
+						} else {
+							separator = '\n';
+						}
 					}
-				}
-				l = line + string ((char*)&inbuf[bufpos], left);
-				while ((pos = l.find(separator)) != string::npos) {
-	                if(pos > 0) // check empty (only pipe) command and don't waste cpu with it ;o)
-						fire(BufferedSocketListener::Line(), l.substr(0, pos));
-					l.erase (0, pos + 1 /* separator char */);
-					if (l.length() < (size_t)left) left = l.length();
-					if (mode != MODE_LINE) {
-						// we changed mode; remainder of l is invalid.
-						l.clear();
-						bufpos = total - left;
-						break;
+
+					auto p = reinterpret_cast<const char*>(&inbuf[bufpos]);
+					auto end = p + left;
+					for (;;) {
+						auto sep = static_cast<const char*>(memchr(p, separator, end - p));
+						if (!sep) {
+							// store the incomplete line
+							line.append(p, end);
+							left = 0;
+							break;
+						}
+
+						if (line.empty()) {
+							fireLine(p, sep - p);
+						} else {
+							// complete the line from the previous read
+							line.append(p, sep);
+							fireLine(line.data(), line.size());
+							line.clear();
+						}
+
+						p = sep + 1 /* separator char */;
+						if (mode != MODE_LINE) {
+							// we changed mode; the rest of the data belongs to the new mode
+							bufpos = p - reinterpret_cast<const char*>(&inbuf[0]);
+							left = end - p;
+							break;
+						}
 					}
+					break;
 				}
-				if (pos == string::npos) 
-					left = 0;
-				line = l;
-				break;
 			case MODE_DATA:
 				while(left > 0) {
 					if(dataBytes == -1) {
@@ -292,101 +384,185 @@ void BufferedSocket::threadRead() {
 	if(mode == MODE_LINE && line.size() > static_cast<size_t>(SETTING(MAX_COMMAND_LENGTH))) {
 		throw SocketException(STRING(COMMAND_TOO_LONG));
 	}
+
+	return true;
 }
 
-void BufferedSocket::threadSendFile(InputStream* file) {
+void BufferedSocket::threadReadFile(function<void ()>&& aRead) {
+	// Disk reads (and compressing the data) may block for a long time so they are performed outside the reactor
+	{
+		Lock l(cs);
+		fileReading = true;
+	}
+
+	SocketReactor::getInstance()->callBlocking([this, aRead] {
+		string error;
+		try {
+			aRead();
+		} catch(const Exception& e) {
+			error = e.getError();
+			if(error.empty()) {
+				error = STRING(UNKNOWN_ERROR);
+			}
+		}
+
+		// the socket may be deleted as soon as the loop sees that we are done
+		Lock l(cs);
+		fileReading = false;
+		if(fileError.empty())
+			fileError = move(error);
+		loop->schedule(this);
+	});
+}
+
+bool BufferedSocket::threadSendFile(InputStream* file) {
+	string error;
+	{
+		Lock l(cs);
+		if(fileReading)
+			return false;
+
+		error.swap(fileError);
+	}
+
 	if(state != RUNNING)
-		return;
+		return true;
+
+	if(!error.empty()) {
+		// the read failed or the socket failed while the stream was in use
+		throw Exception(error);
+	}
+
+	if(fileReadBytes > 0) {
+		fire(BufferedSocketListener::BytesSent(), fileReadBytes, 0);
+		fileReadBytes = 0;
+	}
 
-	if(disconnecting)
-		return;
 	dcassert(file != NULL);
 	size_t sockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
 	size_t bufSize = max(sockSize, (size_t)64*1024);
 
-	ByteVector readBuf(bufSize);
-	ByteVector writeBufTmp(bufSize);
+	size_t sent = 0;
+	while(!disconnecting) {
+		if(fileZeroCopy && filePos == fileBuf.size()) {
+			// send straight from the page cache as long as the stream returns the file as such
+			int64_t pos, bytesLeft;
+			int fd = file->getFileRange(pos, bytesLeft);
+			if(fd == -1 || bytesLeft <= 0) {
+				fileZeroCopy = false;
+				continue;
+			}
 
-	size_t readPos = 0;
+			if(sent >= MAX_FILE_BYTES_PER_TURN) {
+				loop->schedule(this);
+				return false;
+			}
 
-	bool readDone = false;
-	//dcdebug("Starting threadSend\n");
-	while(!disconnecting) {
-		if(!readDone && readBuf.size() > readPos) {
-			// Fill read buffer
-			size_t bytesRead = readBuf.size() - readPos;
-			size_t actual = file->read(&readBuf[readPos], bytesRead);
+			if(!fileWriteBlocked) {
+				fileWriteSize = static_cast<size_t>(min(static_cast<int64_t>(sockSize / 2), bytesLeft));
+				if(pos + static_cast<int64_t>(fileWriteSize) > fileCachedEnd) {
+					// sendfile would block while the data is being read from the disk
+					auto len = min(bytesLeft, static_cast<int64_t>(FILE_READ_AHEAD));
+					threadReadFile([this, fd, pos, len] {
+#ifdef __linux__
+						::readahead(fd, pos, static_cast<size_t>(len));
+#endif
+						fileCachedEnd = pos + len;
+					});
+					return false;
+				}
 
-			if(bytesRead > 0) {
-				fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+				if(useLimiter && !ThrottleManager::getInstance()->getUpTokens(fileWriteSize)) {
+					// no upload tokens left
+					loop->setTimer(this, GET_TICK() + THROTTLE_RETRY);
+					return false;
+				}
 			}
 
-			if(actual == 0) {
-				readDone = true;
+			int written = sock->sendFile(fd, pos, static_cast<int>(fileWriteSize));
+			if(written > 0) {
+				if(useLimiter && static_cast<size_t>(written) < fileWriteSize) {
+					// only the sent bytes are counted against the limit
+					ThrottleManager::getInstance()->returnUpTokens(fileWriteSize - written);
+				}
+
+				fileWriteBlocked = false;
+				file->skipFileRange(written);
+				sent += written;
+
+				fire(BufferedSocketListener::BytesSent(), written, written);
+			} else if(written == -1) {
+				// wait until the socket becomes writable
+				fileWriteBlocked = true;
+				return false;
 			} else {
-				readPos += actual;
+				// not supported by the socket or the file, use the regular reads (they take their own tokens)
+				if(useLimiter)
+					ThrottleManager::getInstance()->returnUpTokens(fileWriteSize);
+
+				fileWriteBlocked = false;
+				fileZeroCopy = false;
 			}
+			continue;
 		}
 
-		if(readDone && readPos == 0) {
-			fire(BufferedSocketListener::TransmitDone());
-			return;
+		if(filePos == fileBuf.size()) {
+			if(fileDone) {
+				fileBuf.clear();
+				filePos = 0;
+				fire(BufferedSocketListener::TransmitDone());
+				return true;
+			}
+
+			// Fill read buffer
+			fileBuf.resize(bufSize);
+			filePos = 0;
+			threadReadFile([this, file] {
+				size_t bytesRead = fileBuf.size();
+				size_t actual = file->read(&fileBuf[0], bytesRead);
+
+				fileReadBytes = bytesRead;
+				fileBuf.resize(actual);
+				if(actual == 0) {
+					fileDone = true;
+				}
+			});
+			return false;
 		}
 
-		readBuf.swap(writeBufTmp);
-		readBuf.resize(bufSize);
-		writeBufTmp.resize(readPos);
-		readPos = 0;
+		if(sent >= MAX_FILE_BYTES_PER_TURN) {
+			// let the other sockets in this loop have their turn
+			loop->schedule(this);
+			return false;
+		}
 
-		size_t writePos = 0, writeSize = 0;
 		int written = 0;
+		if(fileWriteBlocked) {
+			// workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
+			written = sock->write(&fileBuf[filePos], fileWriteSize);
+		} else {
+			fileWriteSize = min(sockSize / 2, fileBuf.size() - filePos);
+			written = useLimiter ? ThrottleManager::getInstance()->write(sock.get(), &fileBuf[filePos], fileWriteSize) : sock->write(&fileBuf[filePos], fileWriteSize);
+		}
 
-		while(writePos < writeBufTmp.size()) {
-			if(disconnecting)
-				return;
-			
-			if(written == -1) {
-				// workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
-				written = sock->write(&writeBufTmp[writePos], writeSize);
-			} else {
-				writeSize = min(sockSize / 2, writeBufTmp.size() - writePos);
-				written = useLimiter ? ThrottleManager::getInstance()->write(sock.get(), &writeBufTmp[writePos], writeSize) : sock->read(&inbuf[0], inbuf.size());
-			}
-			
-			if(written > 0) {
-				writePos += written;
-
-				fire(BufferedSocketListener::BytesSent(), 0, written);
-
-			} else if(written == -1) {
-				if(!readDone && readPos < readBuf.size()) {
-					// Read a little since we're blocking anyway...
-					size_t bytesRead = min(readBuf.size() - readPos, readBuf.size() / 2);
-					size_t actual = file->read(&readBuf[readPos], bytesRead);
+		if(written > 0) {
+			fileWriteBlocked = false;
+			filePos += written;
+			sent += written;
 
-					if(bytesRead > 0) {
-						fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
-					}
-
-					if(actual == 0) {
-						readDone = true;
-					} else {
-						readPos += actual;
-					}
-				} else {
-					while(!disconnecting) {
-						auto w = sock->wait(POLL_TIMEOUT, true, true);
-						if(w.first) {
-							threadRead();
-						}
-						if(w.second) {
-							break;
-						}
-					}
-				}
-			}
+			fire(BufferedSocketListener::BytesSent(), 0, written);
+		} else if(written == -1) {
+			// wait until the socket becomes writable
+			fileWriteBlocked = true;
+			return false;
+		} else {
+			// no upload tokens left
+			loop->setTimer(this, GET_TICK() + THROTTLE_RETRY);
+			return false;
 		}
 	}
+
+	return true;
 }
 
 void BufferedSocket::write(const char* aBuf, size_t aLen) noexcept {
@@ -399,114 +575,213 @@ void BufferedSocket::write(const char* aBuf, size_t aLen) noexcept {
 	writeBuf.insert(writeBuf.end(), aBuf, aBuf+aLen);
 }
 
-void BufferedSocket::threadSendData() {
+bool BufferedSocket::threadSendData() {
 	if(state != RUNNING)
-		return;
+		return true;
 
-	{
-		Lock l(cs);
-		if(writeBuf.empty())
-			return;
+	while(sendPos < sendBuf.size()) {
+		if(disconnecting) {
+			return true;
+		}
 
-		writeBuf.swap(sendBuf);
+		int n = sock->write(&sendBuf[sendPos], sendBuf.size() - sendPos);
+		if(n <= 0) {
+			// wait until the socket becomes writable
+			return false;
+		}
+
+		sendPos += n;
 	}
 
-	size_t left = sendBuf.size();
-	size_t done = 0;
-	while(left > 0) {
-		if(disconnecting) {
-			return;
-		}
+	sendBuf.clear();
+	sendPos = 0;
+	return true;
+}
 
-		auto w = sock->wait(POLL_TIMEOUT, true, true);
+bool BufferedSocket::startTask() {
+	auto& p = current;
+	if(p.first == SHUTDOWN) {
+		if (p.second)
+			static_cast<CallData*>(p.second.get())->f();
+		return false;
+	} else if(p.first == ASYNC_CALL) {
+		static_cast<CallData*>(p.second.get())->f();
+		return true;
+	} else if(p.first == RESUME_READ) {
+		readPaused = false;
+		if(p.second && !disconnecting)
+			static_cast<CallData*>(p.second.get())->f();
+		return true;
+	}
 
-		if(w.first) {
-			threadRead();
-		}
+	if(state == STARTING) {
+		if(p.first == CONNECT) {
+			fire(BufferedSocketListener::Connecting());
 
-		if(w.second) {
-			int n = sock->write(&sendBuf[done], left);
-			if(n > 0) {
-				left -= n;
-				done += n;
+			endTime = GET_TICK() + LONG_TIMEOUT;
+			state = RUNNING;
+
+			threadConnect(static_cast<ConnectInfo*>(p.second.get()));
+			hasCurrent = true;
+		} else if(p.first == ACCEPTED) {
+			threadAccept();
+			hasCurrent = true;
+		} else {
+			dcdebug("%d unexpected in STARTING state\n", p.first);
+		}
+	} else if(state == RUNNING) {
+		if(p.first == SEND_DATA) {
+			{
+				Lock l(cs);
+				if(writeBuf.empty())
+					return true;
+
+				writeBuf.swap(sendBuf);
 			}
+
+			sendPos = 0;
+			hasCurrent = true;
+		} else if(p.first == SEND_FILE) {
+			filePos = 0;
+			fileBuf.clear();
+			fileCachedEnd = 0;
+			fileDone = false;
+			fileWriteBlocked = false;
+			fileZeroCopy = true;
+			hasCurrent = true;
+		} else if(p.first == DISCONNECT) {
+			fail(STRING(DISCONNECTED));
+		} else {
+			dcdebug("%d unexpected in RUNNING state\n", p.first);
 		}
 	}
-	sendBuf.clear();
+	return true;
+}
+
+bool BufferedSocket::continueTask() {
+	switch(current.first) {
+		case CONNECT: return threadConnected(static_cast<ConnectInfo*>(current.second.get()));
+		case ACCEPTED: return threadAccepted();
+		case SEND_DATA: return threadSendData();
+		case SEND_FILE: return threadSendFile(static_cast<SendFileInfo*>(current.second.get())->stream);
+		default: return true;
+	}
 }
 
 bool BufferedSocket::checkEvents() {
-	while(state == RUNNING ? taskSem.wait(0) : taskSem.wait()) {
-		pair<Tasks, unique_ptr<TaskData> > p;
+	for(;;) {
+		if(hasCurrent) {
+			if(!continueTask())
+				return true;
+
+			hasCurrent = false;
+		}
+
 		{
 			Lock l(cs);
-			dcassert(!tasks.empty());
-			p = move(tasks.front());
-			tasks.erase(tasks.begin());
+			if(tasks.empty())
+				return true;
+
+			current = move(tasks.front());
+			tasks.pop_front();
 		}
 
-		if(p.first == SHUTDOWN) {
-			if (p.second)
-				static_cast<CallData*>(p.second.get())->f();
+		if(!startTask())
 			return false;
-		} else if(p.first == ASYNC_CALL) {
-			static_cast<CallData*>(p.second.get())->f();
-			continue;
-		}
+	}
+}
 
-		if(state == STARTING) {
-			if(p.first == CONNECT) {
-				ConnectInfo* ci = static_cast<ConnectInfo*>(p.second.get());
-				threadConnect(ci->addr, ci->port, ci->localPort, ci->natRole, ci->proxy);
-			} else if(p.first == ACCEPTED) {
-				threadAccept();
-			} else {
-				dcdebug("%d unexpected in STARTING state\n", p.first);
-			}
-		} else if(state == RUNNING) {
-			if(p.first == SEND_DATA) {
-				threadSendData();
-			} else if(p.first == SEND_FILE) {
-				threadSendFile(static_cast<SendFileInfo*>(p.second.get())->stream); break;
-			} else if(p.first == DISCONNECT) {
-				fail(STRING(DISCONNECTED));
-			} else {
-				dcdebug("%d unexpected in RUNNING state\n", p.first);
-			}
+void BufferedSocket::checkSocket() {
+	if(hasCurrent && (current.first == CONNECT || current.first == ACCEPTED)) {
+		// the handshake isn't finished yet
+		return;
+	}
+
+	if(readPaused) {
+		// the socket will be scheduled again by resumeRead
+		return;
+	}
+
+	for(int i = 0; i < MAX_READS_PER_TURN; ++i) {
+		if(disconnecting || !threadRead()) {
+			return;
 		}
 	}
-	return true;
+
+	// there may be more data waiting
+	loop->schedule(this);
 }
 
-void BufferedSocket::checkSocket() {
-	auto w = sock->wait(POLL_TIMEOUT, true, false);
+void BufferedSocket::updateWatch() {
+	{
+		Lock l(cs);
+		if(resolving)
+			return;
+	}
+
+	vector<socket_t> fds;
+	if(sock) {
+		auto d = sock->getDescriptors();
+		if(d.first != INVALID_SOCKET)
+			fds.push_back(d.first);
+		if(d.second != INVALID_SOCKET)
+			fds.push_back(d.second);
+	}
+
+	bool read = !readPaused;
+	if(fds == watched && read == watchedRead)
+		return;
+
+	for(auto fd: watched) {
+		if(find(fds.begin(), fds.end(), fd) == fds.end())
+			loop->unwatch(this, fd);
+	}
 
-	if(w.first) {
-		threadRead();
+	for(auto fd: fds) {
+		if(read != watchedRead || find(watched.begin(), watched.end(), fd) == watched.end())
+			loop->watch(this, fd, read);
 	}
+
+	watched.swap(fds);
+	watchedRead = read;
 }
 
 /**
  * Main task dispatcher for the buffered socket abstraction.
- * @todo Fix the polling...
+ * Runs the queued tasks and reads the available data without blocking; the socket
+ * gets called again by the reactor when it becomes readable/writable or a timer expires.
  */
-int BufferedSocket::run() {
-	//dcdebug("BufferedSocket::run() start %p\n", (void*)this);
-	while(true) {
+void BufferedSocket::process() {
+	//dcdebug("BufferedSocket::process() %p\n", (void*)this);
+	for(;;) {
 		try {
 			if(!checkEvents()) {
-				break;
+				loop->remove(this);
+				delete this;
+				return;
 			}
+
 			if(state == RUNNING) {
 				checkSocket();
 			}
+			break;
 		} catch(const Exception& e) {
+			{
+				Lock l(cs);
+				if(fileReading) {
+					// the stream is still being read, fail after that so that it won't be deleted meanwhile
+					if(fileError.empty())
+						fileError = e.getError().empty() ? STRING(UNKNOWN_ERROR) : e.getError();
+					break;
+				}
+			}
+
+			hasCurrent = false;
 			fail(e.getError());
 		}
 	}
-	//dcdebug("BufferedSocket::run() end %p\n", (void*)this);
-	delete this;
-	return 0;
+
+	updateWatch();
 }
 
 void BufferedSocket::fail(const string& aError) {
@@ -528,7 +803,8 @@ void BufferedSocket::shutdown(function<void ()> f) {
 
 void BufferedSocket::addTask(Tasks task, TaskData* data) {
 	dcassert(task == DISCONNECT || task == SHUTDOWN || sock.get());
-	tasks.emplace_back(task, unique_ptr<TaskData>(data)); taskSem.signal();
+	tasks.emplace_back(task, unique_ptr<TaskData>(data));
+	loop->schedule(this);
 }
 
 } // namespace dcpp
@@ -25,7 +25,7 @@
 #include "typedefs.h"
 
 #include "BufferedSocketListener.h"
-#include "Semaphore.h"
+#include "SocketReactor.h"
 #include "Thread.h"
 #include "Speaker.h"
 #include "Socket.h"
@@ -38,7 +38,11 @@ using std::function;
 using std::pair;
 using std::unique_ptr;
 
-class BufferedSocket : public Speaker<BufferedSocketListener>, private Thread {
+/**
+ * Socket with a queue of tasks, driven by the readiness events of SocketReactor.
+ * Listeners are always called from the reactor thread that the socket belongs to.
+ */
+class BufferedSocket : public Speaker<BufferedSocketListener> {
 public:
 	enum Modes {
 		MODE_LINE,
@@ -75,7 +79,7 @@ public:
 
 	void accept(const Socket& srv, bool secure, bool allowUntrusted, const string& expKP = Util::emptyString);
 	void connect(const string& aAddress, const string& aPort, bool secure, bool allowUntrusted, bool proxy, const string& expKP = Util::emptyString);
-	void connect(const string& aAddress, const string& aPort, const string& localPort, NatRoles natRole, bool secure, bool allowUntrusted, bool proxy, const string& expKP = Util::emptyString);
+	void connect(const string& aAddress, const string& aPort, const string& localPort, NatRoles natRole, bool secure, bool allowUntrusted, bool proxy, const string& expKP = Util::emptyString, const string& aPeerId = Util::emptyString);
 
 	/** Sets data mode for aBytes bytes. Must be called within onLine. */
 	void setDataMode(int64_t aBytes = -1) { mode = MODE_DATA; dataBytes = aBytes; }
@@ -100,9 +104,17 @@ public:
 	/** Send the file f over this socket. */
 	void transmitFile(InputStream* f) { Lock l(cs); addTask(SEND_FILE, new SendFileInfo(f)); }
 
-	/** Call a function from the socket's thread. */
+	/** Call a function from the socket's reactor thread. */
 	void callAsync(function<void ()> f) { Lock l(cs); addTask(ASYNC_CALL, new CallData(f)); }
 
+	/** Stop reading from the socket until resumeRead is called. Must be called from the reactor thread. */
+	void pauseRead() { readPaused = true; }
+	/**
+	 * Continue reading from the socket, may be called from any thread.
+	 * f is called from the reactor thread before reading unless the socket is being disconnected.
+	 */
+	void resumeRead(function<void ()> f = nullptr) { Lock l(cs); addTask(RESUME_READ, f ? new CallData(f) : nullptr); }
+
 	void disconnect(bool graceless = false) noexcept { Lock l(cs); if(graceless) disconnecting = true; addTask(DISCONNECT, 0); }
 
 	string getLocalIp() const { return sock->getLocalIp(); }
@@ -119,7 +131,8 @@ private:
 		SEND_FILE,
 		SHUTDOWN,
 		ACCEPTED,
-		ASYNC_CALL
+		ASYNC_CALL,
+		RESUME_READ
 	};
 
 	enum State {
@@ -148,42 +161,81 @@ private:
 		function<void ()> f;
 	};
 
+	friend class SocketReactor::Loop;
+
 	BufferedSocket(char aSeparator, bool v4only);
 
 	virtual ~BufferedSocket();
 
 	CriticalSection cs;
 
-	Semaphore taskSem;
 	deque<pair<Tasks, unique_ptr<TaskData> > > tasks;
 
+	// The task being executed; tasks that need to wait for the socket (connecting, sending) 
+	// stay here until they are finished so that the queue is processed in order
+	pair<Tasks, unique_ptr<TaskData> > current;
+	bool hasCurrent;
+
+	SocketReactor::Loop* loop;
+	bool scheduled; // protected by the loop
+	vector<socket_t> watched;
+	bool watchedRead;
+	bool readPaused;
+
+	// CONNECT
+	bool resolving; // protected by cs
+	string resolveError;
+	uint64_t endTime;
+	uint64_t retryTime;
+
+	// SEND_FILE
+	ByteVector fileBuf;
+	size_t filePos;
+	size_t fileWriteSize;
+	size_t fileReadBytes; // read by the blocking pool, not reported yet
+	int64_t fileCachedEnd; // end of the file range that has been read ahead for sendfile
+	bool fileDone;
+	bool fileWriteBlocked;
+	bool fileZeroCopy;
+	bool fileReading; // protected by cs
+	string fileError; // protected by cs
+
 	Modes mode;
 	std::unique_ptr<UnZFilter> filterIn;
 	int64_t dataBytes;
 	size_t rollback;
-	string line;
+	string line; // incomplete line
+	string lineBuf;
 	ByteVector inbuf;
 	ByteVector writeBuf;
 	ByteVector sendBuf;
+	size_t sendPos;
 
 	std::unique_ptr<Socket> sock;
 	State state;
 	bool disconnecting;
 	bool v4only;
 
-	virtual int run();
+	/** Handle the queued tasks and readiness events (called by the reactor) */
+	void process();
 
-	void threadConnect(const string& aAddr, const string& aPort, const string& localPort, NatRoles natRole, bool proxy);
+	void threadConnect(ConnectInfo* ci);
+	bool threadConnected(ConnectInfo* ci);
 	void threadAccept();
-	void threadRead();
-	void threadSendFile(InputStream* is);
-	void threadSendData();
+	bool threadAccepted();
+	bool threadRead();
+	bool threadSendFile(InputStream* is);
+	void threadReadFile(function<void ()>&& aRead);
+	bool threadSendData();
 
 	void fail(const string& aError);
 	static atomic<long> sockets;
 
 	bool checkEvents();
+	bool startTask();
+	bool continueTask();
 	void checkSocket();
+	void updateWatch();
 
 	void setSocket(std::unique_ptr<Socket>&& s);
 	void setOptions();
@@ -58,11 +58,16 @@ namespace dcpp {
 	CriticalSection* CryptoManager::cs = NULL;
 	int CryptoManager::idxVerifyData = 0;
 	char CryptoManager::idxVerifyDataName[] = "AirDC.VerifyData";
+	int CryptoManager::idxSessionKey = 0;
+	char CryptoManager::idxSessionKeyName[] = "AirDC.SessionKey";
+	unsigned char CryptoManager::sessionIdContext[] = "AirDC.Session";
 	CryptoManager::SSLVerifyData CryptoManager::trustedKeyprint = { false, "trusted_keyp" };
 
 CryptoManager::CryptoManager()
 :
 	certsLoaded(false),
+	fullHandshakes(0),
+	resumedHandshakes(0),
 	lock("EXTENDEDPROTOCOLABCABCABCABCABCABC"),
 	pk("DCPLUSPLUS" + VERSIONSTRING)
 {
@@ -77,6 +82,7 @@ CryptoManager::CryptoManager()
 	serverContext.reset(SSL_CTX_new(SSLv23_server_method()));
 
 	idxVerifyData = SSL_get_ex_new_index(0, idxVerifyDataName, NULL, NULL, NULL);
+	idxSessionKey = SSL_get_ex_new_index(0, idxSessionKeyName, NULL, NULL, NULL);
 
 	if(clientContext && serverContext) {
 		// Check that openssl rng has been seeded with enough data
@@ -126,6 +132,16 @@ CryptoManager::CryptoManager()
 			EC_KEY_free(tmp_ecdh);
 		}
 
+		// Allow resuming the sessions of repeated connections between the same clients: the server side sessions are
+		// kept by OpenSSL (session IDs and tickets) while the client sessions are cached per peer in here
+		SSL_CTX_set_session_id_context(serverContext, sessionIdContext, sizeof(sessionIdContext) - 1);
+		SSL_CTX_set_session_cache_mode(serverContext, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(serverContext, MAX_SESSIONS);
+		SSL_CTX_set_timeout(serverContext, SESSION_TIMEOUT);
+
+		SSL_CTX_set_session_cache_mode(clientContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(clientContext, CryptoManager::new_session_cb);
+
 		SSL_CTX_set_tmp_dh_callback(serverContext, CryptoManager::tmp_dh_cb);
 		SSL_CTX_set_tmp_rsa_callback(serverContext, CryptoManager::tmp_rsa_cb);
 		SSL_CTX_set_verify(clientContext, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_callback);
@@ -157,6 +173,77 @@ CryptoManager::~CryptoManager() {
 	CRYPTO_cleanup_all_ex_data();
 }
 
+int CryptoManager::new_session_cb(SSL* ssl, SSL_SESSION* session) {
+	auto key = (const string*)SSL_get_ex_data(ssl, CryptoManager::idxSessionKey);
+	if (!key)
+		return 0;
+
+	getInstance()->storeSession(*key, session);
+	return 1; // we keep the reference
+}
+
+void CryptoManager::storeSession(const string& aKey, SSL_SESSION* aSession) noexcept {
+	Lock l(sessionCS);
+	if (clientSessions.size() >= MAX_SESSIONS && clientSessions.find(aKey) == clientSessions.end()) {
+		auto oldest = min_element(clientSessions.begin(), clientSessions.end(), [](pair<const string, ssl::SSL_SESSION>& a, pair<const string, ssl::SSL_SESSION>& b) {
+			return SSL_SESSION_get_time(a.second) < SSL_SESSION_get_time(b.second);
+		});
+		clientSessions.erase(oldest);
+	}
+
+	clientSessions[aKey].reset(aSession);
+}
+
+bool CryptoManager::resumeSession(SSL* ssl, const string& aKey) noexcept {
+	Lock l(sessionCS);
+	auto i = clientSessions.find(aKey);
+	if (i == clientSessions.end())
+		return false;
+
+	if (static_cast<time_t>(SSL_SESSION_get_time(i->second) + SSL_SESSION_get_timeout(i->second)) < GET_TIME()) {
+		clientSessions.erase(i);
+		return false;
+	}
+
+	// the session will be replaced through new_session_cb if the server doesn't accept it
+	return SSL_set_session(ssl, i->second) == SSL_SUCCESS;
+}
+
+void CryptoManager::clearSessions() noexcept {
+	{
+		Lock l(sessionCS);
+		clientSessions.clear();
+	}
+
+	// the peers would resume the sessions that were established with the old certificate
+	if (serverContext)
+		SSL_CTX_flush_sessions(serverContext, 0);
+}
+
+void CryptoManager::countHandshake(bool aResumed) noexcept {
+	if (aResumed) {
+		resumedHandshakes++;
+	} else {
+		fullHandshakes++;
+	}
+}
+
+string CryptoManager::getSessionStats() const noexcept {
+	uint64_t full = fullHandshakes;
+	uint64_t resumed = resumedHandshakes;
+
+	size_t cached = 0;
+	{
+		Lock l(sessionCS);
+		cached = clientSessions.size();
+	}
+
+	string statMsg = "TLS handshakes: " + Util::toString(full + resumed) + " (full: " + Util::toString(full) + ", resumed: " + Util::toString(resumed);
+	statMsg += ", resumption rate " + Util::toString(full + resumed > 0 ? ((double)resumed / (double)(full + resumed))*100 : 0) + "%)\r\n";
+	statMsg += "Cached client sessions: " + Util::toString(cached);
+	return statMsg;
+}
+
 bool CryptoManager::TLSOk() const noexcept{
 	return SETTING(TLS_MODE) > 0 && certsLoaded && !keyprint.empty();
 }
@@ -270,6 +357,8 @@ DH* CryptoManager::getTmpDH(int keyLen) {
 	DH* tmpDH = DH_new();
 	if (!tmpDH) return NULL;
 
+	BIGNUM* p = NULL;
+
 	// From RFC 3526; checked via http://wiki.openssl.org/index.php/Diffie-Hellman_parameters#Validating_Parameters
 	switch (keyLen) {
 	case 2048: {			
@@ -297,7 +386,7 @@ DH* CryptoManager::getTmpDH(int keyLen) {
 				0x15,0x72,0x8E,0x5A,0x8A,0xAC,0xAA,0x68,0xFF,0xFF,0xFF,0xFF,
 				0xFF,0xFF,0xFF,0xFF,
 			};
-		tmpDH->p = BN_bin2bn(dh2048_p, sizeof(dh2048_p), 0);
+		p = BN_bin2bn(dh2048_p, sizeof(dh2048_p), 0);
 		break;
 	}
 
@@ -347,7 +436,7 @@ DH* CryptoManager::getTmpDH(int keyLen) {
 				0x90,0xA6,0xC0,0x8F,0x4D,0xF4,0x35,0xC9,0x34,0x06,0x31,0x99,
 				0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
 			};
-		tmpDH->p = BN_bin2bn(dh4096_p, sizeof(dh4096_p), 0);
+		p = BN_bin2bn(dh4096_p, sizeof(dh4096_p), 0);
 		break;
 	}
 	}
@@ -356,9 +445,19 @@ DH* CryptoManager::getTmpDH(int keyLen) {
 		0x02,
 	};
 
-	tmpDH->g = BN_bin2bn(dh_g, sizeof(dh_g), 0);
+	BIGNUM* g = BN_bin2bn(dh_g, sizeof(dh_g), 0);
 
-	if(!tmpDH->p || !tmpDH->g) {
+	// the DH struct is opaque since OpenSSL 1.1.0
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if(!p || !g || !DH_set0_pqg(tmpDH, p, NULL, g)) {
+		BN_free(p);
+		BN_free(g);
+#else
+	tmpDH->p = p;
+	tmpDH->g = g;
+
+	if(!p || !g) {
+#endif
 		DH_free(tmpDH);
 		return NULL;
 	} else return tmpDH;
@@ -389,6 +488,9 @@ void CryptoManager::loadCertificates() noexcept{
 	keyprint.clear();
 	certsLoaded = false;
 
+	// the peers have stored our old certificate in the sessions
+	clearSessions();
+
 	const string& cert = SETTING(TLS_CERTIFICATE_FILE);
 	const string& key = SETTING(TLS_PRIVATE_KEY_FILE);
 
@@ -583,7 +685,11 @@ int CryptoManager::verify_callback(int preverify_ok, X509_STORE_CTX *ctx) {
 			if (err != X509_V_OK) {
 				// This is the right way to get the certificate store, although it is rather roundabout
 				X509_STORE* store = SSL_CTX_get_cert_store(SSL_get_SSL_CTX(ssl));
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+				dcassert(store == X509_STORE_CTX_get0_store(ctx));
+#else
 				dcassert(store == ctx->ctx);
+#endif
 
 				// Hide the potential library error about trying to add a dupe
 				ERR_set_mark();
@@ -21,9 +21,11 @@
 
 #include "SettingsManager.h"
 
+#include "CriticalSection.h"
 #include "Exception.h"
 #include "Singleton.h"
 #include "SSL.h"
+#include "atomic.h"
 
 namespace dcpp {
 
@@ -63,14 +65,21 @@ public:
 
 	bool TLSOk() const noexcept;
 
+	/* Resume the previous session with the peer (the key should identify both the user and the expected keyprint) */
+	bool resumeSession(SSL* ssl, const string& aKey) noexcept;
+	void countHandshake(bool aResumed) noexcept;
+	string getSessionStats() const noexcept;
+
 	static void locking_function(int mode, int n, const char* /*file*/, int /*line*/);
 	static DH* tmp_dh_cb(SSL* /*ssl*/, int /*is_export*/, int keylength);
 	static RSA* tmp_rsa_cb(SSL* /*ssl*/, int /*is_export*/, int keylength);
 	static int verify_callback(int preverify_ok, X509_STORE_CTX *ctx);
+	static int new_session_cb(SSL* ssl, SSL_SESSION* session);
 
 	static void setCertPaths();
 
 	static int idxVerifyData;
+	static int idxSessionKey;
 private:
 
 	friend class Singleton<CryptoManager>;
@@ -91,9 +100,26 @@ private:
 
 	bool certsLoaded;
 
+	enum {
+		MAX_SESSIONS = 1024,
+		SESSION_TIMEOUT = 60 * 60 // seconds
+	};
+
+	void storeSession(const string& aKey, SSL_SESSION* aSession) noexcept;
+	void clearSessions() noexcept;
+
+	// client side sessions by peer
+	unordered_map<string, ssl::SSL_SESSION> clientSessions;
+	mutable CriticalSection sessionCS;
+
+	atomic<uint64_t> fullHandshakes;
+	atomic<uint64_t> resumedHandshakes;
+
 	static void* tmpKeysMap[KEY_LAST];
 	static CriticalSection* cs;
 	static char idxVerifyDataName[];
+	static char idxSessionKeyName[];
+	static unsigned char sessionIdContext[];
 	static SSLVerifyData trustedKeyprint;
 
 	ByteVector keyprint;
@@ -26,6 +26,7 @@
 #include "CryptoManager.h"
 #include "ShareManager.h"
 #include "SearchManager.h"
+#include "SocketReactor.h"
 #include "QueueManager.h"
 #include "ClientManager.h"
 #include "HashManager.h"
@@ -80,6 +81,7 @@ void startup(function<void(const string&)> stepF, function<bool(const string& /*
 
 	LogManager::newInstance();
 	TimerManager::newInstance();
+	SocketReactor::newInstance();
 	HashManager::newInstance();
 	CryptoManager::newInstance();
 	SearchManager::newInstance();
@@ -207,6 +209,7 @@ void shutdown(function<void (const string&)> stepF, function<void (float)> progr
 	HashManager::deleteInstance();
 	LogManager::deleteInstance();
 	SettingsManager::deleteInstance();
+	SocketReactor::deleteInstance();
 	TimerManager::deleteInstance();
 	ResourceManager::deleteInstance();
 
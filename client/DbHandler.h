@@ -48,12 +48,29 @@ public:
 	virtual bool get(void* key, size_t keyLen, size_t initialValueLen, std::function<bool(void* aValue, size_t aValueLen)> loadF, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
 	virtual void remove(void* aKey, size_t keyLen, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
 
+	/* Keys mapped to the new values, empty values are removed */
+	typedef unordered_map<string, string> ValueMap;
+
+	/* Writes all values at once. The data is flushed to disk before returning if sync is set. */
+	virtual void write(const ValueMap& aValues, bool /*aSync*/) throw(DbException) {
+		for (const auto& v: aValues) {
+			if (v.second.empty()) {
+				remove((void*)v.first.data(), v.first.size());
+			} else {
+				put((void*)v.first.data(), v.first.size(), (void*)v.second.data(), v.second.size());
+			}
+		}
+	}
+
 	virtual bool hasKey(void* key, size_t keyLen, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
 
 	virtual size_t size(bool thorough, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
 	virtual int64_t getSizeOnDisk() throw(DbException) = 0;
 
 	virtual void remove_if(std::function<bool(void* aKey, size_t keyLen, void* aValue, size_t valueLen)> f, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
+
+	/* Iterates only the keys beginning with the prefix (in key order) */
+	virtual void remove_if(const string& aPrefix, std::function<bool(void* aKey, size_t keyLen, void* aValue, size_t valueLen)> f, DbSnapshot* aSnapshot = nullptr) throw(DbException) = 0;
 	virtual void compact() {}
 
 	virtual string getStats() throw(DbException) { return "Not supported"; }
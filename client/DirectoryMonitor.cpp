@@ -21,13 +21,18 @@
 
 #include "AirUtil.h"
 #include "DirectoryMonitor.h"
+#include "File.h"
 #include "ResourceManager.h"
 #include "Text.h"
 
-/*#ifndef _WIN32
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
-#include <sys/epoll.h>
-#endif*/
+
+// IN_CLOSE_WRITE is used instead of IN_MODIFY so that we get a single notification for each completed write
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#endif
 
 namespace dcpp {
 
@@ -67,19 +72,22 @@ void DirectoryMonitor::Server::init() throw(MonitorException) {
 		throw MonitorException(Util::translateError(::GetLastError()));
 	}
 #else
-	/*fd = inotify_init();
-	if (fd < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));
-
-	efd = epoll_create(sizeof(int));
-	if (efd < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));
-
-	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-	cfg = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
-	if (cfg < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));*/
+	if (fd < 0) {
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0) {
+			threadRunning.clear();
+			throw MonitorException(getErrorStr(errno));
+		}
+	}
 
+	if (efd < 0) {
+		// used for waking up the thread when monitors are removed
+		efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (efd < 0) {
+			threadRunning.clear();
+			throw MonitorException(getErrorStr(errno));
+		}
+	}
 #endif
 
 	start();
@@ -96,6 +104,10 @@ void DirectoryMonitor::Server::stop() {
 		}
 	}
 
+#ifndef _WIN32
+	wakeUp();
+#endif
+
 	// Wait for the thread to stop
 	while (true) {
 		{
@@ -204,21 +216,42 @@ void Monitor::openDirectory(HANDLE iocp) {
 
 #else
 
-Monitor::Monitor(const string& aPath, DirectoryMonitor::Server* aServer, int monitorFlags, size_t bufferSize) {
+Monitor::Monitor(const string& aPath, DirectoryMonitor::Server* aServer) : server(aServer), changes(0), path(aPath), stopped(false) {
+
 }
 
 Monitor::~Monitor() { }
 
 void Monitor::stopMonitoring() {
+	if (stopped)
+		return;
 
+	stopped = true;
+	server->removeWatches(this, Util::emptyString);
+	server->wakeUp();
 }
 
 DirectoryMonitor::Server::Server(DirectoryMonitor* aBase, int numThreads) : base(aBase), m_bTerminate(false), m_nThreads(numThreads) {
 	threadRunning.clear();
+	readBuf.resize(64 * 1024);
 }
 
 DirectoryMonitor::Server::~Server() {
+	join();
+
+	if (fd >= 0)
+		::close(fd);
+	if (efd >= 0)
+		::close(efd);
+}
+
+void DirectoryMonitor::Server::wakeUp() {
+	if (efd < 0)
+		return;
 
+	uint64_t one = 1;
+	auto ret = ::write(efd, &one, sizeof(one));
+	(void)ret;
 }
 
 #endif
@@ -368,44 +401,263 @@ bool DirectoryMonitor::Server::addDirectory(const string& aPath) throw(MonitorEx
 #else
 
 bool DirectoryMonitor::Server::addDirectory(const string& aPath) throw(MonitorException) {
-	//int fd = inotify_init();
-	//if (fd < 0)
-	//	throw MonitorException(Util::translateError(::GetLastError()));
+	{
+		RLock l(cs);
+		if (monitors.find(aPath) != monitors.end())
+			return false;
+	}
 
-	/*int wd = inotify_add_watch(fd, Text::fromUtf8(aPath), IN_MODIFY);
-	if (wd < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));
+	init();
 
+	Monitor* mon = new Monitor(aPath, this);
+	try {
+		// inotify isn't recursive so each subdirectory needs a watch of its own
+		WLock l(cs);
+		addWatches(mon, Util::emptyString);
+		monitors.emplace(aPath, mon);
+		failedDirectories.erase(aPath);
+	} catch (MonitorException& e) {
+		{
+			WLock l(cs);
+			mon->stopMonitoring();
+			failedDirectories.insert(aPath);
+		}
 
-	int cfg = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
-	if (cfg < 0)
-		throw MonitorException(Util::translateError(::GetLastError()));*/
+		delete mon;
+		throw e;
+	}
 
 	return true;
 }
 
-void DirectoryMonitor::Server::deleteDirectory(DirectoryMonitor::Server::MonitorMap::iterator mon) {
+void DirectoryMonitor::Server::addWatches(Monitor* aMon, const string& aPath) throw(MonitorException) {
+	auto wd = inotify_add_watch(fd, Text::fromUtf8(aMon->path + aPath).c_str(), WATCH_MASK);
+	if (wd < 0) {
+		if (!aPath.empty() && (errno == ENOENT || errno == ENOTDIR || errno == EACCES)) {
+			// removed already or not readable (it won't be shared either)
+			return;
+		}
+
+		if (errno == ENOSPC) {
+			throw MonitorException(getErrorStr(errno) + " (fs.inotify.max_user_watches)");
+		}
+
+		throw MonitorException(getErrorStr(errno));
+	}
+
+	auto w = watches.find(wd);
+	if (w != watches.end() && w->second.monitor != aMon) {
+		// monitored through another root already, the watches are added for this root when the other one is removed
+		return;
+	}
+
+	watches[wd] = { aMon, aPath };
+
+	for (FileFindIter i(aMon->path + aPath); i != FileFindIter(); ++i) {
+		auto name = i->getFileName();
+		if (name == "." || name == ".." || i->isLink() || !i->isDirectory())
+			continue;
 
+		addWatches(aMon, aPath + name + PATH_SEPARATOR);
+	}
+}
+
+void DirectoryMonitor::Server::removeWatches(const Monitor* aMon, const string& aPath) {
+	for (auto i = watches.begin(); i != watches.end();) {
+		if (i->second.monitor == aMon && i->second.path.compare(0, aPath.length(), aPath) == 0) {
+			inotify_rm_watch(fd, i->first);
+			i = watches.erase(i);
+		} else {
+			++i;
+		}
+	}
+
+	// the roots nested inside the removed directories were monitored through the same watches
+	vector<Monitor*> nested;
+	for (auto m: monitors | map_values) {
+		if (m != aMon && !m->stopped && AirUtil::isSub(m->path, aMon->path + aPath))
+			nested.push_back(m);
+	}
+
+	for (auto m: nested) {
+		try {
+			addWatches(m, Util::emptyString);
+		} catch (const MonitorException& e) {
+			// the stopped monitor is deleted by the reader thread
+			m->stopMonitoring();
+			failedDirectories.insert(m->path);
+			base->fire(DirectoryMonitorListener::DirectoryFailed(), m->path, e.getError());
+		}
+	}
+}
+
+void DirectoryMonitor::Server::renameWatches(const Monitor* aMon, const string& aOldPath, const string& aNewPath) {
+	for (auto& w: watches | map_values) {
+		if (w.monitor == aMon && w.path.compare(0, aOldPath.length(), aOldPath) == 0) {
+			w.path = aNewPath + w.path.substr(aOldPath.length());
+		}
+	}
+}
+
+void DirectoryMonitor::Server::deleteDirectory(DirectoryMonitor::Server::MonitorMap::iterator mon) {
+	delete mon->second;
+	monitors.erase(mon);
 }
 
 int DirectoryMonitor::Server::read() {
-	/*struct epoll_event ev;
-	ev.events = EPOLLIN|EPOLLOUT|EPOLLET;
-	int ret = epoll_wait(efd, &ev, 100, 86400000);
-	if (ret > 0) {
-		
-	} else if (ret < 0) {
-		perror("Error in the polling");
-		break;
-	} else {
-		perror("Timed Out");
-		break;
-	}*/
-	return 0;
+	pollfd fds[2] = { { fd, POLLIN, 0 }, { efd, POLLIN, 0 } };
+	if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+		dcdebug("DirectoryMonitor: poll failed (%d)\n", errno);
+		Thread::sleep(1000);
+		return 1;
+	}
+
+	if (fds[1].revents & POLLIN) {
+		uint64_t count;
+		auto ret = ::read(efd, &count, sizeof(count));
+		(void)ret;
+	}
+
+	WLock l(cs);
+	if (fds[0].revents & POLLIN) {
+		for (;;) {
+			auto len = ::read(fd, &readBuf[0], readBuf.size());
+			if (len <= 0)
+				break;
+
+			processEvents(reinterpret_cast<const char*>(&readBuf[0]), static_cast<size_t>(len));
+		}
+	}
+
+	for (auto i = monitors.begin(); i != monitors.end();) {
+		if (i->second->stopped) {
+			// this is going to be deleted
+			deleteDirectory(i++);
+		} else {
+			++i;
+		}
+	}
+
+	return m_bTerminate && monitors.empty() ? 0 : 1;
 }
 
-void DirectoryMonitor::processNotification(const string& aPath, const ByteVector& aBuf) {
+void DirectoryMonitor::Server::processEvents(const char* aBuf, size_t aLen) {
+	// The events are passed to the dispatcher per root in the same format, using paths relative to the root
+	unordered_map<string, ByteVector> notifications;
+
+	// cookie -> (root, directory path)
+	unordered_map<uint32_t, pair<string, string>> movedDirs;
+
+	auto addNotification = [&](const Monitor* aMon, uint32_t aMask, uint32_t aCookie, const string& aPath) {
+		auto& buf = notifications[aMon->path];
+		auto pos = buf.size();
+		auto len = (aPath.length() + sizeof(inotify_event)) / sizeof(inotify_event) * sizeof(inotify_event);
+		buf.resize(pos + sizeof(inotify_event) + len);
+
+		auto ev = reinterpret_cast<inotify_event*>(&buf[pos]);
+		ev->wd = 0;
+		ev->mask = aMask;
+		ev->cookie = aCookie;
+		ev->len = len;
+		memcpy(ev->name, aPath.c_str(), aPath.length());
+	};
 
+	auto findMonitor = [this](const string& aRoot) -> Monitor* {
+		auto m = monitors.find(aRoot);
+		return m != monitors.end() && !m->second->stopped ? m->second : nullptr;
+	};
+
+	for (size_t pos = 0; pos < aLen;) {
+		auto ev = reinterpret_cast<const inotify_event*>(aBuf + pos);
+		pos += sizeof(inotify_event) + ev->len;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			// Too many changes to track, everything needs to be rescanned
+			for (const auto& root: monitors | map_keys) {
+				auto monBase = base;
+				monBase->callAsync([=] { monBase->fire(DirectoryMonitorListener::Overflow(), root); });
+			}
+			continue;
+		}
+
+		auto w = watches.find(ev->wd);
+		if (w == watches.end())
+			continue;
+
+		auto mon = w->second.monitor;
+		if (ev->mask & IN_IGNORED) {
+			// the watch was removed by the kernel (deleted directory)
+			watches.erase(w);
+			continue;
+		}
+
+		if (mon->stopped)
+			continue;
+
+		if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+			if (w->second.path.empty()) {
+				// the monitored root itself is gone, subdirectories are reported by their parents
+				failDirectory(mon->path, (ev->mask & IN_UNMOUNT) ? STRING(DEVICE_REMOVED) : getErrorStr(ENOENT));
+			}
+			continue;
+		}
+
+		auto path = w->second.path + (ev->len > 0 ? Text::toUtf8(ev->name) : Util::emptyString);
+		if (ev->mask & IN_ISDIR) {
+			try {
+				if (ev->mask & IN_CREATE) {
+					addWatches(mon, path + PATH_SEPARATOR);
+				} else if (ev->mask & IN_MOVED_FROM) {
+					movedDirs[ev->cookie] = make_pair(mon->path, path + PATH_SEPARATOR);
+				} else if (ev->mask & IN_MOVED_TO) {
+					auto p = movedDirs.find(ev->cookie);
+					if (p != movedDirs.end() && p->second.first == mon->path) {
+						// renamed inside the same root, the existing watches are still valid
+						renameWatches(mon, p->second.second, path + PATH_SEPARATOR);
+					} else {
+						if (p != movedDirs.end()) {
+							auto oldMon = findMonitor(p->second.first);
+							if (oldMon)
+								removeWatches(oldMon, p->second.second);
+						}
+
+						addWatches(mon, path + PATH_SEPARATOR);
+					}
+
+					if (p != movedDirs.end())
+						movedDirs.erase(p);
+				}
+			} catch (const MonitorException& e) {
+				failDirectory(mon->path, e.getError());
+				continue;
+			}
+		}
+
+		auto mask = ev->mask & (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO);
+		if (mask != 0)
+			addNotification(mon, mask, ev->cookie, path);
+	}
+
+	// directories moved outside the monitored roots
+	for (const auto& p: movedDirs | map_values) {
+		auto mon = findMonitor(p.first);
+		if (mon)
+			removeWatches(mon, p.second);
+	}
+
+	for (auto& n: notifications) {
+		auto mon = findMonitor(n.first);
+		if (!mon)
+			continue;
+
+		mon->changes++;
+
+		auto monBase = base;
+		auto root = n.first;
+		ByteVector buf;
+		buf.swap(n.second);
+		monBase->callAsync([=] { monBase->processNotification(root, buf); });
+	}
 }
 
 #endif
@@ -617,6 +869,42 @@ void DirectoryMonitor::processNotification(const string& aPath, const ByteVector
 
 #else
 
+void DirectoryMonitor::processNotification(const string& aPath, const ByteVector& aBuf) {
+	// cookie -> old path
+	unordered_map<uint32_t, string> movedFrom;
+
+	for (size_t pos = 0; pos < aBuf.size();) {
+		auto ev = reinterpret_cast<const inotify_event*>(&aBuf[pos]);
+		pos += sizeof(inotify_event) + ev->len;
+
+		string notifyPath = aPath + ev->name;
+		if (ev->mask & IN_CREATE) {
+			fire(DirectoryMonitorListener::FileCreated(), notifyPath);
+		} else if (ev->mask & IN_DELETE) {
+			fire(DirectoryMonitorListener::FileDeleted(), notifyPath);
+		} else if (ev->mask & IN_CLOSE_WRITE) {
+			fire(DirectoryMonitorListener::FileModified(), notifyPath);
+		} else if (ev->mask & IN_MOVED_FROM) {
+			// wait for the new name
+			movedFrom[ev->cookie] = notifyPath;
+		} else if (ev->mask & IN_MOVED_TO) {
+			auto p = movedFrom.find(ev->cookie);
+			if (p != movedFrom.end()) {
+				fire(DirectoryMonitorListener::FileRenamed(), p->second, notifyPath);
+				movedFrom.erase(p);
+			} else {
+				// moved from outside the root
+				fire(DirectoryMonitorListener::FileCreated(), notifyPath);
+			}
+		}
+	}
+
+	// moved outside the root
+	for (const auto& p: movedFrom | map_values) {
+		fire(DirectoryMonitorListener::FileDeleted(), p);
+	}
+}
+
 #endif
 
 } //dcpp
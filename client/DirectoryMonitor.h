@@ -113,8 +113,26 @@ private:
 #ifdef WIN32
 		HANDLE m_hIOCP;
 #else
+		friend class Monitor;
+
+		struct Watch {
+			Monitor* monitor;
+			string path; // relative to the monitored root, empty for the root itself
+		};
+
+		std::unordered_map<int, Watch> watches;
+
+		// all watch functions must be called from inside WLock
+		void addWatches(Monitor* aMon, const string& aPath) throw(MonitorException);
+		void removeWatches(const Monitor* aMon, const string& aPath);
+		void renameWatches(const Monitor* aMon, const string& aOldPath, const string& aNewPath);
+
+		void processEvents(const char* aBuf, size_t aLen);
+		void wakeUp();
+
 		int efd = -1;
 		int fd = -1;
+		ByteVector readBuf;
 #endif
 		int	m_nThreads;
 		set<string> failedDirectories;
@@ -138,9 +156,7 @@ public:
 	void openDirectory(HANDLE iocp);
 	void beginRead();
 #else
-	//int addWatch(const string& aPath);
-
-	Monitor(const string& aPath, DirectoryMonitor::Server* aParent, int monitorFlags, size_t bufferSize);
+	Monitor(const string& aPath, DirectoryMonitor::Server* aParent);
 	~Monitor();
 #endif
 
@@ -171,7 +187,10 @@ private:
 	int errorCount;
 	int key;
 #else
+	const string path;
 
+	// the watches have been removed, the server thread will delete the monitor
+	bool stopped;
 #endif
 };
 
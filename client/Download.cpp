@@ -163,7 +163,7 @@ const string& Download::getDownloadTarget() const {
 	return (getTempTarget().empty() ? getPath() : getTempTarget());
 }
 
-void Download::open(int64_t bytes, bool z, bool hasDownloadedBytes) {
+void Download::open(int64_t bytes, bool z, bool hasDownloadedBytes, DispatcherQueue& aVerifier) {
 	if(getType() == Transfer::TYPE_FILE) {
 		auto target = getDownloadTarget();
 		auto fullSize = tt.getFileSize();
@@ -240,11 +240,16 @@ void Download::open(int64_t bytes, bool z, bool hasDownloadedBytes) {
 		output.reset(new BufferedOutputStream<true>(output.release()));
 	}
 
-	if(getType() == Transfer::TYPE_FILE && !SettingsManager::lanMode) {
-		typedef MerkleCheckOutputStream<TigerTree, true> MerkleStream;
+	if(getType() == Transfer::TYPE_FILE || getType() == Transfer::TYPE_FULL_LIST) {
+		typedef AsyncMerkleCheckOutputStream<TigerTree, true> MerkleStream;
 
-		output.reset(new MerkleStream(tt, output.release(), getStartPos()));
-		setFlag(Download::FLAG_TTH_CHECK);
+		// the disk writes are performed in the verifier queue as well
+		auto check = getType() == Transfer::TYPE_FILE && !SettingsManager::lanMode;
+		auto stream = new MerkleStream(check ? &tt : nullptr, output.release(), getStartPos(), aVerifier);
+		output.reset(stream);
+		queuedOutput = stream;
+		if(check)
+			setFlag(Download::FLAG_TTH_CHECK);
 	}
 
 	// Check that we don't get too many bytes
@@ -258,7 +263,27 @@ void Download::open(int64_t bytes, bool z, bool hasDownloadedBytes) {
 
 void Download::close()
 {
+	if (queuedOutput) {
+		verifiedBytes = queuedOutput->verifiedBytes();
+		queuedOutput = nullptr;
+	}
+
 	output.reset();
 }
 
+int64_t Download::getVerifiedPos() const {
+	if (!isSet(FLAG_TTH_CHECK))
+		return getPos();
+
+	auto verified = queuedOutput ? queuedOutput->verifiedBytes() : verifiedBytes;
+	return max(min(verified - getStartPos(), getPos()), (int64_t)0);
+}
+
+bool Download::waitVerified(bool aAll, std::function<void ()>&& aF) {
+	if (!queuedOutput)
+		return false;
+
+	return aAll ? queuedOutput->waitAll(move(aF)) : queuedOutput->waitRoom(move(aF));
+}
+
 } // namespace dcpp
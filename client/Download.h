@@ -35,6 +35,9 @@ namespace dcpp {
 using std::string;
 using std::unique_ptr;
 
+template<class TreeType, bool managed> class AsyncMerkleCheckOutputStream;
+class DispatcherQueue;
+
 /**
  * Comes as an argument in the DownloadManagerListener functions.
  * Use it to retrieve information about the ongoing transfer.
@@ -74,12 +77,22 @@ public:
 	/** @return Target filename without path. */
 	string getTargetFileName() const;
 
-	/** Open the target output for writing */
-	void open(int64_t bytes, bool z, bool hasDownloadedBytes);
+	/** Open the target output for writing, the received data is written and checked against the tree in aVerifier */
+	void open(int64_t bytes, bool z, bool hasDownloadedBytes, DispatcherQueue& aVerifier);
 
 	/** Release the target output */
 	void close();
 
+	/** @return Bytes of the segment that have passed the TTH check */
+	int64_t getVerifiedPos() const;
+
+	/**
+	 * Calls aF from the verification thread when the received data has been written and checked (all of it
+	 * or enough for receiving more)
+	 * @return False if the data can be handled right away, aF won't be called then
+	 */
+	bool waitVerified(bool aAll, std::function<void ()>&& aF);
+
 	/** @internal */
 	TigerTree& getTigerTree() { return tt; }
 	const string& getPFS() const { return pfs; }
@@ -101,6 +114,9 @@ private:
 	const string& getDownloadTarget() const;
 
 	unique_ptr<OutputStream> output;
+	AsyncMerkleCheckOutputStream<TigerTree, true>* queuedOutput = nullptr;
+	int64_t verifiedBytes = 0;
+
 	TigerTree tt;
 	string pfs;
 };
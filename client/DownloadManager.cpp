@@ -44,7 +44,14 @@ namespace dcpp {
 
 static const string DOWNLOAD_AREA = "Downloads";
 
-DownloadManager::DownloadManager() {
+#define MAX_VERIFIERS 4
+
+DownloadManager::DownloadManager() : verifierPos(0) {
+	auto verifierCount = min(max(static_cast<int>(std::thread::hardware_concurrency()), 1), MAX_VERIFIERS);
+	for (int i = 0; i < verifierCount; ++i) {
+		verifiers.emplace_back(new DispatcherQueue(true));
+	}
+
 	TimerManager::getInstance()->addListener(this);
 }
 
@@ -60,6 +67,10 @@ DownloadManager::~DownloadManager() {
 	}
 }
 
+DispatcherQueue& DownloadManager::getVerifier() noexcept {
+	return *verifiers[verifierPos++ % verifiers.size()];
+}
+
 struct DropInfo {
 	DropInfo(const string& aTarget, const BundlePtr& aBundle, const UserPtr& aUser) : bundle(aBundle), user(aUser), target(aTarget) { } 
 
@@ -371,7 +382,7 @@ void DownloadManager::startData(UserConnection* aSource, int64_t start, int64_t
 
 		{
 			RLock l (cs);
-			d->open(bytes, z, hasDownloadedBytes);
+			d->open(bytes, z, hasDownloadedBytes, getVerifier());
 		}
 	} catch(const FileException& e) {
 		failDownload(aSource, STRING(COULD_NOT_OPEN_TARGET_FILE) + " " + e.getError(), true);
@@ -417,8 +428,24 @@ void DownloadManager::on(UserConnectionListener::Data, UserConnection* aSource,
 		d->tick();
 
 		if(d->getOutput()->eof()) {
-			endData(aSource);
+			// the download can't be finished before all data has been verified
+			auto pending = d->waitVerified(true, [this, aSource, d] {
+				aSource->resumeRead([=] {
+					if(aSource->getDownload() == d && aSource->getState() == UserConnection::STATE_RUNNING)
+						endData(aSource);
+				});
+			});
+
+			if(pending) {
+				aSource->pauseRead();
+			} else {
+				endData(aSource);
+			}
+
 			aSource->setLineMode(0);
+		} else if(d->waitVerified(false, [aSource] { aSource->resumeRead(); })) {
+			// don't receive more data than the verifiers can write and check
+			aSource->pauseRead();
 		}
 	} catch(const Exception& e) {
 		//d->resetPos(); // is there a better way than resetting the position?
@@ -29,7 +29,9 @@
 
 #include "Bundle.h"
 #include "CriticalSection.h"
+#include "DispatcherQueue.h"
 #include "MerkleTree.h"
+#include "atomic.h"
 
 namespace dcpp {
 
@@ -87,6 +89,11 @@ private:
 	Bundle::StringBundleMap bundles;
 	UserConnectionList idlers;
 
+	// the received data is checked against the tree outside the socket threads
+	vector<unique_ptr<DispatcherQueue>> verifiers;
+	atomic<long> verifierPos;
+	DispatcherQueue& getVerifier() noexcept;
+
 	void removeRunningUser(UserConnection* aSource, bool sendRemoved=false);
 	void removeConnection(UserConnectionPtr aConn);
 	void removeDownload(Download* aDown);
@@ -75,9 +75,13 @@ DualString::DualString(const string& aStr) {
 	}
 }
 
+size_t DualString::getArraySize(size_t strLen) noexcept {
+	return strLen % ARRAY_BITS == 0 ? strLen / ARRAY_BITS : (strLen / ARRAY_BITS) + 1;
+}
+
 // Create an array with minumum possible length that will store the character sizes (unset=lowercase, set=uppercase)
 size_t DualString::initSizeArray(size_t strLen) {
-	size_t arrSize = strLen % ARRAY_BITS == 0 ? strLen / ARRAY_BITS : (strLen / ARRAY_BITS) + 1;
+	size_t arrSize = getArraySize(strLen);
 	charSizes = new MaskType[arrSize];
 	for (size_t s = 0; s < arrSize; ++s) {
 		charSizes[s] = 0;
@@ -87,14 +91,17 @@ size_t DualString::initSizeArray(size_t strLen) {
 }
 
 DualString& DualString::operator=(DualString&& rhs) {
-	assign(rhs.begin(), rhs.end());
-	charSizes = rhs.charSizes;
-	rhs.charSizes = nullptr;
+	if (this != &rhs) {
+		delete[] charSizes;
+
+		string::operator=(move(static_cast<string&>(rhs)));
+		charSizes = rhs.charSizes;
+		rhs.charSizes = nullptr;
+	}
 	return *this; 
 }
 
-DualString::DualString(DualString&& rhs) : charSizes(rhs.charSizes) {
-	assign(rhs.begin(), rhs.end());
+DualString::DualString(DualString&& rhs) : string(move(static_cast<string&>(rhs))), charSizes(rhs.charSizes) {
 	rhs.charSizes = nullptr;
 }
 
@@ -110,8 +117,11 @@ DualString::DualString(const DualString& rhs) {
 }
 
 DualString& DualString::operator= (const DualString& rhs) {
+	if (this == &rhs)
+		return *this;
+
 	if (charSizes) {
-		delete charSizes;
+		delete[] charSizes;
 		charSizes = nullptr;
 	}
 
@@ -126,8 +136,7 @@ DualString& DualString::operator= (const DualString& rhs) {
 }
 
 DualString::~DualString() { 
-	if (charSizes)
-		delete charSizes; 
+	delete[] charSizes; 
 }
 
 string DualString::getNormal() const {
@@ -165,4 +174,14 @@ string DualString::getNormal() const {
 
 bool DualString::lowerCaseOnly() const noexcept {
 	return !charSizes; 
+}
+
+size_t DualString::getMemoryUsage() const noexcept {
+	// short strings are stored inside the object (the size of the inline buffer depends on the implementation)
+	auto obj = reinterpret_cast<const char*>(static_cast<const string*>(this));
+	bool inlined = data() >= obj && data() < obj + sizeof(string);
+	size_t ret = inlined ? 0 : capacity() + 1;
+	if (charSizes)
+		ret += getArraySize(size()) * sizeof(MaskType);
+	return ret;
 }
\ No newline at end of file
@@ -42,12 +42,16 @@ public:
 
 	bool lowerCaseOnly() const noexcept;
 
+	// heap memory allocated for the string (excluding the object itself)
+	size_t getMemoryUsage() const noexcept;
+
 	DualString(DualString&& rhs);
 	DualString& operator=(DualString&&);
 	DualString(const DualString&);
 	DualString& operator= (const DualString& other);
 private:
 	size_t initSizeArray(size_t strLen);
+	static size_t getArraySize(size_t strLen) noexcept;
 	MaskType* charSizes = nullptr;
 };
 
@@ -30,6 +30,7 @@
 #include <dirent.h>
 #include <fnmatch.h>
 #include <utime.h>
+#include <sys/sysmacros.h>
 #endif
 
 namespace dcpp {
@@ -284,6 +285,12 @@ string File::getMountPath(const string& aPath) noexcept {
 	return Text::fromT(buf.get());
 }
 
+File::BlockDevice File::getBlockDevice(const string& aPath) noexcept {
+	BlockDevice ret;
+	ret.id = getMountPath(aPath);
+	return ret;
+}
+
 int64_t File::getFreeSpace(const string& aPath) noexcept {
 	int64_t freeSpace = 0, tmp = 0;
 	auto ret = GetDiskFreeSpaceEx(Text::toT(aPath).c_str(), NULL, (PULARGE_INTEGER)&tmp, (PULARGE_INTEGER)&freeSpace);
@@ -372,6 +379,16 @@ void File::movePos(int64_t pos) noexcept {
 	lseek(h, (off_t)pos, SEEK_CUR);
 }
 
+int File::getFileRange(int64_t& pos_, int64_t& bytes_) noexcept {
+	pos_ = getPos();
+	bytes_ = max(getSize() - pos_, static_cast<int64_t>(0));
+	return h;
+}
+
+void File::skipFileRange(int64_t aBytes) noexcept {
+	movePos(aBytes);
+}
+
 size_t File::read(void* buf, size_t& len) {
 	ssize_t result = ::read(h, buf, len);
 	if (result == -1) {
@@ -412,6 +429,10 @@ int File::extendFile(int64_t len) noexcept {
 	return -1;
 }
 
+void File::releaseCache() noexcept {
+	posix_fadvise(h, 0, 0, POSIX_FADV_DONTNEED);
+}
+
 void File::setEOF() {
 	int64_t pos;
 	int64_t eof;
@@ -529,6 +550,51 @@ string File::getMountPath(const string& aPath) noexcept {
 	return Util::toString((uint32_t)statbuf.st_dev);
 }
 
+static int readSysValue(const string& aPath) noexcept {
+	int ret = -1;
+	auto f = fopen(aPath.c_str(), "r");
+	if (f) {
+		if (fscanf(f, "%d", &ret) != 1)
+			ret = -1;
+		fclose(f);
+	}
+
+	return ret;
+}
+
+File::BlockDevice File::getBlockDevice(const string& aPath) noexcept {
+	BlockDevice ret;
+
+	struct stat statbuf;
+	if (stat(Text::fromUtf8(aPath).c_str(), &statbuf) == -1) {
+		return ret;
+	}
+
+	ret.id = Util::toString((uint32_t)statbuf.st_dev);
+
+	// resolve the partition to the disk that has the request queue
+	char buf[PATH_MAX];
+	auto sysPath = "/sys/dev/block/" + Util::toString(major(statbuf.st_dev)) + ":" + Util::toString(minor(statbuf.st_dev));
+	if (!realpath(sysPath.c_str(), buf)) {
+		return ret;
+	}
+
+	string devPath = buf;
+	if (access((devPath + "/queue").c_str(), F_OK) != 0) {
+		// partitions are subdirectories of the disk
+		devPath.erase(devPath.rfind('/'));
+		if (access((devPath + "/queue").c_str(), F_OK) != 0) {
+			return ret;
+		}
+	}
+
+	ret.id = devPath.substr(devPath.rfind('/') + 1);
+	ret.rotational = readSysValue(devPath + "/queue/rotational") == 1;
+	ret.queueDepth = max(readSysValue(devPath + "/queue/nr_requests"), 0);
+	ret.detected = true;
+	return ret;
+}
+
 uint64_t File::getLastModified(const string& aPath) noexcept {
 	struct stat statbuf;
 	if (stat(Text::fromUtf8(aPath).c_str(), &statbuf) == -1) {
@@ -718,7 +784,9 @@ FileFindIter::FileFindIter(const string& aPath, const string& aPattern, bool dir
 		return;
 
 	data.base = filename;
+	data.dirFd = dirfd(dir);
 	data.ent = readdir(dir);
+	data.resetStat();
 	if (!aPattern.empty() && aPattern != "*") {
 		pattern.reset(new string(aPattern));
 	}
@@ -740,6 +808,7 @@ FileFindIter& FileFindIter::operator++() {
 	if (!dir)
 		return *this;
 	data.ent = readdir(dir);
+	data.resetStat();
 	if (!data.ent) {
 		closedir(dir);
 		dir = NULL;
@@ -762,7 +831,19 @@ bool FileFindIter::operator!=(const FileFindIter& rhs) const {
 	return dir != rhs.dir;
 }
 
-FileFindIter::DirData::DirData() : ent(NULL) {}
+FileFindIter::DirData::DirData() : ent(NULL), dirFd(-1), statState(STAT_NONE) {}
+
+void FileFindIter::DirData::resetStat() {
+	statState = STAT_NONE;
+}
+
+const struct stat* FileFindIter::DirData::getStat() {
+	if (statState == STAT_NONE) {
+		statState = fstatat(dirFd, ent->d_name, &inode, 0) == 0 ? STAT_OK : STAT_FAILED;
+	}
+
+	return statState == STAT_OK ? &inode : nullptr;
+}
 
 string FileFindIter::DirData::getFileName() {
 	if (!ent) return Util::emptyString;
@@ -770,10 +851,13 @@ string FileFindIter::DirData::getFileName() {
 }
 
 bool FileFindIter::DirData::isDirectory() {
-	struct stat inode;
 	if (!ent) return false;
-	if (stat((base + PATH_SEPARATOR + ent->d_name).c_str(), &inode) == -1) return false;
-	return S_ISDIR(inode.st_mode);
+
+	// links need to be followed
+	if (ent->d_type != DT_UNKNOWN && ent->d_type != DT_LNK) return ent->d_type == DT_DIR;
+
+	auto st = getStat();
+	return st && S_ISDIR(st->st_mode);
 }
 
 bool FileFindIter::DirData::isHidden() {
@@ -784,24 +868,31 @@ bool FileFindIter::DirData::isHidden() {
 }
 
 bool FileFindIter::DirData::isLink() {
-	struct stat inode;
 	if (!ent) return false;
-	if (lstat((base + PATH_SEPARATOR + ent->d_name).c_str(), &inode) == -1) return false;
-	return S_ISLNK(inode.st_mode);
+	if (ent->d_type != DT_UNKNOWN) return ent->d_type == DT_LNK;
+
+	// the file system doesn't fill d_type
+	struct stat linkInode;
+	if (fstatat(dirFd, ent->d_name, &linkInode, AT_SYMLINK_NOFOLLOW) == -1) return false;
+	if (!S_ISLNK(linkInode.st_mode) && statState == STAT_NONE) {
+		// same as the target
+		inode = linkInode;
+		statState = STAT_OK;
+	}
+
+	return S_ISLNK(linkInode.st_mode);
 }
 
 int64_t FileFindIter::DirData::getSize() {
-	struct stat inode;
-	if (!ent) return false;
-	if (stat((base + PATH_SEPARATOR + ent->d_name).c_str(), &inode) == -1) return 0;
-	return inode.st_size;
+	if (!ent) return 0;
+	auto st = getStat();
+	return st ? st->st_size : 0;
 }
 
 uint64_t FileFindIter::DirData::getLastWriteTime() {
-	struct stat inode;
-	if (!ent) return false;
-	if (stat((base + PATH_SEPARATOR + ent->d_name).c_str(), &inode) == -1) return 0;
-	return inode.st_mtime;
+	if (!ent) return 0;
+	auto st = getStat();
+	return st ? st->st_mtime : 0;
 }
 
 #endif // _WIN32
@@ -23,6 +23,7 @@
 
 #ifndef _WIN32
 #include <dirent.h>
+#include <sys/stat.h>
 #endif
 
 namespace dcpp {
@@ -77,6 +78,12 @@ public:
 	// not sure if the client code needs this...
 	int extendFile(int64_t len) noexcept;
 
+	// drop the file from the page cache (used after reading data that won't be needed again)
+	void releaseCache() noexcept;
+
+	int getFileRange(int64_t& pos_, int64_t& bytes_) noexcept;
+	void skipFileRange(int64_t aBytes) noexcept;
+
 #endif // !_WIN32
 
 	File(const string& aFileName, int access, int mode, BufferMode aBufferMode = BUFFER_SEQUENTIAL, bool isAbsolute = true, bool isDirectory = false);
@@ -133,6 +140,17 @@ public:
 	static StringList findFiles(const string& path, const string& pattern, int flags = TYPE_FILE | TYPE_DIRECTORY);
 	static void forEachFile(const string& path, const string& pattern, std::function<void (const string& /*name*/, bool /*isDir*/, int64_t /*size*/)> aF, bool skipHidden = true);
 	static string getMountPath(const string& aPath) noexcept;
+
+	struct BlockDevice {
+		/** Name of the backing block device (the mount path if it couldn't be detected) */
+		string id;
+		bool detected = false;
+		bool rotational = false;
+		int queueDepth = 0;
+	};
+
+	/** Find the block device (instead of the partition or mount) that the path is stored on */
+	static BlockDevice getBlockDevice(const string& aPath) noexcept;
 protected:
 #ifdef _WIN32
 	HANDLE h;
@@ -190,6 +208,16 @@ public:
 		#ifndef _WIN32
 			dirent *ent;
 			string base;
+
+			// the entries are stat'ed relative to the open directory, at most once per entry
+			int dirFd;
+			void resetStat();
+		private:
+			enum StatState { STAT_NONE, STAT_OK, STAT_FAILED };
+			const struct stat* getStat();
+
+			struct stat inode;
+			StatState statState;
 		#endif
 	};
 
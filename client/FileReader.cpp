@@ -22,6 +22,7 @@
 
 #include "debug.h"
 #include "File.h"
+#include "ScopedFunctor.h"
 #include "Text.h"
 #include "Util.h"
 
@@ -57,6 +58,22 @@ size_t FileReader::read(const string& aPath, const DataCallback& callback) {
 	return ret;
 }
 
+size_t FileReader::read(const string& aPath, Strategy aStrategy, const DataCallback& callback) {
+	size_t ret = READ_FAILED;
+	switch(aStrategy) {
+		case DIRECT: ret = readDirect(aPath, callback); break;
+		case MAPPED: ret = readMapped(aPath, callback); break;
+		case CACHED: ret = readCached(aPath, callback); break;
+		case AUTO: return read(aPath, callback);
+	}
+
+	if(ret == READ_FAILED) {
+		throw FileException("The read strategy isn't supported for " + aPath);
+	}
+
+	return ret;
+}
+
 
 /** Read entire file, never returns READ_FAILED */
 size_t FileReader::readCached(const string& aPath, const DataCallback& callback) {
@@ -72,8 +89,20 @@ size_t FileReader::readCached(const string& aPath, const DataCallback& callback)
 		go = callback(buf, n);
 		total += n;
 		n = buffer.size();
+
+#ifndef _WIN32
+		if(direct && total % DEFAULT_MMAP_SIZE < n) {
+			f.releaseCache();
+		}
+#endif
 	}
 
+#ifndef _WIN32
+	if(direct) {
+		f.releaseCache();
+	}
+#endif
+
 	return total;
 }
 
@@ -272,19 +301,240 @@ size_t FileReader::readMapped(const string& /*file*/, const DataCallback& /*call
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// O_DIRECT requires the buffers, offsets and lengths to be aligned to the logical block size of the device
+#define DIRECT_ALIGNMENT 4096
+
+struct Handle : boost::noncopyable {
+	Handle(int h) : h(h) { }
+	~Handle() { ::close(h); }
+
+	operator int() { return h; }
+
+	int h;
+};
+
+size_t FileReader::readDirect(const string& aPath, const DataCallback& callback) {
+	int fd = ::open(Text::fromUtf8(aPath).c_str(), O_RDONLY | O_DIRECT);
+	if(fd == -1) {
+		dcdebug("Failed to open unbuffered file %s: %s\n", aPath.c_str(), Util::translateError(errno).c_str());
+		return READ_FAILED;
+	}
+
+	Handle h(fd);
+
+	struct stat statbuf;
+	if(fstat(h, &statbuf) == -1) {
+		dcdebug("Failed to get the size of %s: %s\n", aPath.c_str(), Util::translateError(errno).c_str());
+		return READ_FAILED;
+	}
+
+	auto bufSize = getBlockSize(DIRECT_ALIGNMENT);
+	buffer.resize(bufSize * DIRECT_QUEUE_DEPTH + DIRECT_ALIGNMENT);
+	auto buf = static_cast<uint8_t*>(align(&buffer[0], DIRECT_ALIGNMENT));
+
+	auto ret = readUring(h, statbuf.st_size, buf, bufSize, callback);
+	if(ret == READ_FAILED) {
+		ret = readPread(h, buf, bufSize, callback);
+	}
+
+	return ret;
+}
+
+size_t FileReader::readPread(int aFd, uint8_t* aBuf, size_t aBufSize, const DataCallback& callback) {
+	size_t total = 0;
+	bool go = true;
+	while(go) {
+		auto n = ::pread(aFd, aBuf, aBufSize, total);
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+
+			if(total == 0) {
+				// the file system may not support direct I/O
+				dcdebug("Unbuffered read failed: %s\n", Util::translateError(errno).c_str());
+				return READ_FAILED;
+			}
+
+			throw FileException(Util::translateError(errno));
+		}
+
+		if(n > 0) {
+			go = callback(aBuf, n);
+			total += n;
+		}
+
+		// the next offset wouldn't be aligned after a short read
+		if(static_cast<size_t>(n) < aBufSize) {
+			break;
+		}
+	}
+
+	return total;
+}
+
+#ifdef HAVE_LIBURING
 
-size_t FileReader::readDirect(const string& file, const DataCallback& callback) {
+size_t FileReader::readUring(int aFd, int64_t aSize, uint8_t* aBuf, size_t aBufSize, const DataCallback& callback) {
+	io_uring ring;
+	auto ret = io_uring_queue_init(DIRECT_QUEUE_DEPTH, &ring, 0);
+	if(ret < 0) {
+		dcdebug("io_uring isn't available: %s\n", Util::translateError(-ret).c_str());
+		return READ_FAILED;
+	}
+
+	struct Request {
+		int result;
+		bool done;
+	} requests[DIRECT_QUEUE_DEPTH];
+
+	int64_t nextPos = 0;
+	size_t queued = 0, inFlight = 0;
+
+	auto submit = [&](size_t i) {
+		auto sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_read(sqe, aFd, aBuf + i * aBufSize, aBufSize, nextPos);
+		io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(i));
+
+		requests[i].done = false;
+		nextPos += aBufSize;
+		queued++;
+		inFlight++;
+	};
+
+	auto complete = [&]() {
+		io_uring_cqe* cqe;
+		auto err = io_uring_wait_cqe(&ring, &cqe);
+		if(err < 0) {
+			if(err == -EINTR)
+				return;
+
+			throw FileException(Util::translateError(-err));
+		}
+
+		auto& r = requests[reinterpret_cast<size_t>(io_uring_cqe_get_data(cqe))];
+		r.result = cqe->res;
+		r.done = true;
+
+		io_uring_cqe_seen(&ring, cqe);
+		inFlight--;
+	};
+
+	// the kernel may not write in the buffers after returning
+	ScopedFunctor([&] {
+		while(inFlight > 0) {
+			try {
+				complete();
+			} catch(const FileException&) {
+				break;
+			}
+		}
+
+		io_uring_queue_exit(&ring);
+	});
+
+	for(size_t i = 0; i < DIRECT_QUEUE_DEPTH && nextPos < aSize; ++i) {
+		submit(i);
+	}
+	io_uring_submit(&ring);
+
+	// the blocks are processed in file order
+	size_t total = 0, cur = 0;
+	bool go = true;
+	while(go && queued > 0) {
+		auto& r = requests[cur];
+		while(!r.done) {
+			complete();
+		}
+
+		queued--;
+		if(r.result < 0) {
+			if(total == 0) {
+				dcdebug("Unbuffered read failed: %s\n", Util::translateError(-r.result).c_str());
+				return READ_FAILED;
+			}
+
+			throw FileException(Util::translateError(-r.result));
+		}
+
+		if(r.result > 0) {
+			go = callback(aBuf + cur * aBufSize, r.result);
+			total += r.result;
+		}
+
+		if(static_cast<size_t>(r.result) < aBufSize) {
+			// end of file
+			break;
+		}
+
+		if(nextPos < aSize) {
+			submit(cur);
+			io_uring_submit(&ring);
+		}
+
+		cur = (cur + 1) % DIRECT_QUEUE_DEPTH;
+	}
+
+	return total;
+}
+
+#else
+
+size_t FileReader::readUring(int /*aFd*/, int64_t /*aSize*/, uint8_t* /*aBuf*/, size_t /*aBufSize*/, const DataCallback& /*callback*/) {
 	return READ_FAILED;
 }
 
+#endif
+
 static const int64_t BUF_SIZE = 0x1000000 - (0x1000000 % getpagesize());
-static sigjmp_buf sb_env;
+
+// The mapping that is being read by this thread (SIGBUS is delivered to the thread that caused it)
+struct MappedRead {
+	const uint8_t* start;
+	size_t len;
+	sigjmp_buf env;
+};
+
+static thread_local MappedRead* currentRead = nullptr;
+static struct sigaction oldBusAction;
 
 static void sigbus_handler(int signum, siginfo_t* info, void* context) {
-	// Jump back to the readMapped which will return error. Apparently truncating
+	// Jump back to the readMapped of this thread which will return error. Apparently truncating
 	// a file in Solaris sets si_code to BUS_OBJERR
-	if (signum == SIGBUS && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR))
-		siglongjmp(sb_env, 1);
+	auto r = currentRead;
+	if (r && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR)) {
+		auto addr = static_cast<const uint8_t*>(info->si_addr);
+		if (addr >= r->start && addr < r->start + r->len)
+			siglongjmp(r->env, 1);
+	}
+
+	// not caused by our reads
+	if (oldBusAction.sa_flags & SA_SIGINFO) {
+		oldBusAction.sa_sigaction(signum, info, context);
+	} else if (oldBusAction.sa_handler != SIG_DFL && oldBusAction.sa_handler != SIG_IGN) {
+		oldBusAction.sa_handler(signum);
+	} else {
+		// the faulting instruction will be run again after returning
+		signal(SIGBUS, SIG_DFL);
+	}
+}
+
+static bool installSigbusHandler() {
+	// Installed only once as the other threads may be reading files at the same time
+	struct sigaction act;
+	sigemptyset(&act.sa_mask);
+	act.sa_sigaction = sigbus_handler;
+	act.sa_flags = SA_SIGINFO;
+
+	if (sigaction(SIGBUS, &act, &oldBusAction) == -1) {
+		dcdebug("Failed to set signal handler for fastHash\n");
+		return false;
+	}
+
+	return true;
 }
 
 size_t FileReader::readMapped(const string& filename, const DataCallback& callback) {
@@ -304,24 +554,18 @@ size_t FileReader::readMapped(const string& filename, const DataCallback& callba
 	int64_t pos = 0;
 	auto size = statbuf.st_size;
 
-	// Prepare and setup a signal handler in case of SIGBUS during mmapped file reads.
+	// Setup a signal handler in case of SIGBUS during mmapped file reads.
 	// SIGBUS can be sent when the file is truncated or in case of read errors.
-	struct sigaction act, oldact;
-	sigset_t signalset;
-
-	sigemptyset(&signalset);
-
-	act.sa_handler = NULL;
-	act.sa_sigaction = sigbus_handler;
-	act.sa_mask = signalset;
-	act.sa_flags = SA_SIGINFO | SA_RESETHAND;
-
-	if (sigaction(SIGBUS, &act, &oldact) == -1) {
-		dcdebug("Failed to set signal handler for fastHash\n");
+	static const bool handlerInstalled = installSigbusHandler();
+	if (!handlerInstalled) {
 		close(fd);
 		return READ_FAILED;	// Better luck with the slow hash.
 	}
 
+	MappedRead mappedRead;
+	currentRead = &mappedRead;
+	ScopedFunctor([] { currentRead = nullptr; });
+
 	void* buf = NULL;
 	int64_t size_read = 0;
 
@@ -334,7 +578,9 @@ size_t FileReader::readMapped(const string& filename, const DataCallback& callba
 			break;
 		}
 
-		if (sigsetjmp(sb_env, 1)) {
+		mappedRead.start = static_cast<const uint8_t*>(buf);
+		mappedRead.len = size_read;
+		if (sigsetjmp(mappedRead.env, 1)) {
 			dcdebug("Caught SIGBUS for file %s\n", filename.c_str());
 			break;
 		}
@@ -353,6 +599,10 @@ size_t FileReader::readMapped(const string& filename, const DataCallback& callba
 			break;
 		}
 
+		if (direct) {
+			posix_fadvise(fd, pos, size_read, POSIX_FADV_DONTNEED);
+		}
+
 		buf = NULL;
 		pos += size_read;
 	}
@@ -363,10 +613,6 @@ size_t FileReader::readMapped(const string& filename, const DataCallback& callba
 
 	::close(fd);
 
-	if (sigaction(SIGBUS, &oldact, NULL) == -1) {
-		dcdebug("Failed to reset old signal handler for SIGBUS\n");
-	}
-
 	return pos == size ? pos : READ_FAILED;
 }
 
@@ -40,7 +40,8 @@ public:
 	enum Strategy {
 		DIRECT,
 		MAPPED,
-		CACHED
+		CACHED,
+		AUTO // the first supported one, as with read(file, callback)
 	};
 
 	typedef function<bool(const void*, size_t)> DataCallback;
@@ -61,9 +62,17 @@ public:
 	 */
 	size_t read(const string& file, const DataCallback& callback);
 
+	/**
+	 * Read file using the specified strategy only (the direct flag is ignored)
+	 * @throw FileException if the read fails or the strategy isn't supported for the file
+	 */
+	size_t read(const string& file, Strategy aStrategy, const DataCallback& callback);
+
 private:
 	static const size_t DEFAULT_BLOCK_SIZE = 256*1024;
 	static const size_t DEFAULT_MMAP_SIZE = 64*1024*1024;
+	/** Number of blocks being read at the same time with direct I/O */
+	static const size_t DIRECT_QUEUE_DEPTH = 4;
 
 	string file;
 	bool direct;
@@ -78,6 +87,11 @@ private:
 	size_t readDirect(const string& aFile, const DataCallback& callback);
 	size_t readMapped(const string& aFile, const DataCallback& callback);
 	size_t readCached(const string& aFile, const DataCallback& callback);
+
+#ifndef _WIN32
+	size_t readPread(int aFd, uint8_t* aBuf, size_t aBufSize, const DataCallback& callback);
+	size_t readUring(int aFd, int64_t aSize, uint8_t* aBuf, size_t aBufSize, const DataCallback& callback);
+#endif
 };
 
 }
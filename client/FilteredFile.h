@@ -156,6 +156,8 @@ public:
 	}
 
 	virtual bool eof() { return !more; }
+
+	Filter& getFilter() { return filter; }
 private:
 	static const size_t BUF_SIZE = 128*1024; //increase buffer from 64, test
 
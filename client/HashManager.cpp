@@ -32,13 +32,28 @@
 #include "version.h"
 #include "ZUtils.h"
 
+#include <thread>
+
 //#include "BerkeleyDB.h"
 #include "LevelDB.h"
 //#include "HamsterDB.h"
 
-#define FILEINDEX_VERSION 1
+#define FILEINDEX_VERSION 2
 #define HASHDATA_VERSION 1
 
+// pending database writes are committed in a single batch after the delay or when the batch grows too large
+#define WRITE_BATCH_DELAY 1000
+#define WRITE_BATCH_ITEMS 1000
+#define WRITE_BATCH_BYTES (4*1024*1024)
+
+// files larger than this are hashed in segments with the worker threads
+#define PARALLEL_MIN_FILE_SIZE (16*1024*1024)
+#define PARALLEL_SEGMENT_SIZE (1024*1024)
+#define MAX_HASH_WORKERS 8
+
+// read larger blocks from spinning disks to reduce seeking
+#define ROTATIONAL_READ_SIZE (4*1024*1024)
+
 namespace dcpp {
 
 using boost::range::find_if;
@@ -46,14 +61,134 @@ using boost::range::find_if;
 SharedMutex HashManager::Hasher::hcs;
 const int64_t HashManager::MIN_BLOCK_SIZE = 64 * 1024;
 
-HashManager::HashManager() {
+HashManager::HashManager() : workerPos(0) {
+	auto workers = min(std::thread::hardware_concurrency(), static_cast<unsigned>(MAX_HASH_WORKERS));
+	if (workers > 1) {
+		for (unsigned i = 0; i < workers; ++i) {
+			hashWorkers.emplace_back(new DispatcherQueue(true, Thread::IDLE));
+		}
+	}
 
+	TimerManager::getInstance()->addListener(this);
 }
 
 HashManager::~HashManager() {
+	TimerManager::getInstance()->removeListener(this);
 	optimizer.join();
 }
 
+void HashManager::on(TimerManagerListener::Second, uint64_t /*aTick*/) noexcept {
+	store.scheduleFlush(false);
+}
+
+void HashManager::runHashWorker(DispatcherQueue::Callback&& aF) noexcept {
+	hashWorkers[workerPos++ % hashWorkers.size()]->addTask(move(aF));
+}
+
+/**
+ * Hashes the read data in aligned segments with the worker threads so that the reading thread
+ * can continue with the next segment. The subtree roots are added in the tree in order and the
+ * last partial segment is hashed by the caller.
+ */
+class ParallelTreeHasher : boost::noncopyable {
+public:
+	ParallelTreeHasher(TigerTree& aTree) : tree(aTree), segmentSize(static_cast<size_t>(min<int64_t>(aTree.getBlockSize(), PARALLEL_SEGMENT_SIZE))) {
+		// keep all workers busy while the next segments are being read
+		for (size_t i = 0; i < HashManager::getInstance()->hashWorkers.size() * 2; ++i) {
+			segments.emplace_back(new Segment(segmentSize));
+		}
+	}
+
+	~ParallelTreeHasher() {
+		// the tasks use the buffers
+		for (auto s: pending) {
+			s->done.wait();
+		}
+	}
+
+	static bool isSupported(int64_t aFileSize) noexcept {
+		return !HashManager::getInstance()->hashWorkers.empty() && aFileSize >= PARALLEL_MIN_FILE_SIZE;
+	}
+
+	void update(const void* aData, size_t aLen) {
+		auto p = static_cast<const uint8_t*>(aData);
+		while (aLen > 0) {
+			if (!cur)
+				cur = getSegment();
+
+			auto n = min(aLen, segmentSize - cur->len);
+			memcpy(&cur->data[cur->len], p, n);
+			cur->len += n;
+			p += n;
+			aLen -= n;
+
+			if (cur->len == segmentSize) {
+				submit(cur);
+				cur = nullptr;
+			}
+		}
+	}
+
+	void finalize() {
+		while (!pending.empty())
+			collect();
+
+		if (cur) {
+			tree.update(&cur->data[0], cur->len);
+			cur = nullptr;
+		}
+
+		tree.finalize();
+	}
+private:
+	struct Segment {
+		Segment(size_t aSize) : data(aSize) { }
+
+		ByteVector data;
+		size_t len = 0;
+		TTHValue root;
+		Semaphore done;
+	};
+
+	TigerTree& tree;
+	const size_t segmentSize;
+
+	vector<unique_ptr<Segment>> segments;
+	size_t pos = 0;
+
+	// submitted segments in file order
+	deque<Segment*> pending;
+	Segment* cur = nullptr;
+
+	Segment* getSegment() {
+		// the buffers are reused in the same order so the oldest one must be finished first
+		if (pending.size() == segments.size())
+			collect();
+
+		auto s = segments[pos++ % segments.size()].get();
+		s->len = 0;
+		return s;
+	}
+
+	void submit(Segment* s) {
+		pending.push_back(s);
+		HashManager::getInstance()->runHashWorker([this, s] {
+			TigerTree tt(segmentSize);
+			tt.update(&s->data[0], segmentSize);
+			tt.finalize();
+			s->root = tt.getRoot();
+			s->done.signal();
+		});
+	}
+
+	void collect() {
+		auto s = pending.front();
+		s->done.wait();
+		pending.pop_front();
+		tree.addSubtree(s->root, segmentSize);
+	}
+};
+
 bool HashManager::checkTTH(const string& aFileLower, const string& aFileName, HashedFile& fi_) {
 	dcassert(Text::isLower(aFileLower));
 	if (!store.checkTTH(aFileLower, fi_)) {
@@ -78,6 +213,10 @@ bool HashManager::getTree(const TTHValue& root, TigerTree& tt) noexcept {
 	return store.getTree(root, tt);
 }
 
+HashManager::TigerTreePtr HashManager::getTree(const TTHValue& root) noexcept {
+	return store.getTree(root);
+}
+
 size_t HashManager::getBlockSize(const TTHValue& root) noexcept {
 	return static_cast<size_t>(store.getRootInfo(root, HashStore::TYPE_BLOCKSIZE));
 }
@@ -86,15 +225,6 @@ int64_t HashManager::Hasher::getTimeLeft() const noexcept {
 	return lastSpeed > 0 ? (totalBytesLeft / lastSpeed) : 0;
 }
 
-bool HashManager::Hasher::getPathVolume(const string& aPath, string& vol_) const noexcept { 
-	auto p = find_if(devices | map_keys, [&aPath](const string& aVol) { return aPath.compare(0, aVol.length(), aVol.c_str()) == 0; });
-	if (p.base() != devices.end()) {
-		vol_ = *p;
-		return true;
-	}
-	return false;
-}
-
 bool HashManager::Hasher::hasFile(const string& aPath) const noexcept {
 	return w.find(aPath) != w.end();
 }
@@ -105,15 +235,12 @@ bool HashManager::hashFile(const string& filePath, const string& pathLower, int6
 
 	Hasher* h = nullptr;
 
-	WLock l(Hasher::hcs);
+	//get the device
+	const auto device = getBlockDevice(filePath);
+	const auto& vol = device.id;
+	auto maxVolHashers = getMaxHashers(device);
 
-	//get the volume name
-	string vol;
-	if (none_of(hashers.begin(), hashers.end(), [&](const Hasher* h) { return h->getPathVolume(pathLower, vol); })) {
-		vol = File::getMountPath(pathLower);
-	}
-
-	//dcassert(!vol.empty());
+	WLock l(Hasher::hcs);
 
 	if (hashers.size() == 1 && !hashers.front()->hasDevices()) {
 		//always use the first hasher if it's idle
@@ -123,7 +250,7 @@ bool HashManager::hashFile(const string& filePath, const string& pathLower, int6
 			return min_element(hl.begin(), hl.end(), [](const Hasher* h1, const Hasher* h2) { return h1->getBytesLeft() < h2->getBytesLeft(); });
 		};
 
-		if (SETTING(HASHERS_PER_VOLUME) == 1) {
+		if (maxVolHashers == 1) {
 			//do we have files for this volume queued already? always use the same one in that case
 			auto p = find_if(hashers, [&vol](const Hasher* aHasher) { return aHasher->hasDevice(vol); });
 			if (p != hashers.end()) {
@@ -150,8 +277,8 @@ bool HashManager::hashFile(const string& filePath, const string& pathLower, int6
 				auto minLoaded = getLeastLoaded(volHashers);
 
 				//don't create new hashers if the file is less than 10 megabytes and there's a hasher with less than 200MB queued, or the maximum number of threads have been reached for this volume
-				if (static_cast<int>(hashers.size()) >= SETTING(MAX_HASHING_THREADS) || (static_cast<int>(volHashers.size()) >= SETTING(HASHERS_PER_VOLUME) && 
-					SETTING(HASHERS_PER_VOLUME) > 0) || (size <= Util::convertSize(10, Util::MB) && !volHashers.empty() && (*minLoaded)->getBytesLeft() <= Util::convertSize(200, Util::MB))) {
+				if (static_cast<int>(hashers.size()) >= SETTING(MAX_HASHING_THREADS) || static_cast<int>(volHashers.size()) >= maxVolHashers || 
+					(size <= Util::convertSize(10, Util::MB) && !volHashers.empty() && (*minLoaded)->getBytesLeft() <= Util::convertSize(200, Util::MB))) {
 
 					//use the least loaded hasher that already has this volume
 					h = *minLoaded;
@@ -175,7 +302,46 @@ bool HashManager::hashFile(const string& filePath, const string& pathLower, int6
 	}
 
 	//queue the file for hashing
-	return h->hashFile(filePath, pathLower, size, vol);
+	return h->hashFile(filePath, pathLower, size, device);
+}
+
+File::BlockDevice HashManager::getBlockDevice(const string& aPath) noexcept {
+	auto devicePath = aPath;
+	auto mountId = File::getMountPath(devicePath);
+	if (mountId.empty()) {
+		// the file can't be accessed (it will fail when it's being hashed), use the device of the directory
+		devicePath = Util::getFilePath(aPath);
+		mountId = File::getMountPath(devicePath);
+	}
+
+	{
+		RLock l(Hasher::hcs);
+		auto p = blockDevices.find(mountId);
+		if (p != blockDevices.end()) {
+			return p->second;
+		}
+	}
+
+	// partitions and bind mounts of the same disk get the same device id
+	auto device = File::getBlockDevice(devicePath);
+	if (device.id.empty()) {
+		device.id = mountId;
+	}
+
+	WLock l(Hasher::hcs);
+	return blockDevices.emplace(mountId, move(device)).first->second;
+}
+
+int HashManager::getMaxHashers(const File::BlockDevice& aDevice) noexcept {
+	if (SETTING(HASHERS_PER_VOLUME) > 0)
+		return SETTING(HASHERS_PER_VOLUME);
+
+	// parallel reads would make spinning disks seek
+	if (!aDevice.detected || aDevice.rotational)
+		return 1;
+
+	// SSDs with deep request queues (NVMe) benefit from multiple readers
+	return max(min(aDevice.queueDepth / 64, SETTING(MAX_HASHING_THREADS)), 1);
 }
 
 void HashManager::getFileTTH(const string& aFile, int64_t aSize, bool addStore, TTHValue& tth_, int64_t& sizeLeft_, const bool& aCancel, std::function<void(int64_t, const string&)> updateF/*nullptr*/) throw(HashException) {
@@ -227,7 +393,7 @@ void HashManager::getFileTTH(const string& aFile, int64_t aSize, bool addStore,
 
 void HashManager::hashDone(const string& aFileName, const string& pathLower, const TigerTree& tt, int64_t speed, HashedFile& aFileInfo, int hasherID /*0*/) noexcept {
 	try {
-		store.addHashedFile(pathLower, tt, aFileInfo);
+		store.addHashedFile(pathLower, tt, aFileInfo, aFileName);
 	} catch (const Exception& e) {
 		log(STRING_F(HASHING_FAILED_X, e.getError()), hasherID, true, true);
 	}
@@ -267,23 +433,293 @@ bool HashManager::addFile(const string& aFilePathLower, const HashedFile& fi_) t
 	return true;
 }
 
-void HashManager::HashStore::addHashedFile(const string& aFileLower, const TigerTree& tt, const HashedFile& fi_) throw(HashException) {
+void HashManager::HashStore::addHashedFile(const string& aFileLower, const TigerTree& tt, const HashedFile& fi_, const string& aReportPath) throw(HashException) {
 	addTree(tt);
 	addFile(aFileLower, fi_);
+
+	if (!aReportPath.empty()) {
+		// the listeners may access the file information so it must be committed first
+		Lock l(cs);
+		if (!hasPending())
+			pendingSince = GET_TICK();
+		pendingHashed.emplace_back(aReportPath, fi_);
+	}
 }
 
 void HashManager::HashStore::addFile(const string& aFileLower, const HashedFile& fi_) throw(HashException) {
-	auto sz = getFileInfoSize(fi_);
-	void* buf = malloc(sz);
-	saveFileInfo(buf, fi_);
+	string value(getFileInfoSize(fi_), 0);
+	saveFileInfo(&value[0], fi_);
+
+	bool full = false;
+	{
+		// the directory can't be removed as empty before the file has been queued
+		Lock l(cs);
+		auto key = getFileKey(aFileLower, true, full);
+		full = addPending(pendingFiles, key, move(value)) || full;
+	}
+
+	if (full)
+		scheduleFlush(true);
+
+	removeLegacyFile(aFileLower);
+}
+
+string HashManager::HashStore::getIdKey(KeyType aType, uint32_t aId) noexcept {
+	// big endian so that the files of each directory are stored next to each other
+	string key(1 + sizeof(uint32_t), aType);
+	for (int i = 0; i < 4; ++i)
+		key[1 + i] = static_cast<char>((aId >> (24 - i * 8)) & 0xFF);
+	return key;
+}
+
+uint32_t HashManager::HashStore::getKeyId(const void* aKey) noexcept {
+	auto p = static_cast<const uint8_t*>(aKey) + 1;
+	return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+string HashManager::HashStore::getFileKey(const string& aPathLower, bool aCreate) noexcept {
+	bool full = false;
+	string key;
+	{
+		Lock l(cs);
+		key = getFileKey(aPathLower, aCreate, full);
+	}
 
+	if (full)
+		scheduleFlush(true);
+
+	return key;
+}
+
+string HashManager::HashStore::getFileKey(const string& aPathLower, bool aCreate, bool& full_) noexcept {
+	auto dir = Util::getFilePath(aPathLower);
+
+	uint32_t id = 0;
+	auto p = directoryIds.find(dir);
+	if (p != directoryIds.end()) {
+		id = p->second;
+		if (aCreate && scanningDirectories)
+			scanUsedDirectories.insert(id);
+	} else if (aCreate) {
+		id = nextDirectoryId++;
+		directoryIds.emplace(dir, id);
+		full_ = addPending(pendingFiles, getIdKey(KEY_DIRECTORY, id), string(dir)) || full_;
+	} else {
+		return Util::emptyString;
+	}
+
+	return getIdKey(KEY_FILE, id) + Util::getFileName(aPathLower);
+}
+
+void HashManager::HashStore::loadDirectories() throw(DbException) {
+	Lock l(cs);
+	directoryIds.clear();
+	nextDirectoryId = 1;
+
+	fileDb->remove_if(string(1, KEY_DIRECTORY), [this](void* aKey, size_t aKeyLen, void* aValue, size_t aValueLen) {
+		if (aKeyLen != 1 + sizeof(uint32_t))
+			return true;
+
+		auto id = getKeyId(aKey);
+		directoryIds.emplace(string((const char*)aValue, aValueLen), id);
+		nextDirectoryId = max(nextDirectoryId, id + 1);
+		return false;
+	});
+}
+
+void HashManager::HashStore::removeLegacyFile(const string& aPathLower) noexcept {
+	// the entry shouldn't be converted anymore
+	if (migratingIndex)
+		queueWrite(pendingFiles, aPathLower, string());
+}
+
+void HashManager::HashStore::migrateIndex() noexcept {
+	int legacyFiles = 0, converted = 0;
 	try {
-		fileDb->put((void*)aFileLower.c_str(), aFileLower.length(), (void*)buf, sz);
+		fileDb->remove_if([&](void* aKey, size_t aKeyLen, void* aValue, size_t aValueLen) {
+			if (getInstance()->aShutdown)
+				throw HashException();
+
+			if (!isLegacyKey(aKey, aKeyLen))
+				return false;
+
+			if (legacyFiles++ == 0)
+				LogManager::getInstance()->message(STRING(FILE_INDEX_UPGRADING), LogManager::LOG_INFO);
+
+			string path((const char*)aKey, aKeyLen);
+
+			bool full = false;
+			{
+				Lock l(cs);
+				auto key = getFileKey(path, true, full);
+
+				// the file may have been removed or hashed again after the conversion was started
+				if (!findPendingFile(path) && fileDb->hasKey(aKey, aKeyLen)) {
+					if (!findPendingFile(key) && !fileDb->hasKey((void*)key.data(), key.length())) {
+						addPending(pendingFiles, key, string((const char*)aValue, aValueLen));
+						converted++;
+					}
+				}
+
+				full = addPending(pendingFiles, path, string()) || full;
+			}
+
+			if (full)
+				flush();
+			return false;
+		});
+	} catch (const HashException&) {
+		// continue on the next startup
+		return;
+	} catch (const DbException& e) {
+		LogManager::getInstance()->message(STRING_F(READ_FAILED_X, fileDb->getNameLower() % e.getError()), LogManager::LOG_ERROR);
+		return;
+	}
+
+	queueWrite(pendingFiles, string(1, KEY_SCHEMA), string(1, FILEINDEX_VERSION));
+	migratingIndex = false;
+	flush();
+
+	if (converted > 0) {
+		LogManager::getInstance()->message(STRING_F(FILE_INDEX_UPGRADED, converted), LogManager::LOG_INFO);
+		LogManager::getInstance()->message(STRING_F(COMPACTING_X, fileDb->getNameLower()), LogManager::LOG_INFO);
+		fileDb->compact();
+	}
+}
+
+void HashManager::HashStore::queueWrite(DbHandler::ValueMap& aValues, const string& aKey, string&& aValue) noexcept {
+	bool full = false;
+	{
+		Lock l(cs);
+		full = addPending(aValues, aKey, move(aValue));
+	}
+
+	if (full)
+		scheduleFlush(true);
+}
+
+bool HashManager::HashStore::addPending(DbHandler::ValueMap& aValues, const string& aKey, string&& aValue) noexcept {
+	if (!hasPending())
+		pendingSince = GET_TICK();
+
+	pendingBytes += aKey.length() + aValue.length();
+	aValues[aKey] = move(aValue);
+
+	// the failed batch is retried by the timer instead of every new change
+	return !writeFailed && (pendingBytes >= WRITE_BATCH_BYTES || pendingFiles.size() + pendingTrees.size() >= WRITE_BATCH_ITEMS);
+}
+
+const string* HashManager::HashStore::findPending(const DbHandler::ValueMap& aPending, const DbHandler::ValueMap& aWriting, const string& aKey) noexcept {
+	auto p = aPending.find(aKey);
+	if (p != aPending.end())
+		return &p->second;
+
+	p = aWriting.find(aKey);
+	if (p != aWriting.end())
+		return &p->second;
+
+	return nullptr;
+}
+
+void HashManager::HashStore::restorePending(DbHandler::ValueMap& aPending, DbHandler::ValueMap& aFailed) noexcept {
+	for (auto& v: aFailed) {
+		if (aPending.find(v.first) != aPending.end())
+			continue;
+
+		pendingBytes += v.first.length() + v.second.length();
+		aPending.emplace(v.first, move(v.second));
+	}
+
+	aFailed.clear();
+}
+
+bool HashManager::HashStore::commit(DbHandler& aDb, const DbHandler::ValueMap& aValues, bool aSync) noexcept {
+	if (aValues.empty())
+		return true;
+
+	try {
+		aDb.write(aValues, aSync);
 	} catch(DbException& e) {
-		throw HashException(STRING_F(WRITE_FAILED_X, fileDb->getNameLower() % e.getError()));
+		LogManager::getInstance()->message(STRING_F(WRITE_FAILED_X, aDb.getNameLower() % e.getError()), LogManager::LOG_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+void HashManager::HashStore::scheduleFlush(bool aForce) noexcept {
+	if (aForce)
+		forceFlush = true;
+
+	// the queued task handles the later requests as well
+	if (flushQueued.exchange(true))
+		return;
+
+	writer.addTask([this] {
+		flushQueued = false;
+		writePending(forceFlush.exchange(false));
+	});
+}
+
+void HashManager::HashStore::flush() noexcept {
+	Semaphore done;
+	writer.addTask([&] {
+		writePending(true);
+		done.signal();
+	});
+
+	done.wait();
+}
+
+void HashManager::HashStore::writePending(bool aForce) noexcept {
+	vector<pair<string, HashedFile>> hashed;
+
+	{
+		Lock wl(writeCs);
+
+		{
+			Lock l(cs);
+			if (!hasPending() || (!aForce && pendingSince + WRITE_BATCH_DELAY > GET_TICK()))
+				return;
+
+			// keep everything pending until the databases have been opened
+			if (!fileDb || !hashDb)
+				return;
+
+			writingTrees.swap(pendingTrees);
+			writingFiles.swap(pendingFiles);
+			hashed.swap(pendingHashed);
+			pendingBytes = 0;
+		}
+
+		// write the trees first so that there won't be any files without a tree
+		auto sync = SETTING(SYNC_HASH_DB_WRITES);
+		auto treesWritten = commit(*hashDb, writingTrees, sync);
+		auto filesWritten = treesWritten && commit(*fileDb, writingFiles, sync);
+
+		Lock l(cs);
+		writeFailed = !filesWritten;
+		if (treesWritten) {
+			writingTrees.clear();
+		} else {
+			restorePending(pendingTrees, writingTrees);
+		}
+
+		if (filesWritten) {
+			writingFiles.clear();
+		} else {
+			restorePending(pendingFiles, writingFiles);
+
+			// report the files after they have been written
+			pendingHashed.insert(pendingHashed.begin(), make_move_iterator(hashed.begin()), make_move_iterator(hashed.end()));
+			hashed.clear();
+			pendingSince = GET_TICK();
+		}
 	}
 
-	free(buf);
+	for (auto& h: hashed) {
+		getInstance()->fire(HashManagerListener::TTHDone(), h.first, h.second);
+	}
 }
 
 void HashManager::renameFile(const string& aOldPath, const string& aNewPath, const HashedFile& fi) throw(HashException) {
@@ -302,23 +738,28 @@ void HashManager::HashStore::renameFile(const string& oldPath, const string& new
 }
 
 void HashManager::HashStore::removeFile(const string& aFilePathLower) throw(HashException) {
-	try {
-		fileDb->remove((void*) aFilePathLower.c_str(), aFilePathLower.length());
-	} catch (DbException& e) {
-		throw HashException(STRING_F(WRITE_FAILED_X, fileDb->getNameLower() % e.getError()));
+	bool full = false;
+	{
+		Lock l(cs);
+		auto key = getFileKey(aFilePathLower, false, full);
+		if (!key.empty())
+			full = addPending(pendingFiles, key, string());
 	}
+
+	if (full)
+		scheduleFlush(true);
+
+	removeLegacyFile(aFilePathLower);
 }
 
 void HashManager::HashStore::addTree(const TigerTree& tt) throw(HashException) {
 	size_t treelen = tt.getLeaves().size() == 1 ? 0 : tt.getLeaves().size() * TTHValue::BYTES;
 	auto sz = sizeof(uint8_t) + sizeof(int64_t) + sizeof(int64_t) + treelen;
 
-	//allocate the memory
-	void* buf = malloc(sz);
-
+	string value(sz, 0);
 
 	//set the data
-	char *p = (char *)buf;
+	char *p = &value[0];
 
 	uint8_t version = HASHDATA_VERSION;
 	memcpy(p, &version, sizeof(uint8_t));
@@ -335,30 +776,120 @@ void HashManager::HashStore::addTree(const TigerTree& tt) throw(HashException) {
 	if (treelen > 0)
 		memcpy(p, tt.getLeaves()[0].data, treelen);
 
-	//throw HashException(STRING_F(WRITE_FAILED_X, hashDb->getNameLower() % "TEST"));
-	try {
-		hashDb->put((void*)tt.getRoot().data, sizeof(TTHValue), buf, sz);
-	} catch(DbException& e) {
-		free(buf);
-		throw HashException(STRING_F(WRITE_FAILED_X, hashDb->getNameLower() % e.getError()));
-	}
-
-	free(buf);
+	queueWrite(pendingTrees, getTreeKey(tt.getRoot()), move(value));
+	treeCache.remove(tt.getRoot());
 }
 
 bool HashManager::HashStore::getTree(const TTHValue& root, TigerTree& tt) {
+	auto tree = getTree(root);
+	if (!tree)
+		return false;
+
+	tt = *tree;
+	return true;
+}
+
+HashManager::TigerTreePtr HashManager::HashStore::getTree(const TTHValue& root) {
+	{
+		Lock l(cs);
+		auto p = findPendingTree(getTreeKey(root));
+		if (p) {
+			auto tree = make_shared<TigerTree>();
+			if (p->empty() || !loadTree(p->data(), p->length(), root, *tree, true))
+				return nullptr;
+			return tree;
+		}
+	}
+
+	auto cached = treeCache.get(root);
+	if (cached)
+		return cached;
+
 	try {
-		return hashDb->get((void*)root.data, sizeof(TTHValue), 100*1024, [&](void* aValue, size_t valueLen) {
-			return loadTree(aValue, valueLen, root, tt, true);
+		auto tree = make_shared<TigerTree>();
+		auto found = hashDb->get((void*)root.data, sizeof(TTHValue), 100*1024, [&](void* aValue, size_t valueLen) {
+			return loadTree(aValue, valueLen, root, *tree, true);
 		});
+
+		if (found) {
+			treeCache.add(tree);
+			return tree;
+		}
 	} catch(DbException& e) {
 		LogManager::getInstance()->message(STRING_F(READ_FAILED_X, hashDb->getNameLower() % e.getError()), LogManager::LOG_ERROR);
 	}
 
-	return false;
+	return nullptr;
+}
+
+HashManager::TigerTreePtr HashManager::TreeCache::get(const TTHValue& aRoot) noexcept {
+	auto& s = getShard(aRoot);
+
+	Lock l(s.cs);
+	auto i = s.treeMap.find(aRoot);
+	if (i == s.treeMap.end()) {
+		s.misses++;
+		return nullptr;
+	}
+
+	s.hits++;
+	s.trees.splice(s.trees.begin(), s.trees, i->second);
+	return *i->second;
+}
+
+void HashManager::TreeCache::add(const TigerTreePtr& aTree) noexcept {
+	auto maxBytes = static_cast<size_t>(Util::convertSize(max(SETTING(TREE_CACHE_SIZE), 0), Util::MB)) / SHARDS;
+	auto treeBytes = getTreeBytes(*aTree);
+	if (treeBytes > maxBytes / 4)
+		return;
+
+	auto& s = getShard(aTree->getRoot());
+
+	Lock l(s.cs);
+	if (s.treeMap.find(aTree->getRoot()) != s.treeMap.end())
+		return;
+
+	s.bytes += treeBytes;
+	s.trees.push_front(aTree);
+	s.treeMap.emplace(aTree->getRoot(), s.trees.begin());
+
+	while (s.bytes > maxBytes) {
+		s.bytes -= getTreeBytes(*s.trees.back());
+		s.treeMap.erase(s.trees.back()->getRoot());
+		s.trees.pop_back();
+	}
+}
+
+void HashManager::TreeCache::remove(const TTHValue& aRoot) noexcept {
+	auto& s = getShard(aRoot);
+
+	Lock l(s.cs);
+	auto i = s.treeMap.find(aRoot);
+	if (i != s.treeMap.end()) {
+		s.bytes -= getTreeBytes(**i->second);
+		s.trees.erase(i->second);
+		s.treeMap.erase(i);
+	}
+}
+
+void HashManager::TreeCache::getStats(uint64_t& hits_, uint64_t& misses_, size_t& bytes_, size_t& trees_) const noexcept {
+	for (const auto& s: shards) {
+		Lock l(s.cs);
+		hits_ += s.hits;
+		misses_ += s.misses;
+		bytes_ += s.bytes;
+		trees_ += s.trees.size();
+	}
 }
 
 bool HashManager::HashStore::hasTree(const TTHValue& root) throw(HashException) {
+	{
+		Lock l(cs);
+		auto p = findPendingTree(getTreeKey(root));
+		if (p)
+			return !p->empty();
+	}
+
 	bool ret = false;
 	try {
 		ret = hashDb->hasKey((void*)root.data, sizeof(TTHValue));
@@ -477,22 +1008,40 @@ void HashManager::HashStore::loadLegacyTree(File& f, int64_t aSize, int64_t aInd
 
 int64_t HashManager::HashStore::getRootInfo(const TTHValue& root, InfoType aType) {
 	int64_t ret = 0;
-	try {
-		hashDb->get((void*)root.data, sizeof(TTHValue), 100*1024, [&](void* aValue, size_t /*valueLen*/) {
-			char* p = (char*)aValue;
+	auto loadInfo = [&](const void* aValue, size_t /*valueLen*/) {
+		char* p = (char*)aValue;
 
-			uint8_t version;
-			memcpy(&version, p, sizeof(uint8_t));
-			p += sizeof(uint8_t);
+		uint8_t version;
+		memcpy(&version, p, sizeof(uint8_t));
+		p += sizeof(uint8_t);
 
-			if (version > FILEINDEX_VERSION) {
-				return false;
-			}
+		if (version > HASHDATA_VERSION) {
+			return false;
+		}
 
-			p += (aType == TYPE_FILESIZE ? 0 : sizeof(int64_t));
+		p += (aType == TYPE_FILESIZE ? 0 : sizeof(int64_t));
 
-			memcpy(&ret, p, sizeof(ret));
-			return true;
+		memcpy(&ret, p, sizeof(ret));
+		return true;
+	};
+
+	{
+		Lock l(cs);
+		auto p = findPendingTree(getTreeKey(root));
+		if (p) {
+			if (!p->empty())
+				loadInfo(p->data(), p->length());
+			return ret;
+		}
+	}
+
+	auto cached = treeCache.get(root);
+	if (cached)
+		return aType == TYPE_FILESIZE ? cached->getFileSize() : cached->getBlockSize();
+
+	try {
+		hashDb->get((void*)root.data, sizeof(TTHValue), 100*1024, [&](void* aValue, size_t valueLen) {
+			return loadInfo(aValue, valueLen);
 		});
 	} catch(DbException& e) {
 		LogManager::getInstance()->message(STRING_F(READ_FAILED_X, hashDb->getNameLower() % e.getError()), LogManager::LOG_ERROR);
@@ -515,10 +1064,33 @@ bool HashManager::HashStore::checkTTH(const string& aFileLower, HashedFile& fi)
 }
 
 bool HashManager::HashStore::getFileInfo(const string& aFileLower, HashedFile& fi_) {
+	string key;
+	bool checkLegacy = migratingIndex;
+
+	{
+		Lock l(cs);
+		bool full = false;
+		key = getFileKey(aFileLower, false, full);
+		if (!key.empty()) {
+			auto p = findPendingFile(key);
+			if (p)
+				return !p->empty() && loadFileInfo(p->data(), p->length(), fi_);
+		}
+
+		// removed or converted already?
+		if (checkLegacy && findPendingFile(aFileLower))
+			checkLegacy = false;
+	}
+
+	auto loadF = [&](void* aValue, size_t valueLen) {
+		return loadFileInfo(aValue, valueLen, fi_);
+	};
+
 	try {
-		return fileDb->get((void*)aFileLower.c_str(), aFileLower.length(), sizeof(HashedFile), [&](void* aValue, size_t valueLen) {
-			return loadFileInfo(aValue, valueLen, fi_);
-		});
+		if (!key.empty() && fileDb->get((void*)key.c_str(), key.length(), sizeof(HashedFile), loadF))
+			return true;
+
+		return checkLegacy && fileDb->get((void*)aFileLower.c_str(), aFileLower.length(), sizeof(HashedFile), loadF);
 	} catch(DbException& e) {
 		LogManager::getInstance()->message(STRING_F(READ_FAILED_X, fileDb->getNameLower() % e.getError()), LogManager::LOG_ERROR);
 	}
@@ -526,7 +1098,56 @@ bool HashManager::HashStore::getFileInfo(const string& aFileLower, HashedFile& f
 	return false;
 }
 
+bool HashManager::HashStore::getDirectoryFiles(const string& aDirLower, HashedFileMap& files_) noexcept {
+	// the files may still be stored with their legacy keys
+	if (migratingIndex)
+		return false;
+
+	string prefix;
+	{
+		Lock l(cs);
+		bool full = false;
+		prefix = getFileKey(aDirLower, false, full);
+		if (prefix.empty()) {
+			// nothing has been hashed in this directory
+			return true;
+		}
+	}
+
+	try {
+		fileDb->remove_if(prefix, [&](void* aKey, size_t aKeyLen, void* aValue, size_t aValueLen) {
+			HashedFile fi;
+			if (loadFileInfo(aValue, aValueLen, fi))
+				files_.emplace(string(static_cast<const char*>(aKey) + prefix.length(), aKeyLen - prefix.length()), fi);
+			return false;
+		});
+	} catch(DbException& e) {
+		LogManager::getInstance()->message(STRING_F(READ_FAILED_X, fileDb->getNameLower() % e.getError()), LogManager::LOG_ERROR);
+		return false;
+	}
+
+	// the queued changes are newer than the database
+	Lock l(cs);
+	for (const auto& values: { &writingFiles, &pendingFiles }) {
+		for (const auto& p: *values) {
+			if (p.first.length() <= prefix.length() || p.first.compare(0, prefix.length(), prefix) != 0)
+				continue;
+
+			auto name = p.first.substr(prefix.length());
+			HashedFile fi;
+			if (!p.second.empty() && loadFileInfo(p.second.data(), p.second.length(), fi)) {
+				files_[name] = fi;
+			} else {
+				files_.erase(name);
+			}
+		}
+	}
+
+	return true;
+}
+
 void HashManager::HashStore::optimize(bool doVerify) noexcept {
+	flush();
 	getInstance()->fire(HashManagerListener::MaintananceStarted());
 
 	int unusedTrees = 0;
@@ -547,17 +1168,43 @@ void HashManager::HashStore::optimize(bool doVerify) noexcept {
 		unique_ptr<DbSnapshot> hashSnapshot(hashDb->getSnapshot()); 
 
 		HashedFile fi;
-		string path;
+		unordered_map<uint32_t, string> directories;
+		unordered_set<uint32_t> usedDirectories;
 
 		// lookup each item in file index from the share
 		try {
-			fileDb->remove_if([&](void* aKey, size_t key_len, void* aValue, size_t valueLen) {
-				path = string((const char*)aKey, key_len);
-				if (ShareManager::getInstance()->isRealPathShared(path)) {
+			fileDb->remove_if(string(1, KEY_DIRECTORY), [&](void* aKey, size_t key_len, void* aValue, size_t valueLen) {
+				if (key_len == 1 + sizeof(uint32_t))
+					directories.emplace(getKeyId(aKey), string((const char*)aValue, valueLen));
+				return false;
+			}, fileSnapshot.get());
+
+			// the files are sorted by directory so the share needs to be checked only once for each directory
+			uint32_t curDir = 0;
+			bool dirShared = false;
+			StringSet sharedFiles;
+
+			fileDb->remove_if(string(1, KEY_FILE), [&](void* aKey, size_t key_len, void* aValue, size_t valueLen) {
+				if (key_len <= 1 + sizeof(uint32_t)) {
+					unusedFiles++;
+					return true;
+				}
+
+				auto dirId = getKeyId(aKey);
+				if (dirId != curDir) {
+					curDir = dirId;
+					sharedFiles.clear();
+
+					auto d = directories.find(dirId);
+					dirShared = d != directories.end() && ShareManager::getInstance()->getRealDirFiles(d->second, sharedFiles);
+				}
+
+				if (dirShared && sharedFiles.find(string((const char*)aKey + 1 + sizeof(uint32_t), key_len - 1 - sizeof(uint32_t))) != sharedFiles.end()) {
 					if (!loadFileInfo(aValue, valueLen, fi))
 						return true;
 
 					usedRoots.emplace(fi.getRoot());
+					usedDirectories.insert(dirId);
 					validFiles++;
 					return false;
 				} else {
@@ -572,6 +1219,8 @@ void HashManager::HashStore::optimize(bool doVerify) noexcept {
 			return;
 		}
 
+		removeEmptyDirectories(directories, usedDirectories);
+
 		//remove trees that aren't shared or queued and optionally check whether each tree can be loaded
 		TigerTree tt;
 		TTHValue curRoot;
@@ -582,6 +1231,7 @@ void HashManager::HashStore::optimize(bool doVerify) noexcept {
 				if (i == usedRoots.end() && !QueueManager::getInstance()->isFileQueued(curRoot)) {
 					//not needed
 					unusedTrees++;
+					treeCache.remove(curRoot);
 					return true;
 				}
 				
@@ -595,6 +1245,7 @@ void HashManager::HashStore::optimize(bool doVerify) noexcept {
 
 				//failed to load it
 				failedTrees++;
+				treeCache.remove(curRoot);
 				return true;
 			}, hashSnapshot.get());
 		} catch(DbException& e) {
@@ -608,7 +1259,7 @@ void HashManager::HashStore::optimize(bool doVerify) noexcept {
 		missingTrees = usedRoots.size() - failedTrees;
 		if (usedRoots.size() > 0) {
 			try {
-				fileDb->remove_if([&](void* /*aKey*/, size_t /*key_len*/, void* aValue, size_t valueLen) {
+				fileDb->remove_if(string(1, KEY_FILE), [&](void* /*aKey*/, size_t /*key_len*/, void* aValue, size_t valueLen) {
 					loadFileInfo(aValue, valueLen, fi);
 					if (usedRoots.find(fi.getRoot()) != usedRoots.end()) {
 						failedSize += fi.getSize();
@@ -665,6 +1316,66 @@ void HashManager::HashStore::optimize(bool doVerify) noexcept {
 	getInstance()->fire(HashManagerListener::MaintananceFinished());
 }
 
+void HashManager::HashStore::removeEmptyDirectories(const unordered_map<uint32_t, string>& aDirectories, const unordered_set<uint32_t>& aUsedDirectories) noexcept {
+	vector<const pair<const uint32_t, string>*> candidates;
+
+	{
+		// files may have been added in the directories after the snapshot was taken
+		Lock l(cs);
+
+		unordered_set<uint32_t> pendingDirectories;
+		for (const auto& values: { &pendingFiles, &writingFiles }) {
+			for (const auto& p: *values) {
+				if (p.first.length() > 1 + sizeof(uint32_t) && p.first[0] == KEY_FILE)
+					pendingDirectories.insert(getKeyId(p.first.data()));
+			}
+		}
+
+		for (const auto& d: aDirectories) {
+			if (aUsedDirectories.find(d.first) == aUsedDirectories.end() && pendingDirectories.find(d.first) == pendingDirectories.end())
+				candidates.push_back(&d);
+		}
+
+		scanningDirectories = true;
+	}
+
+	// the database is scanned without blocking the lookups and new files
+	vector<const pair<const uint32_t, string>*> emptyDirectories;
+	for (const auto d: candidates) {
+		bool hasFiles = false;
+		try {
+			fileDb->remove_if(getIdKey(KEY_FILE, d->first), [&](void* /*aKey*/, size_t /*key_len*/, void* /*aValue*/, size_t /*valueLen*/) {
+				hasFiles = true;
+				return false;
+			});
+		} catch(DbException&) {
+			continue;
+		}
+
+		if (!hasFiles)
+			emptyDirectories.push_back(d);
+	}
+
+	bool full = false;
+
+	{
+		Lock l(cs);
+		for (const auto d: emptyDirectories) {
+			if (scanUsedDirectories.find(d->first) != scanUsedDirectories.end())
+				continue;
+
+			directoryIds.erase(d->second);
+			full = addPending(pendingFiles, getIdKey(KEY_DIRECTORY, d->first), string()) || full;
+		}
+
+		scanningDirectories = false;
+		scanUsedDirectories.clear();
+	}
+
+	if (full)
+		scheduleFlush(true);
+}
+
 void HashManager::HashStore::compact() noexcept {
 	LogManager::getInstance()->message(STRING_F(COMPACTING_X, fileDb->getNameLower()), LogManager::LOG_INFO);
 	fileDb->compact();
@@ -683,6 +1394,15 @@ string HashManager::HashStore::getDbStats() noexcept {
 	statMsg += hashDb->getStats();
 	statMsg += "Deleted entries since last compaction: " + Util::toString(SETTING(CUR_REMOVED_TREES)) + " (" + Util::toString(((double)SETTING(CUR_REMOVED_TREES) / (double)hashDb->size(false))*100) + "%)";
 	statMsg += "\r\n\r\n";
+
+	uint64_t hits = 0, misses = 0;
+	size_t cacheBytes = 0, cachedTrees = 0;
+	treeCache.getStats(hits, misses, cacheBytes, cachedTrees);
+
+	statMsg += "-=[ Tree cache ]=-\r\n";
+	statMsg += "Cached trees: " + Util::toString(cachedTrees) + " (" + Util::formatBytes(cacheBytes) + ")\r\n";
+	statMsg += "Hits: " + Util::toString(hits) + ", misses: " + Util::toString(misses) + " (hit rate " + Util::toString(hits + misses > 0 ? ((double)hits / (double)(hits + misses))*100 : 0) + "%)";
+	statMsg += "\r\n\r\n";
 	statMsg += "\n\nDisk block size: " + Util::formatBytes(File::getBlockSize(hashDb->getPath())) + "\n\n";
 	return statMsg;
 }
@@ -731,6 +1451,18 @@ void HashManager::HashStore::openDb(StepFunction stepF, MessageFunction messageF
 
 	hashDb->open(stepF, messageF);
 	fileDb->open(stepF, messageF);
+
+	// the file entries of the old schema will be converted in the background
+	uint8_t schema = 0;
+	string schemaKey(1, KEY_SCHEMA);
+	fileDb->get((void*)schemaKey.data(), schemaKey.length(), 1, [&schema](void* aValue, size_t aValueLen) {
+		if (aValueLen == 1)
+			schema = *static_cast<uint8_t*>(aValue);
+		return true;
+	});
+
+	migratingIndex = schema < FILEINDEX_VERSION;
+	loadDirectories();
 }
 
 class HashLoader: public SimpleXMLReader::CallBack {
@@ -826,6 +1558,7 @@ void HashManager::HashStore::load(StepFunction stepF, ProgressFunction progressF
 				CountedInputStream<false> countedStream(&f);
 				HashLoader l(*this, countedStream, hashDataSize + hashIndexSize, progressF);
 				SimpleXMLReader(&l).parse(countedStream);
+				flush();
 				migratedFiles = l.migratedFiles;
 				migratedTrees = l.migratedTrees;
 				failedTrees = l.failedTrees;
@@ -932,6 +1665,7 @@ HashManager::HashStore::HashStore() {
 }
 
 void HashManager::HashStore::closeDb() {
+	flush();
 	hashDb.reset(nullptr);
 	fileDb.reset(nullptr);
 }
@@ -940,11 +1674,15 @@ HashManager::HashStore::~HashStore() {
 	closeDb();
 }
 
-bool HashManager::Hasher::hashFile(const string& fileName, const string& filePathLower, int64_t size, const string& devID) noexcept {
+bool HashManager::Hasher::hashFile(const string& fileName, const string& filePathLower, int64_t size, const File::BlockDevice& aDevice) noexcept {
 	//always locked
-	auto ret = w.emplace_sorted(filePathLower, fileName, size, devID);
+	auto ret = w.emplace_sorted(filePathLower, fileName, size, aDevice.id);
 	if (ret.second) {
-		devices[(*ret.first).devID]++; 
+		auto& d = devices[aDevice.id];
+		d.files++;
+		d.bytes += size;
+		d.rotational = aDevice.rotational;
+		d.exclusive = getMaxHashers(aDevice) == 1;
 		totalBytesLeft += size;
 		s.signal();
 		return true;
@@ -967,12 +1705,13 @@ bool HashManager::Hasher::isPaused() const noexcept {
 	return paused;
 }
 
-void HashManager::Hasher::removeDevice(const string& aID) noexcept {
+void HashManager::Hasher::removeDevice(const string& aID, int64_t aSize) noexcept {
 	dcassert(!aID.empty());
 	auto dp = devices.find(aID);
 	if (dp != devices.end()) {
-		dp->second--;
-		if (dp->second == 0)
+		dp->second.files--;
+		dp->second.bytes -= aSize;
+		if (dp->second.files == 0)
 			devices.erase(dp);
 	}
 }
@@ -981,7 +1720,7 @@ void HashManager::Hasher::stopHashing(const string& baseDir) noexcept {
 	for (auto i = w.begin(); i != w.end();) {
 		if (Util::strnicmp(baseDir, i->filePath, baseDir.length()) == 0) {
 			totalBytesLeft -= i->fileSize;
-			removeDevice(i->devID);
+			removeDevice(i->devID, i->fileSize);
 			i = w.erase(i);
 		} else {
 			++i;
@@ -1001,11 +1740,14 @@ void HashManager::setPriority(Thread::Priority p) noexcept {
 		h->setThreadPriority(p); 
 }
 
-void HashManager::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed, int& hasherCount) const noexcept {
+void HashManager::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed, int& hasherCount, DeviceStatsList* deviceStats_) const noexcept {
 	RLock l(Hasher::hcs);
 	hasherCount = hashers.size();
-	for (auto i: hashers)
+	for (auto i: hashers) {
 		i->getStats(curFile, bytesLeft, filesLeft, speed);
+		if (deviceStats_)
+			i->getDeviceStats(*deviceStats_);
+	}
 }
 
 void HashManager::startMaintenance(bool verify){
@@ -1024,12 +1766,27 @@ void HashManager::Optimizer::startMaintenance(bool aVerify) {
 		return;
 
 	verify = aVerify;
+	migrate = false;
+	running = true;
+	start();
+}
+
+void HashManager::Optimizer::startIndexMigration() {
+	if (running)
+		return;
+
+	migrate = true;
 	running = true;
 	start();
 }
 
 int HashManager::Optimizer::run() {
-	HashManager::getInstance()->optimize(verify);
+	if (migrate) {
+		HashManager::getInstance()->store.migrateIndex();
+	} else {
+		HashManager::getInstance()->optimize(verify);
+	}
+
 	running = false;
 	return 0;
 }
@@ -1037,6 +1794,9 @@ int HashManager::Optimizer::run() {
 void HashManager::startup(StepFunction stepF, ProgressFunction progressF, MessageFunction messageF) throw(HashException) {
 	hashers.push_back(new Hasher(false, 0));
 	store.load(stepF, progressF, messageF); 
+
+	if (store.isMigratingIndex())
+		optimizer.startIndexMigration();
 }
 
 void HashManager::stop() noexcept {
@@ -1073,6 +1833,8 @@ void HashManager::shutdown(ProgressFunction progressF) noexcept {
 		}
 		Thread::sleep(50);
 	}
+
+	store.flush();
 }
 
 void HashManager::Hasher::clear() noexcept {
@@ -1090,6 +1852,21 @@ void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t&
 	speed += lastSpeed;
 }
 
+void HashManager::Hasher::getDeviceStats(DeviceStatsList& stats_) const noexcept {
+	for (const auto& d: devices) {
+		auto s = find_if(stats_, [&d](const DeviceStats& aStats) { return aStats.id == d.first; });
+		if (s == stats_.end()) {
+			stats_.push_back({ d.first, d.second.rotational, 0, 0, 0 });
+			s = stats_.end() - 1;
+		}
+
+		s->hashers++;
+		s->bytesLeft += d.second.bytes;
+		if (running && currentDevice == d.first)
+			s->speed += lastSpeed;
+	}
+}
+
 void HashManager::Hasher::instantPause() {
 	if(paused) {
 		t_suspend();
@@ -1121,6 +1898,7 @@ int HashManager::Hasher::run() {
 		int64_t originalSize = 0;
 		bool failed = true;
 		bool dirChanged = false;
+		bool rotational = false, exclusiveDevice = false;
 		string curDevID, pathLower;
 		{
 			WLock l(hcs);
@@ -1132,6 +1910,13 @@ int HashManager::Hasher::run() {
 				pathLower = move(wi.filePathLower);
 				originalSize = wi.fileSize;
 				dcassert(!curDevID.empty());
+
+				currentDevice = curDevID;
+				auto d = devices.find(curDevID);
+				if (d != devices.end()) {
+					rotational = d->second.rotational;
+					exclusiveDevice = d->second.exclusive;
+				}
 				w.pop_front();
 			} else {
 				fname.clear();
@@ -1160,6 +1945,9 @@ int HashManager::Hasher::run() {
 				int64_t bs = max(TigerTree::calcBlockSize(size, 10), MIN_BLOCK_SIZE);
 				uint64_t timestamp = f.getLastModified();
 				TigerTree tt(bs);
+				unique_ptr<ParallelTreeHasher> parallelHasher;
+				if (ParallelTreeHasher::isSupported(size))
+					parallelHasher.reset(new ParallelTreeHasher(tt));
 
 				CRC32Filter crc32;
 
@@ -1167,8 +1955,8 @@ int HashManager::Hasher::run() {
 
 				uint64_t lastRead = GET_TICK();
  
-                FileReader fr(true);
-				fr.read(fname, [&](const void* buf, size_t n) -> bool {
+				FileReader fr(true, rotational ? ROTATIONAL_READ_SIZE : 0);
+				fr.read(fname, getInstance()->readStrategy, [&](const void* buf, size_t n) -> bool {
 					if(SETTING(MAX_HASH_SPEED)> 0) {
 						uint64_t now = GET_TICK();
 						uint64_t minTime = n * 1000LL / Util::convertSize(SETTING(MAX_HASH_SPEED), Util::MB);
@@ -1180,7 +1968,11 @@ int HashManager::Hasher::run() {
 					} else {
 						lastRead = GET_TICK();
 					}
-					tt.update(buf, n);
+					if (parallelHasher) {
+						parallelHasher->update(buf, n);
+					} else {
+						tt.update(buf, n);
+					}
 				
 					if(fileCRC)
 						crc32(buf, n);
@@ -1197,7 +1989,11 @@ int HashManager::Hasher::run() {
 				});
 
 				f.close();
-				tt.finalize();
+				if (parallelHasher) {
+					parallelHasher->finalize();
+				} else {
+					tt.finalize();
+				}
 
 				failed = fileCRC && crc32.getValue() != *fileCRC;
 
@@ -1236,7 +2032,7 @@ int HashManager::Hasher::run() {
 		}
 
 		auto onDirHashed = [&] () -> void {
-			if ((SETTING(HASHERS_PER_VOLUME) == 1 || w.empty()) && (dirFilesHashed > 1 || !failed)) {
+			if ((exclusiveDevice || w.empty()) && (dirFilesHashed > 1 || !failed)) {
 				if (dirFilesHashed == 1) {
 					getInstance()->log(STRING_F(HASHING_FINISHED_FILE, currentFile % 
 						Util::formatBytes(dirSizeHashed) % 
@@ -1262,7 +2058,7 @@ int HashManager::Hasher::run() {
 		{
 			WLock l(hcs);
 			if (!fname.empty())
-				removeDevice(curDevID);
+				removeDevice(curDevID, originalSize);
 
 			if (w.empty()) {
 				if (sizeHashed > 0) {
@@ -1296,9 +2092,6 @@ int HashManager::Hasher::run() {
 			currentFile.clear();
 		}
 
-		if (!failed && !fname.empty())
-			getInstance()->fire(HashManagerListener::TTHDone(), fname, fi);
-
 		if (deleteThis) {
 			//check again if we have added new items while this was unlocked
 
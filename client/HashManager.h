@@ -23,6 +23,9 @@
 #include "typedefs.h"
 
 #include "DbHandler.h"
+#include "DispatcherQueue.h"
+#include "File.h"
+#include "FileReader.h"
 #include "HashedFile.h"
 #include "MerkleTree.h"
 #include "Semaphore.h"
@@ -31,6 +34,7 @@
 #include "SortedVector.h"
 #include "Speaker.h"
 #include "Thread.h"
+#include "TimerManager.h"
 
 #include "atomic.h"
 
@@ -58,7 +62,7 @@ public:
 class HashLoader;
 class FileException;
 
-class HashManager : public Singleton<HashManager>, public Speaker<HashManagerListener> {
+class HashManager : public Singleton<HashManager>, public Speaker<HashManagerListener>, private TimerManagerListener {
 
 public:
 
@@ -79,15 +83,37 @@ public:
 	/** @return HashedFileInfo */
 	void getFileInfo(const string& fileLower, const string& aFileName, HashedFile& aFileInfo) throw(HashException);
 
+	/** Hashed files by the lowercase file name */
+	typedef unordered_map<string, HashedFile> HashedFileMap;
+
+	/**
+	 * Get the information of all hashed files in a directory with a single database scan
+	 * @return False if the files need to be looked up separately with getFileInfo
+	 */
+	bool getDirectoryFiles(const string& aDirLower, HashedFileMap& files_) noexcept { return store.getDirectoryFiles(aDirLower, files_); }
+
 	bool getTree(const TTHValue& root, TigerTree& tt) noexcept;
 
+	/** Shared tree that mustn't be modified (uses the tree cache, null if the tree doesn't exist) */
+	typedef shared_ptr<const TigerTree> TigerTreePtr;
+	TigerTreePtr getTree(const TTHValue& root) noexcept;
+
 	/** Return block size of the tree associated with root, or 0 if no such tree is in the store */
 	size_t getBlockSize(const TTHValue& root) noexcept;
 
 	//void addTree(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tt);
 	void addTree(const TigerTree& tree) throw(HashException) { store.addTree(tree); }
 
-	void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed, int& hashers) const noexcept;
+	struct DeviceStats {
+		string id;
+		bool rotational;
+		int hashers;
+		int64_t bytesLeft;
+		int64_t speed;
+	};
+	typedef vector<DeviceStats> DeviceStatsList;
+
+	void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed, int& hashers, DeviceStatsList* deviceStats_ = nullptr) const noexcept;
 
 	void getFileTTH(const string& aFile, int64_t aSize, bool addStore, TTHValue& tth_, int64_t& sizeLeft_, const bool& aCancel, std::function<void(int64_t /*timeLeft*/, const string& /*fileName*/)> updateF = nullptr)  throw(HashException);
 
@@ -121,13 +147,18 @@ public:
 
 	void renameFile(const string& aOldPath, const string& aNewPath, const HashedFile& fi) throw(HashException);
 	bool addFile(const string& aFilePathLower, const HashedFile& fi_) throw(HashException);
+
+	/** Read the hashed files with a single strategy (for benchmarking), the files fail to hash if it isn't supported */
+	void setReadStrategy(FileReader::Strategy aStrategy) noexcept { readStrategy = aStrategy; }
 private:
+	atomic<FileReader::Strategy> readStrategy { FileReader::AUTO };
+
 	int pausers = 0;
 	class Hasher : public Thread {
 	public:
 		Hasher(bool isPaused, int aHasherID);
 
-		bool hashFile(const string& filePath, const string& filePathLower, int64_t size, const string& devID) noexcept;
+		bool hashFile(const string& filePath, const string& filePathLower, int64_t size, const File::BlockDevice& aDevice) noexcept;
 
 		/// @return whether hashing was already paused
 		bool pause() noexcept;
@@ -139,10 +170,10 @@ private:
 		void stopHashing(const string& baseDir) noexcept;
 		int run();
 		void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& speed) const noexcept;
+		void getDeviceStats(DeviceStatsList& stats_) const noexcept;
 		void shutdown();
 
 		bool hasFile(const string& aPath) const noexcept;
-		bool getPathVolume(const string& aPath, string& vol_) const noexcept;
 		bool hasDevice(const string& aID) const noexcept { return devices.find(aID) != devices.end(); }
 		bool hasDevices() const noexcept { return !devices.empty(); }
 		int64_t getTimeLeft() const noexcept;
@@ -174,13 +205,14 @@ private:
 		SortedVector<WorkItem, std::deque, string, Util::PathSortOrderInt, WorkItem::NameLower> w;
 
 		Semaphore s;
-		void removeDevice(const string& aID) noexcept;
+		void removeDevice(const string& aID, int64_t aSize) noexcept;
 
 		bool closing = false;
 		bool running = false;
 		bool paused;
 
 		string currentFile;
+		string currentDevice;
 		atomic<int64_t> totalBytesLeft;
 		atomic<int64_t> lastSpeed;
 
@@ -198,7 +230,14 @@ private:
 
 		DirSFVReader sfv;
 
-		StringIntMap devices;
+		struct DeviceWork {
+			int files = 0;
+			int64_t bytes = 0;
+			bool rotational = false;
+			bool exclusive = false;
+		};
+
+		unordered_map<string, DeviceWork> devices;
 	};
 
 	friend class Hasher;
@@ -207,12 +246,44 @@ private:
 
 	void optimize(bool doVerify) noexcept { store.optimize(doVerify); }
 
+	/* Recently used trees, the same trees are requested repeatedly by the downloaders of popular files */
+	class TreeCache : boost::noncopyable {
+	public:
+		TigerTreePtr get(const TTHValue& aRoot) noexcept;
+		void add(const TigerTreePtr& aTree) noexcept;
+		void remove(const TTHValue& aRoot) noexcept;
+
+		void getStats(uint64_t& hits_, uint64_t& misses_, size_t& bytes_, size_t& trees_) const noexcept;
+	private:
+		static size_t getTreeBytes(const TigerTree& aTree) noexcept { return sizeof(TigerTree) + aTree.getLeaves().size() * TTHValue::BYTES; }
+
+		// the lookups are spread between separately locked shards by the root
+		struct Shard {
+			// most recently used first
+			typedef list<TigerTreePtr> TreeList;
+			TreeList trees;
+			unordered_map<TTHValue, TreeList::iterator> treeMap;
+
+			size_t bytes = 0;
+			uint64_t hits = 0;
+			uint64_t misses = 0;
+
+			mutable CriticalSection cs;
+		};
+
+		static const int SHARDS = 16;
+		Shard shards[SHARDS];
+
+		Shard& getShard(const TTHValue& aRoot) noexcept { return shards[aRoot.data[0] % SHARDS]; }
+	};
+
 	class HashStore {
 	public:
 		HashStore();
 		~HashStore();
 
-		void addHashedFile(const string& aFilePathLower, const TigerTree& tt, const HashedFile& fi_) throw(HashException);
+		/* Pass the original path for firing TTHDone after the file has been written in the database */
+		void addHashedFile(const string& aFilePathLower, const TigerTree& tt, const HashedFile& fi_, const string& aReportPath = Util::emptyString) throw(HashException);
 		void addFile(const string& aFilePathLower, const HashedFile& fi_) throw(HashException);
 		void renameFile(const string& oldPath, const string& newPath, const HashedFile& fi)  throw(HashException);
 		void removeFile(const string& aFilePathLower) throw(HashException);
@@ -225,7 +296,9 @@ private:
 
 		void addTree(const TigerTree& tt) throw(HashException);
 		bool getFileInfo(const string& aFileLower, HashedFile& aFile);
+		bool getDirectoryFiles(const string& aDirLower, HashedFileMap& files_) noexcept;
 		bool getTree(const TTHValue& root, TigerTree& tth);
+		TigerTreePtr getTree(const TTHValue& root);
 		bool hasTree(const TTHValue& root) throw(HashException);
 
 		enum InfoType {
@@ -244,10 +317,93 @@ private:
 
 		void getDbSizes(int64_t& fileDbSize_, int64_t& hashDbSize_) const noexcept;
 		void compact() noexcept;
+
+		/* Write the pending changes in the databases in the writer thread (unless they are too recent when not forced) */
+		void scheduleFlush(bool aForce) noexcept;
+
+		/* Write all pending changes and wait until they have been committed, must not be called from TTHDone listeners */
+		void flush() noexcept;
+
+		/* Convert the file entries using the legacy full path keys (lookups will work during the conversion) */
+		bool isMigratingIndex() const noexcept { return migratingIndex; }
+		void migrateIndex() noexcept;
 	private:
 		std::unique_ptr<DbHandler> fileDb;
 		std::unique_ptr<DbHandler> hashDb;
 
+		TreeCache treeCache;
+
+		/* Changes that haven't been written in the databases yet, empty value = removed */
+		CriticalSection cs;
+		DbHandler::ValueMap pendingFiles;
+		DbHandler::ValueMap pendingTrees;
+		vector<pair<string, HashedFile>> pendingHashed;
+		size_t pendingBytes = 0;
+		uint64_t pendingSince = 0;
+
+		/* The batch that is being written (without holding cs), protected by cs */
+		DbHandler::ValueMap writingFiles;
+		DbHandler::ValueMap writingTrees;
+		bool writeFailed = false;
+
+		/* Only one batch is written at a time */
+		CriticalSection writeCs;
+
+		/* Runs in the writer thread, the written files are reported with TTHDone from there */
+		void writePending(bool aForce) noexcept;
+		atomic<bool> flushQueued { false };
+		atomic<bool> forceFlush { false };
+
+		bool hasPending() const noexcept { return !pendingFiles.empty() || !pendingTrees.empty() || !pendingHashed.empty(); }
+		void queueWrite(DbHandler::ValueMap& aValues, const string& aKey, string&& aValue) noexcept;
+
+		/* Requires cs, returns true if the pending changes should be flushed */
+		bool addPending(DbHandler::ValueMap& aValues, const string& aKey, string&& aValue) noexcept;
+
+		/* Requires cs, returns nullptr if the key doesn't have any changes that haven't been committed yet */
+		const string* findPendingFile(const string& aKey) const noexcept { return findPending(pendingFiles, writingFiles, aKey); }
+		const string* findPendingTree(const string& aKey) const noexcept { return findPending(pendingTrees, writingTrees, aKey); }
+		static const string* findPending(const DbHandler::ValueMap& aPending, const DbHandler::ValueMap& aWriting, const string& aKey) noexcept;
+
+		/* Requires cs, moves the values of a failed batch back to the pending changes without overwriting newer values */
+		void restorePending(DbHandler::ValueMap& aPending, DbHandler::ValueMap& aFailed) noexcept;
+
+		/* Returns false if the values couldn't be written */
+		static bool commit(DbHandler& aDb, const DbHandler::ValueMap& aValues, bool aSync) noexcept;
+		static string getTreeKey(const TTHValue& aRoot) noexcept { return string((const char*)aRoot.data, sizeof(TTHValue)); }
+
+		/* The file index stores the files by directory id + file name and the paths of the directories separately.
+		The legacy keys are full paths that can't begin with any of these characters. */
+		enum KeyType : char {
+			KEY_SCHEMA = 1,
+			KEY_DIRECTORY = 2,
+			KEY_FILE = 3
+		};
+
+		/* Directory paths mapped to their ids, protected by cs */
+		unordered_map<string, uint32_t> directoryIds;
+		uint32_t nextDirectoryId = 1;
+
+		/* Directories that got files while the empty ones were being looked up from the database, protected by cs */
+		bool scanningDirectories = false;
+		unordered_set<uint32_t> scanUsedDirectories;
+		atomic<bool> migratingIndex { false };
+
+		/* Returns an empty string if the directory doesn't exist and it isn't created */
+		string getFileKey(const string& aPathLower, bool aCreate) noexcept;
+
+		/* Requires cs, the key must be queued before cs is released so that the directory won't be removed as empty */
+		string getFileKey(const string& aPathLower, bool aCreate, bool& full_) noexcept;
+		static string getIdKey(KeyType aType, uint32_t aId) noexcept;
+		static uint32_t getKeyId(const void* aKey) noexcept;
+		static bool isLegacyKey(const void* aKey, size_t aLen) noexcept { return aLen > 0 && *static_cast<const uint8_t*>(aKey) > KEY_FILE; }
+
+		void loadDirectories() throw(DbException);
+		void removeLegacyFile(const string& aPathLower) noexcept;
+
+		/* Remove the directories that don't have any files */
+		void removeEmptyDirectories(const unordered_map<uint32_t, string>& aDirectories, const unordered_set<uint32_t>& aUsedDirectories) noexcept;
+
 
 		friend class HashLoader;
 
@@ -261,11 +417,27 @@ private:
 		static bool loadFileInfo(const void* src, size_t len, HashedFile& aFile);
 		static void saveFileInfo(void *dest, const HashedFile& aTree);
 		static uint32_t getFileInfoSize(const HashedFile& aTree);
+
+		/* Commits the batches away from the timer thread and the threads filling them, destroyed first (after closeDb has flushed through it) */
+		DispatcherQueue writer { true };
 	};
 
 	friend class HashLoader;
+	friend class ParallelTreeHasher;
+
+	/** Threads for hashing the parts of large files in parallel */
+	vector<unique_ptr<DispatcherQueue>> hashWorkers;
+	atomic<long> workerPos;
+	void runHashWorker(DispatcherQueue::Callback&& aF) noexcept;
 
 	bool hashFile(const string& filePath, const string& pathLower, int64_t size);
+
+	/** Block devices by the id of the mounted file system (st_dev), protected by Hasher::hcs */
+	unordered_map<string, File::BlockDevice> blockDevices;
+
+	/** Stats the path without holding hcs, sysfs is only read for file systems that haven't been seen before */
+	File::BlockDevice getBlockDevice(const string& aPath) noexcept;
+	static int getMaxHashers(const File::BlockDevice& aDevice) noexcept;
 	bool aShutdown = false;
 
 	typedef vector<Hasher*> HasherList;
@@ -284,14 +456,18 @@ private:
 		~Optimizer();
 
 		void startMaintenance(bool verify);
+		void startIndexMigration();
 		bool isRunning() const noexcept { return running; }
 	private:
 		bool verify;
+		bool migrate = false;
 		atomic<bool> running;
 		virtual int run();
 	};
 
 	Optimizer optimizer;
+
+	void on(TimerManagerListener::Second, uint64_t aTick) noexcept;
 };
 
 } // namespace dcpp
@@ -183,6 +183,23 @@ void LevelDB::remove(void* aKey, size_t keyLen, DbSnapshot* /*aSnapshot*/ /*null
 	DBACTION(db->Delete(writeoptions, key));
 }
 
+void LevelDB::write(const ValueMap& aValues, bool aSync) throw(DbException) {
+	leveldb::WriteBatch wb;
+	for (const auto& v: aValues) {
+		if (v.second.empty()) {
+			wb.Delete(leveldb::Slice(v.first));
+		} else {
+			wb.Put(leveldb::Slice(v.first), leveldb::Slice(v.second));
+		}
+	}
+
+	totalWrites += aValues.size();
+
+	auto options = writeoptions;
+	options.sync = aSync;
+	DBACTION(db->Write(options, &wb));
+}
+
 int64_t LevelDB::getSizeOnDisk() throw(DbException) {
 	return File::getDirSize(getPath(), false);
 }
@@ -213,6 +230,10 @@ DbSnapshot* LevelDB::getSnapshot() {
 }
 
 void LevelDB::remove_if(std::function<bool(void* aKey, size_t key_len, void* aValue, size_t valueLen)> f, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException) {
+	remove_if(Util::emptyString, f, aSnapshot);
+}
+
+void LevelDB::remove_if(const string& aPrefix, std::function<bool(void* aKey, size_t key_len, void* aValue, size_t valueLen)> f, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException) {
 	leveldb::WriteBatch wb;
 	leveldb::ReadOptions options;
 	options.fill_cache = false;
@@ -222,7 +243,8 @@ void LevelDB::remove_if(std::function<bool(void* aKey, size_t key_len, void* aVa
 
 	{
 		auto it = unique_ptr<leveldb::Iterator>(db->NewIterator(options));
-		for (it->SeekToFirst(); it->Valid(); it->Next()) {
+		leveldb::Slice prefix(aPrefix);
+		for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
 			checkDbError(it->status());
 
 			if (f((void*)it->key().data(), it->key().size(), (void*)it->value().data(), it->value().size())) {
@@ -39,6 +39,7 @@ public:
 	void put(void* aKey, size_t keyLen, void* aValue, size_t valueLen, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
 	bool get(void* aKey, size_t keyLen, size_t /*initialValueLen*/, std::function<bool(void* aValue, size_t aValueLen)> loadF, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
 	void remove(void* aKey, size_t keyLen, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
+	void write(const ValueMap& aValues, bool aSync) throw(DbException);
 	bool hasKey(void* aKey, size_t keyLen, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
 
 	string getStats() throw(DbException);
@@ -47,6 +48,7 @@ public:
 	int64_t getSizeOnDisk() throw(DbException);
 
 	void remove_if(std::function<bool(void* aKey, size_t key_len, void* aValue, size_t valueLen)> f, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
+	void remove_if(const string& aPrefix, std::function<bool(void* aKey, size_t key_len, void* aValue, size_t valueLen)> f, DbSnapshot* aSnapshot /*nullptr*/) throw(DbException);
 	void compact();
 	void repair(StepFunction stepF, MessageFunction messageF) throw(DbException);
 	void open(StepFunction stepF, MessageFunction messageF) throw(DbException);
@@ -21,14 +21,17 @@
 
 #include "Streams.h"
 #include "MerkleTree.h"
+#include "CriticalSection.h"
+#include "DispatcherQueue.h"
+#include "atomic.h"
 
 namespace dcpp {
 
-template<class TreeType, bool managed>
-class MerkleCheckOutputStream : public OutputStream {
+/** Checks the consecutive data of a file against its tree */
+template<class TreeType>
+class MerkleChecker : boost::noncopyable {
 public:
-	MerkleCheckOutputStream(const TreeType& aTree, OutputStream* aStream, int64_t start) : real(aTree), cur(aTree.getBlockSize()), verified(0), bufPos(0) {
-		s.reset(aStream);
+	MerkleChecker(const TreeType& aTree, int64_t start) : real(aTree), cur(aTree.getBlockSize()), verified(0), bufPos(0) {
 		// Only start at block boundaries
 		dcassert(start % aTree.getBlockSize() == 0);
 		cur.setFileSize(start);
@@ -41,12 +44,14 @@ public:
 		cur.getLeaves().insert(cur.getLeaves().begin(), aTree.getLeaves().begin(), aTree.getLeaves().begin() + nBlocks);
 	}
 
-	~MerkleCheckOutputStream() { 
-		if(!managed) 
-			s.release(); 
+	/* Throws if a completed block doesn't match the tree */
+	void verify(const void* b, size_t len) {
+		commitBytes(b, len);
+		checkTrees();
 	}
 
-	size_t flush() {
+	/* Checks the remaining data, the whole tree is compared if all data has been received */
+	void finish() {
 		if (bufPos != 0)
 			cur.update(buf, bufPos);
 		bufPos = 0;
@@ -58,9 +63,20 @@ public:
 		} else {
 			checkTrees();
 		}
-		return s->flush();
 	}
 
+	/* Bytes from the beginning of the file that have passed the check */
+	int64_t verifiedBytes() const {
+		return min(real.getFileSize(), (int64_t)(cur.getBlockSize() * verified));
+	}
+private:
+	TreeType real;
+	TreeType cur;
+	size_t verified;
+
+	uint8_t buf[TreeType::BASE_BLOCK_SIZE];
+	size_t bufPos;
+
 	void commitBytes(const void* b, size_t len) {
 		uint8_t* xb = (uint8_t*)b;
 		size_t pos = 0;
@@ -91,14 +107,42 @@ public:
 		}
 	}
 
+	void checkTrees() {
+		while(cur.getLeaves().size() > verified) {
+			if(cur.getLeaves().size() > real.getLeaves().size() ||
+				!(cur.getLeaves()[verified] == real.getLeaves()[verified])) 
+			{
+				throw FileException(STRING(TTH_INCONSISTENCY));
+			}
+			verified++;
+		}
+	}
+};
+
+template<class TreeType, bool managed>
+class MerkleCheckOutputStream : public OutputStream {
+public:
+	MerkleCheckOutputStream(const TreeType& aTree, OutputStream* aStream, int64_t start) : checker(aTree, start) {
+		s.reset(aStream);
+	}
+
+	~MerkleCheckOutputStream() { 
+		if(!managed) 
+			s.release(); 
+	}
+
+	size_t flush() {
+		checker.finish();
+		return s->flush();
+	}
+
 	size_t write(const void* b, size_t len) {
-		commitBytes(b, len);
-		checkTrees();
+		checker.verify(b, len);
 		return s->write(b, len);
 	}
 
 	int64_t verifiedBytes() const {
-		return min(real.getFileSize(), (int64_t)(cur.getBlockSize() * cur.getLeaves().size()));
+		return checker.verifiedBytes();
 	}
 
 	OutputStream* releaseRootStream() { 
@@ -107,22 +151,229 @@ public:
 	}
 private:
 	unique_ptr<OutputStream> s;
-	TreeType real;
-	TreeType cur;
-	size_t verified;
+	MerkleChecker<TreeType> checker;
+};
 
-	uint8_t buf[TreeType::BASE_BLOCK_SIZE];
-	size_t bufPos;
+/**
+ * Writes the data to the underlying stream and checks it against the tree in a queue, so that
+ * the disk I/O and hashing won't hold the thread that is receiving the data.
+ *
+ * The data is passed to the queue in chunks that are written and checked in order. Writing never blocks: the writer
+ * should use waitRoom/waitAll to stop receiving data while the queue is behind. A failed write or check is
+ * reported by the next write or flush. Only the data before the failed block is counted as verified,
+ * like with MerkleCheckOutputStream. Without a tree the data is only written in the queue.
+ */
+template<class TreeType, bool managed>
+class AsyncMerkleCheckOutputStream : public OutputStream {
+public:
+	AsyncMerkleCheckOutputStream(const TreeType* aTree, OutputStream* aStream, int64_t start, DispatcherQueue& aQueue) : queue(aQueue), state(make_shared<State>(aTree, aStream, start)) {
+		s.reset(aStream);
+		chunk.reserve(CHUNK_SIZE);
+	}
 
-	void checkTrees() {
-		while(cur.getLeaves().size() > verified) {
-			if(cur.getLeaves().size() > real.getLeaves().size() ||
-				!(cur.getLeaves()[verified] == real.getLeaves()[verified])) 
+	~AsyncMerkleCheckOutputStream() { 
+		// the callback may refer to objects that are going away with the stream
+		state->setCallback(0, nullptr);
+		state->cancel();
+
+		if(!managed) 
+			s.release(); 
+	}
+
+	typedef std::function<void ()> Callback;
+
+	/**
+	 * Calls aF from the queue thread when there is room for more pending data.
+	 * @return False if the writing can continue right away, aF won't be called then
+	 */
+	bool waitRoom(Callback&& aF) {
+		return state->setCallback(MAX_PENDING, move(aF));
+	}
+
+	/**
+	 * Queues the buffered data and the finishing of the stream (flushing it and checking the last block),
+	 * aF is called from the queue thread after that. No data may be written after this.
+	 * @return False if everything has been finished already, aF won't be called then
+	 */
+	bool waitAll(Callback&& aF) {
+		submit();
+		if (!finishing) {
+			finishing = true;
+			state->pending++;
+			auto st = state;
+			queue.addTask([st] { st->finish(); });
+		}
+
+		return state->setCallback(0, move(aF));
+	}
+
+	/**
+	 * Returns right away if the stream has been finished with waitAll. Otherwise the download is being
+	 * aborted (or it's empty): the data that hasn't been written yet is dropped and the stream is finished
+	 * from the calling thread. The dropped data hasn't been verified so it will be received again.
+	 */
+	size_t flush() {
+		if (!state->finished) {
+			chunk.clear();
+
+			// nothing will access the stream or the checker from the queue after this
+			state->cancel();
+			if (!state->finished)
+				state->finishLocked();
+		}
+
+		checkFailed();
+		return 0;
+	}
+
+	size_t write(const void* b, size_t len) {
+		checkFailed();
+		dcassert(!finishing || len == 0);
+
+		chunk.insert(chunk.end(), (const uint8_t*)b, (const uint8_t*)b + len);
+		if (chunk.size() >= CHUNK_SIZE) {
+			submit();
+		}
+
+		return len;
+	}
+
+	int64_t verifiedBytes() const {
+		return state->verified;
+	}
+
+	OutputStream* releaseRootStream() { 
+		auto as = s.release();
+		return as->releaseRootStream();
+	}
+private:
+	enum {
+		CHUNK_SIZE = 256*1024,
+		MAX_PENDING = 32*CHUNK_SIZE
+	};
+
+	// shared with the queued tasks, which may still be run after the stream has been closed
+	struct State {
+		State(const TreeType* aTree, OutputStream* aStream, int64_t start) : checker(aTree ? new MerkleChecker<TreeType>(*aTree, start) : nullptr), out(aStream), 
+			verified(checker ? checker->verifiedBytes() : 0), pending(0), failed(false), finished(false), cancelled(false), callbackLimit(0) { }
+
+		bool setCallback(int64_t aLimit, Callback&& aF) {
+			Lock l(cs);
+			if (aF && pending <= aLimit)
+				return false;
+
+			callback = move(aF);
+			callbackLimit = aLimit;
+			return true;
+		}
+
+		void write(const ByteVector& aData) {
 			{
-				throw FileException(STRING(TTH_INCONSISTENCY));
+				Lock l(writeCs);
+				if (!cancelled && !failed) {
+					try {
+						out->write(&aData[0], aData.size());
+						if (checker) {
+							checker->verify(&aData[0], aData.size());
+							verified = checker->verifiedBytes();
+						}
+					} catch (const Exception& e) {
+						setError(e.getError());
+					}
+				}
 			}
-			verified++;
+
+			done(aData.size());
 		}
+
+		void finish() {
+			{
+				Lock l(writeCs);
+				if (!cancelled)
+					finishLocked();
+			}
+
+			done(1);
+		}
+
+		/* Must be called with writeCs held or after cancel */
+		void finishLocked() {
+			if (!failed) {
+				try {
+					if (checker) {
+						checker->finish();
+						verified = checker->verifiedBytes();
+					}
+					out->flush();
+				} catch (const Exception& e) {
+					setError(e.getError());
+				}
+			}
+
+			finished = true;
+		}
+
+		/* Waits for the running task, the rest of the queued data won't be written */
+		void cancel() {
+			Lock l(writeCs);
+			cancelled = true;
+		}
+
+		void setError(const string& aError) {
+			error = aError;
+			failed = true;
+		}
+
+		void done(int64_t aBytes) {
+			pending -= aBytes;
+
+			// called while locked so that the stream won't be destroyed meanwhile
+			Lock l(cs);
+			if (callback && pending <= callbackLimit) {
+				callback();
+				callback = nullptr;
+			}
+		}
+
+		unique_ptr<MerkleChecker<TreeType>> checker;
+		OutputStream* out;
+		atomic<int64_t> verified;
+		atomic<int64_t> pending;
+		atomic<bool> failed;
+		atomic<bool> finished;
+		string error;
+
+		// held while the stream is being accessed by a task
+		CriticalSection writeCs;
+		bool cancelled;
+
+		CriticalSection cs;
+		Callback callback;
+		int64_t callbackLimit;
+	};
+
+	unique_ptr<OutputStream> s;
+	DispatcherQueue& queue;
+	shared_ptr<State> state;
+	ByteVector chunk;
+	bool finishing = false;
+
+	void checkFailed() {
+		if (state->failed)
+			throw FileException(state->error);
+	}
+
+	void submit() {
+		if (chunk.empty())
+			return;
+
+		auto data = make_shared<ByteVector>();
+		data->reserve(CHUNK_SIZE);
+		data->swap(chunk);
+
+		state->pending += data->size();
+		auto st = state;
+		queue.addTask([st, data] { st->write(*data); });
 	}
 };
 
@@ -107,20 +107,42 @@ public:
 		
 		do {
 			size_t n = min(baseBlockSize, len-i);
-			Hasher h;
-			h.update(&zero, 1);
-			h.update(buf + i, n);
-			if((int64_t)baseBlockSize < blockSize) {
-				blocks.emplace_back(MerkleValue(h.finalize()), baseBlockSize);
-				reduceBlocks();
+			if(n == baseBlockSize) {
+				// hash the full base blocks in batches
+				uint8_t results[Hasher::MAX_LEAVES * BYTES];
+				size_t count = min((len - i) / baseBlockSize, Hasher::MAX_LEAVES);
+				Hasher::hashLeaves(buf + i, baseBlockSize, count, results);
+				for(size_t j = 0; j < count; ++j) {
+					addBaseBlock(results + j * BYTES);
+				}
+
+				n = count * baseBlockSize;
 			} else {
-				leaves.emplace_back(h.finalize());
+				Hasher h;
+				h.update(&zero, 1);
+				h.update(buf + i, n);
+				addBaseBlock(h.finalize());
 			}
 			i += n;
 		} while(i < len);
 		fileSize += len;
 	}
 
+	/**
+	 * Append the root of a subtree covering the next aSize bytes of data.
+	 * @param aSize Power of two between baseBlockSize and the block size, the current file size must be a multiple of it
+	 */
+	void addSubtree(const MerkleValue& aRoot, int64_t aSize) {
+		dcassert(aSize >= (int64_t)baseBlockSize && aSize <= blockSize && fileSize % aSize == 0);
+		if(aSize < blockSize) {
+			blocks.emplace_back(aRoot, aSize);
+			reduceBlocks();
+		} else {
+			leaves.push_back(aRoot);
+		}
+		fileSize += aSize;
+	}
+
 	uint8_t* finalize() {
 		// No updates yet, make sure we have at least one leaf for 0-length files...
 		if(leaves.empty() && blocks.empty()) {
@@ -205,6 +227,15 @@ private:
 		return MerkleValue(h.finalize());
 	}
 
+	void addBaseBlock(uint8_t* aHash) {
+		if((int64_t)baseBlockSize < blockSize) {
+			blocks.emplace_back(MerkleValue(aHash), baseBlockSize);
+			reduceBlocks();
+		} else {
+			leaves.emplace_back(aHash);
+		}
+	}
+
 	void reduceBlocks() {
 		while(blocks.size() > 1) {
 			MerkleBlock& a = blocks[blocks.size()-2];
@@ -95,7 +95,7 @@ public:
 #undef GETSET_FIELD
 	uint8_t getSlots() const;
 	void setBytesShared(const string& bs) { set("SS", bs); }
-	int64_t getBytesShared() const { return Util::toInt64(get("SS")); }
+	int64_t getBytesShared() const;
 	
 	void setStatus(const string& st) { set("ST", st); }
 	StatusFlags getStatus() const { return static_cast<StatusFlags>(Util::toInt(get("ST"))); }
@@ -160,10 +160,51 @@ private:
 	UserPtr user;
 	uint32_t sid;
 
-	typedef map<short, string> InfMap;
-	InfMap info;
+	// INF fields that are needed all the time (searches, connecting, user lists)
+	enum Field {
+		FIELD_NI,
+		FIELD_I4,
+		FIELD_I6,
+		FIELD_U4,
+		FIELD_U6,
+		FIELD_SS,
+		FIELD_SL,
+		FIELD_SU,
+		FIELD_LAST
+	};
+
+	// the SU features that are checked for every search and connection
+	enum Feature {
+		FEATURE_TCP4,
+		FEATURE_TCP6,
+		FEATURE_UDP4,
+		FEATURE_UDP6,
+		FEATURE_NAT0,
+		FEATURE_ADCS,
+		FEATURE_ASCH,
+		FEATURE_CCPM,
+		FEATURE_SUD1,
+		FEATURE_SEGA,
+		FEATURE_LAST
+	};
+
+	static int getField(const char* name) noexcept;
+	static int getFeatureBit(const char* aName, size_t aLen) noexcept;
+
+	void setField(int aField, const string& val) noexcept;
+	bool hasFeature(int aBit) const noexcept;
+
+	string fields[FIELD_LAST];
+	int64_t bytesShared = 0;
+	uint8_t slots = 0;
+	uint32_t features = 0; // Feature bits
+
+	// the other fields
+	typedef vector<pair<uint16_t, string>> InfList;
+	InfList info;
 
-	static SharedMutex cs;
+	// held only for copying the values
+	mutable FastCriticalSection cs = BOOST_DETAIL_SPINLOCK_INIT;
 };
 
 class OnlineUser :  public FastAlloc<OnlineUser>, public intrusive_ptr_base<OnlineUser>, public UserInfoBase, private boost::noncopyable {
@@ -1699,7 +1699,8 @@ void QueueManager::putDownload(Download* aDownload, bool finished, bool noAccess
 
 			if(d->getType() == Transfer::TYPE_FILE) {
 				// mark partially downloaded chunk, but align it to block size
-				int64_t downloaded = d->getPos();
+				// (the data may have been written before it was verified)
+				int64_t downloaded = d->getVerifiedPos();
 				downloaded -= downloaded % d->getTigerTree().getBlockSize();
 
 				if(downloaded > 0) {
@@ -68,6 +68,7 @@ typedef scoped_handle<EVP_PKEY, EVP_PKEY_free> EVP_PKEY;
 typedef scoped_handle<RSA, RSA_free> RSA;
 typedef scoped_handle<SSL, SSL_free> SSL;
 typedef scoped_handle<SSL_CTX, SSL_CTX_free> SSL_CTX;
+typedef scoped_handle<SSL_SESSION, SSL_SESSION_free> SSL_SESSION;
 typedef scoped_handle<X509, X509_free> X509;
 typedef scoped_handle<X509_NAME, X509_NAME_free> X509_NAME;
 
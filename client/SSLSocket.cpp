@@ -26,10 +26,18 @@
 
 #include <openssl/err.h>
 
+// kernel TLS offload requires OpenSSL 3.0 built with KTLS support (the kernel module must be loaded as well)
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define DCPP_KTLS
+#endif
+
 namespace dcpp {
 
-SSLSocket::SSLSocket(CryptoManager::SSLContext context, bool allowUntrusted, const string& expKP) : SSLSocket(context) {
+SSLSocket::SSLSocket(CryptoManager::SSLContext context, bool allowUntrusted, const string& expKP, const string& aPeerId) : SSLSocket(context) {
 	verifyData.reset(new CryptoManager::SSLVerifyData(allowUntrusted, expKP));
+	if(!aPeerId.empty() && context == CryptoManager::SSL_CLIENT) {
+		sessionKey = aPeerId + "/" + expKP;
+	}
 }
 SSLSocket::SSLSocket(CryptoManager::SSLContext context) : Socket(TYPE_TCP), ctx(NULL), ssl(NULL), verifyData(nullptr) {
 	ctx = CryptoManager::getInstance()->getSSLContext(context);
@@ -46,15 +54,7 @@ bool SSLSocket::waitConnected(uint32_t millis) {
 		if(!Socket::waitConnected(millis)) {
 			return false;
 		}
-		ssl.reset(SSL_new(ctx));
-		if(!ssl)
-			checkSSL(-1);
-
-		if(!verifyData) {
-			SSL_set_verify(ssl, SSL_VERIFY_NONE, NULL);
-		} else SSL_set_ex_data(ssl, CryptoManager::idxVerifyData, verifyData.get());
-
-		checkSSL(SSL_set_fd(ssl, getSock()));
+		initSSL();
 	}
 
 	if(SSL_is_init_finished(ssl)) {
@@ -62,9 +62,10 @@ bool SSLSocket::waitConnected(uint32_t millis) {
 	}
 
 	while(true) {
-		int ret = ssl->server?SSL_accept(ssl):SSL_connect(ssl);
+		int ret = SSL_is_server(ssl)?SSL_accept(ssl):SSL_connect(ssl);
 		if(ret == 1) {
-			dcdebug("Connected to SSL server using %s as %s\n", SSL_get_cipher(ssl), ssl->server?"server":"client");
+			CryptoManager::getInstance()->countHandshake(SSL_session_reused(ssl) != 0);
+			dcdebug("Connected to SSL server using %s as %s\n", SSL_get_cipher(ssl), SSL_is_server(ssl)?"server":"client");
 			return true;
 		}
 		if(!waitWant(ret, millis)) {
@@ -86,15 +87,7 @@ bool SSLSocket::waitAccepted(uint32_t millis) {
 		if(!Socket::waitAccepted(millis)) {
 			return false;
 		}
-		ssl.reset(SSL_new(ctx));
-		if(!ssl)
-			checkSSL(-1);
-
-		if(!verifyData) {
-			SSL_set_verify(ssl, SSL_VERIFY_NONE, NULL);
-		} else SSL_set_ex_data(ssl, CryptoManager::idxVerifyData, verifyData.get());
-
-		checkSSL(SSL_set_fd(ssl, getSock()));
+		initSSL();
 	}
 
 	if(SSL_is_init_finished(ssl)) {
@@ -104,6 +97,7 @@ bool SSLSocket::waitAccepted(uint32_t millis) {
 	while(true) {
 		int ret = SSL_accept(ssl);
 		if(ret == 1) {
+			CryptoManager::getInstance()->countHandshake(SSL_session_reused(ssl) != 0);
 			dcdebug("Connected to SSL client using %s\n", SSL_get_cipher(ssl));
 			return true;
 		}
@@ -113,6 +107,29 @@ bool SSLSocket::waitAccepted(uint32_t millis) {
 	}
 }
 
+void SSLSocket::initSSL() {
+	ssl.reset(SSL_new(ctx));
+	if(!ssl)
+		checkSSL(-1);
+
+	if(!verifyData) {
+		SSL_set_verify(ssl, SSL_VERIFY_NONE, NULL);
+	} else SSL_set_ex_data(ssl, CryptoManager::idxVerifyData, verifyData.get());
+
+	if(!sessionKey.empty()) {
+		// new sessions are stored through CryptoManager::new_session_cb
+		SSL_set_ex_data(ssl, CryptoManager::idxSessionKey, &sessionKey);
+		CryptoManager::getInstance()->resumeSession(ssl, sessionKey);
+	}
+
+#ifdef DCPP_KTLS
+	// OpenSSL hands the record encryption over to the kernel after the handshake if the cipher is supported
+	SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+	checkSSL(SSL_set_fd(ssl, getSock()));
+}
+
 bool SSLSocket::waitWant(int ret, uint32_t millis) {
 	int err = SSL_get_error(ssl, ret);
 	switch(err) {
@@ -153,6 +170,25 @@ int SSLSocket::write(const void* aBuffer, int aLen) {
 	return ret;
 }
 
+int SSLSocket::sendFile(int aFd, int64_t aPos, int aLen) {
+#ifdef DCPP_KTLS
+	if(!ssl || !SSL_is_init_finished(ssl) || !BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+		return 0;
+	}
+
+	auto ret = SSL_sendfile(ssl, aFd, static_cast<off_t>(aPos), aLen, 0);
+	if(ret > 0) {
+		stats.totalUp += ret;
+		return static_cast<int>(ret);
+	}
+
+	return checkSSL(static_cast<int>(ret));
+#else
+	(void)aFd; (void)aPos; (void)aLen;
+	return 0;
+#endif
+}
+
 int SSLSocket::checkSSL(int ret) {
 	if(!ssl) {
 		return -1;
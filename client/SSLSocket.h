@@ -45,7 +45,8 @@ public:
 
 class SSLSocket : public Socket {
 public:
-	SSLSocket(CryptoManager::SSLContext context, bool allowUntrusted, const string& expKP);
+	/** aPeerId is used for resuming the previous session with the same peer (client context only) */
+	SSLSocket(CryptoManager::SSLContext context, bool allowUntrusted, const string& expKP, const string& aPeerId = Util::emptyString);
 	/** Creates an SSL socket without any verification */
 	SSLSocket(CryptoManager::SSLContext context);
 
@@ -55,6 +56,7 @@ public:
 	virtual void connect(const string& aIp, const string& aPort);
 	virtual int read(void* aBuffer, int aBufLen);
 	virtual int write(const void* aBuffer, int aLen);
+	virtual int sendFile(int aFd, int64_t aPos, int aLen);
 	virtual std::pair<bool, bool> wait(uint32_t millis, bool checkRead, bool checkWrite);
 	virtual void shutdown() noexcept;
 	virtual void close() noexcept;
@@ -73,8 +75,12 @@ private:
 	SSL_CTX* ctx;
 	ssl::SSL ssl;
 
+	// peer and keyprint for the session cache
+	string sessionKey;
+
 	unique_ptr<CryptoManager::SSLVerifyData> verifyData;	// application data used by CryptoManager::verify_callback(...)
 
+	void initSSL();
 	int checkSSL(int ret);
 	bool waitWant(int ret, uint32_t millis);
 };
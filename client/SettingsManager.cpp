@@ -171,6 +171,7 @@ const string SettingsManager::settingTags[] =
 	"QueueSplitterPosition", "FullListDLLimit", "ASDelayHours", "LastListProfile", "MaxHashingThreads", "HashersPerVolume", "SubtractlistSkip", "BloomMode", "FavUsersSplitterPos", "AwayIdleTime",
 	"SearchHistoryMax", "ExcludeHistoryMax", "DirectoryHistoryMax", "MinDupeCheckSize", "DbCacheSize", "DLAutoDisconnectMode", "RemovedTrees", "RemovedFiles", "MultithreadedRefresh", "MonitoringMode",
 	"MonitoringDelay", "DelayCountMode", "MaxRunningBundles", "DefaultShareProfile", "UpdateChannel", "ColorStatusFinished", "ColorStatusShared", "ProgressLighten",
+	"RefreshThreadsPerVolume", "TreeCacheSize",
 	"ConfigBuildNumber",
 	"SENTRY",
 
@@ -222,6 +223,7 @@ const string SettingsManager::settingTags[] =
 	"FilterFLShared", "FilterFLQueued", "FilterFLInversed", "FilterFLTop", "FilterFLPartialDupes", "FilterFLResetChange", "FilterSearchShared", "FilterSearchQueued", "FilterSearchInversed", "FilterSearchTop", "FilterSearchPartialDupes", "FilterSearchResetChange",
 	"SearchAschOnlyMan", "IgnoreIndirectSR", "UseUploadBundles", "CloseMinimize", "LogIgnored", "UsersFilterIgnore", "NfoExternal", "SingleClickTray", "QueueShowFinished", "RemoveFinishedBundles", "LogCRCOk",
 	"FilterQueueInverse", "FilterQueueTop", "FilterQueueReset", "AlwaysCCPM",
+	"SyncHashDbWrites",
 	"SENTRY",
 	// Int64
 	"TotalUpload", "TotalDownload",
@@ -795,7 +797,7 @@ SettingsManager::SettingsManager()
 	//set depending on the cpu count
 	setDefault(MAX_HASHING_THREADS, std::thread::hardware_concurrency());
 
-	setDefault(HASHERS_PER_VOLUME, 1);
+	setDefault(HASHERS_PER_VOLUME, 0);
 
 	setDefault(MIN_DUPE_CHECK_SIZE, 512);
 	setDefault(WARN_ELEVATED, true);
@@ -808,11 +810,13 @@ SettingsManager::SettingsManager()
 	setDefault(ACCEPT_FAILOVERS, true);
 
 	setDefault(DB_CACHE_SIZE, 8);
+	setDefault(TREE_CACHE_SIZE, 16);
 	setDefault(CUR_REMOVED_TREES, 0);
 	setDefault(CUR_REMOVED_FILES, 0);
 
 	setDefault(DL_AUTO_DISCONNECT_MODE, QUEUE_FILE);
 	setDefault(REFRESH_THREADING, MULTITHREAD_MANUAL);
+	setDefault(REFRESH_THREADS_PER_VOLUME, 0);
 
 	setDefault(REMOVE_EXPIRED_AS, false);
 
@@ -820,12 +824,7 @@ SettingsManager::SettingsManager()
 	setDefault(SHARE_FOLLOW_SYMLINKS, true);
 	setDefault(SCAN_MONITORED_FOLDERS, true);
 
-#ifdef _WIN32
 	setDefault(MONITORING_MODE, MONITORING_ALL);
-#else
-	// TODO: implement monitoring
-	setDefault(MONITORING_MODE, MONITORING_DISABLED);
-#endif
 
 	setDefault(FINISHED_NO_HASH, false);
 	setDefault(MONITORING_DELAY, 30);
@@ -871,6 +870,7 @@ SettingsManager::SettingsManager()
 	setDefault(REMOVE_FINISHED_BUNDLES, false);
 	setDefault(LOG_CRC_OK, false);
 	setDefault(ALWAYS_CCPM, false);
+	setDefault(SYNC_HASH_DB_WRITES, true);
 
 	// not in GUI
 	setDefault(IGNORE_INDIRECT_SR, false);
@@ -46,6 +46,11 @@
 
 #ifdef _WIN32
 # include <ShlObj.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
 #endif
 
 namespace dcpp {
@@ -60,6 +65,52 @@ using boost::range::remove_if;
 
 #define SHARE_CACHE_VERSION "3"
 
+/*
+ * Binary share cache: the header is followed by the records of the root directory and its files
+ * and subdirectories in preorder (each directory record is followed by the records of its files and
+ * the subdirectories). The names are stored in the string table at the end of the file.
+ * The TTHs aren't stored as the loader takes the file information from the hash database.
+ */
+#define SHARE_CACHE_BIN_VERSION 2
+static const char SHARE_CACHE_MAGIC[8] = { 'A', 'D', 'C', 'S', 'H', 'A', 'R', 'E' };
+
+struct ShareCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t directories;
+	uint64_t files;
+	uint64_t stringsOffset;
+	uint64_t stringsSize;
+};
+
+struct ShareCacheDirectory {
+	uint32_t nameOffset;
+	uint32_t nameLen;
+	uint32_t lastWrite;
+	uint32_t directories;
+	uint32_t files;
+};
+
+struct ShareCacheFile {
+	int64_t size;
+	uint32_t nameOffset;
+	uint32_t nameLen;
+	uint32_t lastWrite;
+};
+
+// deeper directory structures are treated as corrupted when loading the binary cache
+#define MAX_SHARE_CACHE_DEPTH 1024
+
+// default number of scanning tasks per device for SSDs (spinning disks use a single task)
+#define SSD_REFRESH_TASKS 4
+
+// subdirectories below this level are always scanned by the parent task
+#define MAX_SUBTREE_TASK_LEVEL 3
+
+// the recursive lists of large directories are rarely requested multiple times
+#define PARTIAL_LIST_CACHE_SIZE (32*1024*1024)
+#define PARTIAL_LIST_CACHE_MAX_ITEM (1024*1024)
+
 #ifdef ATOMIC_FLAG_INIT
 atomic_flag ShareManager::refreshing = ATOMIC_FLAG_INIT;
 #else
@@ -522,7 +573,7 @@ void ShareManager::on(DirectoryMonitorListener::FileModified, const string& aPat
 
 void ShareManager::Directory::getRenameInfoList(const string& aPath, RenameList& aRename) noexcept {
 	for (const auto& f: files) {
-		aRename.emplace_back(aPath + f->name.getNormal(), HashedFile(f->getTTH(), f->getLastWrite(), f->getSize()));
+		aRename.emplace_back(aPath + f->getName(*this), HashedFile(f->getTTH(), f->getLastWrite(), f->getSize()));
 	}
 
 	string path = aPath + realName.getNormal() + PATH_SEPARATOR;
@@ -689,7 +740,6 @@ bool ShareManager::handleDeletedFile(const string& aPath, bool isDirectory, Prof
 	bool deleted = false;
 	auto parent = findDirectory(isDirectory ? Util::getParentDir(aPath) : Util::getFilePath(aPath), false, false, false);
 	if (parent) {
-		parent->copyRootProfiles(dirtyProfiles_, true);
 		if (isDirectory) {
 			auto dirNameLower = Text::toLower(Util::getLastDir(aPath));
 			auto p = parent->directories.find(dirNameLower);
@@ -708,6 +758,11 @@ bool ShareManager::handleDeletedFile(const string& aPath, bool isDirectory, Prof
 			}
 		}
 
+		// the revision of the file lists would be updated for nothing otherwise
+		if (!deleted)
+			return false;
+
+		parent->copyRootProfiles(dirtyProfiles_, true);
 		parent->updateModifyDate();
 		if (SETTING(SKIP_EMPTY_DIRS_SHARE) && parent->directories.empty() && parent->files.empty() && parent->getParent()) {
 			//remove the parent
@@ -734,7 +789,7 @@ void ShareManager::abortRefresh() noexcept {
 
 void ShareManager::shutdown(function<void(float)> progressF) noexcept {
 	monitor.removeListener(this);
-	saveXmlList(progressF);
+	saveCache(progressF);
 
 	try {
 		RLock l (cs);
@@ -751,6 +806,8 @@ void ShareManager::shutdown(function<void(float)> progressF) noexcept {
 
 void ShareManager::setProfilesDirty(ProfileTokenSet aProfiles, bool forceXmlRefresh /*false*/) noexcept {
 	if (!aProfiles.empty()) {
+		partialListCache.remove(aProfiles);
+
 		RLock l(cs);
 		for(const auto aProfile: aProfiles) {
 			auto i = find(shareProfiles.begin(), shareProfiles.end(), aProfile);
@@ -765,6 +822,7 @@ void ShareManager::setProfilesDirty(ProfileTokenSet aProfiles, bool forceXmlRefr
 }
 
 ShareManager::Directory::Directory(DualString&& aRealName, const ShareManager::Directory::Ptr& aParent, uint64_t aLastWrite, ProfileDirectory::Ptr aProfileDir) :
+	files(aParent ? aParent->files.getPoolPtr() : FilePool::Ptr(new FilePool())),
 	size(0),
 	parent(aParent.get()),
 	profileDir(aProfileDir),
@@ -774,7 +832,7 @@ ShareManager::Directory::Directory(DualString&& aRealName, const ShareManager::D
 }
 
 ShareManager::Directory::~Directory() { 
-	for_each(files, DeleteFunction());
+
 }
 
 void ShareManager::Directory::updateModifyDate() {
@@ -843,7 +901,7 @@ StringList ShareManager::getRealPaths(const TTHValue& root) const noexcept {
 	RLock l(cs);
 	const auto i = tthIndex.equal_range(const_cast<TTHValue*>(&root)); 
 	for (auto f = i.first; f != i.second; ++f) {
-		ret.push_back((*f).second->getRealPath());
+		ret.push_back(f->second.file->getRealPath(*f->second.directory));
 	}
 
 	const auto k = tempShares.find(root);
@@ -889,14 +947,59 @@ bool ShareManager::Directory::hasProfile(ProfileTokenSet& aProfiles) const noexc
 void ShareManager::Directory::copyRootProfiles(ProfileTokenSet& aProfiles, bool setCacheDirty) const noexcept {
 	if (profileDir) {
 		boost::copy(profileDir->getRootProfiles() | map_keys, inserter(aProfiles, aProfiles.begin()));
-		if (setCacheDirty)
+		if (setCacheDirty) {
 			profileDir->setCacheDirty(true);
+			profileDir->updateRevision();
+		}
 	}
 
 	if (parent)
 		parent->copyRootProfiles(aProfiles, setCacheDirty);
 }
 
+void ShareManager::Directory::copyChangedProfiles(const Directory* aOld, bool aParentsUpdated, ProfileTokenSet& aProfiles) const noexcept {
+	bool changed = !aOld || !hasSameContent(*aOld);
+	if (changed) {
+		if (!aParentsUpdated) {
+			copyRootProfiles(aProfiles, true);
+		} else if (profileDir) {
+			boost::copy(profileDir->getRootProfiles() | map_keys, inserter(aProfiles, aProfiles.begin()));
+			profileDir->setCacheDirty(true);
+			profileDir->updateRevision();
+		}
+	}
+
+	for (const auto& d: directories) {
+		const Directory* old = nullptr;
+		if (aOld) {
+			auto p = aOld->directories.find(d->realName.getLower());
+			if (p != aOld->directories.end())
+				old = p->get();
+		}
+
+		d->copyChangedProfiles(old, changed, aProfiles);
+	}
+}
+
+bool ShareManager::Directory::hasSameContent(const Directory& aOld) const noexcept {
+	if (lastWrite != aOld.lastWrite || realName.getNormal() != aOld.realName.getNormal() || files.size() != aOld.files.size() || directories.size() != aOld.directories.size())
+		return false;
+
+	// both lists are sorted by the name
+	for (size_t i = 0; i < files.size(); ++i) {
+		const auto f = files[i], old = aOld.files[i];
+		if (f->getSize() != old->getSize() || f->getLastWrite() != old->getLastWrite() || f->getTTH() != old->getTTH() || f->getName(*this) != old->getName(aOld))
+			return false;
+	}
+
+	for (size_t i = 0; i < directories.size(); ++i) {
+		if (directories[i]->realName.getLower() != aOld.directories[i]->realName.getLower())
+			return false;
+	}
+
+	return true;
+}
+
 bool ShareManager::ProfileDirectory::hasRootProfile(const ProfileTokenSet& aProfiles) const noexcept {
 	for(const auto ap: aProfiles) {
 		if (rootProfiles.find(ap) != rootProfiles.end())
@@ -939,14 +1042,16 @@ bool ShareManager::ProfileDirectory::isExcluded(ProfileToken aProfile) const noe
 	return excludedProfiles.find(aProfile) != excludedProfiles.end();
 }
 
-ShareManager::ProfileDirectory::ProfileDirectory(const string& aRootPath, const string& aVname, ProfileToken aProfile, bool incoming /*false*/) : path(aRootPath), cacheDirty(false) { 
+atomic<uint64_t> ShareManager::ProfileDirectory::nextRevision(1);
+
+ShareManager::ProfileDirectory::ProfileDirectory(const string& aRootPath, const string& aVname, ProfileToken aProfile, bool incoming /*false*/) : path(aRootPath), cacheDirty(false), revision(nextRevision++) { 
 	rootProfiles.emplace(aProfile, aVname);
 	setFlag(FLAG_ROOT);
 	if (incoming)
 		setFlag(FLAG_INCOMING);
 }
 
-ShareManager::ProfileDirectory::ProfileDirectory(const string& aRootPath, ProfileToken aProfile) : path(aRootPath), cacheDirty(false) {
+ShareManager::ProfileDirectory::ProfileDirectory(const string& aRootPath, ProfileToken aProfile) : path(aRootPath), cacheDirty(false), revision(nextRevision++) {
 	excludedProfiles.insert(aProfile);
 	setFlag(FLAG_EXCLUDE_PROFILE);
 }
@@ -955,6 +1060,7 @@ void ShareManager::ProfileDirectory::addRootProfile(const string& aName, Profile
 	rootProfiles.erase(aProfile);
 	rootProfiles.emplace(aProfile, aName);
 	setFlag(FLAG_ROOT);
+	updateRevision();
 }
 
 void ShareManager::ProfileDirectory::addExclude(ProfileToken aProfile) noexcept {
@@ -962,6 +1068,10 @@ void ShareManager::ProfileDirectory::addExclude(ProfileToken aProfile) noexcept
 	excludedProfiles.insert(aProfile);
 }
 
+void ShareManager::ProfileDirectory::updateRevision() noexcept {
+	revision = nextRevision++;
+}
+
 bool ShareManager::ProfileDirectory::removeRootProfile(ProfileToken aProfile) noexcept {
 	rootProfiles.erase(aProfile);
 	return rootProfiles.empty();
@@ -985,7 +1095,7 @@ string ShareManager::toVirtual(const TTHValue& tth, ProfileToken aProfile) const
 
 	auto i = tthIndex.find(const_cast<TTHValue*>(&tth)); 
 	if(i != tthIndex.end()) 
-		return i->second->getADCPath(aProfile);
+		return i->second.file->getADCPath(*i->second.directory, aProfile);
 
 	//nothing found throw;
 	throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
@@ -1033,9 +1143,9 @@ void ShareManager::toRealWithSize(const string& virtualFile, const ProfileTokenS
 			for(auto f = flst.first; f != flst.second; ++f) {
 				noAccess_ = false; //we may throw if the file doesn't exist on the disk so always reset this to prevent invalid access denied messages
 				auto profiles = aProfiles;
-				if (f->second->getParent()->hasProfile(profiles)) {
-					path_ = f->second->getRealPath();
-					size_ = f->second->getSize();
+				if (f->second.directory->hasProfile(profiles)) {
+					path_ = f->second.file->getRealPath(*f->second.directory);
+					size_ = f->second.file->getSize();
 					return;
 				} else {
 					noAccess_ = true;
@@ -1064,7 +1174,7 @@ void ShareManager::toRealWithSize(const string& virtualFile, const ProfileTokenS
 		for(const auto& d: dirs) {
 			auto it = d->files.find(fileName);
 			if(it != d->files.end()) {
-				path_ = (*it)->getRealPath();
+				path_ = (*it)->getRealPath(*d);
 				size_ = (*it)->getSize();
 				return;
 			}
@@ -1086,21 +1196,25 @@ TTHValue ShareManager::getListTTH(const string& virtualFile, ProfileToken aProfi
 }
 
 MemoryInputStream* ShareManager::getTree(const string& virtualFile, ProfileToken aProfile) const noexcept {
-	TigerTree tree;
+	TTHValue tth;
 	if(virtualFile.compare(0, 4, "TTH/") == 0) {
-		if(!HashManager::getInstance()->getTree(TTHValue(virtualFile.substr(4)), tree))
-			return nullptr;
+		tth = TTHValue(virtualFile.substr(4));
 	} else {
 		try {
-			TTHValue tth = getListTTH(virtualFile, aProfile);
-			HashManager::getInstance()->getTree(tth, tree);
+			tth = getListTTH(virtualFile, aProfile);
 		} catch(const Exception&) {
 			return nullptr;
 		}
 	}
 
-	ByteVector buf = tree.getLeafData();
-	return new MemoryInputStream(&buf[0], buf.size());
+	auto tree = HashManager::getInstance()->getTree(tth);
+	if (!tree)
+		return nullptr;
+
+	// upload the leaves directly from the shared tree
+	static_assert(sizeof(TTHValue) == TTHValue::BYTES, "The leaves must be stored contiguously");
+	const auto& leaves = tree->getLeaves();
+	return new MemoryInputStream(leaves.front().data, leaves.size() * TTHValue::BYTES, tree);
 }
 
 AdcCommand ShareManager::getFileInfo(const string& aFile, ProfileToken aProfile) throw(ShareException) {
@@ -1128,11 +1242,11 @@ AdcCommand ShareManager::getFileInfo(const string& aFile, ProfileToken aProfile)
 	RLock l(cs);
 	auto i = tthIndex.find(const_cast<TTHValue*>(&val)); 
 	if(i != tthIndex.end()) {
-		const Directory::File* f = i->second;
+		const auto& f = i->second;
 		AdcCommand cmd(AdcCommand::CMD_RES);
-		cmd.addParam("FN", f->getADCPath(aProfile));
-		cmd.addParam("SI", Util::toString(f->getSize()));
-		cmd.addParam("TR", f->getTTH().toBase32());
+		cmd.addParam("FN", f.file->getADCPath(*f.directory, aProfile));
+		cmd.addParam("SI", Util::toString(f.file->getSize()));
+		cmd.addParam("TR", f.file->getTTH().toBase32());
 		return cmd;
 	}
 
@@ -1198,7 +1312,7 @@ void ShareManager::getRealPaths(const string& aPath, StringList& ret, ProfileTok
 		for(const auto& d: dirs) {
 			auto it = d->files.find(fileName);
 			if(it != d->files.end()) {
-				ret.push_back((*it)->getRealPath());
+				ret.push_back((*it)->getRealPath(*d));
 				return;
 			}
 		}
@@ -1222,6 +1336,17 @@ bool ShareManager::isRealPathShared(const string& aPath) noexcept {
 	return false;
 }
 
+bool ShareManager::getRealDirFiles(const string& aPath, StringSet& filesLower_) noexcept {
+	RLock l (cs);
+	auto d = findDirectory(aPath, false, false, true);
+	if (!d)
+		return false;
+
+	for (const auto& f: d->files)
+		filesLower_.insert(f->getNameLower(*d));
+	return true;
+}
+
 string ShareManager::realToVirtual(const string& aPath, ProfileToken aProfile) noexcept{
 	RLock l(cs);
 	auto d = findDirectory(Util::getFilePath(aPath), false, false, true);
@@ -1366,17 +1491,76 @@ static const string DATE = "Date";
 static const string SHARE = "Share";
 static const string SVERSION = "Version";
 
-struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, public ShareManager::RefreshInfo {
-	ShareLoader(const string& aPath, const ShareManager::Directory::Ptr& aOldRoot, ShareManager::ShareBloom* aBloom) : 
+// the loaders don't fill the bloom because it isn't thread safe
+struct ShareManager::CacheLoader : public ShareManager::RefreshInfo {
+	CacheLoader(const string& aPath, const ShareManager::Directory::Ptr& aOldRoot, const string& aCachePath) : 
 		ShareManager::RefreshInfo(aPath, aOldRoot, 0),
-		ThreadedCallBack(aOldRoot->getProfileDir()->getCacheXmlPath()),
+		cachePath(aCachePath),
 		curDirPath(aOldRoot->getProfileDir()->getPath()),
-		curDirPathLower(Text::toLower(aOldRoot->getProfileDir()->getPath())),
-		bloom(aBloom)
+		curDirPathLower(Text::toLower(aOldRoot->getProfileDir()->getPath()))
+	{ }
+
+	virtual ~CacheLoader() { }
+
+	virtual void load() = 0;
+
+	// the cache needs to be saved in the current format
+	virtual bool isLegacy() const noexcept { return false; }
+
+	const string cachePath;
+protected:
+	ShareManager::Directory::Ptr enterDirectory(const ShareManager::Directory::Ptr& aParent, const string& aName, uint64_t aLastWrite) {
+		curDirPath += aName + PATH_SEPARATOR;
+
+		ShareManager::ProfileDirectory::Ptr pd = nullptr;
+		if (!subProfiles.empty()) {
+			auto i = subProfiles.find(curDirPath);
+			if(i != subProfiles.end()) {
+				pd = i->second;
+			}
+		}
+
+		auto dir = ShareManager::Directory::create(aName, aParent, aLastWrite, pd);
+		curDirPathLower += dir->realName.getLower() + PATH_SEPARATOR;
+		if (pd && pd->isSet(ShareManager::ProfileDirectory::FLAG_ROOT)) {
+			rootPathsNew[curDirPathLower] = dir;
+		}
+
+		dirNameMapNew.emplace(const_cast<string*>(&dir->realName.getLower()), dir);
+		return dir;
+	}
+
+	void leaveDirectory() noexcept {
+		curDirPath = Util::getParentDir(curDirPath);
+		curDirPathLower = Util::getParentDir(curDirPathLower);
+	}
+
+	void addFile(const ShareManager::Directory::Ptr& aDir, DualString&& aName, const HashedFile& aFileInfo) {
+		auto pos = aDir->files.add(aName, aFileInfo);
+		if (!pos.second) {
+			return;
+		}
+
+		ShareManager::updateIndices(*aDir, *pos.first, addedSize, tthIndexNew);
+	}
+
+	string curDirPath;
+	string curDirPathLower;
+};
+
+struct ShareManager::ShareLoader : public ShareManager::CacheLoader, public SimpleXMLReader::CallBack {
+	ShareLoader(const string& aPath, const ShareManager::Directory::Ptr& aOldRoot) : 
+		ShareManager::CacheLoader(aPath, aOldRoot, aOldRoot->getProfileDir()->getCacheXmlPath())
 	{ 
 		cur = root;
 	}
 
+	void load() {
+		File f(cachePath, File::READ, File::OPEN, File::BUFFER_SEQUENTIAL, false);
+		SimpleXMLReader(this).parse(f);
+	}
+
+	bool isLegacy() const noexcept { return true; }
 
 	void startTag(const string& aName, StringPairList& attribs, bool simple) {
 		if(compare(aName, SDIRECTORY) == 0) {
@@ -1384,29 +1568,13 @@ struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, pub
 			const string& date = getAttrib(attribs, DATE, 1);
 
 			if(!name.empty()) {
-				curDirPath += name + PATH_SEPARATOR;
-
-				ShareManager::ProfileDirectory::Ptr pd = nullptr;
-				if (!subProfiles.empty()) {
-					auto i = subProfiles.find(curDirPath);
-					if(i != subProfiles.end()) {
-						pd = i->second;
-					}
-				}
-
-				cur = ShareManager::Directory::create(name, cur, Util::toUInt32(date), pd);
-				curDirPathLower += cur->realName.getLower() + PATH_SEPARATOR;
-				if (pd && pd->isSet(ShareManager::ProfileDirectory::FLAG_ROOT)) {
-					rootPathsNew[curDirPathLower] = cur;
-				}
-
-				cur->addBloom(*bloom);
-				dirNameMapNew.emplace(const_cast<string*>(&cur->realName.getLower()), cur);
+				cur = enterDirectory(cur, name, Util::toUInt32(date));
 			}
 
 			if(simple) {
 				if(cur) {
 					cur = cur->getParent();
+					leaveDirectory();
 				}
 			}
 		} else if (cur && compare(aName, SFILE) == 0) {
@@ -1420,8 +1588,7 @@ struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, pub
 				DualString name(fname);
 				HashedFile fi;
 				HashManager::getInstance()->getFileInfo(curDirPathLower + name.getLower(), curDirPath + fname, fi);
-				auto pos = cur->files.insert_sorted(new ShareManager::Directory::File(move(name), cur, fi));
-				ShareManager::updateIndices(*cur, *pos.first, *bloom, addedSize, tthIndexNew);
+				addFile(cur, move(name), fi);
 			}catch(Exception& e) {
 				hashSize += File::getSize(curDirPath + fname);
 				dcdebug("Error loading file list %s \n", e.getError().c_str());
@@ -1431,33 +1598,181 @@ struct ShareManager::ShareLoader : public SimpleXMLReader::ThreadedCallBack, pub
 			if (version > Util::toInt(SHARE_CACHE_VERSION))
 				throw("Newer cache version"); //don't load those...
 
-			cur->addBloom(*bloom);
-			dirNameMapNew.emplace(const_cast<string*>(&cur->realName.getLower()), cur);
 			cur->setLastWrite(Util::toUInt32(getAttrib(attribs, DATE, 2)));
 		}
 	}
 	void endTag(const string& name) {
 		if(compare(name, SDIRECTORY) == 0) {
 			if(cur) {
-				curDirPath = Util::getParentDir(curDirPath);
-				curDirPathLower = Util::getParentDir(curDirPathLower);
+				cur->directories.shrink_to_fit();
+				cur->files.shrink_to_fit();
+
 				cur = cur->getParent();
+				leaveDirectory();
 			}
 		}
 	}
 
 private:
-	friend struct SizeSort;
-
 	ShareManager::Directory::Ptr cur;
+};
 
-	string curDirPathLower;
-	string curDirPath;
-	ShareManager::ShareBloom* bloom;
+/* Read-only view of a whole cache file */
+class ShareCacheMapping : boost::noncopyable {
+public:
+	ShareCacheMapping(const string& aPath) {
+#ifdef _WIN32
+		buf = File(aPath, File::READ, File::OPEN).read();
+		data = reinterpret_cast<const uint8_t*>(buf.data());
+		size = buf.size();
+#else
+		auto fd = ::open(Text::fromUtf8(aPath).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			throw FileException(Util::translateError(errno));
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			size = static_cast<size_t>(st.st_size);
+			map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+
+		auto err = errno;
+		::close(fd);
+
+		if (size == 0) {
+			throw FileException(STRING(SHARE_CACHE_INVALID));
+		} else if (map == MAP_FAILED) {
+			throw FileException(Util::translateError(err));
+		}
+
+		madvise(map, size, MADV_SEQUENTIAL);
+		data = static_cast<const uint8_t*>(map);
+#endif
+	}
+
+	~ShareCacheMapping() {
+#ifndef _WIN32
+		if (map != MAP_FAILED)
+			munmap(map, size);
+#endif
+	}
+
+	const uint8_t* getData() const noexcept { return data; }
+	size_t getSize() const noexcept { return size; }
+private:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	string buf;
+#else
+	void* map = MAP_FAILED;
+#endif
+};
+
+struct ShareManager::BinaryShareLoader : public ShareManager::CacheLoader {
+	BinaryShareLoader(const string& aPath, const ShareManager::Directory::Ptr& aOldRoot) : 
+		ShareManager::CacheLoader(aPath, aOldRoot, aOldRoot->getProfileDir()->getCachePath())
+	{ }
+
+	void load() {
+		ShareCacheMapping mapping(cachePath);
+
+		ShareCacheHeader header;
+		if (mapping.getSize() < sizeof(header))
+			throw ShareException(STRING(SHARE_CACHE_INVALID));
+
+		memcpy(&header, mapping.getData(), sizeof(header));
+		if (memcmp(header.magic, SHARE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != SHARE_CACHE_BIN_VERSION ||
+			header.stringsOffset < sizeof(header) || header.stringsOffset > mapping.getSize() || header.stringsSize > mapping.getSize() - header.stringsOffset) {
+			throw ShareException(STRING(SHARE_CACHE_INVALID));
+		}
+
+		pos = mapping.getData() + sizeof(header);
+		recordsEnd = mapping.getData() + header.stringsOffset;
+		strings = reinterpret_cast<const char*>(recordsEnd);
+		stringsSize = header.stringsSize;
+
+		ShareCacheDirectory rootRecord;
+		read(rootRecord);
+
+		root->setLastWrite(rootRecord.lastWrite);
+		loadDirectory(rootRecord, root, 0);
+	}
+private:
+	const uint8_t* pos = nullptr;
+	const uint8_t* recordsEnd = nullptr;
+	const char* strings = nullptr;
+	uint64_t stringsSize = 0;
+
+	template<class T>
+	void read(T& record_) {
+		if (static_cast<size_t>(recordsEnd - pos) < sizeof(T))
+			throw ShareException(STRING(SHARE_CACHE_INVALID));
+
+		memcpy(&record_, pos, sizeof(T));
+		pos += sizeof(T);
+	}
+
+	string getName(uint32_t aOffset, uint32_t aLen) const {
+		if (aLen == 0 || aOffset > stringsSize || aLen > stringsSize - aOffset)
+			throw ShareException(STRING(SHARE_CACHE_INVALID));
+
+		return string(strings + aOffset, aLen);
+	}
+
+	// the records can't exceed the remaining data, don't trust the counts when reserving
+	size_t getMaxRecords(uint32_t aCount, size_t aRecordSize) const noexcept {
+		return min(static_cast<size_t>(aCount), static_cast<size_t>(recordsEnd - pos) / aRecordSize);
+	}
+
+	void loadDirectory(const ShareCacheDirectory& aRecord, const ShareManager::Directory::Ptr& aDir, int aDepth) {
+		if (aDepth > MAX_SHARE_CACHE_DEPTH)
+			throw ShareException(STRING(SHARE_CACHE_INVALID));
+
+		// the files may have been removed from the hash database after the cache was saved
+		HashManager::HashedFileMap hashedFiles;
+		auto scanned = aRecord.files > 0 && HashManager::getInstance()->getDirectoryFiles(curDirPathLower, hashedFiles);
+
+		aDir->files.reserve(getMaxRecords(aRecord.files, sizeof(ShareCacheFile)));
+		for (uint32_t i = 0; i < aRecord.files; ++i) {
+			ShareCacheFile f;
+			read(f);
+
+			DualString name(getName(f.nameOffset, f.nameLen));
+			if (scanned) {
+				auto p = hashedFiles.find(name.getLower());
+				if (p != hashedFiles.end()) {
+					addFile(aDir, move(name), p->second);
+					continue;
+				}
+			}
+
+			// queues the file for hashing
+			try {
+				HashedFile fi;
+				HashManager::getInstance()->getFileInfo(curDirPathLower + name.getLower(), curDirPath + name.getNormal(), fi);
+				addFile(aDir, move(name), fi);
+			} catch (const HashException&) {
+				hashSize += f.size;
+			}
+		}
+
+		aDir->directories.reserve(getMaxRecords(aRecord.directories, sizeof(ShareCacheDirectory)));
+		for (uint32_t i = 0; i < aRecord.directories; ++i) {
+			ShareCacheDirectory d;
+			read(d);
+
+			auto dir = enterDirectory(aDir, getName(d.nameOffset, d.nameLen), d.lastWrite);
+			loadDirectory(d, dir, aDepth + 1);
+			leaveDirectory();
+		}
+	}
 };
 
-typedef shared_ptr<ShareManager::ShareLoader> ShareLoaderPtr;
-typedef vector<ShareLoaderPtr> LoaderList;
+typedef shared_ptr<ShareManager::CacheLoader> CacheLoaderPtr;
+typedef vector<CacheLoaderPtr> LoaderList;
 
 bool ShareManager::loadCache(function<void(float)> progressF) noexcept{
 	HashManager::HashPauser pauser;
@@ -1483,22 +1798,30 @@ bool ShareManager::loadCache(function<void(float)> progressF) noexcept{
 	}
 
 	LoaderList ll;
+	StringSet cacheFiles;
 
-	//create the info dirs
-	for (const auto& p : fileList) {
-		if (Util::getFileExt(p) == ".xml") {
-			auto rp = find_if(parents | map_values, [&p](const Directory::Ptr& aDir) { return Util::stricmp(aDir->getProfileDir()->getCacheXmlPath(), p) == 0; });
-			if (rp.base() != parents.end()) { //make sure that subdirs are never listed here...
-				try {
-					auto loader = new ShareLoader(rp.base()->first, *rp, bloom.get());
-					ll.emplace_back(loader);
-					continue;
-				} catch (...) {}
-			}
+	//create the loaders, subdirs are never listed here
+	for (const auto& p : parents) {
+		auto pd = p.second->getProfileDir();
+
+		CacheLoader* loader = nullptr;
+		if (Util::fileExists(pd->getCachePath())) {
+			loader = new BinaryShareLoader(p.first, p.second);
+		} else if (Util::fileExists(pd->getCacheXmlPath())) {
+			loader = new ShareLoader(p.first, p.second);
+		} else {
+			continue;
 		}
 
-		//no use for extra files
-		File::deleteFile(p);
+		ll.emplace_back(loader);
+		cacheFiles.insert(Text::toLower(loader->cachePath));
+	}
+
+	//no use for extra files (or the XML caches that have been converted already)
+	for (const auto& p : fileList) {
+		if (cacheFiles.find(Text::toLower(p)) == cacheFiles.end()) {
+			File::deleteFile(p);
+		}
 	}
 
 	const auto dirCount = ll.size();
@@ -1510,18 +1833,17 @@ bool ShareManager::loadCache(function<void(float)> progressF) noexcept{
 	bool hasFailed = false;
 
 	try {
-		parallel_for_each(ll.begin(), ll.end(), [&](ShareLoaderPtr& i) {
-			//LogManager::getInstance()->message("Thread: " + Util::toString(::GetCurrentThreadId()) + "Size " + Util::toString(loader.size), LogManager::LOG_INFO);
+		parallel_for_each(ll.begin(), ll.end(), [&](CacheLoaderPtr& i) {
 			auto& loader = *i;
 			try {
-				SimpleXMLReader(&loader).parse(*loader.file);
-			} catch (SimpleXMLException& e) {
-				LogManager::getInstance()->message("Error loading " + loader.xmlPath + ": " + e.getError(), LogManager::LOG_ERROR);
+				loader.load();
+			} catch (const Exception& e) {
+				LogManager::getInstance()->message("Error loading " + loader.cachePath + ": " + e.getError(), LogManager::LOG_ERROR);
 				hasFailed = true;
-				File::deleteFile(loader.xmlPath);
+				File::deleteFile(loader.cachePath);
 			} catch (...) {
 				hasFailed = true;
-				File::deleteFile(loader.xmlPath);
+				File::deleteFile(loader.cachePath);
 			}
 
 			if (progressF) {
@@ -1536,12 +1858,20 @@ bool ShareManager::loadCache(function<void(float)> progressF) noexcept{
 	if (hasFailed)
 		return false;
 
+	for (const auto& l : ll) {
+		l->addBloom(*bloom);
+
+		// convert the old caches
+		if (l->isLegacy())
+			l->root->getProfileDir()->setCacheDirty(true);
+	}
+
 	//apply the changes
 	int64_t hashSize = 0;
 
 	DirMap newRoots;
 
-	mergeRefreshChanges(ll, dirNameMap, newRoots, tthIndex, hashSize, sharedSize, nullptr);
+	mergeRefreshChanges(ll, dirNameMap, newRoots, tthIndex, &searchIndex, hashSize, sharedSize, nullptr);
 
 	//make sure that the subprofiles are added too
 	for (auto& p : newRoots)
@@ -1600,16 +1930,21 @@ void ShareManager::save(SimpleXML& aXml) {
 	}
 }
 
-void ShareManager::Directory::countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles_, size_t& lowerCaseFiles_, size_t& totalStrLen_) const noexcept{
+void ShareManager::Directory::countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles_, size_t& lowerCaseFiles_, size_t& totalStrLen_, size_t& totalMemory_, unordered_set<const FilePool*>& pools_) const noexcept{
 	for(auto& d: directories) {
-		d->countStats(totalAge_, totalDirs_, totalSize_, totalFiles_, lowerCaseFiles_, totalStrLen_);
+		d->countStats(totalAge_, totalDirs_, totalSize_, totalFiles_, lowerCaseFiles_, totalStrLen_, totalMemory_, pools_);
 	}
 
-	for(auto& f: files) {
+	// the names and file records are counted once for each pool
+	if (pools_.insert(&files.getPool()).second)
+		totalMemory_ += files.getPool().getMemoryUsage();
+
+	totalMemory_ += sizeof(Directory) + realName.getMemoryUsage() + directories.capacity() * sizeof(Ptr) + files.capacity() * sizeof(uint32_t);
+	for(auto f: files) {
 		totalSize_ += f->getSize();
 		totalAge_ += f->getLastWrite();
-		totalStrLen_ += f->name.getLower().length();
-		if (f->name.lowerCaseOnly()) {
+		totalStrLen_ += f->getNameLower(*this).length();
+		if (f->isLowerCaseOnly(*this)) {
 			lowerCaseFiles_++;
 		} /*else {
 			totalStrLen_ += f.getNameLower().length(); //the len is the same, right?
@@ -1621,22 +1956,28 @@ void ShareManager::Directory::countStats(uint64_t& totalAge_, size_t& totalDirs_
 	totalFiles_ += files.size();
 }
 
-void ShareManager::countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles_, size_t& lowerCaseFiles_, size_t& totalStrLen_, size_t& roots_) const noexcept{
+void ShareManager::countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles_, size_t& lowerCaseFiles_, size_t& totalStrLen_, size_t& totalMemory_, size_t& roots_) const noexcept{
+	unordered_set<const FilePool*> pools;
+
 	RLock l(cs);
 	for (const auto& d : rootPaths | map_values | filtered(Directory::IsParent())) {
 		totalDirs_++;
 		roots_++;
-		d->countStats(totalAge_, totalDirs_, totalSize_, totalFiles_, lowerCaseFiles_, totalStrLen_);
+		d->countStats(totalAge_, totalDirs_, totalSize_, totalFiles_, lowerCaseFiles_, totalStrLen_, totalMemory_, pools);
 	}
 }
 
 
 string ShareManager::printStats() const noexcept {
 	uint64_t totalAge=0;
-	size_t totalFiles=0, lowerCaseFiles=0, totalDirs=0, totalStrLen=0, roots=0;
+	size_t totalFiles=0, lowerCaseFiles=0, totalDirs=0, totalStrLen=0, totalMemory=0, roots=0;
 	int64_t totalSize=0;
 
-	countStats(totalAge, totalDirs, totalSize, totalFiles, lowerCaseFiles, totalStrLen, roots);
+	countStats(totalAge, totalDirs, totalSize, totalFiles, lowerCaseFiles, totalStrLen, totalMemory, roots);
+
+	uint64_t partialHits = 0, partialMisses = 0;
+	size_t partialBytes = 0;
+	partialListCache.getStats(partialHits, partialMisses, partialBytes);
 
 	unordered_set<TTHValue*> uniqueTTHs;
 	for(auto tth: tthIndex | map_keys) {
@@ -1654,7 +1995,9 @@ Total shared files: %d (of which %d%% are lowercase)\r\n\
 Unique TTHs: %d (%d%%)\r\n\
 Total shared directories: %d (%d files per directory)\r\n\
 Average age of a file: %s\r\n\
-Average name length of a shared item: %d bytes (total size %s)")
+Average name length of a shared item: %d bytes (total size %s)\r\n\
+Memory used by the share tree: %s (%d bytes per file)\r\n\
+Partial lists served from the cache: %d%% (%d hits, %d misses, %s cached)")
 
 		% (shareProfiles.size()-1) // remove hidden
 		% roots % ((rootPaths.size() == 0 ? 0 : static_cast<double>(roots) / static_cast<double>(rootPaths.size())) *100.00)
@@ -1665,6 +2008,9 @@ Average name length of a shared item: %d bytes (total size %s)")
 		% Util::formatTime(GET_TIME() - (totalFiles == 0 ? 0 : totalAge / totalFiles), false, true)
 		% (totalFiles + totalDirs == 0 ? 0 : static_cast<double>(totalStrLen) / static_cast<double>(totalFiles + totalDirs))
 		% Util::formatBytes(totalStrLen)
+		% Util::formatBytes(totalMemory) % (totalFiles == 0 ? 0 : totalMemory / totalFiles)
+		% (partialHits + partialMisses == 0 ? 0 : (static_cast<double>(partialHits) / static_cast<double>(partialHits + partialMisses))*100.00)
+		% partialHits % partialMisses % Util::formatBytes(partialBytes)
 	);
 
 	ret += boost::str(boost::format(
@@ -1675,6 +2021,7 @@ Filtered text searches: %d%% (%d%% of the matched ones returned results)\r\n\
 Average search tokens (non-filtered only): %d (%d bytes per token)\r\n\
 Auto searches (text, ADC only): %d%%\r\n\
 Average time for matching a recursive search: %d ms\r\n\
+Searches narrowed down by the search index: %d%% (%d words, %d items)\r\n\
 TTH searches: %d%% (hash bloom mode: %s)")
 
 		% totalSearches % (totalSearches / upseconds)
@@ -1685,6 +2032,8 @@ TTH searches: %d%% (hash bloom mode: %s)")
 		% (searchTokenCount == 0 ? 0 : static_cast<double>(searchTokenLength) / static_cast<double>(searchTokenCount)) // search token length
 		% (recursiveSearches == 0 ? 0 : (static_cast<double>(autoSearches) / static_cast<double>(recursiveSearches))*100.00) // auto searches
 		% (recursiveSearches - filteredSearches == 0 ? 0 : recursiveSearchTime / (recursiveSearches - filteredSearches)) // search matching time
+		% (recursiveSearches - filteredSearches == 0 ? 0 : (static_cast<double>(indexedSearches) / static_cast<double>(recursiveSearches - filteredSearches))*100.00) // indexed searches
+		% searchIndex.getWordCount() % searchIndex.getItemCount()
 		% (totalSearches == 0 ? 0 : (static_cast<double>(tthSearches) / static_cast<double>(totalSearches))*100.00) // TTH searches
 		% (SETTING(BLOOM_MODE) != SettingsManager::BLOOM_DISABLED ? "Enabled" : "Disabled") // bloom mode
 	);
@@ -1883,7 +2232,7 @@ bool ShareManager::isFileShared(const TTHValue& aTTH, ProfileToken aProfile) con
 	RLock l (cs);
 	const auto files = tthIndex.equal_range(const_cast<TTHValue*>(&aTTH));
 	for(auto i = files.first; i != files.second; ++i) {
-		if(i->second->getParent()->hasProfile(aProfile)) {
+		if(i->second.directory->hasProfile(aProfile)) {
 			return true;
 		}
 	}
@@ -1891,15 +2240,25 @@ bool ShareManager::isFileShared(const TTHValue& aTTH, ProfileToken aProfile) con
 	return false;
 }
 
-void ShareManager::buildTree(string& aPath, string& aPathLower, const Directory::Ptr& aDir, const ProfileDirMap& aSubRoots, DirMultiMap& aDirs, DirMap& newShares, 
-	int64_t& hashSize, int64_t& addedSize, HashFileMap& tthIndexNew, ShareBloom& aBloom) {
+void ShareManager::buildTree(string& aPath, string& aPathLower, const Directory::Ptr& aDir, RefreshInfo& aRefresh, RefreshIndices& aIndices, int aLevel) {
+	struct SubDirectory {
+		SubDirectory(const Directory::Ptr& aDir, string&& aPath, string&& aPathLower) : dir(aDir), path(move(aPath)), pathLower(move(aPathLower)) { }
+
+		Directory::Ptr dir;
+		string path;
+		string pathLower;
+		bool remove = false;
+	};
+
+	// the subdirectories are scanned after the directory has been closed
+	vector<SubDirectory> subDirs;
 
 	FileFindIter end;
 	for(FileFindIter i(aPath, "*"); i != end && !aShutdown; ++i) {
 		string name = i->getFileName();
 		if(name.empty()) {
 			LogManager::getInstance()->message("Invalid file name found while hashing folder " + aPath + ".", LogManager::LOG_WARNING);
-			return;
+			break;
 		}
 
 		if(!SETTING(SHARE_HIDDEN) && i->isHidden())
@@ -1926,10 +2285,10 @@ void ShareManager::buildTree(string& aPath, string& aPathLower, const Directory:
 			}
 
 			ProfileDirectory::Ptr profileDir = nullptr;
-			if (!aSubRoots.empty()) {
+			if (!aRefresh.subProfiles.empty()) {
 				//add excluded dirs and sub roots in our new maps
-				auto p = aSubRoots.find(curPathLower);
-				if (p != aSubRoots.end()) {
+				auto p = aRefresh.subProfiles.find(curPathLower);
+				if (p != aRefresh.subProfiles.end()) {
 					if (p->second->isSet(ProfileDirectory::FLAG_ROOT) || p->second->isSet(ProfileDirectory::FLAG_EXCLUDE_PROFILE))
 						profileDir = p->second;
 					if (p->second->isSet(ProfileDirectory::FLAG_EXCLUDE_TOTAL))
@@ -1938,20 +2297,7 @@ void ShareManager::buildTree(string& aPath, string& aPathLower, const Directory:
 			}
 
 			auto dir = Directory::create(move(dualName), aDir, i->getLastWriteTime(), profileDir);
-
-			buildTree(curPath, curPathLower, dir, aSubRoots, aDirs, newShares, hashSize, addedSize, tthIndexNew, aBloom);
-
-			//roots will always be added
-			if (profileDir && profileDir->isSet(ProfileDirectory::FLAG_ROOT)) {
-				newShares[curPathLower] = dir;
-			} else if (SETTING(SKIP_EMPTY_DIRS_SHARE) && dir->directories.empty() && dir->files.empty()) {
-				//remove it
-				aDir->directories.erase_key(dir->realName.getLower());
-				continue;
-			}
-
-			aDirs.emplace(const_cast<string*>(&dir->realName.getLower()), dir);
-			dir->addBloom(aBloom);
+			subDirs.emplace_back(dir, move(curPath), move(curPathLower));
 		} else {
 			// Not a directory, assume it's a file...
 			int64_t size = i->getSize();
@@ -1964,15 +2310,67 @@ void ShareManager::buildTree(string& aPath, string& aPathLower, const Directory:
 			try {
 				HashedFile fi(i->getLastWriteTime(), size);
 				if(HashManager::getInstance()->checkTTH(aPathLower + dualName.getLower(), aPath + name, fi)) {
-					auto pos = aDir->files.insert_sorted(new ShareManager::Directory::File(move(dualName), aDir, fi));
-					updateIndices(*aDir, *pos.first, aBloom, addedSize, tthIndexNew);
+					auto pos = aDir->files.add(dualName, fi);
+					if (pos.second)
+						updateIndices(*aDir, *pos.first, aIndices.addedSize, aIndices.tthIndexNew);
 				} else {
-					hashSize += size;
+					aIndices.hashSize += size;
 				}
 			} catch(const HashException&) {
 			}
 		}
 	}
+
+	auto addDirectory = [](SubDirectory& aSub, RefreshIndices& aSubIndices) {
+		//roots will always be added
+		if (aSub.dir->getProfileDir() && aSub.dir->getProfileDir()->isSet(ProfileDirectory::FLAG_ROOT)) {
+			aSubIndices.rootPathsNew[aSub.pathLower] = aSub.dir;
+		} else if (SETTING(SKIP_EMPTY_DIRS_SHARE) && aSub.dir->directories.empty() && aSub.dir->files.empty()) {
+			// the parent may be modified by other tasks at this point
+			aSub.remove = true;
+			return;
+		}
+
+		aSubIndices.dirNameMapNew.emplace(const_cast<string*>(&aSub.dir->realName.getLower()), aSub.dir);
+	};
+
+	// Large subtrees are scanned in parallel (the number of tasks is limited per volume)
+	task_group tasks;
+	try {
+		for (auto& sub: subDirs) {
+			if (aShutdown)
+				break;
+
+			if (aRefresh.startSubtreeTask(aLevel)) {
+				auto& subIndices = aRefresh.addSubtree();
+				sub.dir->files.setPool(new FilePool());
+				tasks.run([&, this] {
+					ScopedFunctor([&aRefresh] { aRefresh.endSubtreeTask(); });
+					buildTree(sub.path, sub.pathLower, sub.dir, aRefresh, subIndices, aLevel + 1);
+					addDirectory(sub, subIndices);
+				});
+			} else {
+				buildTree(sub.path, sub.pathLower, sub.dir, aRefresh, aIndices, aLevel + 1);
+				addDirectory(sub, aIndices);
+			}
+		}
+	} catch (...) {
+		tasks.cancel();
+		tasks.wait();
+		throw;
+	}
+
+	tasks.wait();
+
+	for (const auto& sub: subDirs) {
+		if (sub.remove) {
+			aDir->directories.erase_key(sub.dir->realName.getLower());
+		}
+	}
+
+	// the content is complete, don't waste memory for the growth space
+	aDir->directories.shrink_to_fit();
+	aDir->files.shrink_to_fit();
 }
 
 void ShareManager::Directory::addBloom(ShareBloom& aBloom) const noexcept {
@@ -1985,33 +2383,39 @@ void ShareManager::Directory::addBloom(ShareBloom& aBloom) const noexcept {
 	}
 }
 
-void ShareManager::updateIndices(Directory::Ptr& dir, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex, DirMultiMap& aDirNames) noexcept {
+void ShareManager::updateIndices(Directory::Ptr& dir, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex, DirMultiMap& aDirNames, SearchIndex& aSearchIndex) noexcept {
 	// add to bloom
 	dir->addBloom(aBloom);
 	aDirNames.emplace(const_cast<string*>(&dir->realName.getLower()), dir);
+	dir->searchId = aSearchIndex.add(dir->realName.getLower(), dir.get());
 
 	// update all sub items
 	for(auto d: dir->directories) {
-		updateIndices(d, aBloom, sharedSize, tthIndex, aDirNames);
+		updateIndices(d, aBloom, sharedSize, tthIndex, aDirNames, aSearchIndex);
 	}
 
 	for(auto i = dir->files.begin(); i != dir->files.end(); i++) {
 		updateIndices(*dir, *i, aBloom, sharedSize, tthIndex);
+		(*i)->searchId = aSearchIndex.add((*i)->getNameLower(*dir), dir.get(), (*i)->getNameOffset());
 	}
 }
 
 void ShareManager::updateIndices(Directory& dir, const Directory::File* f, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex) noexcept {
+	updateIndices(dir, f, sharedSize, tthIndex);
+	aBloom.add(f->getNameLower(dir));
+}
+
+void ShareManager::updateIndices(Directory& dir, const Directory::File* f, int64_t& sharedSize, HashFileMap& tthIndex) noexcept {
 	dir.size += f->getSize();
 	sharedSize += f->getSize();
 
 #ifdef _DEBUG
 	auto flst = tthIndex.equal_range(const_cast<TTHValue*>(&f->getTTH()));
-	auto p = find(flst | map_values, f);
+	auto p = find_if(flst | map_values, [f](const IndexedFile& aFile) { return aFile.file == f; });
 	dcassert(p.base() == flst.second);
 #endif
 
-	tthIndex.emplace(const_cast<TTHValue*>(&f->getTTH()), f);
-	aBloom.add(f->name.getLower());
+	tthIndex.emplace(const_cast<TTHValue*>(&f->getTTH()), IndexedFile(&dir, f));
 }
 
 int ShareManager::refresh(const string& aDir) noexcept {
@@ -2318,6 +2722,7 @@ void ShareManager::removeDirectories(const ShareDirInfo::List& aRemoveDirs) noex
 					}
 
 					cleanIndices(*sd);
+					File::deleteFile(sd->getProfileDir()->getCachePath());
 					File::deleteFile(sd->getProfileDir()->getCacheXmlPath());
 
 					//no parent directories, get all child roots for this
@@ -2339,7 +2744,7 @@ void ShareManager::removeDirectories(const ShareDirInfo::List& aRemoveDirs) noex
 						if (Util::getParentDir(d->getProfileDir()->getPath()).length() == minLen) {
 							d->setParent(nullptr);
 							d->getProfileDir()->setCacheDirty(true);
-							updateIndices(d, *bloom.get(), sharedSize, tthIndex, dirNameMap);
+							updateIndices(d, *bloom.get(), sharedSize, tthIndex, dirNameMap, searchIndex);
 						}
 					}
 				}
@@ -2467,7 +2872,7 @@ ShareManager::RefreshInfo::~RefreshInfo() {
 
 }
 
-ShareManager::RefreshInfo::RefreshInfo(const string& aPath, const Directory::Ptr& aOldRoot, uint64_t aLastWrite) : path(aPath), oldRoot(aOldRoot), addedSize(0), hashSize(0) {
+ShareManager::RefreshInfo::RefreshInfo(const string& aPath, const Directory::Ptr& aOldRoot, uint64_t aLastWrite) : path(aPath), oldRoot(aOldRoot) {
 	subProfiles = getInstance()->getSubProfileDirs(aPath);
 
 	//create the new root
@@ -2479,6 +2884,57 @@ ShareManager::RefreshInfo::RefreshInfo(const string& aPath, const Directory::Ptr
 	dirNameMapNew.emplace(const_cast<string*>(&root->realName.getLower()), root);
 }
 
+int ShareManager::getMaxRefreshTasks(const File::BlockDevice& aDevice) noexcept {
+	if (SETTING(REFRESH_THREADS_PER_VOLUME) > 0)
+		return SETTING(REFRESH_THREADS_PER_VOLUME);
+
+	// parallel directory scans would make spinning disks seek
+	if (!aDevice.detected || aDevice.rotational)
+		return 1;
+
+	return SSD_REFRESH_TASKS;
+}
+
+ShareManager::RefreshIndices& ShareManager::RefreshInfo::addSubtree() noexcept {
+	Lock l(cs);
+	subtrees.emplace_back(new RefreshIndices());
+	return *subtrees.back();
+}
+
+bool ShareManager::RefreshInfo::startSubtreeTask(int aLevel) noexcept {
+	// the deeper levels are usually too small to be worth splitting
+	if (!volumeTasks || aLevel >= MAX_SUBTREE_TASK_LEVEL)
+		return false;
+
+	auto cur = volumeTasks->load();
+	do {
+		if (cur >= maxVolumeTasks)
+			return false;
+	} while (!volumeTasks->compare_exchange_weak(cur, cur + 1));
+
+	return true;
+}
+
+void ShareManager::RefreshIndices::addBloom(ShareBloom& aBloom) const noexcept {
+	for (const auto& d: dirNameMapNew | map_values) {
+		d->addBloom(aBloom);
+	}
+
+	for (const auto& f: tthIndexNew | map_values) {
+		aBloom.add(f.file->getNameLower(*f.directory));
+	}
+}
+
+void ShareManager::RefreshIndices::addSearchIndex(SearchIndex& aIndex) const noexcept {
+	for (const auto& d: dirNameMapNew | map_values) {
+		d->searchId = aIndex.add(d->realName.getLower(), d.get());
+	}
+
+	for (const auto& f: tthIndexNew | map_values) {
+		f.file->searchId = aIndex.add(f.file->getNameLower(*f.directory), f.directory, f.file->getNameOffset());
+	}
+}
+
 void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexcept {
 	unique_ptr<HashManager::HashPauser> pauser = nullptr;
 
@@ -2554,9 +3010,14 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 			auto& ri = *i.get();
 			auto pathLower = Text::toLower(ri.path);
 			auto path = ri.path;
-			ri.root->addBloom(*refreshBloom);
+
+			// the root task counts towards the volume limit as well
+			if (ri.volumeTasks)
+				(*ri.volumeTasks)++;
+			ScopedFunctor([&ri] { if (ri.volumeTasks) ri.endSubtreeTask(); });
+
 			try {
-				buildTree(path, pathLower, ri.root, ri.subProfiles, ri.dirNameMapNew, ri.rootPathsNew, ri.hashSize, ri.addedSize, ri.tthIndexNew, *refreshBloom);
+				buildTree(path, pathLower, ri.root, ri, ri, 0);
 			} catch (const std::bad_alloc&) {
 				LogManager::getInstance()->message(STRING_F(DIR_REFRESH_FAILED, path % STRING(OUT_OF_MEMORY)), LogManager::LOG_ERROR);
 				return;
@@ -2574,6 +3035,17 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 
 		try {
 			if (SETTING(REFRESH_THREADING) == SettingsManager::MULTITHREAD_ALWAYS || (SETTING(REFRESH_THREADING) == SettingsManager::MULTITHREAD_MANUAL && (task->type == TYPE_MANUAL || task->type == TYPE_STARTUP_BLOCKING))) {
+				// share the task counters between the directories on the same device
+				unordered_map<string, shared_ptr<atomic<int>>> volumes;
+				for (auto& ri: refreshDirs) {
+					auto device = File::getBlockDevice(ri->path);
+					auto& volumeTasks = volumes[device.id];
+					if (!volumeTasks)
+						volumeTasks = make_shared<atomic<int>>(0);
+					ri->volumeTasks = volumeTasks;
+					ri->maxVolumeTasks = getMaxRefreshTasks(device);
+				}
+
 				TaskScheduler s;
 				parallel_for_each(refreshDirs.begin(), refreshDirs.end(), doRefresh);
 			} else {
@@ -2587,6 +3059,24 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 		if (aShutdown)
 			break;
 
+		for (const auto& ri: refreshDirs) {
+			ri->addBloom(*refreshBloom);
+			for (const auto& sub: ri->subtrees) {
+				sub->addBloom(*refreshBloom);
+			}
+		}
+
+		// a full refresh replaces the whole search index so it can be built before locking
+		SearchIndex refreshSearchIndex;
+		if (t.first == REFRESH_ALL) {
+			for (const auto& ri: refreshDirs) {
+				ri->addSearchIndex(refreshSearchIndex);
+				for (const auto& sub: ri->subtrees) {
+					sub->addSearchIndex(refreshSearchIndex);
+				}
+			}
+		}
+
 		int64_t totalHash=0;
 		ProfileTokenSet dirtyProfiles;
 
@@ -2599,18 +3089,19 @@ void ShareManager::runTasks(function<void (float)> progressF /*nullptr*/) noexce
 				}), refreshDirs.end());
 
 				bloom->merge(*refreshBloom);
-				mergeRefreshChanges(refreshDirs, dirNameMap, rootPaths, tthIndex, totalHash, sharedSize, &dirtyProfiles);
+				mergeRefreshChanges(refreshDirs, dirNameMap, rootPaths, tthIndex, &searchIndex, totalHash, sharedSize, &dirtyProfiles);
 			} else {
 				int64_t totalAdded=0;
 				DirMultiMap newDirNames;
 				DirMap newRoots;
 				HashFileMap newTTHs;
 
-				mergeRefreshChanges(refreshDirs, newDirNames, newRoots, newTTHs, totalHash, totalAdded, &dirtyProfiles);
+				mergeRefreshChanges(refreshDirs, newDirNames, newRoots, newTTHs, nullptr, totalHash, totalAdded, &dirtyProfiles);
 
 				rootPaths.swap(newRoots);
 				dirNameMap.swap(newDirNames);
 				tthIndex.swap(newTTHs);
+				searchIndex.swap(refreshSearchIndex);
 
 				sharedSize = totalAdded;
 				bloom.reset(refreshBloom);
@@ -2647,6 +3138,7 @@ bool ShareManager::handleRefreshedDirectory(RefreshInfoPtr& ri, TaskType aTaskTy
 		if (AirUtil::isParentOrExact(ri->path, i->first)) {
 			if (aTaskType == ADD_DIR && AirUtil::isSub(i->first, ri->root->getProfileDir()->getPath()) && !i->second->getParent()) {
 				//in case we are adding a new parent
+				File::deleteFile(i->second->getProfileDir()->getCachePath());
 				File::deleteFile(i->second->getProfileDir()->getCacheXmlPath());
 				cleanIndices(*i->second);
 			}
@@ -2697,7 +3189,7 @@ void ShareManager::on(TimerManagerListener::Second, uint64_t /*tick*/) noexcept
 
 void ShareManager::on(TimerManagerListener::Minute, uint64_t tick) noexcept {
 	if(lastSave == 0 || lastSave + 15*60*1000 <= tick) {
-		saveXmlList();
+		saveCache();
 	}
 
 	if(SETTING(AUTO_REFRESH_TIME) > 0 && lastFullUpdate + SETTING(AUTO_REFRESH_TIME) * 60 * 1000 <= tick) {
@@ -2767,49 +3259,92 @@ FileList* ShareManager::generateXmlList(ProfileToken aProfile, bool forced /*fal
 	{
 		Lock lFl(fl->cs);
 		if (fl->allowGenerateNew(forced)) {
-			auto tmpName = fl->getFileName().substr(0, fl->getFileName().length() - 4);
 			try {
 				{
-					File f(tmpName, File::RW, File::TRUNCATE | File::CREATE, File::BUFFER_SEQUENTIAL, false);
-
-					f.write(SimpleXML::utf8Header);
-					f.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"DC++ " DCVERSIONSTRING "\">\r\n");
+					// The XML is compressed and hashed while it's being generated
+					File bz(fl->getFileName(), File::WRITE, File::TRUNCATE | File::CREATE, File::BUFFER_SEQUENTIAL, false);
+					// We don't care about the leaves...
+					CalcOutputStream<TTFilter<1024 * 1024 * 1024>, false> bzTree(&bz);
+					FilteredOutputStream<ParallelBZFilter, false> bzipper(&bzTree);
+
+					// The XML is hashed from the leaves of the fragments
+					TigerTree xmlTree(TigerTree::BASE_BLOCK_SIZE);
+					auto addLeaves = [&xmlTree](const FileList::Fragment& aFragment) {
+						auto& leaves = xmlTree.getLeaves();
+						leaves.insert(leaves.end(), aFragment.leaves.begin(), aFragment.leaves.end());
+						xmlTree.setFileSize(xmlTree.getFileSize() + aFragment.xmlSize);
+					};
+
+					auto writeFragment = [&](FileList::Fragment& aFragment, const string& aXml, bool aPad) {
+						FileListFragmentStream xml(aFragment, bzipper.getFilter(), bzTree);
+						xml.write(aXml);
+						xml.finish(aPad);
+						addLeaves(aFragment);
+					};
+
+					FileList::Fragment header;
+					writeFragment(header, SimpleXML::utf8Header + "<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"DC++ " DCVERSIONSTRING "\">\r\n", true);
 
 					string tmp;
 					string indent = "\t";
+					FileList::FragmentMap fragments;
 
 					{
-						auto root = FileListDir(Util::emptyString, 0, 0);
-
 						RLock l(cs);
+
+						// Roots with the same virtual name are merged
+						map<string, Directory::List> roots;
 						for (const auto& d : rootPaths | map_values | filtered(Directory::HasRootProfile(aProfile))) {
-							d->toFileList(&root, aProfile, true);
+							roots[d->getProfileDir()->getNameLower(aProfile)].push_back(d);
 						}
 
-						for (const auto it2 : root.listDirs | map_values) {
-							it2->toXml(f, indent, tmp, true);
+						for (const auto& r: roots) {
+							vector<uint64_t> revisions;
+							for (const auto& d: r.second) {
+								revisions.push_back(d->getProfileDir()->getRevision());
+							}
+
+							// Only the changed roots need to be serialized and compressed again
+							auto cached = fl->fragments.find(r.first);
+							if (cached != fl->fragments.end() && cached->second.revisions == revisions) {
+								bzipper.getFilter().addBlocks(cached->second.blocks);
+								bzipper.getFilter().writeReady(bzTree);
+								addLeaves(cached->second);
+								fragments.emplace(r.first, move(cached->second));
+								continue;
+							}
+
+							auto& fragment = fragments[r.first];
+							fragment.revisions = move(revisions);
+
+							auto root = FileListDir(Util::emptyString, 0, 0);
+							for (const auto& d: r.second) {
+								d->toFileList(&root, aProfile, true);
+							}
+
+							FileListFragmentStream xml(fragment, bzipper.getFilter(), bzTree);
+							for (const auto it2 : root.listDirs | map_values) {
+								it2->toXml(xml, indent, tmp, true);
+							}
+
+							xml.finish(true);
+							addLeaves(fragment);
 						}
 					}
 
-					f.write("</FileListing>");
-					f.flush();
-
-					fl->setXmlListLen(f.getSize());
-
-					File bz(fl->getFileName(), File::WRITE, File::TRUNCATE | File::CREATE, File::BUFFER_SEQUENTIAL, false);
-					// We don't care about the leaves...
-					CalcOutputStream<TTFilter<1024 * 1024 * 1024>, false> bzTree(&bz);
-					FilteredOutputStream<BZFilter, false> bzipper(&bzTree);
-					CalcOutputStream<TTFilter<1024 * 1024 * 1024>, false> newXmlFile(&bzipper);
-
-					newXmlFile.write(f.read());
-					newXmlFile.flush();
+					FileList::Fragment footer;
+					writeFragment(footer, "</FileListing>", false);
+					bzipper.flush();
 
-					newXmlFile.getFilter().getTree().finalize();
+					xmlTree.calcRoot();
+					fl->setXmlListLen(xmlTree.getFileSize());
 					bzTree.getFilter().getTree().finalize();
 
-					fl->setXmlRoot(newXmlFile.getFilter().getTree().getRoot());
+					fl->setXmlRoot(xmlTree.getRoot());
 					fl->setBzXmlRoot(bzTree.getFilter().getTree().getRoot());
+
+					// The blocks of the new fragments have been compressed now
+					fl->fragments.swap(fragments);
 				}
 
 				fl->saveList();
@@ -2824,8 +3359,6 @@ FileList* ShareManager::generateXmlList(ProfileToken aProfile, bool forced /*fal
 					throw ShareException(UserConnection::FILE_NOT_AVAILABLE);
 				}
 			}
-
-			File::deleteFile(tmpName);
 		}
 	}
 	return fl;
@@ -2835,6 +3368,13 @@ MemoryInputStream* ShareManager::generatePartialList(const string& dir, bool rec
 	if(dir.front() != '/' || dir.back() != '/')
 		return 0;
 
+	auto key = PartialListCache::getKey(aProfile, dir, recurse, false);
+	auto cached = partialListCache.get(key);
+	if (cached) {
+		return new MemoryInputStream(cached);
+	}
+
+	auto revision = partialListCache.getRevision();
 	string xml = SimpleXML::utf8Header;
 
 	{
@@ -2892,7 +3432,9 @@ MemoryInputStream* ShareManager::generatePartialList(const string& dir, bool rec
 		return nullptr;
 	} else {
 		dcdebug("Partial list Generated.");
-		return new MemoryInputStream(xml);
+		auto ret = new MemoryInputStream(xml);
+		partialListCache.add(key, aProfile, make_shared<const string>(move(xml)), revision);
+		return ret;
 	}
 }
 
@@ -2969,8 +3511,9 @@ void ShareManager::FileListDir::filesToXml(OutputStream& xmlFile, string& indent
 		if (filesAdded) {
 			for(const auto& fi: (*di)->files) {
 				//go through the dirs that we have added already
-				if (none_of(shareDirs.begin(), di, [&fi](const Directory::Ptr& d) { return d->files.find(fi->name.getLower()) != d->files.end(); })) {
-					fi->toXml(xmlFile, indent, tmp2, addDate);
+				auto nameLower = fi->getNameLower(**di);
+				if (none_of(shareDirs.begin(), di, [&nameLower](const Directory::Ptr& d) { return d->files.find(nameLower) != d->files.end(); })) {
+					fi->toXml(**di, xmlFile, indent, tmp2, addDate);
 				} else {
 					dupeFiles++;
 				}
@@ -2978,7 +3521,7 @@ void ShareManager::FileListDir::filesToXml(OutputStream& xmlFile, string& indent
 		} else if (!(*di)->files.empty()) {
 			filesAdded = true;
 			for(const auto& f: (*di)->files)
-				f->toXml(xmlFile, indent, tmp2, addDate);
+				f->toXml(**di, xmlFile, indent, tmp2, addDate);
 		}
 	}
 
@@ -2991,29 +3534,148 @@ void ShareManager::FileListDir::filesToXml(OutputStream& xmlFile, string& indent
 	}
 }
 
-void ShareManager::Directory::filesToXmlList(OutputStream& xmlFile, string& indent, string& tmp2) const {
-	for(const auto& f: files) {
-		xmlFile.write(indent);
-		xmlFile.write(LITERAL("<File Name=\""));
-		xmlFile.write(SimpleXML::escape(f->name.lowerCaseOnly() ? f->name.getLower() : f->name.getNormal(), tmp2, true));
-		xmlFile.write(LITERAL("\"/>\r\n"));
+uint32_t ShareManager::FilePool::addName(const DualString& aName) noexcept {
+	const auto& nameLower = aName.getLower();
+	auto name = aName.lowerCaseOnly() ? Util::emptyString : aName.getNormal();
+	dcassert(nameLower.size() <= numeric_limits<uint16_t>::max() && name.size() <= numeric_limits<uint16_t>::max());
+
+	NameHeader header = { static_cast<uint16_t>(nameLower.size()), static_cast<uint16_t>(name.size()) };
+	auto len = sizeof(NameHeader) + nameLower.size() + 1 + (name.empty() ? 0 : name.size() + 1);
+	dcassert(len <= CHUNK_SIZE);
+
+	if (chunks.empty() || chunks.back().size() + len > CHUNK_SIZE) {
+		dcassert(chunks.size() < (1ULL << (32 - CHUNK_BITS)));
+		chunks.emplace_back();
+	}
+
+	auto& chunk = chunks.back();
+	if (chunk.capacity() < chunk.size() + len) {
+		// don't let the vector allocate more than the chunk can hold
+		chunk.reserve(min(CHUNK_SIZE, max(chunk.capacity() * 2, chunk.size() + len)));
+	}
+
+	auto offset = static_cast<uint32_t>(((chunks.size() - 1) << CHUNK_BITS) + chunk.size());
+
+	auto p = reinterpret_cast<const char*>(&header);
+	chunk.insert(chunk.end(), p, p + sizeof(NameHeader));
+	chunk.insert(chunk.end(), nameLower.c_str(), nameLower.c_str() + nameLower.size() + 1);
+	if (!name.empty()) {
+		chunk.insert(chunk.end(), name.c_str(), name.c_str() + name.size() + 1);
+	}
+
+	return offset;
+}
+
+ShareManager::FilePool::NameHeader ShareManager::FilePool::getHeader(uint32_t aOffset) const noexcept {
+	NameHeader header;
+	memcpy(&header, &chunks[aOffset >> CHUNK_BITS][aOffset & (CHUNK_SIZE - 1)], sizeof(NameHeader));
+	return header;
+}
+
+string ShareManager::FilePool::getName(uint32_t aOffset) const noexcept {
+	auto header = getHeader(aOffset);
+	if (header.nameLen == 0)
+		return string(getData(aOffset), header.lowerLen);
+
+	return string(getData(aOffset) + header.lowerLen + 1, header.nameLen);
+}
+
+string ShareManager::FilePool::getNameLower(uint32_t aOffset) const noexcept {
+	return string(getData(aOffset), getHeader(aOffset).lowerLen);
+}
+
+void ShareManager::FilePool::getNameLower(uint32_t aOffset, string& name_) const noexcept {
+	name_.assign(getData(aOffset), getHeader(aOffset).lowerLen);
+}
+
+int ShareManager::FilePool::compareLower(uint32_t aOffset, const string& aNameLower) const noexcept {
+	return -aNameLower.compare(0, string::npos, getData(aOffset), getHeader(aOffset).lowerLen);
+}
+
+bool ShareManager::FilePool::containsLower(uint32_t aOffset, const string& aPatternLower) const noexcept {
+	auto name = getData(aOffset);
+	auto end = name + getHeader(aOffset).lowerLen;
+	return std::search(name, end, aPatternLower.begin(), aPatternLower.end()) != end;
+}
+
+uint32_t ShareManager::FilePool::addFile(const DualString& aName, const HashedFile& aFileInfo) noexcept {
+	Directory::File file(addName(aName), aFileInfo);
+	if (!freeIds.empty()) {
+		auto id = freeIds.back();
+		freeIds.pop_back();
+		getFile(id) = file;
+		return id;
+	}
+
+	// never reallocate a chunk, the files are referenced by their addresses
+	if (fileChunks.empty() || fileChunks.back().size() == fileChunks.back().capacity()) {
+		auto chunkSize = fileChunks.empty() ? 16 : min(fileChunks.back().capacity() * 2, FILE_CHUNK_SIZE);
+		fileChunks.emplace_back();
+		fileChunks.back().reserve(chunkSize);
+	}
+
+	fileChunks.back().push_back(file);
+	return static_cast<uint32_t>(((fileChunks.size() - 1) << FILE_CHUNK_BITS) + fileChunks.back().size() - 1);
+}
+
+size_t ShareManager::FilePool::getMemoryUsage() const noexcept {
+	size_t ret = sizeof(FilePool) + chunks.capacity() * sizeof(vector<char>) + fileChunks.capacity() * sizeof(vector<Directory::File>) + freeIds.capacity() * sizeof(uint32_t);
+	for (const auto& c: chunks) {
+		ret += c.capacity();
+	}
+
+	for (const auto& c: fileChunks) {
+		ret += c.capacity() * sizeof(Directory::File);
 	}
+
+	return ret;
 }
 
-ShareManager::Directory::File::File(DualString&& aName, const Directory::Ptr& aParent, const HashedFile& aFileInfo) : 
-	size(aFileInfo.getSize()), parent(aParent.get()), tth(aFileInfo.getRoot()), lastWrite(aFileInfo.getTimeStamp()), name(move(aName)) {
+ShareManager::Directory::File::File(uint32_t aNameOffset, const HashedFile& aFileInfo) noexcept :
+	size(aFileInfo.getSize()), tth(aFileInfo.getRoot()), nameOffset(aNameOffset), lastWrite(static_cast<uint32_t>(aFileInfo.getTimeStamp())) {
 	
 }
 
-ShareManager::Directory::File::~File() {
-	//if (name)
-	//	delete name;
+ShareManager::Directory::File::Set::~Set() {
+	for (auto id: ids) {
+		pool->removeFile(id);
+	}
+}
+
+ShareManager::Directory::File::Set::IdList::const_iterator ShareManager::Directory::File::Set::lowerBound(const string& aNameLower) const noexcept {
+	return lower_bound(ids.begin(), ids.end(), aNameLower, [this](uint32_t aId, const string& aName) { return pool->compareLower(pool->getFile(aId).nameOffset, aName) < 0; });
+}
+
+pair<ShareManager::Directory::File::Set::iterator, bool> ShareManager::Directory::File::Set::add(const DualString& aName, const HashedFile& aFileInfo) noexcept {
+	const auto& nameLower = aName.getLower();
+	auto i = ids.begin() + (lowerBound(nameLower) - ids.begin());
+	if (i != ids.end() && pool->compareLower(pool->getFile(*i).nameOffset, nameLower) == 0) {
+		//return the dupe
+		return { iterator(i, GetFile{ pool.get() }), false };
+	}
+
+	return { iterator(ids.insert(i, pool->addFile(aName, aFileInfo)), GetFile{ pool.get() }), true };
 }
 
-void ShareManager::Directory::File::toXml(OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const {
+ShareManager::Directory::File::Set::iterator ShareManager::Directory::File::Set::erase(iterator aFile) noexcept {
+	pool->removeFile(*aFile.base());
+	return iterator(ids.erase(aFile.base()), GetFile{ pool.get() });
+}
+
+ShareManager::Directory::File::Set::const_iterator ShareManager::Directory::File::Set::find(const string& aNameLower) const noexcept {
+	auto i = lowerBound(aNameLower);
+	return i != ids.end() && pool->compareLower(pool->getFile(*i).nameOffset, aNameLower) == 0 ? const_iterator(i, GetFile{ pool.get() }) : end();
+}
+
+ShareManager::Directory::File::Set::iterator ShareManager::Directory::File::Set::find(const string& aNameLower) noexcept {
+	auto i = ids.begin() + (lowerBound(aNameLower) - ids.begin());
+	return i != ids.end() && pool->compareLower(pool->getFile(*i).nameOffset, aNameLower) == 0 ? iterator(i, GetFile{ pool.get() }) : end();
+}
+
+void ShareManager::Directory::File::toXml(const Directory& aParent, OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const {
 	xmlFile.write(indent);
 	xmlFile.write(LITERAL("<File Name=\""));
-	xmlFile.write(SimpleXML::escape(name.lowerCaseOnly() ? name.getLower() : name.getNormal(), tmp2, true));
+	xmlFile.write(SimpleXML::escape(getName(aParent), tmp2, true));
 	xmlFile.write(LITERAL("\" Size=\""));
 	xmlFile.write(Util::toString(size));
 	xmlFile.write(LITERAL("\" TTH=\""));
@@ -3031,13 +3693,15 @@ ShareManager::FileListDir::~FileListDir() {
 	for_each(listDirs | map_values, DeleteFunction());
 }
 
+string ShareManager::ProfileDirectory::getCachePath() const noexcept {
+	return Util::getPath(Util::PATH_SHARECACHE) + "ShareCache_" + Util::validateFileName(path) + ".bin";
+}
+
 string ShareManager::ProfileDirectory::getCacheXmlPath() const noexcept {
 	return Util::getPath(Util::PATH_SHARECACHE) + "ShareCache_" + Util::validateFileName(path) + ".xml";
 }
 
-#define LITERAL(n) n, sizeof(n)-1
-
-void ShareManager::saveXmlList(function<void(float)> progressF /*nullptr*/) noexcept {
+void ShareManager::saveCache(function<void(float)> progressF /*nullptr*/) noexcept {
 
 	if(xml_saving)
 		return;
@@ -3056,35 +3720,39 @@ void ShareManager::saveXmlList(function<void(float)> progressF /*nullptr*/) noex
 
 		try {
 			parallel_for_each(dirtyDirs.begin(), dirtyDirs.end(), [&](const Directory::Ptr& d) {
-				string path = d->getProfileDir()->getCacheXmlPath();
+				string path = d->getProfileDir()->getCachePath();
 				try {
-					string indent, tmp;
-
 					//create a backup first in case we get interrupted on creation.
 					File ff(path + ".tmp", File::WRITE, File::TRUNCATE | File::CREATE);
-					BufferedOutputStream<false> xmlFile(&ff);
-
-					xmlFile.write(SimpleXML::utf8Header);
-					xmlFile.write(LITERAL("<Share Version=\"" SHARE_CACHE_VERSION));
-					xmlFile.write(LITERAL("\" Path=\""));
-					xmlFile.write(SimpleXML::escape(d->getProfileDir()->getPath(), tmp, true));
 
-					xmlFile.write(LITERAL("\" Date=\""));
-					xmlFile.write(SimpleXML::escape(Util::toString(d->getLastWrite()), tmp, true));
-					xmlFile.write(LITERAL("\">\r\n"));
-					indent += '\t';
+					// the header is written after the counts are known
+					ShareCacheHeader header;
+					memset(&header, 0, sizeof(header));
+					ff.write(&header, sizeof(header));
 
-					for (const auto& child : d->directories) {
-						child->toXmlList(xmlFile, d->getProfileDir()->getPath() + child->realName.getNormal() + PATH_SEPARATOR, indent, tmp);
+					string strings;
+					{
+						BufferedOutputStream<false> cacheFile(&ff);
+						d->toCache(cacheFile, strings, header.directories, header.files);
+						cacheFile.flush();
 					}
-					d->filesToXmlList(xmlFile, indent, tmp);
 
-					xmlFile.write(LITERAL("</Share>"));
-					xmlFile.flush();
+					ff.write(strings);
+
+					memcpy(header.magic, SHARE_CACHE_MAGIC, sizeof(header.magic));
+					header.version = SHARE_CACHE_BIN_VERSION;
+					header.stringsOffset = sizeof(ShareCacheHeader) + header.directories * sizeof(ShareCacheDirectory) + header.files * sizeof(ShareCacheFile);
+					header.stringsSize = strings.size();
+
+					ff.setPos(0);
+					ff.write(&header, sizeof(header));
 					ff.close();
 
 					File::deleteFile(path);
 					File::renameFile(path + ".tmp", path);
+
+					// not needed after it has been converted
+					File::deleteFile(d->getProfileDir()->getCacheXmlPath());
 				} catch (Exception& e) {
 					LogManager::getInstance()->message(STRING_F(SAVE_FAILED_X, path % e.getError()), LogManager::LOG_WARNING);
 				}
@@ -3104,32 +3772,62 @@ void ShareManager::saveXmlList(function<void(float)> progressF /*nullptr*/) noex
 	lastSave = GET_TICK();
 }
 
-void ShareManager::Directory::toXmlList(OutputStream& xmlFile, string&& path, string& indent, string& tmp) {
-	xmlFile.write(indent);
-	xmlFile.write(LITERAL("<Directory Name=\""));
-	xmlFile.write(SimpleXML::escape(realName.lowerCaseOnly() ? realName.getLower() : realName.getNormal(), tmp, true));
+static uint32_t addCacheString(const string& aStr, string& strings_) {
+	if (strings_.size() + aStr.size() > std::numeric_limits<uint32_t>::max())
+		throw ShareException(STRING(SHARE_CACHE_INVALID));
 
-	xmlFile.write(LITERAL("\" Date=\""));
-	xmlFile.write(SimpleXML::escape(Util::toString(lastWrite), tmp, true));
-	xmlFile.write(LITERAL("\">\r\n"));
+	auto offset = static_cast<uint32_t>(strings_.size());
+	strings_ += aStr;
+	return offset;
+}
 
-	indent += '\t';
-	filesToXmlList(xmlFile, indent, tmp);
+void ShareManager::Directory::toCache(OutputStream& aStream, string& strings_, uint32_t& directories_, uint64_t& files_) const {
+	ShareCacheDirectory dir;
+	memset(&dir, 0, sizeof(dir));
 
-	for(const auto& d: directories) {
-		d->toXmlList(xmlFile, path + d->realName.getLower() + PATH_SEPARATOR, indent, tmp);
+	// the name of the root is taken from the path
+	if (parent) {
+		auto name = realName.lowerCaseOnly() ? realName.getLower() : realName.getNormal();
+		dir.nameOffset = addCacheString(name, strings_);
+		dir.nameLen = static_cast<uint32_t>(name.size());
 	}
 
-	indent.erase(indent.length()-1);
-	xmlFile.write(indent);
-	xmlFile.write(LITERAL("</Directory>\r\n"));
+	dir.lastWrite = static_cast<uint32_t>(lastWrite);
+	dir.directories = static_cast<uint32_t>(directories.size());
+	dir.files = static_cast<uint32_t>(files.size());
+	aStream.write(&dir, sizeof(dir));
+	directories_++;
+
+	ShareCacheFile file;
+	memset(&file, 0, sizeof(file));
+	for (const auto& f: files) {
+		auto name = f->getName(*this);
+		file.nameOffset = addCacheString(name, strings_);
+		file.nameLen = static_cast<uint32_t>(name.size());
+		file.lastWrite = static_cast<uint32_t>(f->getLastWrite());
+		file.size = f->getSize();
+		aStream.write(&file, sizeof(file));
+	}
+
+	files_ += files.size();
+
+	for (const auto& d: directories) {
+		d->toCache(aStream, strings_, directories_, files_);
+	}
 }
 
 MemoryInputStream* ShareManager::generateTTHList(const string& dir, bool recurse, ProfileToken aProfile) const noexcept {
 	
 	if(aProfile == SP_HIDDEN)
 		return nullptr;
-	
+
+	auto key = PartialListCache::getKey(aProfile, dir, recurse, true);
+	auto cached = partialListCache.get(key);
+	if (cached) {
+		return new MemoryInputStream(cached);
+	}
+
+	auto revision = partialListCache.getRevision();
 	string tths;
 	string tmp;
 	StringOutputStream sos(tths);
@@ -3150,8 +3848,72 @@ MemoryInputStream* ShareManager::generateTTHList(const string& dir, bool recurse
 		dcdebug("Partial NULL");
 		return nullptr;
 	} else {
-		return new MemoryInputStream(tths);
+		auto ret = new MemoryInputStream(tths);
+		partialListCache.add(key, aProfile, make_shared<const string>(move(tths)), revision);
+		return ret;
+	}
+}
+
+string ShareManager::PartialListCache::getKey(ProfileToken aProfile, const string& aDir, bool aRecurse, bool aTTHList) noexcept {
+	return Util::toString(aProfile) + (aRecurse ? 'R' : 'N') + (aTTHList ? 'T' : 'X') + aDir;
+}
+
+ShareManager::PartialListCache::ListPtr ShareManager::PartialListCache::get(const string& aKey) noexcept {
+	Lock l(cs);
+	auto i = itemMap.find(aKey);
+	if (i == itemMap.end()) {
+		misses++;
+		return nullptr;
 	}
+
+	hits++;
+	items.splice(items.begin(), items, i->second);
+	return i->second->list;
+}
+
+void ShareManager::PartialListCache::add(const string& aKey, ProfileToken aProfile, ListPtr&& aList, uint64_t aRevision) noexcept {
+	if (aList->size() > PARTIAL_LIST_CACHE_MAX_ITEM)
+		return;
+
+	Lock l(cs);
+	if (aRevision != revision || itemMap.find(aKey) != itemMap.end())
+		return;
+
+	bytes += aList->size();
+	items.emplace_front(aKey, aProfile, move(aList));
+	itemMap.emplace(aKey, items.begin());
+
+	while (bytes > PARTIAL_LIST_CACHE_SIZE) {
+		bytes -= items.back().list->size();
+		itemMap.erase(items.back().key);
+		items.pop_back();
+	}
+}
+
+void ShareManager::PartialListCache::remove(const ProfileTokenSet& aProfiles) noexcept {
+	Lock l(cs);
+	revision++;
+	for (auto i = items.begin(); i != items.end();) {
+		if (aProfiles.find(i->profile) != aProfiles.end()) {
+			bytes -= i->list->size();
+			itemMap.erase(i->key);
+			i = items.erase(i);
+		} else {
+			i++;
+		}
+	}
+}
+
+uint64_t ShareManager::PartialListCache::getRevision() const noexcept {
+	Lock l(cs);
+	return revision;
+}
+
+void ShareManager::PartialListCache::getStats(uint64_t& hits_, uint64_t& misses_, size_t& bytes_) const noexcept {
+	Lock l(cs);
+	hits_ = hits;
+	misses_ = misses;
+	bytes_ = bytes;
 }
 
 void ShareManager::Directory::toTTHList(OutputStream& tthList, string& tmp2, bool recursive) const {
@@ -3204,14 +3966,14 @@ bool ShareManager::addDirResult(const string& aPath, SearchResultList& aResults,
 	return false;
 }
 
-void ShareManager::Directory::File::addSR(SearchResultList& aResults, ProfileToken aProfile, bool addParent) const noexcept {
+void ShareManager::Directory::File::addSR(const Directory& aParent, SearchResultList& aResults, ProfileToken aProfile, bool addParent) const noexcept {
 	if (addParent) {
 		//getInstance()->addDirResult(getFullName(aProfile), aResults, aProfile, true);
-		SearchResultPtr sr(new SearchResult(parent->getFullName(aProfile)));
+		SearchResultPtr sr(new SearchResult(aParent.getFullName(aProfile)));
 		aResults.push_back(sr);
 	} else {
 		SearchResultPtr sr(new SearchResult(SearchResult::TYPE_FILE, 
-			size, getFullName(aProfile), getTTH(), getLastWrite(), 1));
+			size, getFullName(aParent, aProfile), getTTH(), getLastWrite(), 1));
 		aResults.push_back(sr);
 	}
 }
@@ -3229,8 +3991,16 @@ void ShareManager::nmdcSearch(SearchResultList& l, const string& nmdcString, int
 * but not the parents...
 */
 
-void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuery& aStrings, ProfileToken aProfile, int level) const noexcept{
+void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuery& aStrings, ProfileToken aProfile, int level, const IndexMatches* aIndexMatches, uint64_t aPathMatches, string& nameLower_) const noexcept{
 	const auto& dirName = getVirtualNameLower(aProfile);
+	if (aIndexMatches) {
+		// nothing to find if the indexed patterns can't be completed within this directory
+		aPathMatches |= aIndexMatches->matchName(dirName, aPathMatches);
+		if (!aIndexMatches->hasMatches(this, aPathMatches)) {
+			return;
+		}
+	}
+
 	if (aStrings.isExcludedLower(dirName)) {
 		return;
 	}
@@ -3280,11 +4050,12 @@ void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuer
 	// Match files
 	if(aStrings.itemType != SearchQuery::TYPE_DIRECTORY) {
 		for(const auto& f: files) {
-			if (!aStrings.matchesFileLower(f->name.getLower(), f->getSize(), f->getLastWrite())) {
+			f->getNameLower(*this, nameLower_);
+			if (!aStrings.matchesFileLower(nameLower_, f->getSize(), f->getLastWrite())) {
 				continue;
 			}
 
-			results_.insert(Directory::SearchResultInfo(f, aStrings, level));
+			results_.insert(Directory::SearchResultInfo(this, f, nameLower_, aStrings, level));
 			if (aStrings.addParents)
 				break;
 		}
@@ -3294,7 +4065,7 @@ void ShareManager::Directory::search(SearchResultInfo::Set& results_, SearchQuer
 	for(const auto& d: directories) {
 		if (d->isLevelExcluded(aProfile))
 			continue;
-		d->search(results_, aStrings, aProfile, level);
+		d->search(results_, aStrings, aProfile, level, aIndexMatches, aPathMatches, nameLower_);
 	}
 
 	// Moving to a lower level
@@ -3316,8 +4087,8 @@ void ShareManager::search(SearchResultList& results, SearchQuery& srch, ProfileT
 		tthSearches++;
 		const auto i = tthIndex.equal_range(const_cast<TTHValue*>(&(*srch.root)));
 		for(auto& f: i | map_values) {
-			if (f->hasProfile(aProfile) && AirUtil::isParentOrExact(aDir, f->getADCPath(aProfile))) {
-				f->addSR(results, aProfile, srch.addParents);
+			if (f.directory->hasProfile(aProfile) && AirUtil::isParentOrExact(aDir, f.file->getADCPath(*f.directory, aProfile))) {
+				f.file->addSR(*f.directory, results, aProfile, srch.addParents);
 				return;
 			}
 		}
@@ -3365,10 +4136,16 @@ void ShareManager::search(SearchResultList& results, SearchQuery& srch, ProfileT
 
 	auto start = GET_TICK();
 
+	// find the directories containing the words of the search
+	IndexMatches indexMatches(srch, searchIndex);
+	if (!indexMatches.empty())
+		indexedSearches++;
+
 	// go them through recursively
 	Directory::SearchResultInfo::Set resultInfos;
+	string nameLower;
 	for (const auto& d: roots) {
-		d->search(resultInfos, srch, aProfile, 0);
+		d->search(resultInfos, srch, aProfile, 0, indexMatches.empty() ? nullptr : &indexMatches, 0, nameLower);
 	}
 
 	// update statistics
@@ -3385,7 +4162,7 @@ void ShareManager::search(SearchResultList& results, SearchQuery& srch, ProfileT
 		if (info.getType() == Directory::SearchResultInfo::DIRECTORY) {
 			addDirResult(info.directory->getFullName(aProfile), results, aProfile, srch);
 		} else {
-			info.file->addSR(results, aProfile, srch.addParents);
+			info.file->addSR(*info.directory, results, aProfile, srch.addParents);
 		}
 	}
 
@@ -3393,12 +4170,64 @@ void ShareManager::search(SearchResultList& results, SearchQuery& srch, ProfileT
 		recursiveSearchesResponded++;
 }
 
+ShareManager::IndexMatches::IndexMatches(const SearchQuery& aSearch, const SearchIndex& aIndex) noexcept {
+	// very common words won't narrow down the search much
+	auto maxItems = max<size_t>(aIndex.getItemCount() / 20, 1000);
+
+	for (const auto& p: aSearch.include.getPatterns()) {
+		if (patterns.size() == 64)
+			break;
+
+		uint64_t pattern = 1ULL << patterns.size();
+		auto found = aIndex.find(p.str(), maxItems, [&](const Directory* d) {
+			// mark the parents as well, they may be matched already by other items
+			for (; d; d = d->getParent()) {
+				auto& matches = subtreeMatches[d];
+				if (matches & pattern)
+					break;
+
+				matches |= pattern;
+			}
+		});
+
+		if (found) {
+			patterns.push_back(&p.str());
+			allPatterns |= pattern;
+		}
+	}
+}
+
+uint64_t ShareManager::IndexMatches::matchName(const string& aNameLower, uint64_t aPathMatches) const noexcept {
+	uint64_t ret = 0;
+	for (size_t i = 0; i < patterns.size(); ++i) {
+		uint64_t pattern = 1ULL << i;
+		if (!(aPathMatches & pattern) && aNameLower.find(*patterns[i]) != string::npos) {
+			ret |= pattern;
+		}
+	}
+
+	return ret;
+}
+
+bool ShareManager::IndexMatches::hasMatches(const Directory* aDir, uint64_t aPathMatches) const noexcept {
+	if ((aPathMatches & allPatterns) == allPatterns)
+		return true;
+
+	auto i = subtreeMatches.find(aDir);
+	return i != subtreeMatches.end() && ((i->second | aPathMatches) & allPatterns) == allPatterns;
+}
+
 void ShareManager::cleanIndices(Directory& dir, const Directory::File* f) noexcept {
 	dir.size -= f->getSize();
 	sharedSize -= f->getSize();
 
+	if (f->searchId != 0) {
+		searchIndex.remove(f->searchId);
+		f->searchId = 0;
+	}
+
 	auto flst = tthIndex.equal_range(const_cast<TTHValue*>(&f->getTTH()));
-	auto p = find(flst | map_values, f);
+	auto p = find_if(flst | map_values, [f](const IndexedFile& aFile) { return aFile.file == f; });
 	if (p.base() != flst.second)
 		tthIndex.erase(p.base());
 	else
@@ -3412,6 +4241,7 @@ void ShareManager::addDirName(Directory::Ptr& dir) noexcept {
 	dcassert(p.base() == directories.second);
 #endif
 	dirNameMap.emplace(const_cast<string*>(&dir->realName.getLower()), dir);
+	dir->searchId = searchIndex.add(dir->realName.getLower(), dir.get());
 }
 
 void ShareManager::removeDirName(Directory& dir) noexcept {
@@ -3421,6 +4251,11 @@ void ShareManager::removeDirName(Directory& dir) noexcept {
 		dirNameMap.erase(p.base());
 	else
 		dcassert(0);
+
+	if (dir.searchId != 0) {
+		searchIndex.remove(dir.searchId);
+		dir.searchId = 0;
+	}
 }
 
 void ShareManager::cleanIndices(Directory& dir) noexcept {
@@ -3559,8 +4394,9 @@ void ShareManager::addFile(const string& aName, Directory::Ptr& aDir, const Hash
 		aDir->files.erase(i);
 	}
 
-	auto it = aDir->files.insert_sorted(new Directory::File(move(dualName), aDir, fi)).first;
+	auto it = aDir->files.add(dualName, fi).first;
 	updateIndices(*aDir, *it, *bloom.get(), sharedSize, tthIndex);
+	(*it)->searchId = searchIndex.add(dualName.getLower(), aDir.get(), (*it)->getNameOffset());
 
 	aDir->copyRootProfiles(dirtyProfiles_, true);
 }
@@ -3592,6 +4428,14 @@ ShareProfileInfo::List ShareManager::getProfileInfos() const noexcept {
 void ShareManager::changeExcludedDirs(const ProfileTokenStringList& aAdd, const ProfileTokenStringList& aRemove) noexcept {
 	ProfileTokenSet dirtyProfiles;
 
+	// the cached list fragments of the parent roots can't be used anymore
+	auto updateRevisions = [](const Directory* aDir) {
+		for (auto d = aDir; d; d = d->getParent()) {
+			if (d->getProfileDir())
+				d->getProfileDir()->updateRevision();
+		}
+	};
+
 	{
 		WLock l (cs);
 
@@ -3599,6 +4443,7 @@ void ShareManager::changeExcludedDirs(const ProfileTokenStringList& aAdd, const
 		for(const auto i: aAdd) {
 			auto dir = findDirectory(i.second, false, false);
 			if (dir) {
+				updateRevisions(dir.get());
 				dirtyProfiles.insert(i.first);
 				if (dir->getProfileDir()) {
 					dir->getProfileDir()->addExclude(i.first);
@@ -3614,6 +4459,10 @@ void ShareManager::changeExcludedDirs(const ProfileTokenStringList& aAdd, const
 
 		//remove existing excludes
 		for(const auto i: aRemove) {
+			auto dir = findDirectory(i.second, false, false, false);
+			if (dir)
+				updateRevisions(dir.get());
+
 			dirtyProfiles.insert(i.first);
 			auto pdPos = profileDirs.find(i.second);
 			if (pdPos != profileDirs.end() && pdPos->second->removeExcludedProfile(i.first) && !pdPos->second->hasRoots()) {
@@ -43,12 +43,15 @@
 #include "StringSearch.h"
 #include "TaskQueue.h"
 #include "Thread.h"
+#include "TokenIndex.h"
 #include "UserConnection.h"
 
 #include "DirectoryMonitor.h"
 #include "DirectoryMonitorListener.h"
 #include "DualString.h"
 
+#include <boost/iterator/transform_iterator.hpp>
+
 namespace dcpp {
 
 STANDARD_EXCEPTION(ShareException);
@@ -182,7 +185,7 @@ public:
 	MemoryInputStream* generateTTHList(const string& dir, bool recurse, ProfileToken aProfile) const noexcept;
 	MemoryInputStream* getTree(const string& virtualFile, ProfileToken aProfile) const noexcept;
 
-	void saveXmlList(function<void (float)> progressF = nullptr) noexcept;	//for filelist caching
+	void saveCache(function<void (float)> progressF = nullptr) noexcept;	//for filelist caching
 
 	AdcCommand getFileInfo(const string& aFile, ProfileToken aProfile) throw(ShareException);
 
@@ -254,7 +257,7 @@ public:
 
 	ShareProfilePtr getShareProfile(ProfileToken aProfile, bool allowFallback = false) const noexcept;
 	void getParentPaths(StringList& aDirs) const noexcept;
-	void countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles, size_t& lowerCaseFiles, size_t& totalStrLen_, size_t& roots_) const noexcept;
+	void countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles, size_t& lowerCaseFiles, size_t& totalStrLen_, size_t& totalMemory_, size_t& roots_) const noexcept;
 
 	void addDirectories(const ShareDirInfo::List& aNewDirs) noexcept;
 	void removeDirectories(const ShareDirInfo::List& removeDirs) noexcept;
@@ -265,6 +268,9 @@ public:
 	void renameProfiles(const ShareProfileInfo::List& aProfiles) noexcept;
 
 	bool isRealPathShared(const string& aPath) noexcept;
+
+	/* Adds the lowercase names of the files in a shared real directory, returns false if the directory isn't shared */
+	bool getRealDirFiles(const string& aPath, StringSet& filesLower_) noexcept;
 	string realToVirtual(const string& aPath, ProfileToken aProfile) noexcept;
 
 	ShareProfilePtr getProfile(ProfileToken aProfile) const noexcept;
@@ -279,7 +285,9 @@ public:
 	mutable SharedMutex cs;
 
 	int addRefreshTask(TaskType aTaskType, StringList& dirs, RefreshType aRefreshType, const string& displayName = Util::emptyString, function<void(float)> progressF = nullptr) noexcept;
+	struct CacheLoader;
 	struct ShareLoader;
+	struct BinaryShareLoader;
 
 	void rebuildMonitoring() noexcept;
 	void handleChangedFiles() noexcept;
@@ -292,6 +300,7 @@ private:
 	uint64_t recursiveSearchTime = 0;
 	uint64_t filteredSearches = 0;
 	uint64_t recursiveSearchesResponded = 0;
+	uint64_t indexedSearches = 0;
 	uint64_t searchTokenCount = 0;
 	uint64_t searchTokenLength = 0;
 	uint64_t autoSearches = 0;
@@ -339,12 +348,25 @@ private:
 				return rootProfiles.at(aProfile).getLower();
 			}
 
+			string getCachePath() const noexcept;
+
+			// cache of the older versions, which is only read for converting it
 			string getCacheXmlPath() const noexcept;
+
+			/* Changes whenever the content of the tree (or the virtual name) changes, unique for all directories */
+			uint64_t getRevision() const noexcept { return revision; }
+			void updateRevision() noexcept;
+		private:
+			uint64_t revision;
+			static atomic<uint64_t> nextRevision;
 	};
 
 	unique_ptr<ShareBloom> bloom;
 
+	class FilePool;
+
 	struct FileListDir;
+	class IndexMatches;
 	class Directory : public intrusive_ptr_base<Directory>, boost::noncopyable {
 	public:
 		typedef boost::intrusive_ptr<Directory> Ptr;
@@ -358,30 +380,86 @@ private:
 
 		class File {
 		public:
-			struct NameLower {
-				const string& operator()(const File* a) const { return a->name.getLower(); }
+			/* Ids of the files of a directory sorted by the lowercase name, the records are stored in the pool (the set owns them and the pool).
+			The iterators return the records from the pool. */
+			class Set : boost::noncopyable {
+				typedef std::vector<uint32_t> IdList;
+
+				struct GetFile {
+					typedef File* result_type;
+					File* operator()(uint32_t aId) const noexcept { return &pool->getFile(aId); }
+					FilePool* pool;
+				};
+			public:
+				typedef boost::transform_iterator<GetFile, IdList::iterator> iterator;
+				typedef boost::transform_iterator<GetFile, IdList::const_iterator> const_iterator;
+
+				explicit Set(const boost::intrusive_ptr<FilePool>& aPool) noexcept : pool(aPool) { }
+				~Set();
+
+				// returns the existing file if there is one with the same name
+				std::pair<iterator, bool> add(const DualString& aName, const HashedFile& aFileInfo) noexcept;
+				iterator erase(iterator aFile) noexcept;
+
+				const_iterator find(const string& aNameLower) const noexcept;
+				iterator find(const string& aNameLower) noexcept;
+
+				iterator begin() noexcept { return iterator(ids.begin(), GetFile{ pool.get() }); }
+				iterator end() noexcept { return iterator(ids.end(), GetFile{ pool.get() }); }
+				const_iterator begin() const noexcept { return const_iterator(ids.begin(), GetFile{ pool.get() }); }
+				const_iterator end() const noexcept { return const_iterator(ids.end(), GetFile{ pool.get() }); }
+
+				File* operator[](size_t aPos) const noexcept { return &pool->getFile(ids[aPos]); }
+				size_t size() const noexcept { return ids.size(); }
+				bool empty() const noexcept { return ids.empty(); }
+
+				size_t capacity() const noexcept { return ids.capacity(); }
+				void reserve(size_t aSize) noexcept { ids.reserve(aSize); }
+				void shrink_to_fit() noexcept { ids.shrink_to_fit(); }
+
+				const FilePool& getPool() const noexcept { return *pool; }
+				const boost::intrusive_ptr<FilePool>& getPoolPtr() const noexcept { return pool; }
+
+				// the files of a directory that is scanned by a separate task are stored in a pool of their own
+				void setPool(const boost::intrusive_ptr<FilePool>& aPool) noexcept { dcassert(empty()); pool = aPool; }
+			private:
+				IdList::const_iterator lowerBound(const string& aNameLower) const noexcept;
+
+				IdList ids;
+				boost::intrusive_ptr<FilePool> pool;
 			};
 
-			//typedef set<File, FileLess> Set;
-			typedef SortedVector<File*, std::vector, string, Compare, NameLower> Set;
+			File(uint32_t aNameOffset, const HashedFile& aFileInfo) noexcept;
 
-			File(DualString&& aName, const Directory::Ptr& aParent, const HashedFile& aFileInfo);
-			~File();
-		
-			inline string getADCPath(ProfileToken aProfile) const noexcept{ return parent->getADCPath(aProfile) + name.getNormal(); }
-			inline string getFullName(ProfileToken aProfile) const noexcept{ return parent->getFullName(aProfile) + name.getNormal(); }
-			inline string getRealPath() const noexcept { return parent->getRealPath(name.getNormal()); }
-			inline bool hasProfile(ProfileToken aProfile) const noexcept { return parent->hasProfile(aProfile); }
+			// the parent isn't stored in the file, the name is looked up from the pool of the containing directory
+			inline string getName(const Directory& aParent) const noexcept { return aParent.files.getPool().getName(nameOffset); }
+			inline string getNameLower(const Directory& aParent) const noexcept { return aParent.files.getPool().getNameLower(nameOffset); }
+			inline void getNameLower(const Directory& aParent, string& name_) const noexcept { aParent.files.getPool().getNameLower(nameOffset, name_); }
+			inline bool isLowerCaseOnly(const Directory& aParent) const noexcept { return aParent.files.getPool().isLowerCaseOnly(nameOffset); }
+			inline const TTHValue& getTTH() const noexcept { return tth; }
+			inline uint32_t getNameOffset() const noexcept { return nameOffset; }
+
+			inline string getADCPath(const Directory& aParent, ProfileToken aProfile) const noexcept{ return aParent.getADCPath(aProfile) + getName(aParent); }
+			inline string getFullName(const Directory& aParent, ProfileToken aProfile) const noexcept{ return aParent.getFullName(aProfile) + getName(aParent); }
+			inline string getRealPath(const Directory& aParent) const noexcept { return aParent.getRealPath(getName(aParent)); }
 
-			void toXml(OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const;
-			void addSR(SearchResultList& aResults, ProfileToken aProfile, bool addParent) const noexcept;
+			void toXml(const Directory& aParent, OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const;
+			void addSR(const Directory& aParent, SearchResultList& aResults, ProfileToken aProfile, bool addParent) const noexcept;
 
 			GETSET(int64_t, size, Size);
-			GETSET(Directory*, parent, Parent);
-			GETSET(uint64_t, lastWrite, LastWrite);
-			GETSET(TTHValue, tth, TTH);
 
-			DualString name;
+			uint64_t getLastWrite() const noexcept { return lastWrite; }
+			void setLastWrite(uint64_t aLastWrite) noexcept { lastWrite = static_cast<uint32_t>(aLastWrite); }
+
+			mutable TokenIndex<Directory>::ItemId searchId = 0;
+		private:
+			TTHValue tth;
+
+			// offset of the name in the name arena of the pool
+			uint32_t nameOffset;
+
+			// seconds, 32 bits will be enough until 2106
+			uint32_t lastWrite;
 		};
 
 		class SearchResultInfo {
@@ -390,8 +468,8 @@ private:
 				bool operator()(const SearchResultInfo& left, const SearchResultInfo& right) const { return left.scores > right.scores; }
 			};
 
-			explicit SearchResultInfo(const File* f, const SearchQuery& aSearch, int aLevel) :
-				file(f), type(FILE), scores(SearchQuery::getRelevancyScores(aSearch, aLevel, false, f->name.getLower())) {
+			explicit SearchResultInfo(const Directory* aParent, const File* f, const string& aNameLower, const SearchQuery& aSearch, int aLevel) :
+				directory(aParent), file(f), type(FILE), scores(SearchQuery::getRelevancyScores(aSearch, aLevel, false, aNameLower)) {
 
 				//init(aSearch, aLevel);
 			}
@@ -408,10 +486,9 @@ private:
 				DIRECTORY
 			};
 
-			union {
-				const Directory* directory;
-				const Directory::File* file;
-			};
+			// the parent directory for files
+			const Directory* directory;
+			const Directory::File* file = nullptr;
 
 			//void init(const SearchQuery& aSearch, int aLevel);
 			Type getType() const { return type; }
@@ -422,8 +499,13 @@ private:
 
 		typedef SortedVector<Ptr, std::vector, string, Compare, NameLower> Set;
 		Set directories;
+
+		// the pool is inherited from the parent
 		File::Set files;
 
+		// the file names are added in the search index by their offset in the pool
+		bool containsIndexedName(uint32_t aNameOffset, const string& aPatternLower) const noexcept { return files.getPool().containsLower(aNameOffset, aPatternLower); }
+
 		static Ptr create(DualString&& aRealName, const Ptr& aParent, uint64_t aLastWrite, ProfileDirectory::Ptr aRoot = nullptr);
 
 		struct HasRootProfile {
@@ -457,15 +539,14 @@ private:
 		int64_t getTotalSize() const noexcept;
 		void getProfileInfo(ProfileToken aProfile, int64_t& totalSize, size_t& filesCount) const noexcept;
 
-		void search(SearchResultInfo::Set& aResults, SearchQuery& aStrings, ProfileToken aProfile, int level) const noexcept;
+		void search(SearchResultInfo::Set& aResults, SearchQuery& aStrings, ProfileToken aProfile, int level, const IndexMatches* aIndexMatches, uint64_t aPathMatches, string& nameLower_) const noexcept;
 
 		void toFileList(FileListDir* aListDir, ProfileToken aProfile, bool isFullList);
 		void toXml(SimpleXML& aXml, bool fullList, ProfileToken aProfile) const;
 		void toTTHList(OutputStream& tthList, string& tmp2, bool recursive) const;
 
 		//for file list caching
-		void toXmlList(OutputStream& xmlFile, string&& path, string& indent, string& tmp);
-		void filesToXmlList(OutputStream& xmlFile, string& indent, string& tmp2) const;
+		void toCache(OutputStream& aStream, string& strings_, uint32_t& directories_, uint64_t& files_) const;
 
 		GETSET(uint64_t, lastWrite, LastWrite);
 		GETSET(Directory*, parent, Parent);
@@ -475,6 +556,9 @@ private:
 		~Directory();
 
 		void copyRootProfiles(ProfileTokenSet& aProfiles, bool setCacheDirty) const noexcept;
+
+		// copies the profiles of the directories whose content differs from the tree that was refreshed (the revisions are updated as well)
+		void copyChangedProfiles(const Directory* aOld, bool aParentsUpdated, ProfileTokenSet& aProfiles) const noexcept;
 		bool isRootLevel(ProfileToken aProfile) const noexcept;
 		inline bool isLevelExcluded(ProfileToken aProfile) const noexcept{ return profileDir && profileDir->isExcluded(aProfile); }
 		bool isLevelExcluded(ProfileTokenSet& aProfiles) const noexcept;
@@ -482,8 +566,9 @@ private:
 
 		void addBloom(ShareBloom& aBloom) const noexcept;
 
-		void countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles, size_t& lowerCaseFiles, size_t& totalStrLen_) const noexcept;
+		void countStats(uint64_t& totalAge_, size_t& totalDirs_, int64_t& totalSize_, size_t& totalFiles, size_t& lowerCaseFiles, size_t& totalStrLen_, size_t& totalMemory_, unordered_set<const FilePool*>& pools_) const noexcept;
 		DualString realName;
+		TokenIndex<Directory>::ItemId searchId = 0;
 
 		// check for an updated modify date from filesystem
 		void updateModifyDate();
@@ -493,6 +578,84 @@ private:
 		friend void intrusive_ptr_release(intrusive_ptr_base<Directory>*);
 
 		string getRealPath(const string& path) const noexcept;
+
+		// compares the files and the names of the subdirectories
+		bool hasSameContent(const Directory& aOld) const noexcept;
+	};
+
+	/* Names and records of the files added by the same refresh task (or loaded from the same cache).
+	The names are stored in an arena as null-terminated lowercase strings, followed by the original name only when it differs.
+	The file records are stored by value in chunks that are never reallocated, the id of a file tells the chunk and the position in it.
+	The addresses stay valid for the TTH index and the search results until the file is removed.
+	Not thread safe, the tasks that scan subtrees in parallel add the files in pools of their own. */
+	class FilePool : public intrusive_ptr_base<FilePool>, boost::noncopyable {
+	public:
+		typedef boost::intrusive_ptr<FilePool> Ptr;
+
+		// returns the offset of the name (the names of removed files are left in the arena until the directory is refreshed)
+		uint32_t addName(const DualString& aName) noexcept;
+
+		string getName(uint32_t aOffset) const noexcept;
+		string getNameLower(uint32_t aOffset) const noexcept;
+		void getNameLower(uint32_t aOffset, string& name_) const noexcept;
+		bool isLowerCaseOnly(uint32_t aOffset) const noexcept { return getHeader(aOffset).nameLen == 0; }
+		int compareLower(uint32_t aOffset, const string& aNameLower) const noexcept;
+		bool containsLower(uint32_t aOffset, const string& aPatternLower) const noexcept;
+
+		// returns the id of the file
+		uint32_t addFile(const DualString& aName, const HashedFile& aFileInfo) noexcept;
+		void removeFile(uint32_t aId) noexcept { freeIds.push_back(aId); }
+
+		Directory::File& getFile(uint32_t aId) noexcept { return fileChunks[aId >> FILE_CHUNK_BITS][aId & (FILE_CHUNK_SIZE - 1)]; }
+		const Directory::File& getFile(uint32_t aId) const noexcept { return fileChunks[aId >> FILE_CHUNK_BITS][aId & (FILE_CHUNK_SIZE - 1)]; }
+
+		size_t getMemoryUsage() const noexcept;
+	private:
+		// the names never span over chunks so that the offsets don't need to be translated
+		static const uint32_t CHUNK_BITS = 16;
+		static const size_t CHUNK_SIZE = 1 << CHUNK_BITS;
+
+		struct NameHeader {
+			uint16_t lowerLen;
+			uint16_t nameLen; // 0 if the name is lowercase
+		};
+
+		NameHeader getHeader(uint32_t aOffset) const noexcept;
+		inline const char* getData(uint32_t aOffset) const noexcept { return &chunks[aOffset >> CHUNK_BITS][(aOffset & (CHUNK_SIZE - 1)) + sizeof(NameHeader)]; }
+
+		vector<vector<char>> chunks;
+
+		// the chunks grow up to the maximum size, small pools of the subtree tasks won't reserve a full chunk
+		static const uint32_t FILE_CHUNK_BITS = 10;
+		static const size_t FILE_CHUNK_SIZE = 1 << FILE_CHUNK_BITS;
+
+		vector<vector<Directory::File>> fileChunks;
+		vector<uint32_t> freeIds;
+	};
+
+	/* Words of the shared directory and file names (files are mapped to their parent directories) */
+	typedef TokenIndex<Directory> SearchIndex;
+	SearchIndex searchIndex;
+
+	/* Include patterns of a search that could be looked up from the search index */
+	class IndexMatches : boost::noncopyable {
+	public:
+		IndexMatches(const SearchQuery& aSearch, const SearchIndex& aIndex) noexcept;
+
+		// the whole tree needs to be searched if no patterns were looked up
+		bool empty() const noexcept { return patterns.empty(); }
+
+		// returns the indexed patterns that are matched by the directory name
+		uint64_t matchName(const string& aNameLower, uint64_t aPathMatches) const noexcept;
+
+		// returns false if the directory and its children can't complete the patterns that aren't matched by the path
+		bool hasMatches(const Directory* aDir, uint64_t aPathMatches) const noexcept;
+	private:
+		vector<const string*> patterns;
+		uint64_t allPatterns = 0;
+
+		// indexed patterns matched by items in the subtree of each directory
+		unordered_map<const Directory*, uint64_t> subtreeMatches;
 	};
 
 	struct FileListDir {
@@ -511,6 +674,45 @@ private:
 		void filesToXml(OutputStream& xmlFile, string& indent, string& tmp2, bool addDate) const;
 	};
 
+	/* Recently generated partial lists, the same directories (especially the root) are requested by many users */
+	class PartialListCache : boost::noncopyable {
+	public:
+		typedef shared_ptr<const string> ListPtr;
+
+		static string getKey(ProfileToken aProfile, const string& aDir, bool aRecurse, bool aTTHList) noexcept;
+
+		ListPtr get(const string& aKey) noexcept;
+
+		// the list is ignored if the profiles have been changed after the revision was taken
+		void add(const string& aKey, ProfileToken aProfile, ListPtr&& aList, uint64_t aRevision) noexcept;
+		void remove(const ProfileTokenSet& aProfiles) noexcept;
+		uint64_t getRevision() const noexcept;
+
+		void getStats(uint64_t& hits_, uint64_t& misses_, size_t& bytes_) const noexcept;
+	private:
+		struct Item {
+			Item(const string& aKey, ProfileToken aProfile, ListPtr&& aList) : key(aKey), profile(aProfile), list(move(aList)) { }
+
+			string key;
+			ProfileToken profile;
+			ListPtr list;
+		};
+
+		// most recently used first
+		typedef list<Item> ItemList;
+		ItemList items;
+		unordered_map<string, ItemList::iterator> itemMap;
+
+		size_t bytes = 0;
+		uint64_t revision = 0;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+
+		mutable CriticalSection cs;
+	};
+
+	mutable PartialListCache partialListCache;
+
 	void addAsyncTask(AsyncF aF) noexcept;
 
 	// Returns the dupe directories by directory name/NMDC path
@@ -524,7 +726,15 @@ private:
 
 	friend class Singleton<ShareManager>;
 
-	typedef unordered_multimap<TTHValue*, const Directory::File*> HashFileMap;
+	/* Files are indexed together with their parent directory (the files don't store it) */
+	struct IndexedFile {
+		IndexedFile(const Directory* aDirectory, const Directory::File* aFile) : directory(aDirectory), file(aFile) { }
+
+		const Directory* directory;
+		const Directory::File* file;
+	};
+
+	typedef unordered_multimap<TTHValue*, IndexedFile> HashFileMap;
 	HashFileMap tthIndex;
 	
 	ShareManager();
@@ -573,49 +783,93 @@ private:
 	DirMap rootPaths;
 	DirMultiMap dirNameMap;
 
-	class RefreshInfo : boost::noncopyable {
+	/* Directories and files added by a single refresh task */
+	class RefreshIndices : boost::noncopyable {
 	public:
-		RefreshInfo(const string& aPath, const Directory::Ptr& aOldRoot, uint64_t aLastWrite);
-		~RefreshInfo();
+		RefreshIndices() : hashSize(0), addedSize(0) { }
 
-		Directory::Ptr oldRoot;
-		Directory::Ptr root;
 		int64_t hashSize;
 		int64_t addedSize;
-		ProfileDirMap subProfiles;
 		DirMultiMap dirNameMapNew;
 		HashFileMap tthIndexNew;
 		DirMap rootPathsNew;
 
+		// the bloom isn't thread safe so it's filled only after the refresh tasks have finished
+		void addBloom(ShareBloom& aBloom) const noexcept;
+		void addSearchIndex(SearchIndex& aIndex) const noexcept;
+	};
+
+	class RefreshInfo : public RefreshIndices {
+	public:
+		RefreshInfo(const string& aPath, const Directory::Ptr& aOldRoot, uint64_t aLastWrite);
+		~RefreshInfo();
+
+		Directory::Ptr oldRoot;
+		Directory::Ptr root;
+		ProfileDirMap subProfiles;
+
 		string path;
+
+		// subdirectories that were scanned by tasks of their own
+		vector<unique_ptr<RefreshIndices>> subtrees;
+		RefreshIndices& addSubtree() noexcept;
+
+		// number of scanning tasks running on the same device (not set if the refresh isn't threaded)
+		shared_ptr<atomic<int>> volumeTasks;
+		int maxVolumeTasks = 1;
+
+		// returns true if a subdirectory on the given level should be scanned by a separate task
+		bool startSubtreeTask(int aLevel) noexcept;
+		void endSubtreeTask() noexcept { (*volumeTasks)--; }
+	private:
+		CriticalSection cs;
 	};
 
 	typedef shared_ptr<RefreshInfo> RefreshInfoPtr;
 	typedef vector<RefreshInfoPtr> RefreshInfoList;
 
+	/* Number of parallel scanning tasks for the directories on the same device */
+	static int getMaxRefreshTasks(const File::BlockDevice& aDevice) noexcept;
+
 	bool handleRefreshedDirectory(RefreshInfoPtr& ri, TaskType aTaskType);
 
+	static void mergeIndices(const RefreshIndices& aIndices, DirMultiMap& aDirNameMap, DirMap& aRootPaths, HashFileMap& aTTHIndex, int64_t& totalHash, int64_t& totalAdded) noexcept {
+		aDirNameMap.insert(aIndices.dirNameMapNew.begin(), aIndices.dirNameMapNew.end());
+		aRootPaths.insert(aIndices.rootPathsNew.begin(), aIndices.rootPathsNew.end());
+		aTTHIndex.insert(aIndices.tthIndexNew.begin(), aIndices.tthIndexNew.end());
+
+		totalHash += aIndices.hashSize;
+		totalAdded += aIndices.addedSize;
+	}
+
+	// the search index can be left out if the items have been indexed already
 	template<typename T>
-	void mergeRefreshChanges(T& aList, DirMultiMap& aDirNameMap, DirMap& aRootPaths, HashFileMap& aTTHIndex, int64_t& totalHash, int64_t& totalAdded, ProfileTokenSet* dirtyProfiles) noexcept {
+	void mergeRefreshChanges(T& aList, DirMultiMap& aDirNameMap, DirMap& aRootPaths, HashFileMap& aTTHIndex, SearchIndex* aSearchIndex, int64_t& totalHash, int64_t& totalAdded, ProfileTokenSet* dirtyProfiles) noexcept {
 		for (const auto& i: aList) {
 			auto& ri = *i;
-			aDirNameMap.insert(ri.dirNameMapNew.begin(), ri.dirNameMapNew.end());
-			aRootPaths.insert(ri.rootPathsNew.begin(), ri.rootPathsNew.end());
-			aTTHIndex.insert(ri.tthIndexNew.begin(), ri.tthIndexNew.end());
+			mergeIndices(ri, aDirNameMap, aRootPaths, aTTHIndex, totalHash, totalAdded);
+			for (const auto& s: ri.subtrees) {
+				mergeIndices(*s, aDirNameMap, aRootPaths, aTTHIndex, totalHash, totalAdded);
+			}
 
-			totalHash += ri.hashSize;
-			totalAdded += ri.addedSize;
+			if (aSearchIndex) {
+				ri.addSearchIndex(*aSearchIndex);
+				for (const auto& s: ri.subtrees) {
+					s->addSearchIndex(*aSearchIndex);
+				}
+			}
 
 			if (dirtyProfiles)
-				ri.root->copyRootProfiles(*dirtyProfiles, true);
+				ri.root->copyChangedProfiles(ri.oldRoot.get(), false, *dirtyProfiles);
 		}
 	}
 
-	void buildTree(string& aPath, string& aPathLower, const Directory::Ptr& aDir, const ProfileDirMap& aSubRoots, DirMultiMap& aDirs, DirMap& newShares, int64_t& hashSize, int64_t& addedSize, HashFileMap& tthIndexNew, ShareBloom& aBloom);
+	void buildTree(string& aPath, string& aPathLower, const Directory::Ptr& aDir, RefreshInfo& aRefresh, RefreshIndices& aIndices, int aLevel);
 	void addFile(const string& aName, Directory::Ptr& aDir, const HashedFile& fi, ProfileTokenSet& dirtyProfiles_) noexcept;
 
-	static void updateIndices(Directory::Ptr& aDirectory, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex, DirMultiMap& aDirNames) noexcept;
+	static void updateIndices(Directory::Ptr& aDirectory, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex, DirMultiMap& aDirNames, SearchIndex& aSearchIndex) noexcept;
 	static void updateIndices(Directory& dir, const Directory::File* f, ShareBloom& aBloom, int64_t& sharedSize, HashFileMap& tthIndex) noexcept;
+	static void updateIndices(Directory& dir, const Directory::File* f, int64_t& sharedSize, HashFileMap& tthIndex) noexcept;
 	void cleanIndices(Directory& dir) noexcept;
 	void addDirName(Directory::Ptr& dir) noexcept;
 	void removeDirName(Directory& dir) noexcept;
@@ -62,6 +62,70 @@ void FileList::saveList() {
 	}
 }
 
+FileListFragmentStream::FileListFragmentStream(FileList::Fragment& aFragment, ParallelBZFilter& aBZFilter, OutputStream& aOutput) : fragment(aFragment), bzFilter(aBZFilter), output(aOutput), tree(TigerTree::BASE_BLOCK_SIZE) {
+	leaf.reserve(TigerTree::BASE_BLOCK_SIZE);
+}
+
+size_t FileListFragmentStream::write(const void* aBuf, size_t aLen) {
+	auto buf = static_cast<const char*>(aBuf);
+	for (size_t pos = 0; pos < aLen;) {
+		if (!block) {
+			block = make_shared<BZBlock>();
+		}
+
+		pos += block->add(buf + pos, aLen - pos);
+		if (block->isFull()) {
+			addBlock();
+		}
+	}
+
+	// hash the full leaves
+	size_t pos = 0;
+	if (!leaf.empty()) {
+		pos = min(aLen, TigerTree::BASE_BLOCK_SIZE - leaf.size());
+		leaf.append(buf, pos);
+		if (leaf.size() == TigerTree::BASE_BLOCK_SIZE) {
+			tree.update(leaf.data(), leaf.size());
+			leaf.clear();
+		}
+	}
+
+	auto len = (aLen - pos) / TigerTree::BASE_BLOCK_SIZE * TigerTree::BASE_BLOCK_SIZE;
+	if (len > 0) {
+		tree.update(buf + pos, len);
+		pos += len;
+	}
+
+	leaf.append(buf + pos, aLen - pos);
+	return aLen;
+}
+
+void FileListFragmentStream::finish(bool aPad) {
+	if (aPad && !leaf.empty()) {
+		// whitespace between the elements
+		write(string(TigerTree::BASE_BLOCK_SIZE - leaf.size(), ' '));
+	}
+
+	if (!leaf.empty()) {
+		tree.update(leaf.data(), leaf.size());
+		leaf.clear();
+	}
+
+	addBlock();
+
+	fragment.leaves = move(tree.getLeaves());
+	fragment.xmlSize = tree.getFileSize();
+}
+
+void FileListFragmentStream::addBlock() {
+	if (block) {
+		fragment.blocks.push_back(block);
+		bzFilter.addBlocks({ block });
+		bzFilter.writeReady(output);
+		block = nullptr;
+	}
+}
+
 ShareProfileInfo::ShareProfileInfo(const string& aName, ProfileToken aToken /*rand*/, State aState /*STATE_NORMAL*/) : name(aName), token(aToken), state(aState), isDefault(false) {}
 
 string ShareProfileInfo::getDisplayName() const {
@@ -25,6 +25,7 @@
 #include "File.h"
 #include "GetSet.h"
 #include "HashValue.h"
+#include "MerkleTree.h"
 #include "Pointer.h"
 #include "TigerHash.h"
 #include "Util.h"
@@ -33,6 +34,8 @@ namespace dcpp {
 
 using std::string;
 
+class BZBlock;
+class ParallelBZFilter;
 
 /*
 A Class that holds info on a profile specific file list
@@ -59,10 +62,55 @@ class FileList {
 		void saveList();
 		CriticalSection cs;
 		int getCurrentNumber() const { return listN; }
+
+		/*
+		Compressed XML of a shared root (or the merged roots with the same virtual name), which is
+		reused in the following lists for as long as the content of the roots stays the same
+		..*/
+		struct Fragment {
+			// content revisions of the roots
+			vector<uint64_t> revisions;
+			vector<shared_ptr<BZBlock>> blocks;
+
+			// the XML is padded to full leaves so that the list can be hashed without it
+			TigerTree::MerkleList leaves;
+			int64_t xmlSize = 0;
+		};
+
+		// lowercase virtual names, protected by cs
+		typedef map<string, Fragment> FragmentMap;
+		FragmentMap fragments;
 	private:
 		int listN = 0;
 };
 
+/*
+Splits the XML of a file list fragment in compression blocks and hashes it
+..*/
+class FileListFragmentStream : public OutputStream {
+public:
+	using OutputStream::write;
+
+	/* The compressed blocks are written to aOutput as soon as they are ready */
+	FileListFragmentStream(FileList::Fragment& aFragment, ParallelBZFilter& aBZFilter, OutputStream& aOutput);
+
+	size_t write(const void* aBuf, size_t aLen);
+	size_t flush() { return 0; }
+
+	/* Adds the remaining data to the compressor, the fragments are padded to full leaves unless they end the list */
+	void finish(bool aPad);
+private:
+	void addBlock();
+
+	FileList::Fragment& fragment;
+	ParallelBZFilter& bzFilter;
+	OutputStream& output;
+
+	shared_ptr<BZBlock> block;
+	TigerTree tree;
+	string leaf;
+};
+
 class ShareProfileInfo;
 typedef boost::intrusive_ptr<ShareProfileInfo> ShareProfileInfoPtr;
 
@@ -25,6 +25,10 @@
 #include "TimerManager.h"
 #include "ResourceManager.h"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 /// @todo remove when MinGW has this
 #ifdef __MINGW32__
 #ifndef EADDRNOTAVAIL
@@ -597,6 +601,36 @@ int Socket::write(const void* aBuffer, int aLen) {
 	return sent;
 }
 
+int Socket::sendFile(int aFd, int64_t aPos, int aLen) {
+#ifdef __linux__
+	for(;;) {
+		off_t offset = static_cast<off_t>(aPos);
+		auto sent = ::sendfile(getSock(), aFd, &offset, aLen);
+		if(sent >= 0) {
+			// nothing is sent if the file has been truncated, the regular reads will notice that
+			stats.totalUp += sent;
+			return static_cast<int>(sent);
+		}
+
+		auto error = getLastError();
+		if(error == EWOULDBLOCK || error == ENOBUFS || error == EAGAIN) {
+			return -1;
+		}
+
+		if(error == EINVAL || error == ENOSYS || error == EOPNOTSUPP) {
+			// not supported by the file system
+			return 0;
+		}
+
+		if(error != EINTR) {
+			throw SocketException(error);
+		}
+	}
+#else
+	return 0;
+#endif
+}
+
 /**
  * Sends data, will block until all data has been sent or an exception occurs
  * @param aBuffer Buffer with data
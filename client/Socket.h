@@ -117,6 +117,14 @@ public:
 	void writeAll(const void* aBuffer, int aLen, uint32_t timeout = 0);
 	virtual int write(const void* aBuffer, int aLen);
 	int write(const string& aData) { return write(aData.data(), (int)aData.length()); }
+
+	/**
+	 * Sends a range of a file without copying it through the user space
+	 * @return The number of bytes sent, -1 if the call would block or 0 if the data can't be sent
+	 * directly (write() should be used instead)
+	 * @throw SocketException Send failed.
+	 */
+	virtual int sendFile(int aFd, int64_t aPos, int aLen);
 	virtual void writeTo(const string& aIp, const string& aPort, const void* aBuffer, int aLen, bool proxy = true);
 	void writeTo(const string& aIp, const string& aPort, const string& aData) { writeTo(aIp, aPort, aData.data(), (int)aData.length()); }
 	virtual void shutdown() noexcept;
@@ -162,6 +170,9 @@ public:
 
 	void setBlocking(bool block) noexcept;
 
+	/** Both descriptors are open while a connection attempt is in progress (INVALID_SOCKET if not used) */
+	std::pair<socket_t, socket_t> getDescriptors() const noexcept { return std::make_pair(sock4.get(), sock6.get()); }
+
 	string getLocalIp() noexcept;
 	uint16_t getLocalPort() noexcept;
 
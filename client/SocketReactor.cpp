@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2011-2015 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "stdinc.h"
+#include "SocketReactor.h"
+
+#include "BufferedSocket.h"
+#include "TimerManager.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+namespace dcpp {
+
+#define MAX_LOOPS 4
+#define BLOCKING_THREADS 4
+#define MAX_EVENTS 256
+
+SocketReactor::SocketReactor() : blockingPos(0) {
+	auto loopCount = min(max(static_cast<int>(std::thread::hardware_concurrency()), 1), MAX_LOOPS);
+	for (int i = 0; i < loopCount; ++i) {
+		loops.emplace_back(new Loop());
+		loops.back()->start();
+	}
+
+	for (int i = 0; i < BLOCKING_THREADS; ++i) {
+		blockingQueues.emplace_back(new DispatcherQueue(true));
+	}
+}
+
+SocketReactor::~SocketReactor() {
+	for (auto& l: loops) {
+		l->stop();
+	}
+
+	for (auto& l: loops) {
+		l->join();
+	}
+}
+
+SocketReactor::Loop* SocketReactor::addSocket(BufferedSocket* aSock) noexcept {
+	auto loop = min_element(loops.begin(), loops.end(), [](const unique_ptr<Loop>& a, const unique_ptr<Loop>& b) {
+		return a->getSocketCount() < b->getSocketCount();
+	})->get();
+
+	loop->add(aSock);
+	return loop;
+}
+
+void SocketReactor::callBlocking(DispatcherQueue::Callback&& aF) noexcept {
+	blockingQueues[blockingPos++ % blockingQueues.size()]->addTask(move(aF));
+}
+
+SocketReactor::Loop::Loop() : socketCount(0) {
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	dcassert(efd >= 0 && wakeFd >= 0);
+
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = wakeFd;
+	epoll_ctl(efd, EPOLL_CTL_ADD, wakeFd, &ev);
+}
+
+SocketReactor::Loop::~Loop() {
+	::close(wakeFd);
+	::close(efd);
+}
+
+void SocketReactor::Loop::add(BufferedSocket* /*aSock*/) noexcept {
+	socketCount++;
+}
+
+void SocketReactor::Loop::remove(BufferedSocket* aSock) noexcept {
+	{
+		Lock l(cs);
+		pending.erase(std::remove(pending.begin(), pending.end(), aSock), pending.end());
+	}
+
+	for (auto i = timers.begin(); i != timers.end();) {
+		if (i->second == aSock) {
+			timers.erase(i++);
+		} else {
+			++i;
+		}
+	}
+
+	for (auto i = descriptors.begin(); i != descriptors.end();) {
+		if (i->second == aSock) {
+			epoll_ctl(efd, EPOLL_CTL_DEL, i->first, nullptr);
+			descriptors.erase(i++);
+		} else {
+			++i;
+		}
+	}
+
+	socketCount--;
+}
+
+void SocketReactor::Loop::schedule(BufferedSocket* aSock) noexcept {
+	Lock l(cs);
+	if (aSock->scheduled)
+		return;
+
+	aSock->scheduled = true;
+	pending.push_back(aSock);
+	if (pending.size() == 1) {
+		wake();
+	}
+}
+
+void SocketReactor::Loop::wake() noexcept {
+	uint64_t one = 1;
+	auto ret = ::write(wakeFd, &one, sizeof(one));
+	(void)ret;
+}
+
+void SocketReactor::Loop::stop() noexcept {
+	Lock l(cs);
+	stopping = true;
+	wake();
+}
+
+void SocketReactor::Loop::setTimer(BufferedSocket* aSock, uint64_t aTick) noexcept {
+	auto range = timers.equal_range(aTick);
+	if (find_if(range.first, range.second, [aSock](const pair<const uint64_t, BufferedSocket*>& t) { return t.second == aSock; }) != range.second) {
+		return;
+	}
+
+	timers.emplace(aTick, aSock);
+}
+
+void SocketReactor::Loop::watch(BufferedSocket* aSock, socket_t aFd, bool aRead) noexcept {
+	// Edge triggered: the socket reads and writes until the call would block before waiting for the next event
+	// The incoming data isn't waited for while the reading has been paused
+	epoll_event ev = {};
+	ev.events = (aRead ? static_cast<uint32_t>(EPOLLIN) : 0u) | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = aFd;
+
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, aFd, &ev) != 0 && errno == EEXIST) {
+		epoll_ctl(efd, EPOLL_CTL_MOD, aFd, &ev);
+	}
+
+	descriptors[aFd] = aSock;
+}
+
+void SocketReactor::Loop::unwatch(BufferedSocket* aSock, socket_t aFd) noexcept {
+	auto i = descriptors.find(aFd);
+	if (i == descriptors.end() || i->second != aSock) {
+		// closed and reused by another socket already
+		return;
+	}
+
+	// the descriptor may have been closed already, which removes it from the set automatically
+	epoll_ctl(efd, EPOLL_CTL_DEL, aFd, nullptr);
+	descriptors.erase(i);
+}
+
+int SocketReactor::Loop::getTimeout() const noexcept {
+	if (timers.empty())
+		return -1;
+
+	auto tick = GET_TICK();
+	return timers.begin()->first <= tick ? 0 : static_cast<int>(timers.begin()->first - tick);
+}
+
+int SocketReactor::Loop::run() {
+	epoll_event events[MAX_EVENTS];
+	vector<BufferedSocket*> batch;
+
+	for (;;) {
+		int n = epoll_wait(efd, events, MAX_EVENTS, getTimeout());
+		if (n < 0 && errno != EINTR) {
+			dcdebug("SocketReactor: epoll_wait failed (%d)\n", errno);
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			if (events[i].data.fd == wakeFd) {
+				uint64_t count;
+				auto ret = ::read(wakeFd, &count, sizeof(count));
+				(void)ret;
+				continue;
+			}
+
+			auto s = descriptors.find(events[i].data.fd);
+			if (s != descriptors.end()) {
+				schedule(s->second);
+			}
+		}
+
+		auto tick = GET_TICK();
+		while (!timers.empty() && timers.begin()->first <= tick) {
+			schedule(timers.begin()->second);
+			timers.erase(timers.begin());
+		}
+
+		{
+			Lock l(cs);
+			if (stopping)
+				break;
+
+			pending.swap(batch);
+			for (auto s: batch) {
+				s->scheduled = false;
+			}
+		}
+
+		for (auto s: batch) {
+			s->process();
+		}
+
+		batch.clear();
+	}
+
+	return 0;
+}
+
+} // namespace dcpp
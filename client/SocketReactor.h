@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2011-2015 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_SOCKET_REACTOR_H
+#define DCPLUSPLUS_DCPP_SOCKET_REACTOR_H
+
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "CriticalSection.h"
+#include "DispatcherQueue.h"
+#include "Singleton.h"
+#include "Socket.h"
+#include "Thread.h"
+#include "atomic.h"
+
+namespace dcpp {
+
+using std::multimap;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+class BufferedSocket;
+
+/**
+ * Readiness based I/O for all BufferedSockets (hubs, client connections and HTTP).
+ *
+ * The sockets are divided between a small fixed number of epoll loops. All tasks, timers and
+ * readiness events of a single socket are handled by the loop it was assigned to, so the
+ * listeners of a socket still get called from one thread only.
+ *
+ * Operations that may block for a long time (name resolution, SOCKS5 negotiation, reading the
+ * uploaded files) are run in a separate pool of threads so that they won't stall the other sockets
+ * of the loop. The listeners of the transfer connections pass their disk I/O and list generation
+ * to the queues of the respective managers.
+ */
+class SocketReactor : public Singleton<SocketReactor> {
+public:
+	class Loop : public Thread {
+	public:
+		Loop();
+		~Loop();
+
+		/* Any thread */
+		void add(BufferedSocket* aSock) noexcept;
+		void schedule(BufferedSocket* aSock) noexcept;
+		size_t getSocketCount() const noexcept { return socketCount; }
+
+		/* Loop thread only */
+		void remove(BufferedSocket* aSock) noexcept;
+		void setTimer(BufferedSocket* aSock, uint64_t aTick) noexcept;
+		void watch(BufferedSocket* aSock, socket_t aFd, bool aRead) noexcept;
+		void unwatch(BufferedSocket* aSock, socket_t aFd) noexcept;
+
+		void stop() noexcept;
+	private:
+		int run();
+
+		int getTimeout() const noexcept;
+		void wake() noexcept;
+
+		int efd = -1;
+		int wakeFd = -1;
+		bool stopping = false;
+
+		CriticalSection cs;
+		vector<BufferedSocket*> pending;
+		atomic<long> socketCount;
+
+		// loop thread only
+		unordered_map<socket_t, BufferedSocket*> descriptors;
+		multimap<uint64_t, BufferedSocket*> timers;
+	};
+
+	/** Assign a new socket to the least loaded loop */
+	Loop* addSocket(BufferedSocket* aSock) noexcept;
+
+	/** Run a blocking operation outside the loop threads */
+	void callBlocking(DispatcherQueue::Callback&& aF) noexcept;
+
+	size_t getLoopCount() const noexcept { return loops.size(); }
+private:
+	friend class Singleton<SocketReactor>;
+
+	SocketReactor();
+	~SocketReactor();
+
+	vector<unique_ptr<Loop>> loops;
+	vector<unique_ptr<DispatcherQueue>> blockingQueues;
+	atomic<long> blockingPos;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_SOCKET_REACTOR_H)
@@ -84,6 +84,14 @@ public:
 	/* This only works for file streams */
 	virtual void setPos(int64_t /*pos*/) noexcept { }
 	virtual InputStream* releaseRootStream() { return this; }
+
+	/**
+	 * Zero-copy transfers: returns the descriptor of the file that the stream reads as such (-1 if there isn't one).
+	 * pos_ and bytes_ are set to the range of the file that the next reads would return.
+	 */
+	virtual int getFileRange(int64_t& /*pos_*/, int64_t& /*bytes_*/) noexcept { return -1; }
+	/* Zero-copy transfers: the bytes at the beginning of the file range were sent without reading them */
+	virtual void skipFileRange(int64_t /*aBytes*/) noexcept { }
 };
 
 class MemoryInputStream : public InputStream {
@@ -95,13 +103,17 @@ public:
 		memcpy(buf, src.data(), src.size());
 	}
 
+	/** Reads the data without copying it, the owner keeps the data alive while the stream exists */
+	MemoryInputStream(const uint8_t* src, size_t len, shared_ptr<const void> aOwner) : pos(0), size(len), buf(nullptr), data(src), owner(move(aOwner)) { }
+	MemoryInputStream(const shared_ptr<const string>& src) : MemoryInputStream((const uint8_t*)src->data(), src->size(), src) { }
+
 	~MemoryInputStream() {
 		delete[] buf;
 	}
 
 	size_t read(void* tgt, size_t& len) {
 		len = min(len, size - pos);
-		memcpy(tgt, buf+pos, len);
+		memcpy(tgt, (buf ? buf : data)+pos, len);
 		pos += len;
 		return len;
 	}
@@ -112,6 +124,10 @@ private:
 	size_t pos;
 	size_t size;
 	uint8_t* buf;
+
+	// shared data
+	const uint8_t* data = nullptr;
+	shared_ptr<const void> owner;
 };
 
 class IOStream : public InputStream, public OutputStream {
@@ -171,6 +187,16 @@ public:
 		auto as = s.release();
 		return as->releaseRootStream();
 	}
+
+	int getFileRange(int64_t& pos_, int64_t& bytes_) noexcept {
+		auto fd = s->getFileRange(pos_, bytes_);
+		bytes_ = min(bytes_, maxBytes);
+		return fd;
+	}
+	void skipFileRange(int64_t aBytes) noexcept {
+		s->skipFileRange(aBytes);
+		maxBytes -= aBytes;
+	}
 private:
 	unique_ptr<InputStream> s;
 	int64_t maxBytes;
@@ -1456,7 +1456,7 @@ std::string dcpp::ResourceManager::strings[] = {
 "Active mode with NAT-PMP / UPnP (let the client configure my router)", 
 "Active mode (no router or manual router configuration)", 
 "Manual router/firewall configuration", 
-"Maximum number of hashers per volume", 
+"Maximum number of hashers per volume (0 = detect from the device)", 
 "Maximum number of hashing threads", 
 "Hashing options", 
 "Refreshing options", 
@@ -1600,6 +1600,9 @@ std::string dcpp::ResourceManager::strings[] = {
 "The hash database has been upgraded.\r\n\r\nConverted file entries: %1%\r\nConverted tree entries: %2%\r\nFailed tree entries: %3%\r\n\r\nThe old database files in the settings directory have been renamed to HashIndex.xml.bak (%4%) and HashData.dat.bak (%5%). Those files can safely be removed.", 
 "Compacting %1%...", 
 "File index", 
+"Upgrading the file index in the background...", 
+"The file index has been upgraded (%1% file entries converted)", 
+"The share cache file is invalid", 
 "Hash data", 
 "Open log directory", 
 "Repairing %1%", 
@@ -1882,6 +1885,9 @@ std::string dcpp::ResourceManager::strings[] = {
 "Integrity check finished: %1% of failed segments were found", 
 "List view colors", 
 "Font used in list views (User list, Search, Queue, Transfers...)", 
+"Maximum number of refresh threads per volume (0 = detect from the device)", 
+"Flush the hash database writes to disk (safer but slower)", 
+"Size of the cache for recently used hash trees (MiB, 0 = disabled)", 
 };
 std::string dcpp::ResourceManager::names[] = {
 "Active", 
@@ -3482,6 +3488,9 @@ std::string dcpp::ResourceManager::names[] = {
 "DbMigrationComplete", 
 "CompactingX", 
 "FileIndex", 
+"FileIndexUpgrading", 
+"FileIndexUpgraded", 
+"ShareCacheInvalid", 
 "HashData", 
 "OpenLogDir", 
 "RepairingX", 
@@ -3764,4 +3773,7 @@ std::string dcpp::ResourceManager::names[] = {
 "IntegrityCheckFinishedFiles", 
 "ListViewColors", 
 "ListTextstyle", 
+"MaxVolRefreshThreads", 
+"SyncHashDbWrites", 
+"TreeCacheSize", 
 };
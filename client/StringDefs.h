@@ -1460,7 +1460,7 @@ enum Strings { // @DontAdd
 	SETTINGS_ACTIVE_UPNP, // "Active mode with NAT-PMP / UPnP (let the client configure my router)"
 	SETTINGS_ACTIVE, // "Active mode (no router or manual router configuration)"
 	SETTINGS_MANUAL_CONFIG, // "Manual router/firewall configuration"
-	MAX_VOL_HASHERS, // "Maximum number of hashers per volume"
+	MAX_VOL_HASHERS, // "Maximum number of hashers per volume (0 = detect from the device)"
 	MAX_HASHING_THREADS, // "Maximum number of hashing threads"
 	HASHING_OPTIONS, // "Hashing options"
 	REFRESH_OPTIONS, // "Refreshing options"
@@ -1604,6 +1604,9 @@ enum Strings { // @DontAdd
 	DB_MIGRATION_COMPLETE, // "The hash database has been upgraded.\r\n\r\nConverted file entries: %1%\r\nConverted tree entries: %2%\r\nFailed tree entries: %3%\r\n\r\nThe old database files in the settings directory have been renamed to HashIndex.xml.bak (%4%) and HashData.dat.bak (%5%). Those files can safely be removed."
 	COMPACTING_X, // "Compacting %1%..."
 	FILE_INDEX, // "File index"
+	FILE_INDEX_UPGRADING, // "Upgrading the file index in the background..."
+	FILE_INDEX_UPGRADED, // "The file index has been upgraded (%1% file entries converted)"
+	SHARE_CACHE_INVALID, // "The share cache file is invalid"
 	HASH_DATA, // "Hash data"
 	OPEN_LOG_DIR, // "Open log directory"
 	REPAIRING_X, // "Repairing %1%"
@@ -1886,5 +1889,8 @@ enum Strings { // @DontAdd
 	INTEGRITY_CHECK_FINISHED_FILES, // "Integrity check finished: %1% of failed segments were found"
 	LIST_VIEW_COLORS, // "List view colors"
 	LIST_TEXTSTYLE, // "Font used in list views (User list, Search, Queue, Transfers...)"
+	MAX_VOL_REFRESH_THREADS, // "Maximum number of refresh threads per volume (0 = detect from the device)"
+	SYNC_HASH_DB_WRITES, // "Flush the hash database writes to disk (safer but slower)"
+	TREE_CACHE_SIZE, // "Size of the cache for recently used hash trees (MiB, 0 = disabled)"
 	LAST // @DontAdd
 };
@@ -36,8 +36,9 @@ namespace dcpp {
 /*
  * Throttles traffic and reads a packet from the network
  */
-int ThrottleManager::read(Socket* sock, void* buffer, size_t len)
+int ThrottleManager::read(Socket* sock, void* buffer, size_t len, bool& limited_)
 {
+	limited_ = false;
 	int64_t readSize = -1;
 	size_t downs = DownloadManager::getInstance()->getDownloadCount();
 	auto downLimit = getDownLimit(); // avoid even intra-function races
@@ -57,17 +58,13 @@ int ThrottleManager::read(Socket* sock, void* buffer, size_t len)
 
 			if(readSize > 0)
 				downTokens -= readSize;
+		} else {
+			limited_ = true;
 		}
 	}
 
-	if(readSize != -1)
-	{
-		Thread::yield(); // give a chance to other transfers to get a token
-		return readSize;
-	}
-
-	waitToken();
-	return -1;	// from BufferedSocket: -1 = retry, 0 = connection close
+	// -1 if there were no tokens left, the socket will retry after a while
+	return static_cast<int>(readSize);	// from BufferedSocket: -1 = retry, 0 = connection close
 }
 
 /*
@@ -76,36 +73,47 @@ int ThrottleManager::read(Socket* sock, void* buffer, size_t len)
  */
 int ThrottleManager::write(Socket* sock, void* buffer, size_t& len)
 {
-	bool gotToken = false;
+	if(getUpTokens(len))
+	{
+		// write to socket			
+		return sock->write(buffer, len);
+	}
+
+	// no tokens left, the socket will retry after a while
+	return 0;	// from BufferedSocket: -1 = failed, 0 = retry
+}
+
+bool ThrottleManager::getUpTokens(size_t& len)
+{
 	size_t ups = UploadManager::getInstance()->getUploadCount();
 	auto upLimit = getUpLimit(); // avoid even intra-function races
 	if(!getCurThrottling() || upLimit == 0 || ups == 0)
-		return sock->write(buffer, len);
+		return true;
 
-	{
-		Lock l(upCS);
+	Lock l(upCS);
 
-		if(upTokens > 0)
-		{
-			size_t slice = (upLimit * 1024) / ups;
-			len = min(slice, min(len, static_cast<size_t>(upTokens)));
-			upTokens -= len;
+	if(upTokens > 0)
+	{
+		size_t slice = (upLimit * 1024) / ups;
+		len = min(slice, min(len, static_cast<size_t>(upTokens)));
+		upTokens -= len;
 
-			gotToken = true; // token successfuly assigned
-		}
+		return true; // token successfuly assigned
 	}
 
-	if(gotToken)
-	{
-		// write to socket			
-		int sent = sock->write(buffer, len);
+	return false;
+}
 
-		Thread::yield(); // give a chance to other transfers get a token
-		return sent;
-	}
+void ThrottleManager::returnUpTokens(size_t len)
+{
+	auto upLimit = getUpLimit();
+	if(len == 0 || !getCurThrottling() || upLimit == 0)
+		return;
 
-	waitToken();
-	return 0;	// from BufferedSocket: -1 = failed, 0 = retry
+	Lock l(upCS);
+
+	// the bucket may have been refilled meanwhile
+	upTokens = min(upTokens + static_cast<int64_t>(len), static_cast<int64_t>(upLimit) * 1024);
 }
 
 SettingsManager::IntSetting ThrottleManager::getCurSetting(SettingsManager::IntSetting setting) {
@@ -156,24 +164,7 @@ void ThrottleManager::setSetting(SettingsManager::IntSetting setting, int value)
 }
 
 bool ThrottleManager::getCurThrottling() {
-	Lock l(stateCS);
-	return activeWaiter != -1;
-}
-
-void ThrottleManager::waitToken() {
-	// no tokens, wait for them, so long as throttling still active
-	// avoid keeping stateCS lock on whole function
-	CriticalSection *curCS = 0;
-	{
-		Lock l(stateCS);
-		if (activeWaiter != -1)
-			curCS = &waitCS[activeWaiter];
-	}
-	// possible post-CS aW shifts: 0->1/1->0: lock lands in wrong place, will
-	// either fall through immediately or wait depending on whether in
-	// stateCS-protected transition elsewhere; 0/1-> -1: falls through. Both harmless.
-	if (curCS)
-		Lock l(*curCS);
+	return active;
 }
 
 ThrottleManager::~ThrottleManager(void)
@@ -183,11 +174,7 @@ ThrottleManager::~ThrottleManager(void)
 }
 
 void ThrottleManager::shutdown() {
-	Lock l(stateCS);
-	if (activeWaiter != -1) {
-		waitCS[activeWaiter].unlock();
-		activeWaiter = -1;
-	}
+	active = false;
 }
 
 // TimerManagerListener
@@ -198,14 +185,6 @@ void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noe
 	//	setSetting(SettingsManager::SLOTS, newSlots);
 	//}
 
-	{
-		Lock l(stateCS);
-		if (activeWaiter == -1)
-			// This will create slight weirdness for the read/write calls between
-			// here and the first activeWaiter-toggle below.
-			waitCS[activeWaiter = 0].lock();
-	}
-
 	// readd tokens
 	{
 		Lock l(downCS);
@@ -217,17 +196,7 @@ void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noe
 		upTokens = getUpLimit() * 1024;
 	}
 
-	// let existing events drain out (fairness).
-	// www.cse.wustl.edu/~schmidt/win32-cv-1.html documents various
-	// fairer strategies, but when only broadcasting, irrelevant
-	{
-		Lock l(stateCS);
-
-		dcassert(activeWaiter == 0 || activeWaiter == 1);
-		waitCS[1-activeWaiter].lock();
-		activeWaiter = 1-activeWaiter;
-		waitCS[1-activeWaiter].unlock();
-	}
+	active = true;
 }
 
 }	// namespace dcpp
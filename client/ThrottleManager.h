@@ -23,6 +23,7 @@
 #include "Socket.h"
 #include "TimerManager.h"
 #include "SettingsManager.h"
+#include "atomic.h"
 
 namespace dcpp
 {
@@ -37,8 +38,9 @@ namespace dcpp
 
 		/*
 		 * Throttles traffic and reads a packet from the network
+		 * Doesn't block when the limit has been reached; -1 is returned with limited_ set and the caller should try again later
 		 */
-		int read(Socket* sock, void* buffer, size_t len);
+		int read(Socket* sock, void* buffer, size_t len, bool& limited_);
 
 		/*
 		 * Throttles traffic and writes a packet to the network
@@ -46,6 +48,17 @@ namespace dcpp
 		 */
 		int write(Socket* sock, void* buffer, size_t& len);
 
+		/*
+		 * Limits len to the amount that may be uploaded now (for writes that don't go through write())
+		 * Returns false if there are no upload tokens left and the caller should try again later
+		 */
+		bool getUpTokens(size_t& len);
+
+		/*
+		 * Gives back the upload tokens from getUpTokens that weren't used (partial writes)
+		 */
+		void returnUpTokens(size_t len);
+
 		void shutdown();
 
 		static SettingsManager::IntSetting getCurSetting(SettingsManager::IntSetting setting);
@@ -58,10 +71,8 @@ namespace dcpp
 		static const int MAX_LIMIT = 1024 * 1024; // 1 GiB/s
 
 	private:
-		// stack up throttled read & write threads
-		CriticalSection stateCS;
-		CriticalSection waitCS[2];
-		long activeWaiter;
+		// tokens are being handed out (set after the first refill)
+		atomic<bool> active;
 
 		// download limiter
 		CriticalSection	downCS;
@@ -73,7 +84,7 @@ namespace dcpp
 
 		friend class Singleton<ThrottleManager>;
 
-		ThrottleManager() : activeWaiter(-1), downTokens(0), upTokens(0)
+		ThrottleManager() : active(false), downTokens(0), upTokens(0)
 		{
 			TimerManager::getInstance()->addListener(this);
 		}
@@ -81,7 +92,6 @@ namespace dcpp
 		virtual ~ThrottleManager();
 
 		bool getCurThrottling();
-		void waitToken();
 
 		// TimerManagerListener
 		void on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept;
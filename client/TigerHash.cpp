@@ -42,6 +42,11 @@
 #define TIGER_ARCH64
 #endif
 
+#if defined(__GNUC__) && (defined(__amd64__) || defined(__x86_64__))
+#define TIGER_SIMD
+#include <immintrin.h>
+#endif
+
 namespace dcpp {
 
 #define PASSES 3
@@ -249,6 +254,261 @@ uint8_t* TigerHash::finalize() {
 	return getResult();
 }
 
+void TigerHash::hashLeaves(const uint8_t* aData, size_t aBlockSize, size_t aCount, uint8_t* aResults) {
+	auto done = hashLeavesSimd(aData, aBlockSize, aCount, aResults, getSimdLanes());
+	hashLeavesScalar(aData + done * aBlockSize, aBlockSize, aCount - done, aResults + done * BYTES);
+}
+
+size_t TigerHash::getSimdLanes() {
+	static const size_t lanes = [] {
+		// known answer test, fall back to the narrower implementations if the results are wrong
+		auto ret = detectSimdLanes();
+		while (ret > 0 && !verifyLeaves(ret)) {
+			ret = ret == 8 ? 4 : 0;
+		}
+		return ret;
+	}();
+
+	return lanes;
+}
+
+bool TigerHash::verifySimd() {
+	auto lanes = detectSimdLanes();
+	return lanes == 0 || verifyLeaves(lanes);
+}
+
+bool TigerHash::verifyLeaves(size_t aLanes) {
+	// a block size that isn't a power of two catches wrong lane offsets as well
+	const size_t blockSizes[] = { BLOCK_SIZE, 1024 + BLOCK_SIZE };
+	const size_t maxCount = MAX_LEAVES * 2 + 1;
+
+	vector<uint8_t> data(maxCount * blockSizes[1]);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>(i * 131 + (i >> 8));
+	}
+
+	uint8_t expected[maxCount * BYTES];
+	uint8_t results[maxCount * BYTES];
+	for (auto bs: blockSizes) {
+		for (size_t count = 1; count <= maxCount; count += 2) {
+			hashLeavesScalar(&data[0], bs, count, expected);
+
+			auto done = hashLeavesSimd(&data[0], bs, count, results, aLanes);
+			hashLeavesScalar(&data[done * bs], bs, count - done, results + done * BYTES);
+
+			if (memcmp(expected, results, count * BYTES) != 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+size_t TigerHash::hashLeavesSimd(const uint8_t* aData, size_t aBlockSize, size_t aCount, uint8_t* aResults, size_t aLanes) {
+	if (aLanes == 0 || aBlockSize % BLOCK_SIZE != 0)
+		return 0;
+
+	size_t done = 0;
+	while (aCount - done >= 4) {
+		auto data = aData + done * aBlockSize;
+		auto results = aResults + done * BYTES;
+
+		size_t n;
+		if (aLanes == 8 && aCount - done >= 8) {
+			hashLeavesAvx512(data, aBlockSize, results);
+			n = 8;
+		} else {
+			hashLeavesAvx2(data, aBlockSize, results);
+			n = 4;
+		}
+
+#ifdef _DEBUG
+		// compare every lane with the scalar implementation
+		uint8_t expected[MAX_LEAVES * BYTES];
+		hashLeavesScalar(data, aBlockSize, n, expected);
+		dcassert(memcmp(expected, results, n * BYTES) == 0);
+#endif
+
+		done += n;
+	}
+
+	return done;
+}
+
+void TigerHash::hashLeavesScalar(const uint8_t* aData, size_t aBlockSize, size_t aCount, uint8_t* aResults) {
+	for (; aCount > 0; --aCount) {
+		TigerHash h;
+		uint8_t zero = 0;
+		h.update(&zero, 1);
+		h.update(aData, aBlockSize);
+		memcpy(aResults, h.finalize(), BYTES);
+
+		aData += aBlockSize;
+		aResults += BYTES;
+	}
+}
+
+#ifdef TIGER_SIMD
+
+/*
+ * Multi-buffer versions of the compress function: each vector lane holds the state of a different leaf.
+ * The S box lookups are done with gathers, V_* are defined separately for each instruction set.
+ */
+#define V_NOT(x) V_XOR(x, V_SET1(-1))
+#define V_MUL5(x) V_ADD(V_SHL(x, 2), x)
+#define V_MUL7(x) V_SUB(V_SHL(x, 3), x)
+#define V_MUL9(x) V_ADD(V_SHL(x, 3), x)
+#define V_BYTE(c, n) V_AND(V_SHR(c, (n)*8), V_SET1(0xFF))
+#define V_LOOKUP(t, c, n) V_GATHER(t, V_BYTE(c, n), 8)
+
+#define vround(a,b,c,x,mul) \
+	c = V_XOR(c, x); \
+	a = V_SUB(a, V_XOR(V_XOR(V_LOOKUP(t1, c, 0), V_LOOKUP(t2, c, 2)), V_XOR(V_LOOKUP(t3, c, 4), V_LOOKUP(t4, c, 6)))); \
+	b = V_ADD(b, V_XOR(V_XOR(V_LOOKUP(t4, c, 1), V_LOOKUP(t3, c, 3)), V_XOR(V_LOOKUP(t2, c, 5), V_LOOKUP(t1, c, 7)))); \
+	b = V_MUL##mul(b);
+
+#define vpass(a,b,c,mul) \
+	vround(a,b,c,x0,mul) \
+	vround(b,c,a,x1,mul) \
+	vround(c,a,b,x2,mul) \
+	vround(a,b,c,x3,mul) \
+	vround(b,c,a,x4,mul) \
+	vround(c,a,b,x5,mul) \
+	vround(a,b,c,x6,mul) \
+	vround(b,c,a,x7,mul)
+
+#define vkey_schedule \
+	x0 = V_SUB(x0, V_XOR(x7, V_SET1(_ULL(0xA5A5A5A5A5A5A5A5)))); \
+	x1 = V_XOR(x1, x0); \
+	x2 = V_ADD(x2, x1); \
+	x3 = V_SUB(x3, V_XOR(x2, V_SHL(V_NOT(x1), 19))); \
+	x4 = V_XOR(x4, x3); \
+	x5 = V_ADD(x5, x4); \
+	x6 = V_SUB(x6, V_XOR(x5, V_SHR(V_NOT(x4), 23))); \
+	x7 = V_XOR(x7, x6); \
+	x0 = V_ADD(x0, x7); \
+	x1 = V_SUB(x1, V_XOR(x0, V_SHL(V_NOT(x7), 19))); \
+	x2 = V_XOR(x2, x1); \
+	x3 = V_ADD(x3, x2); \
+	x4 = V_SUB(x4, V_XOR(x3, V_SHR(V_NOT(x2), 23))); \
+	x5 = V_XOR(x5, x4); \
+	x6 = V_ADD(x6, x5); \
+	x7 = V_SUB(x7, V_XOR(x6, V_SET1(_ULL(0x0123456789ABCDEF))));
+
+/*
+ * The message of a leaf is the zero byte followed by the data, so the words are read from one byte
+ * before their position in the data (with the lanes aBlockSize bytes apart)
+ */
+#define vhash_leaves(LANES) \
+{ \
+	const size_t blocks = aBlockSize / BLOCK_SIZE; \
+	auto a = V_SET1(_ULL(0x0123456789ABCDEF)); \
+	auto b = V_SET1(_ULL(0xFEDCBA9876543210)); \
+	auto c = V_SET1(_ULL(0xF096A5B4C3B2E187)); \
+	\
+	for (size_t k = 0; k <= blocks; ++k) { \
+		decltype(a) x0, x1, x2, x3, x4, x5, x6, x7; \
+		if (k < blocks) { \
+			const uint8_t* p = aData + k * BLOCK_SIZE - 1; \
+			x0 = k == 0 ? V_SHL(V_GATHER(aData, offsets, 1), 8) : V_GATHER(p, offsets, 1); \
+			x1 = V_GATHER(p + 8, offsets, 1); x2 = V_GATHER(p + 16, offsets, 1); \
+			x3 = V_GATHER(p + 24, offsets, 1); x4 = V_GATHER(p + 32, offsets, 1); \
+			x5 = V_GATHER(p + 40, offsets, 1); x6 = V_GATHER(p + 48, offsets, 1); \
+			x7 = V_GATHER(p + 56, offsets, 1); \
+		} else { \
+			/* the last data byte, padding and the message length in bits */ \
+			x0 = V_OR(V_SHR(V_GATHER(aData + aBlockSize - 8, offsets, 1), 56), V_SET1(0x0100)); \
+			x1 = x2 = x3 = x4 = x5 = x6 = V_SET1(0); \
+			x7 = V_SET1(static_cast<int64_t>((aBlockSize + 1) << 3)); \
+		} \
+		\
+		auto aa = a, bb = b, cc = c; \
+		vpass(a,b,c,5) \
+		vkey_schedule \
+		vpass(c,a,b,7) \
+		vkey_schedule \
+		vpass(b,c,a,9) \
+		a = V_XOR(a, aa); \
+		b = V_SUB(b, bb); \
+		c = V_ADD(c, cc); \
+	} \
+	\
+	uint64_t ra[LANES], rb[LANES], rc[LANES]; \
+	V_STORE(ra, a); \
+	V_STORE(rb, b); \
+	V_STORE(rc, c); \
+	for (size_t i = 0; i < LANES; ++i) { \
+		uint64_t* res = reinterpret_cast<uint64_t*>(aResults + i * BYTES); \
+		res[0] = ra[i]; \
+		res[1] = rb[i]; \
+		res[2] = rc[i]; \
+	} \
+}
+
+#define V_SET1(x) _mm256_set1_epi64x(x)
+#define V_XOR(x, y) _mm256_xor_si256(x, y)
+#define V_OR(x, y) _mm256_or_si256(x, y)
+#define V_AND(x, y) _mm256_and_si256(x, y)
+#define V_ADD(x, y) _mm256_add_epi64(x, y)
+#define V_SUB(x, y) _mm256_sub_epi64(x, y)
+#define V_SHL(x, n) _mm256_slli_epi64(x, n)
+#define V_SHR(x, n) _mm256_srli_epi64(x, n)
+#define V_GATHER(base, idx, scale) _mm256_i64gather_epi64((const long long*)(base), idx, scale)
+#define V_STORE(dest, x) _mm256_storeu_si256((__m256i*)(dest), x)
+
+__attribute__((target("avx2")))
+void TigerHash::hashLeavesAvx2(const uint8_t* aData, size_t aBlockSize, uint8_t* aResults) {
+	const int64_t bs = static_cast<int64_t>(aBlockSize);
+	const auto offsets = _mm256_set_epi64x(3 * bs, 2 * bs, bs, 0);
+	vhash_leaves(4)
+}
+
+#undef V_SET1
+#undef V_XOR
+#undef V_OR
+#undef V_AND
+#undef V_ADD
+#undef V_SUB
+#undef V_SHL
+#undef V_SHR
+#undef V_GATHER
+#undef V_STORE
+
+#define V_SET1(x) _mm512_set1_epi64(x)
+#define V_XOR(x, y) _mm512_xor_si512(x, y)
+#define V_OR(x, y) _mm512_or_si512(x, y)
+#define V_AND(x, y) _mm512_and_si512(x, y)
+#define V_ADD(x, y) _mm512_add_epi64(x, y)
+#define V_SUB(x, y) _mm512_sub_epi64(x, y)
+#define V_SHL(x, n) _mm512_slli_epi64(x, n)
+#define V_SHR(x, n) _mm512_srli_epi64(x, n)
+#define V_GATHER(base, idx, scale) _mm512_i64gather_epi64(idx, (const void*)(base), scale)
+#define V_STORE(dest, x) _mm512_storeu_si512((void*)(dest), x)
+
+__attribute__((target("avx512f")))
+void TigerHash::hashLeavesAvx512(const uint8_t* aData, size_t aBlockSize, uint8_t* aResults) {
+	const int64_t bs = static_cast<int64_t>(aBlockSize);
+	const auto offsets = _mm512_set_epi64(7 * bs, 6 * bs, 5 * bs, 4 * bs, 3 * bs, 2 * bs, bs, 0);
+	vhash_leaves(8)
+}
+
+size_t TigerHash::detectSimdLanes() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return 8;
+	if (__builtin_cpu_supports("avx2"))
+		return 4;
+	return 0;
+}
+
+#else
+
+size_t TigerHash::detectSimdLanes() { return 0; }
+void TigerHash::hashLeavesAvx2(const uint8_t*, size_t, uint8_t*) { }
+void TigerHash::hashLeavesAvx512(const uint8_t*, size_t, uint8_t*) { }
+
+#endif
+
 uint64_t TigerHash::table[4*256] = {
 	_ULL(0x02AAB17CF7E90C5E)   /*    0 */,    _ULL(0xAC424B03E243A8EC)   /*    1 */,
 		_ULL(0x72CD5BE30DD5FCD3)   /*    2 */,    _ULL(0x6D019B93F6F97F3A)   /*    3 */,
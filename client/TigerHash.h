@@ -57,6 +57,22 @@ public:
 	uint8_t* finalize();
 
 	uint8_t* getResult() { return (uint8_t*) res; }
+
+	/** Maximum number of leaves that are hashed in parallel */
+	static const size_t MAX_LEAVES = 8;
+
+	/**
+	 * Calculates the Merkle leaf hashes (the data prefixed with a zero byte) of aCount consecutive
+	 * blocks of aBlockSize bytes, storing the results consecutively in aResults.
+	 * Multiple leaves are hashed at once with AVX2/AVX-512 when the CPU supports them.
+	 */
+	static void hashLeaves(const uint8_t* aData, size_t aBlockSize, size_t aCount, uint8_t* aResults);
+
+	/** Number of leaves hashed at once by hashLeaves (0 if the vectorized implementations aren't used) */
+	static size_t getSimdLanes();
+
+	/** Compares the vectorized implementations supported by the CPU with the scalar one, returns false if the results differ */
+	static bool verifySimd();
 private:
 	enum { BLOCK_SIZE = 512/8 };
 	/** 512 bit blocks for the compress function */
@@ -69,6 +85,19 @@ private:
 	static uint64_t table[];
 
 	void tigerCompress(const uint64_t* data, uint64_t state[3]);
+
+	/** Number of leaves hashed by the fastest vectorized implementation supported by the CPU (0 if none) */
+	static size_t detectSimdLanes();
+
+	/** Hashes the leaves in batches of 4 or 8, returns the number of leaves that were hashed */
+	static size_t hashLeavesSimd(const uint8_t* aData, size_t aBlockSize, size_t aCount, uint8_t* aResults, size_t aLanes);
+	static void hashLeavesScalar(const uint8_t* aData, size_t aBlockSize, size_t aCount, uint8_t* aResults);
+
+	/** Compares the results of the vectorized implementation with the scalar ones for odd batch sizes */
+	static bool verifyLeaves(size_t aLanes);
+
+	static void hashLeavesAvx2(const uint8_t* aData, size_t aBlockSize, uint8_t* aResults);
+	static void hashLeavesAvx512(const uint8_t* aData, size_t aBlockSize, uint8_t* aResults);
 };
 
 } // namespace dcpp
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2011-2015 AirDC++ Project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DCPLUSPLUS_DCPP_TOKEN_INDEX_H
+#define DCPLUSPLUS_DCPP_TOKEN_INDEX_H
+
+#include "typedefs.h"
+#include "debug.h"
+
+namespace dcpp {
+
+/**
+* Inverted index for finding the items whose lowercase name contains a substring.
+*
+* Names are split into words (runs of alphanumeric and non-ASCII characters) and each word has
+* a posting list of the items using it. As the lookups are substring matches, the words containing
+* the longest word of the pattern are found through the trigrams of the vocabulary.
+*
+* Removed items are only marked as deleted until enough of them have been collected for purging
+* the posting lists. The names passed as strings must stay valid for as long as the items are in the index,
+* names that are stored by the owner itself are added by their offset and resolved through T::containsIndexedName.
+*/
+template<class T>
+class TokenIndex : boost::noncopyable {
+public:
+	typedef uint32_t ItemId;
+
+	TokenIndex() { clear(); }
+
+	/* Returns the id that is used for removing the item */
+	ItemId add(const string& aNameLower, const T* aOwner) noexcept {
+		return addItem(aNameLower, Item(aOwner, &aNameLower));
+	}
+
+	/* The name isn't referenced after the call, the item is matched through aOwner->containsIndexedName(aNameOffset, pattern) */
+	ItemId add(const string& aNameLower, const T* aOwner, uint32_t aNameOffset) noexcept {
+		return addItem(aNameLower, Item(aOwner, aNameOffset));
+	}
+
+	void remove(ItemId aId) noexcept {
+		dcassert(aId > 0 && aId < items.size() && items[aId].owner);
+		items[aId] = Item();
+		removedIds.push_back(aId);
+
+		if (removedIds.size() > MIN_PURGE_ITEMS && removedIds.size() > getItemCount()) {
+			purge();
+		}
+	}
+
+	/**
+	* Calls aF with the owner of each item whose name contains the pattern (an owner may be passed multiple times)
+	* Returns false without calling aF if the pattern is too short to be looked up or if it would match more than aMaxItems items
+	*/
+	template<class F>
+	bool find(const string& aPatternLower, size_t aMaxItems, F aF) const noexcept {
+		// the occurrence of the longest word of the pattern must be inside a single word in the name
+		const char* longest = nullptr;
+		size_t longestLen = 0;
+		forEachWord(aPatternLower, [&](const char* aWord, size_t aLen) {
+			if (aLen > longestLen) {
+				longest = aWord;
+				longestLen = aLen;
+			}
+		});
+
+		if (longestLen < MIN_WORD_LEN)
+			return false;
+
+		// use the rarest trigram for finding the words
+		const vector<WordId>* candidates = nullptr;
+		for (size_t i = 0; i + 3 <= longestLen; ++i) {
+			auto t = trigrams.find(getTrigram(longest + i));
+			if (t == trigrams.end())
+				return true;
+
+			if (!candidates || t->second.size() < candidates->size())
+				candidates = &t->second;
+		}
+
+		string word(longest, longestLen);
+		vector<WordId> matchingWords;
+		size_t itemCount = 0;
+		for (auto w: *candidates) {
+			if (wordNames[w]->find(word) != string::npos) {
+				itemCount += postings[w].size();
+				if (itemCount > aMaxItems)
+					return false;
+
+				matchingWords.push_back(w);
+			}
+		}
+
+		for (auto w: matchingWords) {
+			for (auto id: postings[w]) {
+				const auto& item = items[id];
+				if (item.owner && item.contains(aPatternLower)) {
+					aF(item.owner);
+				}
+			}
+		}
+
+		return true;
+	}
+
+	void clear() noexcept {
+		items.clear();
+		items.emplace_back(); // reserve id 0 for items that aren't indexed
+		freeIds.clear();
+		removedIds.clear();
+
+		words.clear();
+		wordNames.clear();
+		postings.clear();
+		trigrams.clear();
+	}
+
+	void swap(TokenIndex& rhs) noexcept {
+		items.swap(rhs.items);
+		freeIds.swap(rhs.freeIds);
+		removedIds.swap(rhs.removedIds);
+
+		words.swap(rhs.words);
+		wordNames.swap(rhs.wordNames);
+		postings.swap(rhs.postings);
+		trigrams.swap(rhs.trigrams);
+	}
+
+	size_t getItemCount() const noexcept { return items.size() - freeIds.size() - removedIds.size() - 1; }
+	size_t getWordCount() const noexcept { return words.size(); }
+private:
+	typedef uint32_t WordId;
+
+	enum {
+		// shorter words can't contain any trigrams
+		MIN_WORD_LEN = 3,
+		MIN_PURGE_ITEMS = 1024
+	};
+
+	struct Item {
+		Item() { }
+		Item(const T* aOwner, const string* aName) : owner(aOwner), name(aName) { }
+		Item(const T* aOwner, uint32_t aNameOffset) : owner(aOwner), nameOffset(aNameOffset) { }
+
+		bool contains(const string& aPatternLower) const noexcept {
+			return name ? name->find(aPatternLower) != string::npos : owner->containsIndexedName(nameOffset, aPatternLower);
+		}
+
+		// nullptr if the item has been removed
+		const T* owner = nullptr;
+
+		// the name is either referenced directly or looked up from the owner
+		const string* name = nullptr;
+		uint32_t nameOffset = 0;
+	};
+
+	ItemId addItem(const string& aNameLower, Item&& aItem) noexcept {
+		ItemId id;
+		if (!freeIds.empty()) {
+			id = freeIds.back();
+			freeIds.pop_back();
+			items[id] = move(aItem);
+		} else {
+			id = static_cast<ItemId>(items.size());
+			items.push_back(move(aItem));
+		}
+
+		forEachWord(aNameLower, [&](const char* aWord, size_t aLen) {
+			auto& posting = postings[getWordId(string(aWord, aLen))];
+
+			// the same word may exist multiple times in the name
+			if (posting.empty() || posting.back() != id)
+				posting.push_back(id);
+		});
+
+		return id;
+	}
+
+	static bool isWordChar(uint8_t c) noexcept {
+		return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+	}
+
+	template<class F>
+	static void forEachWord(const string& aStr, F aF) noexcept {
+		const char* p = aStr.c_str();
+		const char* end = p + aStr.length();
+		while (p < end) {
+			while (p < end && !isWordChar(*p))
+				++p;
+
+			auto start = p;
+			while (p < end && isWordChar(*p))
+				++p;
+
+			if (static_cast<size_t>(p - start) >= MIN_WORD_LEN)
+				aF(start, static_cast<size_t>(p - start));
+		}
+	}
+
+	static uint32_t getTrigram(const char* aStr) noexcept {
+		return static_cast<uint8_t>(aStr[0]) | (static_cast<uint8_t>(aStr[1]) << 8) | (static_cast<uint8_t>(aStr[2]) << 16);
+	}
+
+	WordId getWordId(string&& aWord) noexcept {
+		auto i = words.emplace(move(aWord), static_cast<WordId>(wordNames.size()));
+		if (i.second) {
+			const auto& word = i.first->first;
+			wordNames.push_back(&word);
+			postings.emplace_back();
+
+			for (size_t j = 0; j + 3 <= word.length(); ++j) {
+				auto& t = trigrams[getTrigram(word.c_str() + j)];
+				if (t.empty() || t.back() != i.first->second)
+					t.push_back(i.first->second);
+			}
+		}
+
+		return i.first->second;
+	}
+
+	// remove the deleted items from the posting lists and drop the words that aren't used anymore
+	void purge() noexcept {
+		for (auto& posting: postings) {
+			posting.erase(std::remove_if(posting.begin(), posting.end(), [this](ItemId id) { return !items[id].owner; }), posting.end());
+		}
+
+		freeIds.insert(freeIds.end(), removedIds.begin(), removedIds.end());
+		removedIds.clear();
+
+		decltype(words) oldWords;
+		decltype(postings) oldPostings;
+		oldWords.swap(words);
+		oldPostings.swap(postings);
+		wordNames.clear();
+		trigrams.clear();
+
+		for (auto& w: oldWords) {
+			auto& posting = oldPostings[w.second];
+			if (!posting.empty()) {
+				auto id = getWordId(string(w.first));
+				postings[id].swap(posting);
+			}
+		}
+	}
+
+	vector<Item> items;
+	vector<ItemId> freeIds;
+	vector<ItemId> removedIds;
+
+	unordered_map<string, WordId> words;
+	vector<const string*> wordNames;
+	vector<vector<ItemId>> postings;
+	unordered_map<uint32_t, vector<WordId>> trigrams;
+};
+
+} // namespace dcpp
+
+#endif // !defined(DCPLUSPLUS_DCPP_TOKEN_INDEX_H)
@@ -39,7 +39,7 @@ namespace dcpp {
 
 using boost::range::find_if;
 
-UploadManager::UploadManager() noexcept : running(0), extra(0), lastGrant(0), lastFreeSlots(-1), extraPartial(0), mcnSlots(0), smallSlots(0) {	
+UploadManager::UploadManager() noexcept : running(0), extra(0), lastGrant(0), lastFreeSlots(-1), extraPartial(0), mcnSlots(0), smallSlots(0), listGenerator(true) {	
 	ClientManager::getInstance()->addListener(this);
 	TimerManager::getInstance()->addListener(this);
 }
@@ -85,7 +85,67 @@ int UploadManager::getFreeExtraSlots() const {
 	return max(SETTING(EXTRA_SLOTS) - getExtra(), 0); 
 }
 
-bool UploadManager::prepareFile(UserConnection& aSource, const string& aType, const string& aFile, int64_t aStartPos, int64_t& aBytes, const string& userSID, bool listRecursive, bool tthList) {
+bool UploadManager::isList(const string& aType, const string& aFile) noexcept {
+	if (aType == Transfer::names[Transfer::TYPE_PARTIAL_LIST])
+		return true;
+
+	return aType == Transfer::names[Transfer::TYPE_FILE] && (aFile == Transfer::USER_LIST_NAME_BZ || aFile == Transfer::USER_LIST_NAME);
+}
+
+void UploadManager::generateList(UserConnection* aSource, const string& aType, const string& aFile, const string& userSID, bool listRecursive, bool tthList,
+	function<void (unique_ptr<MemoryInputStream>&&)>&& aF) noexcept {
+
+	// the next commands must wait for this one
+	aSource->pauseRead();
+
+	listGenerator.addTask([=] {
+		auto list = make_shared<unique_ptr<MemoryInputStream>>();
+
+		auto profile = ClientManager::getInstance()->findProfile(*aSource, userSID);
+		if (profile) {
+			try {
+				if (aType == Transfer::names[Transfer::TYPE_PARTIAL_LIST]) {
+					list->reset(generatePartialList(aFile, *profile, listRecursive, tthList));
+				} else {
+					// the full list is cached, prepareFile will use the generated file
+					auto info = ShareManager::getInstance()->getFileListInfo(aFile, *profile);
+					if (aFile == Transfer::USER_LIST_NAME) {
+						list->reset(decodeList(info.second));
+					}
+				}
+			} catch (const Exception&) {
+				// prepareFile will try again and report the error
+			}
+		}
+
+		aSource->resumeRead([=] { aF(move(*list)); });
+	});
+}
+
+MemoryInputStream* UploadManager::generatePartialList(const string& aFile, ProfileToken aProfile, bool listRecursive, bool tthList) {
+	if (tthList) {
+		if (aFile[0] != '/') {
+			return QueueManager::getInstance()->generateTTHList(aFile, aProfile != SP_HIDDEN);
+		} else {
+			return ShareManager::getInstance()->generateTTHList(aFile, listRecursive, aProfile);
+		}
+	}
+
+	return ShareManager::getInstance()->generatePartialList(aFile, listRecursive, aProfile);
+}
+
+MemoryInputStream* UploadManager::decodeList(const string& aPath) {
+	// Unpack before sending...
+	string bz2 = File(aPath, File::READ, File::OPEN).read();
+	string xml;
+	CryptoManager::getInstance()->decodeBZ2(reinterpret_cast<const uint8_t*>(bz2.data()), bz2.size(), xml);
+	// Clear to save some memory...
+	string().swap(bz2);
+	return new MemoryInputStream(xml);
+}
+
+bool UploadManager::prepareFile(UserConnection& aSource, const string& aType, const string& aFile, int64_t aStartPos, int64_t& aBytes, const string& userSID, bool listRecursive, bool tthList, 
+	unique_ptr<MemoryInputStream>&& aList) {
 	dcdebug("Preparing %s %s " I64_FMT " " I64_FMT " %d" " " "%s %s\n", aType.c_str(), aFile.c_str(), aStartPos, aBytes, listRecursive, 
 		aSource.getHubUrl().c_str(), ClientManager::getInstance()->getFormatedNicks(aSource.getHintedUser()).c_str());
 
@@ -284,15 +344,14 @@ checkslots:
 		case Transfer::TYPE_FULL_LIST:
 			{
 				if(aFile == Transfer::USER_LIST_NAME) {
-					// Unpack before sending...
-					string bz2 = File(sourceFile, File::READ, File::OPEN).read();
-					string xml;
-					CryptoManager::getInstance()->decodeBZ2(reinterpret_cast<const uint8_t*>(bz2.data()), bz2.size(), xml);
-					// Clear to save some memory...
-					string().swap(bz2);
-					is.reset(new MemoryInputStream(xml));
+					unique_ptr<MemoryInputStream> mis(move(aList));
+					if(!mis.get()) {
+						mis.reset(decodeList(sourceFile));
+					}
+
 					start = 0;
-					fileSize = size = xml.size();
+					fileSize = size = mis->getSize();
+					is = move(mis);
 				} else {
 					countFilePositions();
 					unique_ptr<File> f(new File(sourceFile, File::READ, File::OPEN | File::SHARED_WRITE)); // write for partial sharing
@@ -321,16 +380,10 @@ checkslots:
 			}
 		case Transfer::TYPE_PARTIAL_LIST:
 			{
-				unique_ptr<MemoryInputStream> mis = nullptr;
 				// Partial file list
-				if (tthList) {
-					if (aFile[0] != '/') {
-						mis.reset(QueueManager::getInstance()->generateTTHList(aFile, *profile != SP_HIDDEN));
-					} else {
-						mis.reset(ShareManager::getInstance()->generateTTHList(aFile, listRecursive, *profile));
-					}
-				} else {
-					mis.reset(ShareManager::getInstance()->generatePartialList(aFile, listRecursive, *profile));
+				unique_ptr<MemoryInputStream> mis(move(aList));
+				if(!mis.get()) {
+					mis.reset(generatePartialList(aFile, *profile, listRecursive, tthList));
 				}
 
 				if(!mis.get()) {
@@ -901,10 +954,19 @@ void UploadManager::on(UserConnectionListener::Get, UserConnection* aSource, con
 		return;
 	}
 	
-	int64_t bytes = -1;
-	if(prepareFile(*aSource, Transfer::names[Transfer::TYPE_FILE], Util::toAdcFile(aFile), aResume, bytes, Util::emptyString)) {
-		aSource->setState(UserConnection::STATE_SEND);
-		aSource->fileLength(Util::toString(aSource->getUpload()->getSegmentSize()));
+	auto file = Util::toAdcFile(aFile);
+	auto prepare = [=](unique_ptr<MemoryInputStream>&& aList) {
+		int64_t bytes = -1;
+		if(prepareFile(*aSource, Transfer::names[Transfer::TYPE_FILE], file, aResume, bytes, Util::emptyString, false, false, move(aList))) {
+			aSource->setState(UserConnection::STATE_SEND);
+			aSource->fileLength(Util::toString(aSource->getUpload()->getSegmentSize()));
+		}
+	};
+
+	if(isList(Transfer::names[Transfer::TYPE_FILE], file)) {
+		generateList(aSource, Transfer::names[Transfer::TYPE_FILE], file, Util::emptyString, false, false, prepare);
+	} else {
+		prepare(nullptr);
 	}
 }
 
@@ -930,6 +992,25 @@ void UploadManager::on(AdcCommand::GET, UserConnection* aSource, const AdcComman
 		return;
 	}
 
+	const string& type = c.getParam(0);
+	const string& fname = c.getParam(1);
+	if(isList(type, fname)) {
+		string userSID;
+		c.getParam("ID", 0, userSID);
+		generateList(aSource, type, fname, userSID, c.hasFlag("RE", 4), c.hasFlag("TL", 4), [=](unique_ptr<MemoryInputStream>&& aList) {
+			handleGet(aSource, c, move(aList));
+		});
+	} else {
+		handleGet(aSource, c, nullptr);
+	}
+}
+
+void UploadManager::handleGet(UserConnection* aSource, const AdcCommand& c, unique_ptr<MemoryInputStream>&& aList) noexcept {
+	if(aSource->getState() != UserConnection::STATE_GET) {
+		dcdebug("UM::onGET Bad state, ignoring\n");
+		return;
+	}
+
 	const string& type = c.getParam(0);
 	const string& fname = c.getParam(1);
 	int64_t aStartPos = Util::toInt64(c.getParam(2));
@@ -940,7 +1021,7 @@ void UploadManager::on(AdcCommand::GET, UserConnection* aSource, const AdcComman
 	// bundles
 
 
-	if(prepareFile(*aSource, type, fname, aStartPos, aBytes, userSID, c.hasFlag("RE", 4), c.hasFlag("TL", 4))) {
+	if(prepareFile(*aSource, type, fname, aStartPos, aBytes, userSID, c.hasFlag("RE", 4), c.hasFlag("TL", 4), move(aList))) {
 		Upload* u = aSource->getUpload();
 		dcassert(u);
 
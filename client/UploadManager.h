@@ -23,6 +23,7 @@
 
 #include "ClientManagerListener.h"
 #include "CriticalSection.h"
+#include "DispatcherQueue.h"
 #include "FastAlloc.h"
 #include "HintedUser.h"
 #include "MerkleTree.h"
@@ -166,6 +167,9 @@ private:
 	SlotMap notifiedUsers;
 	SlotQueue uploadQueue;
 
+	// generates the requested file lists outside the socket threads
+	DispatcherQueue listGenerator;
+
 	size_t addFailedUpload(const UserConnection& source, const string& file, int64_t pos, int64_t size);
 	void notifyQueuedUsers();
 	void connectUser(const HintedUser& aUser, const string& aToken);
@@ -215,7 +219,22 @@ private:
 	void on(AdcCommand::GET, UserConnection*, const AdcCommand&) noexcept;
 	void on(AdcCommand::GFI, UserConnection*, const AdcCommand&) noexcept;
 
-	bool prepareFile(UserConnection& aSource, const string& aType, const string& aFile, int64_t aResume, int64_t& aBytes, const string& userSID, bool listRecursive=false, bool tthList=false);
+	void handleGet(UserConnection* aSource, const AdcCommand& c, unique_ptr<MemoryInputStream>&& aList) noexcept;
+
+	bool prepareFile(UserConnection& aSource, const string& aType, const string& aFile, int64_t aResume, int64_t& aBytes, const string& userSID, bool listRecursive=false, bool tthList=false, 
+		unique_ptr<MemoryInputStream>&& aList = nullptr);
+
+	static bool isList(const string& aType, const string& aFile) noexcept;
+
+	/**
+	 * Generating a file list may take a long time so it's done in listGenerator. Reading from the connection is paused
+	 * meanwhile, aF is called from the socket thread with the generated list (null if the generation failed or the
+	 * list is read from the disk).
+	 */
+	void generateList(UserConnection* aSource, const string& aType, const string& aFile, const string& userSID, bool listRecursive, bool tthList,
+		function<void (unique_ptr<MemoryInputStream>&&)>&& aF) noexcept;
+	MemoryInputStream* generatePartialList(const string& aFile, ProfileToken aProfile, bool listRecursive, bool tthList);
+	static MemoryInputStream* decodeList(const string& aPath);
 };
 
 } // namespace dcpp
@@ -34,8 +34,6 @@
 
 namespace dcpp {
 
-SharedMutex Identity::cs;
-
 OnlineUser::OnlineUser(const UserPtr& ptr, ClientBase& client_, uint32_t sid_) : identity(ptr, sid_), client(client_), isInList(false) { 
 }
 
@@ -45,7 +43,8 @@ bool Identity::isTcpActive(const Client* c) const {
 
 bool Identity::isTcp4Active(const Client* c) const {
 	if (!user->isSet(User::NMDC)) {
-		return !getIp4().empty() && supports(AdcHub::TCP4_FEATURE);
+		FastLock l(cs);
+		return !fields[FIELD_I4].empty() && (features & (1 << FEATURE_TCP4));
 	} else {
 		//we don't want to use the global passive flag for our own user...
 		return c && user == ClientManager::getInstance()->getMe() ? c->isActiveV4() : !user->isSet(User::PASSIVE);
@@ -53,7 +52,8 @@ bool Identity::isTcp4Active(const Client* c) const {
 }
 
 bool Identity::isTcp6Active() const {
-	return !getIp6().empty() && supports(AdcHub::TCP6_FEATURE);
+	FastLock l(cs);
+	return !fields[FIELD_I6].empty() && (features & (1 << FEATURE_TCP6));
 }
 
 bool Identity::isUdpActive() const {
@@ -61,23 +61,26 @@ bool Identity::isUdpActive() const {
 }
 
 bool Identity::isUdp4Active() const {
-	if(getIp4().empty() || getUdp4Port().empty())
+	FastLock l(cs);
+	if(fields[FIELD_I4].empty() || fields[FIELD_U4].empty())
 		return false;
-	return user->isSet(User::NMDC) ? !user->isSet(User::PASSIVE) : supports(AdcHub::UDP4_FEATURE);
+	return user->isSet(User::NMDC) ? !user->isSet(User::PASSIVE) : (features & (1 << FEATURE_UDP4)) != 0;
 }
 
 bool Identity::isUdp6Active() const {
-	if(getIp6().empty() || getUdp6Port().empty())
+	FastLock l(cs);
+	if(fields[FIELD_I6].empty() || fields[FIELD_U6].empty())
 		return false;
-	return user->isSet(User::NMDC) ? false : supports(AdcHub::UDP6_FEATURE);
+	return user->isSet(User::NMDC) ? false : (features & (1 << FEATURE_UDP6)) != 0;
 }
 
 string Identity::getUdpPort() const {
-	if(getIp6().empty() || getUdp6Port().empty()) {
-		return getUdp4Port();
+	FastLock l(cs);
+	if(fields[FIELD_I6].empty() || fields[FIELD_U6].empty()) {
+		return fields[FIELD_U4];
 	}
 
-	return getUdp6Port();
+	return fields[FIELD_U6];
 }
 
 string Identity::getIp() const {
@@ -97,16 +100,20 @@ int64_t Identity::getAdcConnectionSpeed(bool download) const {
 }
 
 uint8_t Identity::getSlots() const {
-	return static_cast<uint8_t>(Util::toInt(get("SL")));
+	FastLock l(cs);
+	return slots;
+}
+
+int64_t Identity::getBytesShared() const {
+	FastLock l(cs);
+	return bytesShared;
 }
 
 void Identity::getParams(ParamMap& sm, const string& prefix, bool compatibility) const {
-	{
-		RLock l(cs);
-		for(auto& i: info) {
-			sm[prefix + string((char*)(&i.first), 2)] = i.second;
-		}
+	for(auto& i: getInfo()) {
+		sm[prefix + i.first] = i.second;
 	}
+
 	if(user) {
 		sm[prefix + "NI"] = getNick();
 		sm[prefix + "SID"] = getSIDString();
@@ -173,12 +180,37 @@ Identity::Identity(const Identity& rhs) : Flags(), sid(0), connectMode(rhs.getCo
 }
 
 Identity& Identity::operator = (const Identity& rhs) {
-	WLock l(cs);
+	if(this == &rhs)
+		return *this;
+
+	// copy the values first so that the locks of both identities are never held at the same time
+	string newFields[FIELD_LAST];
+	InfList newInfo;
+	int64_t newBytesShared;
+	uint8_t newSlots;
+	uint32_t newFeatures;
+	{
+		FastLock l(rhs.cs);
+		copy(rhs.fields, rhs.fields + FIELD_LAST, newFields);
+		newInfo = rhs.info;
+		newBytesShared = rhs.bytesShared;
+		newSlots = rhs.slots;
+		newFeatures = rhs.features;
+	}
+
 	*static_cast<Flags*>(this) = rhs;
 	user = rhs.user;
 	sid = rhs.sid;
-	info = rhs.info;
 	connectMode = rhs.connectMode;
+
+	FastLock l(cs);
+	for(int i = 0; i < FIELD_LAST; ++i) {
+		fields[i].swap(newFields[i]);
+	}
+	info.swap(newInfo);
+	bytesShared = newBytesShared;
+	slots = newSlots;
+	features = newFeatures;
 	return *this;
 }
 
@@ -202,28 +234,114 @@ const string& Identity::getCountry() const {
 	return GeoManager::getInstance()->getCountry(v6 ? getIp6() : getIp4(), v6 ? GeoManager::V6 : GeoManager::V4);
 }
 
+int Identity::getField(const char* name) noexcept {
+	switch(name[0]) {
+		case 'N': return name[1] == 'I' ? FIELD_NI : -1;
+		case 'I': return name[1] == '4' ? FIELD_I4 : name[1] == '6' ? FIELD_I6 : -1;
+		case 'U': return name[1] == '4' ? FIELD_U4 : name[1] == '6' ? FIELD_U6 : -1;
+		case 'S': return name[1] == 'S' ? FIELD_SS : name[1] == 'L' ? FIELD_SL : name[1] == 'U' ? FIELD_SU : -1;
+		default: return -1;
+	}
+}
+
+int Identity::getFeatureBit(const char* aName, size_t aLen) noexcept {
+	// in the order of Feature
+	static const char* common[FEATURE_LAST] = { "TCP4", "TCP6", "UDP4", "UDP6", "NAT0", "ADCS", "ASCH", "CCPM", "SUD1", "SEGA" };
+	if(aLen == 4) {
+		for(int i = 0; i < FEATURE_LAST; ++i) {
+			if(memcmp(common[i], aName, 4) == 0)
+				return i;
+		}
+	}
+	return -1;
+}
+
 string Identity::get(const char* name) const {
-	RLock l(cs);
-	auto i = info.find(*(short*)name);
+	auto f = getField(name);
+
+	FastLock l(cs);
+	if(f != -1)
+		return fields[f];
+
+	auto code = *(uint16_t*)name;
+	auto i = find_if(info.begin(), info.end(), [code](const pair<uint16_t, string>& p) { return p.first == code; });
 	return i == info.end() ? Util::emptyString : i->second;
 }
 
 bool Identity::isSet(const char* name) const {
-	RLock l(cs);
-	auto i = info.find(*(short*)name);
-	return i != info.end();
-}
+	auto f = getField(name);
+
+	FastLock l(cs);
+	if(f != -1)
+		return !fields[f].empty();
 
+	auto code = *(uint16_t*)name;
+	return find_if(info.begin(), info.end(), [code](const pair<uint16_t, string>& p) { return p.first == code; }) != info.end();
+}
 
 void Identity::set(const char* name, const string& val) {
-	WLock l(cs);
-	if(val.empty())
-		info.erase(*(short*)name);
-	else
-		info[*(short*)name] = val;
+	auto f = getField(name);
+	if(f != -1) {
+		setField(f, val);
+		return;
+	}
+
+	auto code = *(uint16_t*)name;
+
+	FastLock l(cs);
+	auto i = find_if(info.begin(), info.end(), [code](const pair<uint16_t, string>& p) { return p.first == code; });
+	if(val.empty()) {
+		if(i != info.end()) {
+			// the order doesn't matter
+			swap(*i, info.back());
+			info.pop_back();
+		}
+	} else if(i != info.end()) {
+		i->second = val;
+	} else {
+		info.emplace_back(code, val);
+	}
+}
+
+void Identity::setField(int aField, const string& val) noexcept {
+	// parse the values outside the lock
+	int64_t newBytesShared = 0;
+	uint8_t newSlots = 0;
+	uint32_t newFeatures = 0;
+	if(aField == FIELD_SS) {
+		newBytesShared = Util::toInt64(val);
+	} else if(aField == FIELD_SL) {
+		newSlots = static_cast<uint8_t>(Util::toInt(val));
+	} else if(aField == FIELD_SU) {
+		StringTokenizer<string> st(val, ',');
+		for(const auto& s: st.getTokens()) {
+			auto bit = getFeatureBit(s.c_str(), s.length());
+			if(bit != -1)
+				newFeatures |= 1 << bit;
+		}
+	}
+
+	FastLock l(cs);
+	fields[aField] = val;
+	if(aField == FIELD_SS) {
+		bytesShared = newBytesShared;
+	} else if(aField == FIELD_SL) {
+		slots = newSlots;
+	} else if(aField == FIELD_SU) {
+		features = newFeatures;
+	}
+}
+
+bool Identity::hasFeature(int aBit) const noexcept {
+	FastLock l(cs);
+	return (features & (1 << aBit)) != 0;
 }
 
 bool Identity::supports(const string& name) const {
+	auto bit = getFeatureBit(name.c_str(), name.length());
+	if(bit != -1)
+		return hasFeature(bit);
+
 	string su = get("SU");
 	StringTokenizer<string> st(su, ',');
 	for(auto s: st.getTokens()) {
@@ -234,11 +352,25 @@ bool Identity::supports(const string& name) const {
 }
 
 std::map<string, string> Identity::getInfo() const {
+	static const char* fieldNames[FIELD_LAST] = { "NI", "I4", "I6", "U4", "U6", "SS", "SL", "SU" };
+
+	// build the map after releasing the lock as with operator=
+	string curFields[FIELD_LAST];
+	InfList curInfo;
+	{
+		FastLock l(cs);
+		copy(fields, fields + FIELD_LAST, curFields);
+		curInfo = info;
+	}
+
 	std::map<string, string> ret;
+	for(int i = 0; i < FIELD_LAST; ++i) {
+		if(!curFields[i].empty())
+			ret[fieldNames[i]] = move(curFields[i]);
+	}
 
-	RLock l(cs);
-	for(auto& i: info) {
-		ret[string((char*)(&i.first), 2)] = i.second;
+	for(auto& i: curInfo) {
+		ret[string((char*)(&i.first), 2)] = move(i.second);
 	}
 
 	return ret;
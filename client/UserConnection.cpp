@@ -160,7 +160,7 @@ void UserConnection::connect(const string& aServer, const string& aPort, const s
 
 	// TODO: verify that this KeyPrint was mediated by a trusted hub?
 	string expKP = user ? ClientManager::getInstance()->getField(user->getCID(), hubUrl, "KP") : Util::emptyString;
-	socket->connect(aServer, aPort, localPort, natRole, secure, SETTING(ALLOW_UNTRUSTED_CLIENTS), true, expKP);
+	socket->connect(aServer, aPort, localPort, natRole, secure, SETTING(ALLOW_UNTRUSTED_CLIENTS), true, expKP, user ? user->getCID().toBase32() : Util::emptyString);
 }
 
 int64_t UserConnection::getChunkSize() const {
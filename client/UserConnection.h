@@ -153,6 +153,9 @@ public:
 	template<typename F>
 	void callAsync(F f) { if(socket) socket->callAsync(f); }
 
+	void pauseRead() { dcassert(socket); socket->pauseRead(); }
+	void resumeRead(function<void ()> f = nullptr) { if(socket) socket->resumeRead(f); }
+
 	void disconnect(bool graceless = false) { if(socket) socket->disconnect(graceless); }
 	void transmitFile(InputStream* f) { socket->transmitFile(f); }
 
@@ -86,6 +86,18 @@ public:
 
 #define parallel_for_each for_each
 
+	// runs the tasks in the calling thread
+	class task_group {
+	public:
+		template <typename F>
+		void run(const F& f) {
+			f();
+		}
+
+		void wait() { }
+		void cancel() { }
+	};
+
 	template <typename T>
 	class concurrent_queue {
 	public:
@@ -100,6 +100,8 @@ class InputStream;
 
 class LogManager;
 
+class MemoryInputStream;
+
 class OnlineUser;
 typedef boost::intrusive_ptr<OnlineUser> OnlineUserPtr;
 typedef std::vector<OnlineUserPtr> OnlineUserList;
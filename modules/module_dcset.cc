@@ -29,6 +29,7 @@
 #include <client/AirUtil.h>
 #include <client/ConnectionManager.h>
 #include <client/ConnectivityManager.h>
+#include <client/CryptoManager.h>
 #include <client/SearchManager.h>
 #include <client/SettingHolder.h>
 #include <client/SettingItem.h>
@@ -325,11 +326,14 @@ static NamedSettingItem settings [] = {
 	{ "max_total_hashers", SettingsManager::MAX_HASHING_THREADS, ResourceManager::MAX_HASHING_THREADS },
 	{ "max_vol_hashers", SettingsManager::HASHERS_PER_VOLUME, ResourceManager::MAX_VOL_HASHERS },
 	{ "report_each_hashed_file", SettingsManager::LOG_HASHING, ResourceManager::LOG_HASHING },
+	{ "hash_db_sync", SettingsManager::SYNC_HASH_DB_WRITES, ResourceManager::SYNC_HASH_DB_WRITES },
+	{ "tree_cache_size", SettingsManager::TREE_CACHE_SIZE, ResourceManager::TREE_CACHE_SIZE },
 
 	{ ResourceManager::REFRESH_OPTIONS },
 	{ "refresh_time", SettingsManager::AUTO_REFRESH_TIME, ResourceManager::SETTINGS_AUTO_REFRESH_TIME },
 	{ "refresh_time_incoming", SettingsManager::INCOMING_REFRESH_TIME, ResourceManager::SETTINGS_INCOMING_REFRESH_TIME },
 	{ "refresh_startup", SettingsManager::STARTUP_REFRESH, ResourceManager::SETTINGS_STARTUP_REFRESH },
+	{ "refresh_vol_threads", SettingsManager::REFRESH_THREADS_PER_VOLUME, ResourceManager::MAX_VOL_REFRESH_THREADS },
 	{ "refresh_report_scheduled_refreshes", SettingsManager::LOG_SCHEDULED_REFRESHES, ResourceManager::SETTINGS_LOG_SCHEDULED_REFRESHES },
 
 	{ ResourceManager::SETTINGS_SHARING_OPTIONS },
@@ -398,6 +402,7 @@ class DcSet {
 public:
 	HelpHandler::CommandList commands = {
 		{ "connectioninfo", std::bind(&DcSet::connection, this), nullptr },
+		{ "tlsinfo", std::bind(&DcSet::tls, this), nullptr },
 		{ "dcset", std::bind(&DcSet::handleDcset, this), COMPLETION(DcSet::handleSuggest) },
 		{ "dcreset", std::bind(&DcSet::handleDcreset, this), COMPLETION(DcSet::handleSuggest) },
 		{ "nick", std::bind(&DcSet::set_nick, this), nullptr }
@@ -438,6 +443,15 @@ public:
 		}
 	}
 
+	void tls() {
+		auto info = CryptoManager::getInstance()->getSessionStats();
+		StringTokenizer<string> lines(info, "\r\n");
+		for (const auto& l : lines.getTokens()) {
+			if (!l.empty())
+				display::Manager::get()->cmdMessage(l);
+		}
+	}
+
     /** "command nick" event handler. */
     void set_nick() {
         if(events::args() < 1) {
@@ -47,8 +47,9 @@ void StatusHash::on(Second, uint64_t)
     size_t files = 0;
 	int64_t speed = 0;
 	int hashers = 0;
+	HashManager::DeviceStatsList devices;
 
-	HashManager::getInstance()->getStats(file, bytesLeft, files, speed, hashers);
+	HashManager::getInstance()->getStats(file, bytesLeft, files, speed, hashers, &devices);
 	if (bytesLeft == 0) {
 		if (m_visible) {
 			// nothing to hash
@@ -71,6 +72,13 @@ void StatusHash::on(Second, uint64_t)
 			<< std::setprecision(1)
 			<< percent * 100 << "%%";
 
+		// show the throughput of each disk when several of them are being hashed
+		if (devices.size() > 1) {
+			for (const auto& d: devices) {
+				oss << " " << d.id << ": " << Util::formatBytes(d.speed) << "/s";
+			}
+		}
+
 		m_text = oss.str();
 	});
 }